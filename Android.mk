@@ -27,10 +27,21 @@ LOCAL_SRC_FILES := \
 # add nandroid
 LOCAL_SRC_FILES += \
     nandroid/nandroid.c \
+    nandroid/nandroid_catalog.c \
+    nandroid/nandroid_compress.c \
+    nandroid/nandroid_dedup.c \
+    nandroid/nandroid_md5.c \
+    nandroid/nandroid_queue.c \
     nandroid/nandroid_raw.c \
     nandroid/nandroid_scan.c \
+    nandroid/nandroid_sched.c \
+    nandroid/nandroid_sparse.c \
     nandroid/nandroid_tar.c \
-    nandroid/nandroid_yaffs.c
+    nandroid/nandroid_tar_reader.c \
+    nandroid/nandroid_tar_writer.c \
+    nandroid/nandroid_tee.c \
+    nandroid/nandroid_yaffs.c \
+    nandroid/nandroid_yaffs_image.c
 
 # add our menus
 LOCAL_SRC_FILES += \
@@ -82,9 +93,12 @@ else
     LOCAL_STATIC_LIBRARIES += libext4_utils
 endif
 LOCAL_STATIC_LIBRARIES += libe2fsck libtune2fs libmke2fs libext2fs libext2_blkid libext2_uuid libext2_profile libext2_com_err libext2_e2p
-LOCAL_STATIC_LIBRARIES += libz libbusybox libclearsilverregex libunyaffs libmkyaffs2image
+LOCAL_STATIC_LIBRARIES += libz libbz libbusybox libclearsilverregex
 LOCAL_STATIC_LIBRARIES += libflash_image libdump_image liberase_image libxz liblzma
 LOCAL_STATIC_LIBRARIES += libminzip libunz libflashutils libmtdutils libmmcutils libbmlutils libmincrypt
+ifeq ($(MINZIP_USE_LIBDEFLATE),true)
+LOCAL_STATIC_LIBRARIES += libdeflate
+endif
 LOCAL_STATIC_LIBRARIES += libminui libpixelflinger_static libpng libcutils
 LOCAL_STATIC_LIBRARIES += libstdc++ libc
 
@@ -93,7 +107,7 @@ ifeq ($(USE_INTERNAL_EXT4UTILS),true)
 else
     LOCAL_C_INCLUDES += system/extras/ext4_utils
 endif
-LOCAL_C_INCLUDES += external/yaffs2/yaffs2/utils
+LOCAL_C_INCLUDES += external/zlib external/bzip2
 
 include $(BUILD_EXECUTABLE)
 
@@ -128,6 +142,35 @@ LOCAL_MODULE_TAGS := tests
 LOCAL_STATIC_LIBRARIES := libmincrypt libcutils libstdc++ libc
 include $(BUILD_EXECUTABLE)
 
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := \
+    nandroid/nandroid_bench.c \
+    nandroid/nandroid_compress.c \
+    nandroid/nandroid_queue.c \
+    nandroid/nandroid_tar_reader.c \
+    nandroid/nandroid_tar_writer.c \
+    nandroid/nandroid_yaffs_image.c
+LOCAL_MODULE := nandroid_bench
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_MODULE_TAGS := tests
+LOCAL_C_INCLUDES += external/zlib external/bzip2
+LOCAL_STATIC_LIBRARIES := libz libbz libcutils libstdc++ libc
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := \
+    nandroid/nandroid_tar_test.c \
+    nandroid/nandroid_compress.c \
+    nandroid/nandroid_queue.c \
+    nandroid/nandroid_tar_reader.c \
+    nandroid/nandroid_tar_writer.c
+LOCAL_MODULE := nandroid_tar_test
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_MODULE_TAGS := tests
+LOCAL_C_INCLUDES += external/zlib external/bzip2
+LOCAL_STATIC_LIBRARIES := libz libbz libcutils libstdc++ libc
+include $(BUILD_EXECUTABLE)
+
 ifeq ($(USE_INTERNAL_EXT4UTILS),true)
     include $(commands_recovery_local_path)/ext4_utils/Android.mk
 endif
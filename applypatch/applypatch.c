@@ -16,6 +16,8 @@
 
 #include <errno.h>
 #include <libgen.h>
+#include <malloc.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,8 +37,6 @@ static int LoadPartitionContents(const char* filename, FileContents* file);
 int ParseSha1(const char* str, uint8_t* digest);
 static ssize_t FileSink(unsigned char* data, ssize_t len, void* token);
 
-static int mtd_partitions_scanned = 0;
-
 // Read a file into memory; store it and its associated metadata in
 // *file.  Return 0 on success.
 int LoadFileContents(const char* filename, FileContents* file) {
@@ -116,6 +116,128 @@ void FreeFileContents(FileContents* file) {
 // to find one of those hashes.
 enum PartitionType { MTD, EMMC };
 
+// EMMC partitions are read straight into the FileContents buffer by a
+// second thread, in big O_DIRECT chunks, while LoadPartitionContents()
+// hashes whatever has arrived so far.  The reader is told to stop as soon
+// as one of the sizes matches, so it reads at most a chunk too much.
+#define EMMC_READ_CHUNK  (1024 * 1024)
+#define EMMC_READ_ALIGN  4096
+
+typedef struct {
+    int fd;
+    int direct;             // fd is O_DIRECT, so reads must be aligned
+    unsigned char* data;    // padded out to EMMC_READ_ALIGN
+    size_t size;            // read at most this much
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t available;       // bytes of data read so far
+    int done;               // the reader has finished or failed
+    int error;              // errno if it failed
+    int stop;               // no more data is needed
+} EmmcReader;
+
+static void* EmmcReaderThread(void* cookie) {
+    EmmcReader* r = (EmmcReader*)cookie;
+    size_t pos = 0;
+    int error = 0;
+
+    while (pos < r->size) {
+        pthread_mutex_lock(&r->lock);
+        int stop = r->stop;
+        pthread_mutex_unlock(&r->lock);
+        if (stop) break;
+
+        size_t want = r->size - pos;
+        if (want > EMMC_READ_CHUNK) want = EMMC_READ_CHUNK;
+        size_t len = want;
+        if (r->direct) {
+            len = (want + EMMC_READ_ALIGN - 1) & ~(EMMC_READ_ALIGN - 1);
+        }
+
+        ssize_t n = pread64(r->fd, r->data + pos, len, pos);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EINVAL && r->direct) {
+            // The device won't do direct I/O here (an unaligned tail,
+            // say); carry on through the page cache.
+            fcntl(r->fd, F_SETFL, fcntl(r->fd, F_GETFL) & ~O_DIRECT);
+            r->direct = 0;
+            continue;
+        }
+        if (n < 0) {
+            error = errno;
+            break;
+        }
+        if (n == 0) break;      // end of the partition
+        if ((size_t)n > want) n = want;
+        pos += n;
+
+        pthread_mutex_lock(&r->lock);
+        r->available = pos;
+        pthread_cond_signal(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+    }
+
+    pthread_mutex_lock(&r->lock);
+    r->done = 1;
+    r->error = error;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+static int StartEmmcReader(EmmcReader* r, const char* device,
+                           unsigned char* data, size_t size) {
+    memset(r, 0, sizeof(*r));
+    r->data = data;
+    r->size = size;
+    r->direct = 1;
+    r->fd = open(device, O_RDONLY | O_DIRECT);
+    if (r->fd < 0) {
+        r->direct = 0;
+        r->fd = open(device, O_RDONLY);
+        if (r->fd < 0) return -1;
+    }
+    posix_fadvise(r->fd, 0, size, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(r->fd, 0, size, POSIX_FADV_WILLNEED);
+
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    if (pthread_create(&r->thread, NULL, EmmcReaderThread, r) != 0) {
+        pthread_cond_destroy(&r->cond);
+        pthread_mutex_destroy(&r->lock);
+        close(r->fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Wait until there's data beyond 'have', and return how much there is,
+// up to 'want'.  Returns 'have' if the reader stopped short.
+static size_t WaitForEmmcData(EmmcReader* r, size_t have, size_t want) {
+    pthread_mutex_lock(&r->lock);
+    while (r->available <= have && !r->done) {
+        pthread_cond_wait(&r->cond, &r->lock);
+    }
+    size_t available = r->available;
+    if (available <= have && r->error != 0) {
+        printf("error reading emmc partition: %s\n", strerror(r->error));
+    }
+    pthread_mutex_unlock(&r->lock);
+    return available < want ? available : want;
+}
+
+static void StopEmmcReader(EmmcReader* r) {
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+    close(r->fd);
+}
+
 static int LoadPartitionContents(const char* filename, FileContents* file) {
     char* copy = strdup(filename);
     const char* magic = strtok(copy, ":");
@@ -167,19 +289,33 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     qsort(index, pairs, sizeof(int), compare_size_indices);
 
     MtdReadContext* ctx = NULL;
-    FILE* dev = NULL;
+    EmmcReader reader;
+    size_t max_size = size[index[pairs-1]];
+
+    // allocate enough memory to hold the largest size; direct reads
+    // need it aligned, and may run up to the end of an aligned block.
+    if (type == EMMC) {
+        file->data = memalign(EMMC_READ_ALIGN,
+                              (max_size + EMMC_READ_ALIGN - 1) & ~(EMMC_READ_ALIGN - 1));
+    } else {
+        file->data = malloc(max_size);
+    }
+    if (file->data == NULL) {
+        printf("failed to allocate %lu bytes for partition \"%s\"\n",
+               (unsigned long)max_size, partition);
+        return -1;
+    }
 
     switch (type) {
         case MTD:
-            if (!mtd_partitions_scanned) {
-                mtd_scan_partitions();
-                mtd_partitions_scanned = 1;
-            }
+            mtd_scan_partitions_cached();
 
             const MtdPartition* mtd = mtd_find_partition_by_name(partition);
             if (mtd == NULL) {
                 printf("mtd partition \"%s\" not found (loading %s)\n",
                        partition, filename);
+                free(file->data);
+                file->data = NULL;
                 return -1;
             }
 
@@ -187,15 +323,18 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
             if (ctx == NULL) {
                 printf("failed to initialize read of mtd partition \"%s\"\n",
                        partition);
+                free(file->data);
+                file->data = NULL;
                 return -1;
             }
             break;
 
         case EMMC:
-            dev = fopen(partition, "rb");
-            if (dev == NULL) {
+            if (StartEmmcReader(&reader, partition, file->data, max_size) != 0) {
                 printf("failed to open emmc partition \"%s\": %s\n",
                        partition, strerror(errno));
+                free(file->data);
+                file->data = NULL;
                 return -1;
             }
     }
@@ -204,8 +343,6 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     SHA_init(&sha_ctx);
     uint8_t parsed_sha[SHA_DIGEST_SIZE];
 
-    // allocate enough memory to hold the largest size.
-    file->data = malloc(size[index[pairs-1]]);
     char* p = (char*)file->data;
     file->size = 0;                // # bytes read so far
 
@@ -222,17 +359,26 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
                     break;
 
                 case EMMC:
-                    read = fread(p, 1, next, dev);
+                    // hash each piece as soon as the reader delivers it
+                    while (read < next) {
+                        size_t end = WaitForEmmcData(&reader, file->size + read,
+                                                     file->size + next);
+                        if (end <= file->size + read) break;
+                        SHA_update(&sha_ctx, p + read, end - file->size - read);
+                        read = end - file->size;
+                    }
                     break;
             }
             if (next != read) {
                 printf("short read (%d bytes of %d) for partition \"%s\"\n",
                        read, next, partition);
+                if (type == EMMC) StopEmmcReader(&reader);
                 free(file->data);
                 file->data = NULL;
                 return -1;
             }
-            SHA_update(&sha_ctx, p, read);
+            // EMMC pieces were hashed above as they arrived
+            if (type == MTD) SHA_update(&sha_ctx, p, read);
             file->size += read;
         }
 
@@ -245,6 +391,7 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
         if (ParseSha1(sha1sum[index[i]], parsed_sha) != 0) {
             printf("failed to parse sha1 %s in %s\n",
                    sha1sum[index[i]], filename);
+            if (type == EMMC) StopEmmcReader(&reader);
             free(file->data);
             file->data = NULL;
             return -1;
@@ -267,7 +414,7 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
             break;
 
         case EMMC:
-            fclose(dev);
+            StopEmmcReader(&reader);
             break;
     }
 
@@ -360,10 +507,7 @@ int WriteToPartition(unsigned char* data, size_t len,
 
     switch (type) {
         case MTD:
-            if (!mtd_partitions_scanned) {
-                mtd_scan_partitions();
-                mtd_partitions_scanned = 1;
-            }
+            mtd_scan_partitions_cached();
 
             const MtdPartition* mtd = mtd_find_partition_by_name(partition);
             if (mtd == NULL) {
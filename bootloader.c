@@ -70,7 +70,7 @@ static const int MISC_COMMAND_PAGE = 1;  // bootloader command is this page
 static int get_bootloader_message_mtd(struct bootloader_message *out,
                                       const Volume* v) {
     size_t write_size;
-    mtd_scan_partitions();
+    mtd_scan_partitions_cached();
     const MtdPartition *part = mtd_find_partition_by_name(v->device);
     if (part == NULL || mtd_partition_info(part, NULL, NULL, &write_size)) {
         LOGE("Can't find %s\n", v->device);
@@ -96,7 +96,7 @@ static int get_bootloader_message_mtd(struct bootloader_message *out,
 static int set_bootloader_message_mtd(const struct bootloader_message *in,
                                       const Volume* v) {
     size_t write_size;
-    mtd_scan_partitions();
+    mtd_scan_partitions_cached();
     const MtdPartition *part = mtd_find_partition_by_name(v->device);
     if (part == NULL || mtd_partition_info(part, NULL, NULL, &write_size)) {
         LOGE("Can't find %s\n", v->device);
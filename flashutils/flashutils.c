@@ -1,9 +1,18 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
 #include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/sendfile.h>
 #include <sys/wait.h>
 
 #include "flashutils/flashutils.h"
+#include "mtdutils/mtdutils.h"
+#include "mmcutils/mmcutils.h"
 
 int the_flash_type = UNKNOWN;
 
@@ -28,6 +37,19 @@ char* get_default_filesystem()
     return device_flash_type() == MMC ? "ext3" : "yaffs2";
 }
 
+int scan_partitions()
+{
+    switch (device_flash_type()) {
+        case MTD:
+            return mtd_scan_partitions();
+        case MMC:
+            return mmc_scan_partitions();
+        default:
+            // BML partitions are fixed device nodes, there's nothing to scan
+            return 0;
+    }
+}
+
 // This was pulled from bionic: The default system command always looks
 // for shell in /system/bin/sh. This is bad.
 #define _PATH_BSHELL "/sbin/sh"
@@ -69,6 +91,114 @@ __system(const char *command)
     return (pid == -1 ? -1 : pstat);
 }
 
+#define RAW_COPY_BUFFER_SIZE (1024 * 1024)
+#define RAW_COPY_ALIGNMENT   4096
+
+static long long raw_copy_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int raw_copy_write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Copy a whole file or block device to another one, used for raw partition
+// backups and restores on MMC and BML.  The kernel copies the data itself
+// with sendfile() when it can; older kernels only sendfile() to sockets, so
+// otherwise we go through a 1MB page aligned buffer.  Sizes that aren't a
+// multiple of the block size are fine, the tail is just a short read.
+int raw_copy(const char *in_file, const char *out_file)
+{
+    int in = open(in_file, O_RDONLY | O_LARGEFILE);
+    if (in < 0) {
+        printf("Unable to open %s: %s\n", in_file, strerror(errno));
+        return -1;
+    }
+
+    int out = open(out_file, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+    if (out < 0) {
+        printf("Unable to open %s: %s\n", out_file, strerror(errno));
+        close(in);
+        return -1;
+    }
+
+    int ret = 0;
+    long long total = 0;
+    long long start = raw_copy_now_ms();
+    char *buf = NULL;
+
+    for (;;) {
+        ssize_t n = sendfile(out, in, NULL, RAW_COPY_BUFFER_SIZE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+        if (n == 0)
+            goto done;
+        total += n;
+    }
+
+    if (errno != EINVAL && errno != ENOSYS) {
+        printf("Error copying %s to %s: %s\n", in_file, out_file, strerror(errno));
+        ret = -1;
+        goto done;
+    }
+
+    // sendfile() can't do it, carry on from wherever it got to
+    buf = (char*)memalign(RAW_COPY_ALIGNMENT, RAW_COPY_BUFFER_SIZE);
+    if (buf == NULL) {
+        ret = -1;
+        goto done;
+    }
+
+    for (;;) {
+        ssize_t n = read(in, buf, RAW_COPY_BUFFER_SIZE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            printf("Error reading %s: %s\n", in_file, strerror(errno));
+            ret = -1;
+            break;
+        }
+        if (n == 0)
+            break;
+        if (raw_copy_write_all(out, buf, n) != 0) {
+            printf("Error writing %s: %s\n", out_file, strerror(errno));
+            ret = -1;
+            break;
+        }
+        total += n;
+    }
+
+done:
+    free(buf);
+    if (fsync(out) != 0 && errno != EINVAL)
+        ret = -1;
+    if (close(out) != 0)
+        ret = -1;
+    close(in);
+
+    if (ret == 0) {
+        long long ms = raw_copy_now_ms() - start;
+        printf("Copied %lld KB from %s to %s in %lld ms (%lld KB/s)\n",
+               total / 1024, in_file, out_file, ms, ms > 0 ? total * 1000 / 1024 / ms : 0);
+    }
+    return ret;
+}
+
 int restore_raw_partition(const char *partition, const char *filename)
 {
     int type = device_flash_type();
@@ -15,7 +15,12 @@ int get_partition_device(const char *partition, char *device);
 int is_mtd_device();
 char* get_default_filesystem();
 
+// Reads the partition table of the device's flash once, up front, so the
+// lookups in the cmd_* functions and the installers come from the cache.
+int scan_partitions();
+
 int __system(const char *command);
+int raw_copy(const char *in_file, const char *out_file);
 
 extern int cmd_mtd_restore_raw_partition(const char *partition, const char *filename);
 extern int cmd_mtd_backup_raw_partition(const char *partition, const char *filename);
@@ -25,17 +25,22 @@ recovery_menu_item** select_nandroid_menu_create_items(void* data) {
 
     recovery_menu_item** items = (recovery_menu_item**)calloc(count + 1, sizeof(recovery_menu_item*));
     int i;
-    const char* item_format = "%s (parts: %d)"; // name: (part count)
+    const char* item_format = "%s (parts: %d, %lldMB)"; // name: (part count, total size)
     for(i = 0; i < count; ++i) {
         char* name = strdup(basename(strdup(nandroids[i]->dir)));
         int pcount = 0;
+        long long size = 0;
         int* pp = nandroids[i]->partitions;
-        while(*(pp++) != INT_MAX) pcount++;
+        while(*(pp++) != INT_MAX) {
+            if(nandroids[i]->sizes)
+                size += nandroids[i]->sizes[pcount];
+            pcount++;
+        }
 
-        int buflen = strlen(item_format) + strlen(name) + 4;
+        int buflen = strlen(item_format) + strlen(name) + 24;
         char* buf = (char*)calloc(buflen, sizeof(char));
 
-        snprintf(buf, buflen, item_format, name, pcount);
+        snprintf(buf, buflen, item_format, name, pcount, size / (1024 * 1024));
 
         items[i] = create_menu_item(i, buf);
 
@@ -215,6 +220,8 @@ void show_nandroid_adv_restore_menu() {
     nandroid* n = (nandroid*)malloc(sizeof(nandroid));
     n->partitions = NULL;
     n->dir = NULL;
+    n->types = NULL;
+    n->sizes = NULL;
 
     recovery_menu* menu = create_menu(
             headers,
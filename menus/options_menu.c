@@ -57,6 +57,7 @@ int options_menu_select(int chosen_item, void* data) {
         items[j++] = create_menu_item(NANDROID_TYPE_TAR_BZ2,  "TAR + BZip2 Compression");
         items[j++] = create_menu_item(NANDROID_TYPE_TAR_LZMA, "TAR + LZMA Compression");
         items[j++] = create_menu_item(NANDROID_TYPE_YAFFS,    "YAFFS (ClockworkMod)");
+        items[j++] = create_menu_item(NANDROID_TYPE_DEDUP,    "Incremental (Deduplicated)");
         items[j++] = NULL;
 
         int selection = display_item_select_menu(items, rconfig->nandroid_type);
@@ -0,0 +1,119 @@
+/*
+ * Inflate backends for DEFLATED entries.
+ */
+#include "zlib.h"
+
+#include <string.h>
+#ifdef MINZIP_USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#define LOG_TAG "minzip"
+#include "Log.h"
+#include "Inflate.h"
+
+/*
+ * zlib, in a single call with all the input and all the output.
+ */
+static bool zlibInflateBuffer(const unsigned char* src, size_t srcLen,
+        unsigned char* dst, size_t dstLen)
+{
+    z_stream zstream;
+    int zerr;
+
+    memset(&zstream, 0, sizeof(zstream));
+    zstream.next_in = (Bytef*) src;
+    zstream.avail_in = srcLen;
+    zstream.next_out = (Bytef*) dst;
+    zstream.avail_out = dstLen;
+
+    /*
+     * Use the undocumented "negative window bits" feature to tell zlib
+     * that there's no zlib header waiting for it.
+     */
+    zerr = inflateInit2(&zstream, -MAX_WBITS);
+    if (zerr != Z_OK) {
+        LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
+        return false;
+    }
+    zerr = inflate(&zstream, Z_FINISH);
+    inflateEnd(&zstream);
+
+    if (zerr != Z_STREAM_END || zstream.total_out != dstLen) {
+        LOGW("zlib inflate failed (zerr=%d, %lu of %lu bytes)\n", zerr,
+                (unsigned long) zstream.total_out, (unsigned long) dstLen);
+        return false;
+    }
+    return true;
+}
+
+#ifdef MINZIP_USE_LIBDEFLATE
+/*
+ * libdeflate only works on whole buffers, but has vectorized CRC and
+ * match copying, and a much faster Huffman decoder than zlib.
+ */
+static bool libdeflateInflateBuffer(const unsigned char* src, size_t srcLen,
+        unsigned char* dst, size_t dstLen)
+{
+    struct libdeflate_decompressor* d = libdeflate_alloc_decompressor();
+    if (d == NULL) {
+        LOGE("Can't allocate libdeflate decompressor\n");
+        return false;
+    }
+    enum libdeflate_result result =
+            libdeflate_deflate_decompress(d, src, srcLen, dst, dstLen, NULL);
+    libdeflate_free_decompressor(d);
+
+    if (result != LIBDEFLATE_SUCCESS) {
+        LOGW("libdeflate inflate failed (result=%d)\n", result);
+        return false;
+    }
+    return true;
+}
+#endif
+
+static const MzInflater gInflaters[] = {
+#ifdef MINZIP_USE_LIBDEFLATE
+    { "libdeflate", libdeflateInflateBuffer },
+#endif
+    { "zlib", zlibInflateBuffer },
+};
+
+static const MzInflater* gInflater = &gInflaters[0];
+static size_t gInflateBufferSize = MZ_INFLATE_BUFFER_SIZE;
+
+const MzInflater* mzGetInflaters(int* count)
+{
+    *count = sizeof(gInflaters) / sizeof(gInflaters[0]);
+    return gInflaters;
+}
+
+const MzInflater* mzGetInflater(void)
+{
+    return gInflater;
+}
+
+bool mzSetInflater(const char* name)
+{
+    unsigned int i;
+    for (i = 0; i < sizeof(gInflaters) / sizeof(gInflaters[0]); i++) {
+        if (strcmp(gInflaters[i].name, name) == 0) {
+            gInflater = &gInflaters[i];
+            return true;
+        }
+    }
+    LOGW("No inflate backend called \"%s\"\n", name);
+    return false;
+}
+
+void mzSetInflateBufferSize(size_t size)
+{
+    /* Anything smaller than zlib's 32K window just means more calls.
+     */
+    gInflateBufferSize = size < 32 * 1024 ? 32 * 1024 : size;
+}
+
+size_t mzGetInflateBufferSize(void)
+{
+    return gInflateBufferSize;
+}
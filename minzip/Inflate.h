@@ -0,0 +1,55 @@
+/*
+ * Inflate backends for DEFLATED entries.
+ */
+#ifndef _MINZIP_INFLATE
+#define _MINZIP_INFLATE
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * One way of inflating a raw deflate stream that's entirely in memory
+ * (an entry's data in the archive mapping) into a buffer that holds all
+ * of the output.
+ *
+ * zlib is always there.  Building with MINZIP_USE_LIBDEFLATE adds
+ * libdeflate, which is a good deal faster, and becomes the default.
+ */
+typedef struct MzInflater {
+    const char* name;
+
+    /*
+     * Inflate srcLen bytes at src, which must come out to exactly dstLen
+     * bytes.  Returns false if the data is bad or the size is wrong.
+     */
+    bool (*inflateBuffer)(const unsigned char* src, size_t srcLen,
+            unsigned char* dst, size_t dstLen);
+} MzInflater;
+
+/*
+ * The backends built in, fastest first.
+ */
+const MzInflater* mzGetInflaters(int* count);
+
+/*
+ * The backend used for entries inflated in one go: those extracted to a
+ * buffer, and those that fit in the inflate buffer.  Anything bigger is
+ * streamed through zlib, a buffer at a time.
+ */
+const MzInflater* mzGetInflater(void);
+
+/*
+ * Choose a backend by name.  Returns false, leaving things as they were,
+ * if there's no such backend.  This and mzSetInflateBufferSize() aren't
+ * thread safe; call them before extracting anything.
+ */
+bool mzSetInflater(const char* name);
+
+/*
+ * Size of the buffer that streamed output goes through.
+ */
+#define MZ_INFLATE_BUFFER_SIZE (128 * 1024)
+void mzSetInflateBufferSize(size_t size);
+size_t mzGetInflateBufferSize(void);
+
+#endif /*_MINZIP_INFLATE*/
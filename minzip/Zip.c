@@ -9,8 +9,11 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>     // for uintptr_t
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>   // for S_ISLNK()
 #include <unistd.h>
 
@@ -19,6 +22,7 @@
 #include "Bits.h"
 #include "Log.h"
 #include "DirUtil.h"
+#include "Inflate.h"
 
 #undef NDEBUG   // do this after including Log.h
 #include <assert.h>
@@ -111,6 +115,41 @@ static int hashcmpZipEntry(const void* ventry1, const void* ventry2)
     return memcmp(entry1->fileName, entry2->fileName, entry1->fileNameLen);
 }
 
+/*
+ * Compare a ZipEntry's name with the first nameLen bytes of name, in the
+ * order the entries are sorted: byte by byte, with a prefix before
+ * anything longer.
+ */
+static int compareEntryName(const ZipEntry* entry, const char* name,
+        unsigned int nameLen)
+{
+    unsigned int len = entry->fileNameLen < nameLen ?
+            entry->fileNameLen : nameLen;
+    int diff = memcmp(entry->fileName, name, len);
+    if (diff != 0)
+        return diff;
+    return (int) entry->fileNameLen - (int) nameLen;
+}
+
+/*
+ * (This is a qsort callback.)
+ *
+ * Order ZipEntry structs by name.  Duplicates stay in central directory
+ * order, which is the order their names appear in the mapping.
+ */
+static int compareZipEntryNames(const void* ventry1, const void* ventry2)
+{
+    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
+    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
+    int diff = compareEntryName(entry1, entry2->fileName,
+            entry2->fileNameLen);
+
+    if (diff != 0)
+        return diff;
+    return entry1->fileName < entry2->fileName ? -1 :
+            (entry1->fileName > entry2->fileName);
+}
+
 /*
  * (This is a mzHashTableLookup callback.)
  *
@@ -275,58 +314,7 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
             goto bail;
         }
 
-#if SORT_ENTRIES
-        /* Figure out where this entry should go (binary search).
-         */
-        if (i > 0) {
-            int low, high;
-
-            low = 0;
-            high = i - 1;
-            while (low <= high) {
-                int mid;
-                int diff;
-                int diffLen;
-
-                mid = low + ((high - low) / 2); // avoid overflow
-
-                if (pArchive->pEntries[mid].fileNameLen < fileNameLen) {
-                    diffLen = pArchive->pEntries[mid].fileNameLen;
-                } else {
-                    diffLen = fileNameLen;
-                }
-                diff = strncmp(pArchive->pEntries[mid].fileName, fileName,
-                        diffLen);
-                if (diff == 0) {
-                    diff = pArchive->pEntries[mid].fileNameLen - fileNameLen;
-                }
-                if (diff < 0) {
-                    low = mid + 1;
-                } else if (diff > 0) {
-                    high = mid - 1;
-                } else {
-                    high = mid;
-                    break;
-                }
-            }
-
-            unsigned int target = high + 1;
-            assert(target <= i);
-            if (target != i) {
-                /* It belongs somewhere other than at the end of
-                 * the list.  Make some room at [target].
-                 */
-                memmove(pArchive->pEntries + target + 1,
-                        pArchive->pEntries + target,
-                        (i - target) * sizeof(ZipEntry));
-            }
-            pEntry = &pArchive->pEntries[target];
-        } else {
-            pEntry = &pArchive->pEntries[0];
-        }
-#else
         pEntry = &pArchive->pEntries[i];
-#endif
 
         //LOGI("%d: localHdr=%d fnl=%d el=%d cl=%d\n",
         //    i, localHdrOffset, fileNameLen, extraLen, commentLen);
@@ -392,10 +380,14 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
     }
 
 #if SORT_ENTRIES
-    /* If we're sorting, we have to wait until all entries
-     * are in their final places, otherwise the pointers will
-     * probably point to the wrong things.
+    /* Sort once everything's been read, rather than inserting each
+     * entry in place, which moves O(n^2) entries around when the central
+     * directory isn't already in order.  The hash table has to wait
+     * until the entries are in their final places, otherwise the pointers
+     * will point to the wrong things.
      */
+    qsort(pArchive->pEntries, numEntries, sizeof(ZipEntry),
+            compareZipEntryNames);
     for (i = 0; i < numEntries; i++) {
         /* Add to hash table; no need to lock here.
          */
@@ -511,6 +503,29 @@ const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
                 itemHash, (char*) entryName, hashcmpZipName, false);
 }
 
+#if SORT_ENTRIES
+/*
+ * Return the index of the first entry whose name begins with prefix,
+ * or numEntries if there isn't one.  The entries are sorted, so all the
+ * names that begin with it follow on from there.
+ */
+static unsigned int findFirstPrefixMatch(const ZipArchive* pArchive,
+        const char* prefix, unsigned int prefixLen)
+{
+    unsigned int low = 0;
+    unsigned int high = pArchive->numEntries;
+
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (compareEntryName(&pArchive->pEntries[mid], prefix, prefixLen) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+#endif
+
 /*
  * Return true if the entry is a symbolic link.
  */
@@ -522,33 +537,71 @@ bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
     return false;
 }
 
-/* Call processFunction on the uncompressed data of a STORED entry.
+/*
+ * Return the contents of a STORED entry, straight out of the archive's
+ * mapping.
+ */
+const unsigned char* mzGetStoredZipEntryData(const ZipArchive *pArchive,
+    const ZipEntry *pEntry)
+{
+    if (pEntry->compression != STORED || pEntry->compLen != pEntry->uncompLen) {
+        return NULL;
+    }
+    /* parseZipArchive() made sure the entry lies inside the mapping */
+    return (const unsigned char*)pArchive->map.addr + pEntry->offset;
+}
+
+/* Tell the kernel a range of the mapping is about to be read once, in
+ * order, so it reads ahead.
+ */
+static void adviseSequential(const unsigned char *data, long len)
+{
+    long pageSize = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)data & ~(pageSize - 1);
+    madvise((void*)start, (uintptr_t)data + len - start, MADV_SEQUENTIAL);
+}
+
+/* Call processFunction on the uncompressed data of a STORED entry.  The
+ * data is handed over in one piece from the mapping, without copying it.
  */
 static bool processStoredEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
-    size_t bytesLeft = pEntry->compLen;
-    while (bytesLeft > 0) {
-        unsigned char buf[32 * 1024];
-        ssize_t n;
-        size_t count;
-        bool ret;
-
-        count = bytesLeft;
-        if (count > sizeof(buf)) {
-            count = sizeof(buf);
-        }
-        n = read(pArchive->fd, buf, count);
-        if (n < 0 || (size_t)n != count) {
-            LOGE("Can't read %zu bytes from zip file: %ld\n", count, n);
-            return false;
-        }
-        ret = processFunction(buf, n, cookie);
-        if (!ret) {
-            return false;
-        }
-        bytesLeft -= count;
+    const unsigned char *data = mzGetStoredZipEntryData(pArchive, pEntry);
+    if (data == NULL) {
+        LOGE("Bad STORED entry '%.*s'\n", pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+    if (pEntry->compLen == 0) {
+        return true;
+    }
+
+    adviseSequential(data, pEntry->compLen);
+    return processFunction(data, pEntry->compLen, cookie);
+}
+
+/*
+ * Inflate a DEFLATED entry in one go with the current backend, into a
+ * buffer that holds all of it.  The compressed data is read straight out
+ * of the mapping; parseZipArchive() made sure it's all in there.
+ */
+static bool inflateEntryToBuffer(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, unsigned char *buffer)
+{
+    const unsigned char *compData =
+            (const unsigned char*)pArchive->map.addr + pEntry->offset;
+    if (pEntry->compLen > 0) {
+        adviseSequential(compData, pEntry->compLen);
+    }
+
+    const MzInflater *inflater = mzGetInflater();
+    if (!inflater->inflateBuffer(compData, pEntry->compLen,
+            buffer, pEntry->uncompLen))
+    {
+        LOGW("Can't inflate '%.*s' with %s\n", pEntry->fileNameLen,
+                pEntry->fileName, inflater->name);
+        return false;
     }
     return true;
 }
@@ -558,13 +611,47 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
     void *cookie)
 {
     long result = -1;
-    unsigned char readBuf[32 * 1024];
-    unsigned char procBuf[32 * 1024];
+    size_t procBufSize = mzGetInflateBufferSize();
+    unsigned char *procBuf;
     z_stream zstream;
     int zerr;
-    long compRemaining;
 
-    compRemaining = pEntry->compLen;
+    /*
+     * If it all fits in the buffer, the backend does the whole thing.
+     */
+    if ((unsigned long)pEntry->uncompLen <= procBufSize) {
+        procBuf = malloc(pEntry->uncompLen > 0 ? pEntry->uncompLen : 1);
+        if (procBuf == NULL) {
+            LOGE("Can't allocate %ld bytes to inflate into\n",
+                    pEntry->uncompLen);
+            return false;
+        }
+        bool ret = inflateEntryToBuffer(pArchive, pEntry, procBuf);
+        if (ret && pEntry->uncompLen > 0) {
+            ret = processFunction(procBuf, pEntry->uncompLen, cookie);
+            if (!ret) {
+                LOGW("Process function elected to fail (in inflate)\n");
+            }
+        }
+        free(procBuf);
+        return ret;
+    }
+
+    /*
+     * Otherwise stream it through zlib, a buffer at a time.  The
+     * compressed data is read straight out of the mapping, so this
+     * doesn't touch the fd, or copy anything.
+     */
+    const unsigned char *compData =
+            (const unsigned char*)pArchive->map.addr + pEntry->offset;
+    adviseSequential(compData, pEntry->compLen);
+
+    procBuf = malloc(procBufSize);
+    if (procBuf == NULL) {
+        LOGE("Can't allocate %lu byte inflate buffer\n",
+                (unsigned long)procBufSize);
+        return false;
+    }
 
     /*
      * Initialize the zlib stream.
@@ -573,10 +660,10 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
     zstream.zalloc = Z_NULL;
     zstream.zfree = Z_NULL;
     zstream.opaque = Z_NULL;
-    zstream.next_in = NULL;
-    zstream.avail_in = 0;
+    zstream.next_in = (Bytef*) compData;
+    zstream.avail_in = pEntry->compLen;
     zstream.next_out = (Bytef*) procBuf;
-    zstream.avail_out = sizeof(procBuf);
+    zstream.avail_out = procBufSize;
     zstream.data_type = Z_UNKNOWN;
 
     /*
@@ -598,25 +685,6 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
      * Loop while we have data.
      */
     do {
-        /* read as much as we can */
-        if (zstream.avail_in == 0) {
-            long getSize = (compRemaining > (long)sizeof(readBuf)) ?
-                        (long)sizeof(readBuf) : compRemaining;
-            LOGVV("+++ reading %ld bytes (%ld left)\n",
-                getSize, compRemaining);
-
-            int cc = read(pArchive->fd, readBuf, getSize);
-            if (cc != (int) getSize) {
-                LOGW("inflate read failed (%d vs %ld)\n", cc, getSize);
-                goto z_bail;
-            }
-
-            compRemaining -= getSize;
-
-            zstream.next_in = readBuf;
-            zstream.avail_in = getSize;
-        }
-
         /* uncompress the data */
         zerr = inflate(&zstream, Z_NO_FLUSH);
         if (zerr != Z_OK && zerr != Z_STREAM_END) {
@@ -626,7 +694,7 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
 
         /* write when we're full or when we're done */
         if (zstream.avail_out == 0 ||
-            (zerr == Z_STREAM_END && zstream.avail_out != sizeof(procBuf)))
+            (zerr == Z_STREAM_END && zstream.avail_out != procBufSize))
         {
             long procSize = zstream.next_out - procBuf;
             LOGVV("+++ processing %d bytes\n", (int) procSize);
@@ -637,7 +705,7 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
             }
 
             zstream.next_out = procBuf;
-            zstream.avail_out = sizeof(procBuf);
+            zstream.avail_out = procBufSize;
         }
     } while (zerr == Z_OK);
 
@@ -650,6 +718,7 @@ z_bail:
     inflateEnd(&zstream);        /* free up any allocated structures */
 
 bail:
+    free(procBuf);
     if (result != pEntry->uncompLen) {
         if (result != -1)        // error already shown?
             LOGW("Size mismatch on inflated file (%ld vs %ld)\n",
@@ -674,14 +743,10 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     void *cookie)
 {
     bool ret = false;
-    off_t oldOff;
-
-    /* save current offset */
-    oldOff = lseek(pArchive->fd, 0, SEEK_CUR);
-
-    /* Seek to the beginning of the entry's compressed data. */
-    lseek(pArchive->fd, pEntry->offset, SEEK_SET);
 
+    /* Both readers work straight from the mapping and never touch the
+     * fd, so entries can be extracted from more than one thread at once.
+     */
     switch (pEntry->compression) {
     case STORED:
         ret = processStoredEntry(pArchive, pEntry, processFunction, cookie);
@@ -695,8 +760,6 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
         break;
     }
 
-    /* restore file offset */
-    lseek(pArchive->fd, oldOff, SEEK_SET);
     return ret;
 }
 
@@ -758,6 +821,14 @@ bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
     CopyProcessArgs args;
     bool ret;
 
+    if (pEntry->compression == DEFLATED && bufLen >= pEntry->uncompLen) {
+        ret = inflateEntryToBuffer(pArchive, pEntry, (unsigned char *)buf);
+        if (!ret) {
+            LOGE("Can't extract entry to buffer.\n");
+        }
+        return ret;
+    }
+
     args.buf = buf;
     args.bufLen = bufLen;
     ret = mzProcessZipEntryContents(pArchive, pEntry, copyProcessFunction,
@@ -795,14 +866,58 @@ static bool writeProcessFunction(const unsigned char *data, int dataLen,
     }
 }
 
+/*
+ * Copy a STORED entry to "fd".  The kernel does the copy with sendfile()
+ * if it can; older kernels only sendfile() to sockets, so otherwise the
+ * rest is written straight from the mapping.
+ */
+static bool extractStoredEntryToFile(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int fd)
+{
+    const unsigned char *data = mzGetStoredZipEntryData(pArchive, pEntry);
+    if (data == NULL) {
+        LOGE("Bad STORED entry '%.*s'\n", pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+
+    /* the archive is mapped from the start of the file */
+    off_t offset = pEntry->offset;
+    size_t left = pEntry->compLen;
+    while (left > 0) {
+        ssize_t n = sendfile(fd, pArchive->fd, &offset, left);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno != EINVAL && errno != ENOSYS) {
+            LOGE("Error copying %zu bytes from zip file: %s\n",
+                 left, strerror(errno));
+            return false;
+        }
+        if (n <= 0) {
+            break;
+        }
+        left -= n;
+    }
+    if (left == 0) {
+        return true;
+    }
+    return writeProcessFunction(data + (pEntry->compLen - left), left,
+                                (void*)fd);
+}
+
 /*
  * Uncompress "pEntry" in "pArchive" to "fd" at the current offset.
  */
 bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     const ZipEntry *pEntry, int fd)
 {
-    bool ret = mzProcessZipEntryContents(pArchive, pEntry, writeProcessFunction,
-                                         (void*)fd);
+    bool ret;
+    if (pEntry->compression == STORED) {
+        ret = extractStoredEntryToFile(pArchive, pEntry, fd);
+    } else {
+        ret = mzProcessZipEntryContents(pArchive, pEntry, writeProcessFunction,
+                                        (void*)fd);
+    }
     if (!ret) {
         LOGE("Can't extract entry to file.\n");
         return false;
@@ -833,6 +948,14 @@ static bool bufferProcessFunction(const unsigned char *data, int dataLen,
 bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
     const ZipEntry *pEntry, unsigned char *buffer)
 {
+    if (pEntry->compression == DEFLATED) {
+        if (!inflateEntryToBuffer(pArchive, pEntry, buffer)) {
+            LOGE("Can't extract entry to memory buffer.\n");
+            return false;
+        }
+        return true;
+    }
+
     BufferExtractCookie bec;
     bec.buffer = buffer;
     bec.len = mzGetZipEntryUncompLen(pEntry);
@@ -907,6 +1030,159 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
     return helper->buf;
 }
 
+#define UNZIP_DIRMODE 0755
+#define UNZIP_FILEMODE 0644
+
+/* Extract a regular file entry to targetFile, whose directory must
+ * already exist.
+ */
+static bool extractFileEntry(const ZipArchive *pArchive,
+        const ZipEntry *pEntry, const char *targetFile,
+        const struct utimbuf *timestamp)
+{
+    int fd = creat(targetFile, UNZIP_FILEMODE);
+    if (fd < 0) {
+        LOGE("Can't create target file \"%s\": %s\n",
+                targetFile, strerror(errno));
+        return false;
+    }
+
+    bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
+    close(fd);
+    if (!ok) {
+        LOGE("Error extracting \"%s\"\n", targetFile);
+        return false;
+    }
+
+    if (timestamp != NULL && utime(targetFile, timestamp)) {
+        LOGE("Error touching \"%s\"\n", targetFile);
+        return false;
+    }
+
+    LOGD("Extracted file \"%s\"\n", targetFile);
+    return true;
+}
+
+/* With MZ_EXTRACT_PARALLEL, regular files are queued up while the
+ * directories are created, and then shared out between worker threads.
+ */
+#define MZ_EXTRACT_MAX_THREADS 8
+
+typedef struct {
+    const ZipEntry *pEntry;
+    char *targetFile;
+} MzExtractJob;
+
+typedef struct {
+    const ZipArchive *pArchive;
+    const struct utimbuf *timestamp;
+    void (*callback)(const char *fn, void *);
+    void *cookie;
+    MzExtractJob *jobs;
+    int jobCount;
+    int jobsAllocd;
+
+    /* Guards the fields below, and calls to the callback.
+     */
+    pthread_mutex_t lock;
+    int nextJob;
+    bool ok;
+} MzExtractPool;
+
+static bool addExtractJob(MzExtractPool *pool, const ZipEntry *pEntry,
+        const char *targetFile)
+{
+    if (pool->jobCount == pool->jobsAllocd) {
+        int newAllocd = pool->jobsAllocd ? pool->jobsAllocd * 2 : 64;
+        MzExtractJob *newJobs = (MzExtractJob *)realloc(pool->jobs,
+                newAllocd * sizeof(MzExtractJob));
+        if (newJobs == NULL) {
+            return false;
+        }
+        pool->jobs = newJobs;
+        pool->jobsAllocd = newAllocd;
+    }
+    char *copy = strdup(targetFile);
+    if (copy == NULL) {
+        return false;
+    }
+    pool->jobs[pool->jobCount].pEntry = pEntry;
+    pool->jobs[pool->jobCount].targetFile = copy;
+    pool->jobCount++;
+    return true;
+}
+
+/* Biggest first, so one large file doesn't end up holding up the rest
+ * at the end.
+ */
+static int compareJobSize(const void *a, const void *b)
+{
+    long lenA = ((const MzExtractJob *)a)->pEntry->uncompLen;
+    long lenB = ((const MzExtractJob *)b)->pEntry->uncompLen;
+    return (lenA < lenB) - (lenA > lenB);
+}
+
+static void *extractWorker(void *arg)
+{
+    MzExtractPool *pool = (MzExtractPool *)arg;
+
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+        if (!pool->ok || pool->nextJob >= pool->jobCount) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        MzExtractJob *job = &pool->jobs[pool->nextJob++];
+        pthread_mutex_unlock(&pool->lock);
+
+        bool ok = extractFileEntry(pool->pArchive, job->pEntry,
+                job->targetFile, pool->timestamp);
+
+        pthread_mutex_lock(&pool->lock);
+        if (!ok) {
+            pool->ok = false;
+        } else if (pool->callback != NULL) {
+            pool->callback(job->targetFile, pool->cookie);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+/* Extract everything queued in the pool, using up to one thread per CPU
+ * (this one included).
+ */
+static bool runExtractPool(MzExtractPool *pool)
+{
+    pthread_t threads[MZ_EXTRACT_MAX_THREADS];
+    int threadCount = 0;
+    int wanted;
+
+    qsort(pool->jobs, pool->jobCount, sizeof(MzExtractJob), compareJobSize);
+
+    wanted = sysconf(_SC_NPROCESSORS_ONLN);
+    if (wanted > MZ_EXTRACT_MAX_THREADS) {
+        wanted = MZ_EXTRACT_MAX_THREADS;
+    }
+    if (wanted > pool->jobCount) {
+        wanted = pool->jobCount;
+    }
+    while (threadCount < wanted - 1) {
+        if (pthread_create(&threads[threadCount], NULL, extractWorker, pool)) {
+            break;
+        }
+        threadCount++;
+    }
+    LOGD("Extracting %d files with %d threads\n",
+            pool->jobCount, threadCount + 1);
+
+    extractWorker(pool);
+    while (threadCount > 0) {
+        pthread_join(threads[--threadCount], NULL);
+    }
+    return pool->ok;
+}
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -925,6 +1201,10 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
  *     /tmp/two
  *     /tmp/d/three
  *
+ * With MZ_EXTRACT_PARALLEL, the directories and symlinks are made first,
+ * in order, and then the regular files are extracted by a pool of
+ * threads, in no particular order.
+ *
  * Returns true on success, false on failure.
  */
 bool mzExtractRecursive(const ZipArchive *pArchive,
@@ -977,51 +1257,49 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.bufLen = 0;
 
     /* Walk through the entries and extract anything whose path begins
-     * with zpath.
-//TODO: since the entries are sorted, binary search for the first match
-//      and stop after the first non-match.
+     * with zpath.  They're sorted, so that's a run of entries starting
+     * at the first match.
      */
     unsigned int i;
-    bool seenMatch = false;
     int ok = true;
-    for (i = 0; i < pArchive->numEntries; i++) {
+    bool parallel = (flags & MZ_EXTRACT_PARALLEL) &&
+            !(flags & MZ_EXTRACT_DRY_RUN);
+    MzExtractPool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.pArchive = pArchive;
+    pool.timestamp = timestamp;
+    pool.callback = callback;
+    pool.cookie = cookie;
+    pool.ok = true;
+    pthread_mutex_init(&pool.lock, NULL);
+
+#if SORT_ENTRIES
+    i = findFirstPrefixMatch(pArchive, zpath, zipDirLen);
+#else
+    i = 0;
+#endif
+    for (; i < pArchive->numEntries; i++) {
         ZipEntry *pEntry = pArchive->pEntries + i;
-        if (pEntry->fileNameLen < zipDirLen) {
 //TODO: look out for a single empty directory entry that matches zpath, but
 //      missing the trailing slash.  Most zip files seem to include
 //      the trailing slash, but I think it's legal to leave it off.
 //      e.g., zpath "a/b/", entry "a/b", with no children of the entry.
-            /* No chance of matching.
-             */
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
-        }
-        /* If zpath is empty, this strncmp() will match everything,
+        /* If zpath is empty, this memcmp() will match everything,
          * which is what we want.
          */
-        if (strncmp(pEntry->fileName, zpath, zipDirLen) != 0) {
+        if (pEntry->fileNameLen < zipDirLen ||
+            memcmp(pEntry->fileName, zpath, zipDirLen) != 0)
+        {
 #if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
+            /* Since the entries are sorted, that was the last match.
+             */
+            break;
+#else
             continue;
+#endif
         }
         /* This entry begins with zipDir, so we'll extract it.
-         */
-        seenMatch = true;
-
-        /* Find the target location of the entry.
+         * Find the target location of the entry.
          */
         const char *targetFile = targetEntryPath(&helper, pEntry);
         if (targetFile == NULL) {
@@ -1040,8 +1318,6 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
 
         /* Create the file or directory.
          */
-#define UNZIP_DIRMODE 0755
-#define UNZIP_FILEMODE 0644
         if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
             if (!(flags & MZ_EXTRACT_FILES_ONLY)) {
                 int ret = dirCreateHierarchy(
@@ -1109,39 +1385,39 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                 LOGD("Extracted symlink \"%s\" -> \"%s\"\n",
                         targetFile, linkTarget);
                 free(linkTarget);
-            } else {
-                /* The entry is a regular file.
-                 * Open the target for writing.
+            } else if (parallel) {
+                /* The entry is a regular file; a worker will get to it
+                 * once all the directories are there.  The callback is
+                 * made then, too.
                  */
-                int fd = creat(targetFile, UNZIP_FILEMODE);
-                if (fd < 0) {
-                    LOGE("Can't create target file \"%s\": %s\n",
-                            targetFile, strerror(errno));
+                if (!addExtractJob(&pool, pEntry, targetFile)) {
+                    LOGE("Can't queue \"%s\" for extraction\n", targetFile);
                     ok = false;
                     break;
                 }
-
-                bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
-                close(fd);
-                if (!ok) {
-                    LOGE("Error extracting \"%s\"\n", targetFile);
-                    ok = false;
-                    break;
-                }
-
-                if (timestamp != NULL && utime(targetFile, timestamp)) {
-                    LOGE("Error touching \"%s\"\n", targetFile);
+                continue;
+            } else {
+                /* The entry is a regular file.
+                 */
+                if (!extractFileEntry(pArchive, pEntry, targetFile, timestamp)) {
                     ok = false;
                     break;
                 }
-
-                LOGD("Extracted file \"%s\"\n", targetFile);
             }
         }
 
         if (callback != NULL) callback(targetFile, cookie);
     }
 
+    if (ok && pool.jobCount > 0) {
+        ok = runExtractPool(&pool);
+    }
+    for (i = 0; i < (unsigned int)pool.jobCount; i++) {
+        free(pool.jobs[i].targetFile);
+    }
+    free(pool.jobs);
+    pthread_mutex_destroy(&pool.lock);
+
     free(helper.buf);
     free(zpath);
 
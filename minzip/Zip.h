@@ -37,6 +37,10 @@ typedef struct ZipEntry {
 
 /*
  * One Zip archive.  Treat as opaque.
+ *
+ * Once it's open, entries can be looked up, checked and extracted from
+ * several threads at once: the entry data is read out of the mapping and
+ * nothing in here changes after mzOpenZipArchive().
  */
 typedef struct ZipArchive {
     int         fd;
@@ -163,7 +167,16 @@ bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
 bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry);
 
 /*
- * Inflate and write an entry to a file.
+ * Return a pointer to the data of a STORED (uncompressed) entry, right
+ * in the archive's mapping, or NULL for compressed entries.  The data is
+ * borrowed: it's read-only, and only valid until the archive is closed.
+ */
+const unsigned char* mzGetStoredZipEntryData(const ZipArchive *pArchive,
+    const ZipEntry *pEntry);
+
+/*
+ * Inflate and write an entry to a file.  STORED entries are copied
+ * without going through a user-space buffer.
  */
 bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     const ZipEntry *pEntry, int fd);
@@ -197,6 +210,9 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
  *
  *     MZ_EXTRACT_FILES_ONLY - only unpack files, not directories or symlinks
  *     MZ_EXTRACT_DRY_RUN - don't do anything, but do invoke the callback
+ *     MZ_EXTRACT_PARALLEL - unpack regular files on several threads at
+ *         once, after the directories are made; the callback is still
+ *         made one at a time, but not in archive order
  *
  * If timestamp is non-NULL, file timestamps will be set accordingly.
  *
@@ -204,7 +220,8 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
  *
  * Returns true on success, false on failure.
  */
-enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2 };
+enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2,
+       MZ_EXTRACT_PARALLEL = 4 };
 bool mzExtractRecursive(const ZipArchive *pArchive,
         const char *zipDir, const char *targetDir,
         int flags, const struct utimbuf *timestamp,
@@ -0,0 +1,173 @@
+/*
+ * Compares the inflate backends (see Inflate.h) on real archives: APKs,
+ * OTA packages, anything with DEFLATED entries in it.  Each backend
+ * inflates every entry whole, as mzExtractZipEntryToBuffer() does, then
+ * entries are streamed through mzProcessZipEntryContents() with a few
+ * buffer sizes, the way files are extracted.  Results are in MB/s of
+ * uncompressed output, split into native libraries, dex files and
+ * everything else.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Zip.h"
+#include "Inflate.h"
+
+#define METHOD_DEFLATED 8    // compression method, from the zip spec
+
+enum { KIND_SO, KIND_DEX, KIND_OTHER, KIND_ALL, NUM_KINDS };
+static const char *kind_names[NUM_KINDS] = { ".so", ".dex", "other", "all" };
+
+static const size_t stream_sizes[] = { 32 * 1024, 128 * 1024, 1024 * 1024 };
+#define NUM_STREAM_SIZES (sizeof(stream_sizes) / sizeof(stream_sizes[0]))
+
+typedef struct {
+    double secs[NUM_KINDS];
+    double bytes[NUM_KINDS];
+} Result;
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int entry_kind(const ZipEntry *entry) {
+    UnterminatedString name = mzGetZipEntryFileName(entry);
+    if (name.len >= 3 && memcmp(name.str + name.len - 3, ".so", 3) == 0)
+        return KIND_SO;
+    if (name.len >= 4 && memcmp(name.str + name.len - 4, ".dex", 4) == 0)
+        return KIND_DEX;
+    return KIND_OTHER;
+}
+
+static void add_result(Result *r, int kind, double secs, double bytes) {
+    r->secs[kind] += secs;
+    r->bytes[kind] += bytes;
+    r->secs[KIND_ALL] += secs;
+    r->bytes[KIND_ALL] += bytes;
+}
+
+static void print_result(const char *name, const Result *r) {
+    int k;
+    printf("%-18s", name);
+    for (k = 0; k < NUM_KINDS; ++k) {
+        if (r->secs[k] > 0) {
+            printf(" %9.1f", r->bytes[k] / r->secs[k] / (1024 * 1024));
+        } else {
+            printf(" %9s", "-");
+        }
+    }
+    printf("\n");
+}
+
+static bool discard(const unsigned char *data, int len, void *cookie) {
+    return true;
+}
+
+// Runs every DEFLATED entry of every archive through one backend, whole
+// if stream_size is 0 and streamed through that size of buffer otherwise.
+static int run(ZipArchive *archives, int count, int iterations,
+               size_t stream_size, Result *r) {
+    int a, i;
+    memset(r, 0, sizeof(*r));
+    if (stream_size > 0) mzSetInflateBufferSize(stream_size);
+
+    for (a = 0; a < count; ++a) {
+        unsigned int e;
+        for (e = 0; e < mzZipEntryCount(&archives[a]); ++e) {
+            const ZipEntry *entry = mzGetZipEntryAt(&archives[a], e);
+            long len = mzGetZipEntryUncompLen(entry);
+            if (entry->compression != METHOD_DEFLATED) continue;
+
+            unsigned char *buf = malloc(len > 0 ? len : 1);
+            if (buf == NULL) return -1;
+            double start = now_sec();
+            for (i = 0; i < iterations; ++i) {
+                bool ok = stream_size > 0 ?
+                        mzProcessZipEntryContents(&archives[a], entry,
+                                                  discard, NULL) :
+                        mzExtractZipEntryToBuffer(&archives[a], entry, buf);
+                if (!ok) {
+                    UnterminatedString name = mzGetZipEntryFileName(entry);
+                    fprintf(stderr, "can't inflate %.*s\n",
+                            (int) name.len, name.str);
+                    free(buf);
+                    return -1;
+                }
+            }
+            add_result(r, entry_kind(entry), now_sec() - start,
+                       (double) len * iterations);
+            free(buf);
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int iterations = 5;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:")) != -1) {
+        switch (opt) {
+        case 'i': iterations = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-i iterations (5)] <zip>...\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind >= argc || iterations <= 0) {
+        fprintf(stderr, "Usage: %s [-i iterations (5)] <zip>...\n", argv[0]);
+        return 2;
+    }
+
+    int count = argc - optind;
+    ZipArchive *archives = calloc(count, sizeof(ZipArchive));
+    int a;
+    for (a = 0; a < count; ++a) {
+        if (mzOpenZipArchive(argv[optind + a], &archives[a]) != 0) {
+            fprintf(stderr, "can't open %s\n", argv[optind + a]);
+            return 1;
+        }
+    }
+
+    int k, failed = 0;
+    printf("%-18s", "MB/s");
+    for (k = 0; k < NUM_KINDS; ++k) printf(" %9s", kind_names[k]);
+    printf("\n");
+
+    int num_inflaters, b;
+    const MzInflater *inflaters = mzGetInflaters(&num_inflaters);
+    const char *default_name = mzGetInflater()->name;
+    Result r;
+    for (b = 0; b < num_inflaters; ++b) {
+        mzSetInflater(inflaters[b].name);
+        if (run(archives, count, iterations, 0, &r) != 0) {
+            failed = 1;
+            continue;
+        }
+        print_result(inflaters[b].name, &r);
+    }
+
+    // Streaming goes through zlib once entries outgrow the buffer
+    mzSetInflater(default_name);
+    unsigned int s;
+    for (s = 0; s < NUM_STREAM_SIZES; ++s) {
+        char name[32];
+        snprintf(name, sizeof(name), "stream %luK",
+                 (unsigned long) stream_sizes[s] / 1024);
+        if (run(archives, count, iterations, stream_sizes[s], &r) != 0) {
+            failed = 1;
+            continue;
+        }
+        print_result(name, &r);
+    }
+
+    for (a = 0; a < count; ++a) mzCloseZipArchive(&archives[a]);
+    free(archives);
+    return failed;
+}
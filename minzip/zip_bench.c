@@ -0,0 +1,245 @@
+/*
+ * Times opening a large package and looking things up in it.  Writes a
+ * synthetic package with lots of small entries spread over a system
+ * image-like tree (10000 by default), then reports how long
+ * mzOpenZipArchive() takes, and the cost per call of mzFindZipEntry() and
+ * of walking a directory with mzExtractRecursive(), which is what
+ * package_extract_dir does.  The directory walks are dry runs, so only
+ * the lookups are measured, not the file system.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "Zip.h"
+
+typedef struct {
+    const char *dir;
+    int share;          // parts per 100 of the entries
+} BenchDir;
+
+static const BenchDir bench_dirs[] = {
+    { "META-INF/com/google/android/", 1 },
+    { "system/app/",                  10 },
+    { "system/bin/",                  15 },
+    { "system/etc/",                  8 },
+    { "system/fonts/",                2 },
+    { "system/framework/",            4 },
+    { "system/lib/",                  20 },
+    { "system/lib/hw/",               1 },
+    { "system/media/audio/ui/",       4 },
+    { "system/usr/share/zoneinfo/",   25 },
+    { "system/xbin/",                 10 },
+};
+#define NUM_DIRS (sizeof(bench_dirs) / sizeof(bench_dirs[0]))
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void put2(unsigned char *p, unsigned int v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put4(unsigned char *p, unsigned int v) {
+    put2(p, v);
+    put2(p + 2, v >> 16);
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// Writes count STORED entries, each holding its own name, in central
+// directory order if sorted is set and shuffled otherwise.
+static int write_package(const char *path, int count, int sorted) {
+    char **names = malloc(count * sizeof(char *));
+    unsigned int *offsets = malloc(count * sizeof(unsigned int));
+    if (names == NULL || offsets == NULL) return -1;
+
+    int i = 0;
+    unsigned int d;
+    for (d = 0; d < NUM_DIRS; ++d) {
+        int n = d == NUM_DIRS - 1 ? count - i : count * bench_dirs[d].share / 100;
+        for (; n > 0 && i < count; --n, ++i) {
+            names[i] = malloc(strlen(bench_dirs[d].dir) + 16);
+            sprintf(names[i], "%sf%05d.bin", bench_dirs[d].dir, i);
+        }
+    }
+    if (sorted) {
+        qsort(names, count, sizeof(char *), compare_names);
+    } else {
+        unsigned int seed = 12345;
+        for (i = count - 1; i > 0; --i) {
+            seed = seed * 1103515245 + 12345;
+            int j = (seed >> 8) % (i + 1);
+            char *t = names[i];
+            names[i] = names[j];
+            names[j] = t;
+        }
+    }
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    unsigned char hdr[46];
+    unsigned int pos = 0;
+    for (i = 0; i < count; ++i) {
+        unsigned int len = strlen(names[i]);
+        unsigned int crc = crc32(crc32(0L, Z_NULL, 0),
+                                 (const unsigned char *) names[i], len);
+        memset(hdr, 0, sizeof(hdr));
+        put4(hdr, 0x04034b50);
+        put2(hdr + 4, 10);
+        put4(hdr + 14, crc);
+        put4(hdr + 18, len);
+        put4(hdr + 22, len);
+        put2(hdr + 26, len);
+        offsets[i] = pos;
+        fwrite(hdr, 1, 30, f);
+        fwrite(names[i], 1, len, f);
+        fwrite(names[i], 1, len, f);
+        pos += 30 + 2 * len;
+    }
+    unsigned int cd_start = pos;
+    for (i = 0; i < count; ++i) {
+        unsigned int len = strlen(names[i]);
+        unsigned int crc = crc32(crc32(0L, Z_NULL, 0),
+                                 (const unsigned char *) names[i], len);
+        memset(hdr, 0, sizeof(hdr));
+        put4(hdr, 0x02014b50);
+        put2(hdr + 4, 0x0314);          // made by unix
+        put2(hdr + 6, 10);
+        put4(hdr + 16, crc);
+        put4(hdr + 20, len);
+        put4(hdr + 24, len);
+        put2(hdr + 28, len);
+        put4(hdr + 38, 0100644 << 16);
+        put4(hdr + 42, offsets[i]);
+        fwrite(hdr, 1, 46, f);
+        fwrite(names[i], 1, len, f);
+        pos += 46 + len;
+    }
+    memset(hdr, 0, sizeof(hdr));
+    put4(hdr, 0x06054b50);
+    put2(hdr + 8, count);
+    put2(hdr + 10, count);
+    put4(hdr + 12, pos - cd_start);
+    put4(hdr + 16, cd_start);
+    fwrite(hdr, 1, 22, f);
+
+    int ret = 0;
+    if (fclose(f) != 0) {
+        perror(path);
+        ret = -1;
+    }
+    for (i = 0; i < count; ++i) free(names[i]);
+    free(names);
+    free(offsets);
+    return ret;
+}
+
+static void count_callback(const char *fn, void *cookie) {
+    ++*(int *) cookie;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s [options] <work dir>\n"
+            "  -n count  entries in the package (10000)\n"
+            "  -i count  times to repeat each measurement (20)\n"
+            "  -s        write the central directory already sorted\n",
+            argv0);
+}
+
+int main(int argc, char **argv) {
+    int count = 10000, iterations = 20, sorted = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:i:s")) != -1) {
+        switch (opt) {
+        case 'n': count = atoi(optarg); break;
+        case 'i': iterations = atoi(optarg); break;
+        case 's': sorted = 1; break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    // The end of central directory record only has 16 bits for the count
+    if (optind != argc - 1 || count < (int) NUM_DIRS || count > 65535 ||
+        iterations <= 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/zip_bench.zip", argv[optind]);
+    if (write_package(path, count, sorted) != 0) return 1;
+
+    ZipArchive za;
+    int i, failed = 0;
+    double start = now_sec();
+    for (i = 0; i < iterations; ++i) {
+        if (mzOpenZipArchive(path, &za) != 0) {
+            fprintf(stderr, "can't open %s\n", path);
+            unlink(path);
+            return 1;
+        }
+        if (i < iterations - 1) mzCloseZipArchive(&za);
+    }
+    printf("%-36s %10.3f ms\n", "open", (now_sec() - start) * 1000 / iterations);
+
+    // Look up every entry, by a copy of its name
+    unsigned int n = mzZipEntryCount(&za);
+    char **names = malloc(n * sizeof(char *));
+    unsigned int e;
+    for (e = 0; e < n; ++e) {
+        UnterminatedString s = mzGetZipEntryFileName(mzGetZipEntryAt(&za, e));
+        names[e] = strndup(s.str, s.len);
+    }
+    start = now_sec();
+    for (i = 0; i < iterations; ++i) {
+        for (e = 0; e < n; ++e) {
+            if (mzFindZipEntry(&za, names[e]) == NULL) {
+                fprintf(stderr, "can't find %s\n", names[e]);
+                failed = 1;
+            }
+        }
+    }
+    printf("%-36s %10.3f us/call\n", "find",
+           (now_sec() - start) * 1e6 / iterations / n);
+
+    struct utimbuf timestamp = { 1217592000, 1217592000 };
+    unsigned int d;
+    for (d = 0; d < NUM_DIRS; ++d) {
+        int found = 0;
+        start = now_sec();
+        for (i = 0; i < iterations; ++i) {
+            found = 0;
+            if (!mzExtractRecursive(&za, bench_dirs[d].dir, "/bench",
+                                    MZ_EXTRACT_DRY_RUN, &timestamp,
+                                    count_callback, &found)) {
+                failed = 1;
+            }
+        }
+        printf("%-30s %5d %10.3f us/call\n", bench_dirs[d].dir, found,
+               (now_sec() - start) * 1e6 / iterations);
+    }
+
+    for (e = 0; e < n; ++e) free(names[e]);
+    free(names);
+    mzCloseZipArchive(&za);
+    unlink(path);
+    return failed;
+}
@@ -0,0 +1,134 @@
+/*
+ * Reads every entry of a zip from several threads at once, all sharing
+ * one ZipArchive, and checks each one against the CRC in the central
+ * directory.  Each thread walks the entries in a different order and
+ * alternates between mzIsZipEntryIntact() and extracting to a buffer, so
+ * the readers overlap on the same entries as well as on different ones.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "Zip.h"
+
+#define MAX_THREADS 64
+
+typedef struct {
+    const ZipArchive *archive;
+    int id;
+    int passes;
+    int checked;
+    int failed;
+} StressThread;
+
+static bool checkEntry(const ZipArchive *archive, const ZipEntry *entry,
+        bool extract)
+{
+    if (!extract) {
+        return mzIsZipEntryIntact(archive, entry);
+    }
+
+    long len = mzGetZipEntryUncompLen(entry);
+    unsigned char *buf = malloc(len > 0 ? len : 1);
+    if (buf == NULL) {
+        return false;
+    }
+    bool ok = mzExtractZipEntryToBuffer(archive, entry, buf);
+    if (ok) {
+        unsigned long crc = crc32(crc32(0L, Z_NULL, 0), buf, len);
+        ok = crc == (unsigned long) mzGetZipEntryCrc32(entry);
+    }
+    free(buf);
+    return ok;
+}
+
+static void *stressThread(void *cookie)
+{
+    StressThread *t = (StressThread *) cookie;
+    unsigned int count = mzZipEntryCount(t->archive);
+    /* Odd strides are coprime with a power of two; a prime is coprime
+     * with everything else it doesn't divide.
+     */
+    unsigned int stride = (t->id % 2 == 0) ? 1 : 7919;
+    if (count % stride == 0) {
+        stride = 1;
+    }
+    int pass;
+
+    for (pass = 0; pass < t->passes; pass++) {
+        unsigned int start = (t->id * 131 + pass * 17) % (count ? count : 1);
+        unsigned int i;
+        for (i = 0; i < count; i++) {
+            unsigned int index = (start + (unsigned long) i * stride) % count;
+            const ZipEntry *entry = mzGetZipEntryAt(t->archive, index);
+            if (mzIsZipEntrySymlink(entry)) {
+                continue;
+            }
+            bool extract = ((index + t->id + pass) % 2) == 0;
+            if (!checkEntry(t->archive, entry, extract)) {
+                UnterminatedString name = mzGetZipEntryFileName(entry);
+                fprintf(stderr, "thread %d: bad %s of %.*s\n", t->id,
+                        extract ? "extract" : "crc", (int) name.len,
+                        name.str);
+                t->failed++;
+            }
+            t->checked++;
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "Usage: %s <zip> [threads (8)] [passes (4)]\n",
+                argv[0]);
+        return 2;
+    }
+    int threads = argc > 2 ? atoi(argv[2]) : 8;
+    int passes = argc > 3 ? atoi(argv[3]) : 4;
+    if (threads < 1 || threads > MAX_THREADS || passes < 1) {
+        fprintf(stderr, "threads must be 1-%d, passes at least 1\n",
+                MAX_THREADS);
+        return 2;
+    }
+
+    ZipArchive archive;
+    int err = mzOpenZipArchive(argv[1], &archive);
+    if (err != 0) {
+        fprintf(stderr, "Can't open %s: %s\n", argv[1], strerror(err));
+        return 1;
+    }
+
+    StressThread t[MAX_THREADS];
+    pthread_t tid[MAX_THREADS];
+    int started = 0;
+    int i;
+    for (i = 0; i < threads; i++) {
+        memset(&t[i], 0, sizeof(t[i]));
+        t[i].archive = &archive;
+        t[i].id = i;
+        t[i].passes = passes;
+        if (pthread_create(&tid[i], NULL, stressThread, &t[i]) != 0) {
+            fprintf(stderr, "Can't start thread %d\n", i);
+            break;
+        }
+        started++;
+    }
+
+    int checked = 0, failed = 0;
+    for (i = 0; i < started; i++) {
+        pthread_join(tid[i], NULL);
+        checked += t[i].checked;
+        failed += t[i].failed;
+    }
+    mzCloseZipArchive(&archive);
+
+    printf("%d threads checked %d entries, %d bad\n", started, checked,
+            failed);
+    return (failed > 0 || started < threads) ? 1 : 0;
+}
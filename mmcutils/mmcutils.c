@@ -39,7 +39,11 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/mount.h>  // for _IOW, _IOR, mount()
+#include <fcntl.h>
+#include <malloc.h>
+#include <time.h>
 
+#include "mincrypt/sha.h"
 #include "mmcutils.h"
 
 unsigned ext3_count = 0;
@@ -62,15 +66,77 @@ typedef struct {
     MmcPartition *partitions;
     int partitions_allocd;
     int partition_count;
+    // what the table was read from at the last successful scan: the
+    // kernel's /proc/partitions, and the MBR and EBR sectors themselves
+    char *proc_text;
+    int table_sectors;
+    unsigned table_sector[MAX_PARTITIONS + 1];
+    unsigned char table[MAX_PARTITIONS + 1][512];
 } MmcState;
 
 static MmcState g_mmc_state = {
     NULL,   // partitions
     0,      // partitions_allocd
-    -1      // partition_count
+    -1,     // partition_count
+    NULL,   // proc_text
+    0       // table_sectors
 };
 
 #define MMC_DEVICENAME "/dev/block/mmcblk0"
+#define MMC_PROC_FILENAME "/proc/partitions"
+
+static int
+mmc_read_proc (char *buf, size_t len) {
+    int fd = open(MMC_PROC_FILENAME, O_RDONLY);
+    size_t nbytes = 0;
+    if (fd >= 0) {
+        ssize_t n;
+        while (nbytes < len - 1 &&
+               (n = read(fd, buf + nbytes, len - 1 - nbytes)) > 0)
+            nbytes += n;
+        close(fd);
+    }
+    // no /proc/partitions just leaves the table sectors to go on
+    buf[nbytes] = '\0';
+    return nbytes;
+}
+
+/* Read one 512 byte sector of the partition table, and remember it so
+ * mmc_scan_partitions_cached() can tell if the table changed.
+ */
+static int
+mmc_read_table_sector (FILE *fd, unsigned sec, unsigned char *buffer) {
+    if (fseek(fd, (sec * 512), SEEK_SET) != 0 ||
+        fread(buffer, 512, 1, fd) != 1)
+        return -1;
+    if (g_mmc_state.table_sectors < MAX_PARTITIONS + 1) {
+        int i = g_mmc_state.table_sectors++;
+        g_mmc_state.table_sector[i] = sec;
+        memcpy(g_mmc_state.table[i], buffer, 512);
+    }
+    return 0;
+}
+
+/* Read the table sectors of the last scan again, from the device rather
+ * than the page cache, and compare them with what was parsed.
+ */
+static int
+mmc_table_changed (void) {
+    unsigned char buffer[512];
+    int i, changed = 0;
+    int fd = open(MMC_DEVICENAME, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    for (i = 0; i < g_mmc_state.table_sectors && !changed; i++) {
+        off64_t pos = (off64_t)g_mmc_state.table_sector[i] * 512;
+        posix_fadvise(fd, pos, 512, POSIX_FADV_DONTNEED);
+        if (pread64(fd, buffer, 512, pos) != 512 ||
+            memcmp(buffer, g_mmc_state.table[i], 512) != 0)
+            changed = 1;
+    }
+    close(fd);
+    return changed;
+}
 
 static void
 mmc_partition_name (MmcPartition *mbr, unsigned int type) {
@@ -122,7 +188,7 @@ mmc_read_mbr (const char *device, MmcPartition *mbr) {
         printf("Can't open device: \"%s\"\n", device);
         goto ERROR2;
     }
-    if ((fread(buffer, 512, 1, fd)) != 1)
+    if (mmc_read_table_sector(fd, 0, buffer) != 0)
     {
         printf("Can't read device: \"%s\"\n", device);
         goto ERROR1;
@@ -173,8 +239,7 @@ mmc_read_mbr (const char *device, MmcPartition *mbr) {
     EBR_first_sec = dfirstsec;
     EBR_current_sec = dfirstsec;
 
-    fseek (fd, (EBR_first_sec * 512), SEEK_SET);
-    if ((fread(buffer, 512, 1, fd)) != 1)
+    if (mmc_read_table_sector(fd, EBR_first_sec, buffer) != 0)
         goto ERROR1;
 
     /* Loop to parse the EBR */
@@ -214,8 +279,7 @@ mmc_read_mbr (const char *device, MmcPartition *mbr) {
             break;
         }
         /* More EBR to follow - read in the next EBR sector */
-        fseek (fd,  ((EBR_first_sec + dfirstsec) * 512), SEEK_SET);
-        if ((fread(buffer, 512, 1, fd)) != 1)
+        if (mmc_read_table_sector(fd, EBR_first_sec + dfirstsec, buffer) != 0)
             goto ERROR1;
 
         EBR_current_sec = EBR_first_sec + dfirstsec;
@@ -269,6 +333,12 @@ mmc_scan_partitions() {
         }
     }
 
+    char buf[4096];
+    mmc_read_proc(buf, sizeof(buf));
+    free(g_mmc_state.proc_text);
+    g_mmc_state.proc_text = strdup(buf);
+    g_mmc_state.table_sectors = 0;
+
     g_mmc_state.partition_count = mmc_read_mbr(MMC_DEVICENAME, g_mmc_state.partitions);
     if(g_mmc_state.partition_count == -1)
     {
@@ -279,6 +349,17 @@ mmc_scan_partitions() {
     return g_mmc_state.partition_count;
 }
 
+int
+mmc_scan_partitions_cached() {
+    char buf[4096];
+    if (g_mmc_state.partition_count >= 0 && g_mmc_state.proc_text != NULL) {
+        mmc_read_proc(buf, sizeof(buf));
+        if (strcmp(g_mmc_state.proc_text, buf) == 0 && !mmc_table_changed())
+            return g_mmc_state.partition_count;
+    }
+    return mmc_scan_partitions();
+}
+
 const MmcPartition *
 mmc_find_partition_by_name(const char *name)
 {
@@ -368,170 +449,361 @@ mmc_mount_partition(const MmcPartition *partition, const char *mount_point,
     return rv;
 }
 
-int
-mmc_raw_copy (const MmcPartition *partition, char *in_file) {
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
-    int ret = -1;
-    char *out_file = partition->device_index;
+static size_t raw_chunk_size = MMC_RAW_CHUNK_SIZE;
+static void (*raw_progress)(float fraction) = NULL;
 
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
+void
+mmc_set_raw_chunk_size (size_t chunk_size) {
+    // direct I/O has to stay aligned
+    chunk_size &= ~(size_t)(MMC_RAW_ALIGN - 1);
+    raw_chunk_size = chunk_size > 0 ? chunk_size : MMC_RAW_ALIGN;
+}
 
-    out = fopen ( out_file,  "w" );
-    if (out == NULL)
-        goto ERROR2;
+void
+mmc_set_progress_callback (void (*progress)(float fraction)) {
+    raw_progress = progress;
+}
 
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
+static long long
+mmc_raw_now_ms (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
 
-    if (sz % 512)
-    {
-        while ( ( ch = fgetc ( in ) ) != EOF )
-            fputc ( ch, out );
+/* Open a partition for raw I/O, bypassing the page cache if the device
+ * lets us.
+ */
+static int
+mmc_raw_open (const char *device, int flags, int *direct) {
+    int fd = open(device, flags | O_DIRECT | O_LARGEFILE);
+    *direct = (fd >= 0);
+    if (fd < 0)
+        fd = open(device, flags | O_LARGEFILE);
+    if (fd < 0)
+        printf("Can't open device: \"%s\" (%s)\n", device, strerror(errno));
+    return fd;
+}
+
+/* Read or write all of len, short of an error or the end of the file. */
+static ssize_t
+mmc_raw_file_io (int fd, char *buf, size_t len, int writing) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = writing ? write(fd, buf + done, len - done)
+                            : read(fd, buf + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
     }
-    else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
+    return done;
+}
+
+/* Move size bytes between the device and either data or, if data is NULL
+ * and file_fd isn't -1, a file.  It goes a chunk at a time through an
+ * aligned bounce buffer, since the caller's data needn't be aligned.  A
+ * tail that isn't a whole number of blocks goes through the page cache.
+ * If hash isn't NULL it's updated with everything that passes through.
+ * Progress goes from progress_start to progress_end of the way.
+ *
+ * When writing from a file with to_eof set, size is only a limit: the
+ * file is written until it ends, which is how pipes are flashed, and
+ * anything past the limit is an error.
+ *
+ * Returns the number of bytes moved, or -1.
+ */
+static long long
+mmc_raw_transfer (int fd, int direct, char *data, int file_fd,
+                  unsigned long long size, int writing, int to_eof,
+                  SHA_CTX *hash, float progress_start, float progress_end) {
+    char *buf = memalign(MMC_RAW_ALIGN, raw_chunk_size);
+    if (buf == NULL)
+        return -1;
+
+    int ret = 0;
+    int at_eof = 0;
+    unsigned long long limit = size;
+    unsigned long long done = 0;
+    size_t staged = 0;      // bytes in buf from the source not written yet
+    while (done < size) {
+        size_t len = size - done < raw_chunk_size ? size - done : raw_chunk_size;
+        if (direct && (len & (MMC_RAW_ALIGN - 1)) != 0) {
+            if (len > MMC_RAW_ALIGN) {
+                len &= ~(size_t)(MMC_RAW_ALIGN - 1);
+            } else {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+                direct = 0;
+            }
+        }
+
+        ssize_t n;
+        if (writing) {
+            if (staged < len) {
+                ssize_t got = len - staged;
+                if (data != NULL) {
+                    memcpy(buf + staged, data + done + staged, got);
+                } else {
+                    errno = 0;
+                    got = mmc_raw_file_io(file_fd, buf + staged, len - staged, 0);
+                    if (got < 0 || (got < (ssize_t)(len - staged) && !to_eof)) {
+                        printf("Error reading image at %llu: %s\n", done + staged,
+                               errno ? strerror(errno) : "file is short");
+                        ret = -1;
+                        break;
+                    }
+                }
+                if (hash != NULL)
+                    SHA_update(hash, buf + staged, got);
+                staged += got;
+                if (staged < len) {
+                    // the end of the stream; size the rest to what's left
+                    at_eof = 1;
+                    size = done + staged;
+                    continue;
+                }
+            }
+            n = pwrite64(fd, buf, len, done);
+        } else {
+            n = pread64(fd, buf, len, done);
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EINVAL && direct) {
+            // the driver won't do direct I/O after all
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+            direct = 0;
+            continue;
+        }
+        if (n <= 0) {
+            printf("%s error at %llu: %s\n", writing ? "Write" : "Read",
+                   done, n < 0 ? strerror(errno) : "end of device");
+            ret = -1;
+            break;
+        }
+
+        if (writing) {
+            // keep whatever a short write left for the next time round
+            staged -= n;
+            memmove(buf, buf + n, staged);
+        } else {
+            if (hash != NULL)
+                SHA_update(hash, buf, n);
+            if (data != NULL) {
+                memcpy(data + done, buf, n);
+            } else if (file_fd >= 0 &&
+                       mmc_raw_file_io(file_fd, buf, n, 1) != n) {
+                printf("Error writing image at %llu: %s\n", done, strerror(errno));
+                ret = -1;
+                break;
+            }
+        }
+        done += n;
+
+        if (raw_progress != NULL) {
+            raw_progress(progress_start +
+                         (progress_end - progress_start) * done / limit);
         }
     }
 
-    fsync(out);
-    ret = 0;
-ERROR1:
-    fclose ( out );
-ERROR2:
-    fclose ( in );
-ERROR3:
-    return ret;
+    if (ret == 0 && writing && to_eof && !at_eof) {
+        // filled the partition; the stream had better be over
+        char c;
+        ssize_t n;
+        while ((n = read(file_fd, &c, 1)) < 0 && errno == EINTR)
+            ;
+        if (n != 0) {
+            printf("Image is bigger than the partition (%llu bytes)\n", limit);
+            ret = -1;
+        }
+    }
 
+    free(buf);
+    return ret == 0 ? (long long)done : -1;
 }
 
+/* Write size bytes from data or file_fd to the device in chunks, sync once
+ * at the end, and then read it all back from the device and check it
+ * against a SHA-1 of what was meant to be written.
+ */
+static int
+mmc_raw_write_verified (const char *device, char *data, int file_fd,
+                        unsigned long long size, int to_eof) {
+    long long start = mmc_raw_now_ms();
+    int direct;
+    int fd = mmc_raw_open(device, O_WRONLY, &direct);
+    if (fd < 0)
+        return -1;
 
-// TODO: refactor this to not be a giant copy paste mess
-int
-mmc_raw_dump (const MmcPartition *partition, char *out_file) {
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
-    int ret = -1;
-    char *in_file = partition->device_index;
+    SHA_CTX written_ctx;
+    SHA_init(&written_ctx);
+    long long written_size = mmc_raw_transfer(fd, direct, data, file_fd, size,
+                                              1, to_eof, &written_ctx,
+                                              0.0, MMC_RAW_WRITE_PROGRESS);
+    if (written_size <= 0) {
+        if (written_size == 0)
+            printf("No data to write to %s\n", device);
+        close(fd);
+        return -1;
+    }
+    size = written_size;
+    if (fsync(fd) != 0) {
+        printf("Error syncing %s: %s\n", device, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    long long written = mmc_raw_now_ms();
 
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
+    fd = mmc_raw_open(device, O_RDONLY, &direct);
+    if (fd < 0)
+        return -1;
+    if (!direct) {
+        // make sure the check reads the device, not our own pages
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
 
-    out = fopen ( out_file,  "w" );
-    if (out == NULL)
-        goto ERROR2;
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    long long ret = mmc_raw_transfer(fd, direct, NULL, -1, size, 0, 0, &ctx,
+                                     MMC_RAW_WRITE_PROGRESS, 1.0);
+    close(fd);
+    if (ret < 0)
+        return -1;
 
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
+    if (memcmp(SHA_final(&ctx), SHA_final(&written_ctx), SHA_DIGEST_SIZE) != 0) {
+        printf("Verification of %s failed\n", device);
+        return -1;
+    }
 
-    if (sz % 512)
-    {
-        while ( ( ch = fgetc ( in ) ) != EOF )
-            fputc ( ch, out );
+    long long ms = written - start;
+    printf("Wrote %llu KB to %s in %lld ms (%llu KB/s), verified in %lld ms\n",
+           size / 1024, device, ms, ms > 0 ? size / 1024 * 1000ULL / ms : 0,
+           mmc_raw_now_ms() - written);
+    return 0;
+}
+
+static unsigned long long
+mmc_raw_device_size (const char *device) {
+    int fd = open(device, O_RDONLY | O_LARGEFILE);
+    if (fd < 0)
+        return 0;
+    off64_t size = lseek64(fd, 0, SEEK_END);
+    close(fd);
+    return size > 0 ? size : 0;
+}
+
+/* Flash an image file to a partition, with the progress and read-back
+ * check of mmc_raw_write().  The image can be a fifo, which is flashed
+ * until it ends.
+ */
+int
+mmc_raw_copy (const MmcPartition *partition, char *in_file) {
+    int in = open(in_file, O_RDONLY | O_LARGEFILE);
+    if (in < 0) {
+        printf("Unable to open %s: %s\n", in_file, strerror(errno));
+        return -1;
     }
-    else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
+    struct stat st;
+    if (fstat(in, &st) != 0) {
+        printf("Unable to stat %s: %s\n", in_file, strerror(errno));
+        close(in);
+        return -1;
+    }
+    unsigned long long limit = (unsigned long long)partition->dsize * BLOCK_SIZE;
+    if (limit == 0)
+        limit = mmc_raw_device_size(partition->device_index);
+
+    int ret;
+    if (S_ISREG(st.st_mode)) {
+        if (limit > 0 && (unsigned long long)st.st_size > limit) {
+            printf("%s is bigger than partition %s\n", in_file, partition->name);
+            close(in);
+            return -1;
         }
+        posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+        ret = mmc_raw_write_verified(partition->device_index, NULL, in,
+                                     st.st_size, 0);
+    } else if (limit > 0) {
+        // a pipe has no size up front, flash whatever comes down it
+        ret = mmc_raw_write_verified(partition->device_index, NULL, in,
+                                     limit, 1);
+    } else {
+        printf("Can't get the size of partition %s\n", partition->name);
+        ret = -1;
     }
-
-    fsync(out);
-    ret = 0;
-ERROR1:
-    fclose ( out );
-ERROR2:
-    fclose ( in );
-ERROR3:
+    close(in);
     return ret;
-
 }
 
-
+/* Copy a whole partition out to a file. */
 int
-mmc_raw_read (const MmcPartition *partition, char *data, int data_size) {
-    int ch;
-    FILE *in;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
-    int ret = -1;
-    char *in_file = partition->device_index;
-
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
+mmc_raw_dump (const MmcPartition *partition, char *out_file) {
+    int direct;
+    int fd = mmc_raw_open(partition->device_index, O_RDONLY, &direct);
+    if (fd < 0)
+        return -1;
 
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
+    off64_t size = lseek64(fd, 0, SEEK_END);
+    if (size <= 0) {
+        printf("Can't get the size of %s: %s\n", partition->device_index,
+               size < 0 ? strerror(errno) : "empty");
+        close(fd);
+        return -1;
+    }
 
-    fread(data, data_size, 1, in);
+    int out = open(out_file, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+    if (out < 0) {
+        printf("Unable to open %s: %s\n", out_file, strerror(errno));
+        close(fd);
+        return -1;
+    }
 
-    ret = 0;
-ERROR1:
-ERROR2:
-    fclose ( in );
-ERROR3:
+    long long start = mmc_raw_now_ms();
+    int ret = mmc_raw_transfer(fd, direct, NULL, out, size, 0, 0, NULL,
+                               0.0, 1.0) < 0 ? -1 : 0;
+    close(fd);
+    // fifos can't be synced, which is fine
+    if ((fsync(out) != 0 && errno != EINVAL) || close(out) != 0) {
+        printf("Error writing %s: %s\n", out_file, strerror(errno));
+        ret = -1;
+    }
+    if (ret == 0) {
+        long long ms = mmc_raw_now_ms() - start;
+        printf("Copied %lld KB from %s to %s in %lld ms\n", (long long)size / 1024,
+               partition->device_index, out_file, ms);
+    }
     return ret;
-
 }
 
 int
-mmc_raw_write (const MmcPartition *partition, char *data, int data_size) {
-    int ch;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
-    int ret = -1;
-    char *out_file = partition->device_index;
-
-    out  = fopen ( out_file,  "w" );
-    if (out == NULL)
-        goto ERROR3;
-
-    fwrite(data, data_size, 1, out);
+mmc_raw_read (const MmcPartition *partition, char *data, int data_size) {
+    int direct;
+    int fd = mmc_raw_open(partition->device_index, O_RDONLY, &direct);
+    if (fd < 0)
+        return -1;
 
-    ret = 0;
-ERROR1:
-ERROR2:
-    fclose ( out );
-ERROR3:
-    return ret;
+    long long ret = mmc_raw_transfer(fd, direct, data, -1, data_size, 0, 0, NULL,
+                                     0.0, 1.0);
+    close(fd);
+    return ret < 0 ? -1 : 0;
+}
 
+/* The data is written in chunks, synced once at the end, and then read
+ * back from the device and checked against a SHA-1 of what was meant to
+ * be written.
+ */
+int
+mmc_raw_write (const MmcPartition *partition, char *data, int data_size) {
+    return mmc_raw_write_verified(partition->device_index, data, -1, data_size, 0);
 }
 
 int cmd_mmc_restore_raw_partition(const char *partition, const char *filename)
 {
-    mmc_scan_partitions();
+    mmc_scan_partitions_cached();
     const MmcPartition *p;
     p = mmc_find_partition_by_name(partition);
     if (p == NULL)
@@ -541,7 +813,7 @@ int cmd_mmc_restore_raw_partition(const char *partition, const char *filename)
 
 int cmd_mmc_backup_raw_partition(const char *partition, const char *filename)
 {
-    mmc_scan_partitions();
+    mmc_scan_partitions_cached();
     const MmcPartition *p;
     p = mmc_find_partition_by_name(partition);
     if (p == NULL)
@@ -551,7 +823,7 @@ int cmd_mmc_backup_raw_partition(const char *partition, const char *filename)
 
 int cmd_mmc_erase_raw_partition(const char *partition)
 {
-    mmc_scan_partitions();
+    mmc_scan_partitions_cached();
     const MmcPartition *p;
     p = mmc_find_partition_by_name(partition);
     if (p == NULL)
@@ -563,7 +835,7 @@ int cmd_mmc_erase_raw_partition(const char *partition)
 
 int cmd_mmc_erase_partition(const char *partition, const char *filesystem)
 {
-    mmc_scan_partitions();
+    mmc_scan_partitions_cached();
     const MmcPartition *p;
     p = mmc_find_partition_by_name(partition);
     if (p == NULL)
@@ -573,7 +845,7 @@ int cmd_mmc_erase_partition(const char *partition, const char *filesystem)
 
 int cmd_mmc_mount_partition(const char *partition, const char *mount_point, const char *filesystem, int read_only)
 {
-    mmc_scan_partitions();
+    mmc_scan_partitions_cached();
     const MmcPartition *p;
     p = mmc_find_partition_by_name(partition);
     if (p == NULL)
@@ -583,7 +855,7 @@ int cmd_mmc_mount_partition(const char *partition, const char *mount_point, cons
 
 int cmd_mmc_get_partition_device(const char *partition, char *device)
 {
-    mmc_scan_partitions();
+    mmc_scan_partitions_cached();
     const MmcPartition *p;
     p = mmc_find_partition_by_name(partition);
     if (p == NULL)
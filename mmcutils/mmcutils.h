@@ -30,6 +30,8 @@
 #ifndef MMCUTILS_H_
 #define MMCUTILS_H_
 
+#include <sys/types.h>
+
 /* Some useful define used to access the MBR/EBR table */
 #define BLOCK_SIZE                0x200
 #define TABLE_ENTRY_0             0x1BE
@@ -75,6 +77,9 @@ typedef struct MmcPartition MmcPartition;
 
 /* Functions */
 int mmc_scan_partitions();
+/* Only parses the partition table again if /proc/partitions or the MBR
+ * and EBR sectors it was read from changed */
+int mmc_scan_partitions_cached();
 const MmcPartition *mmc_find_partition_by_name(const char *name);
 int mmc_format_ext3 (MmcPartition *partition);
 int mmc_mount_partition(const MmcPartition *partition, const char *mount_point, \
@@ -83,6 +88,20 @@ int mmc_raw_copy (const MmcPartition *partition, char *in_file);
 int mmc_raw_read (const MmcPartition *partition, char *data, int data_size);
 int mmc_raw_write (const MmcPartition *partition, char *data, int data_size);
 
+/* Raw reads and writes go to the device in chunks of this size, with
+ * O_DIRECT where the device allows it.  Writes are synced once at the end
+ * and read back to check them, which takes the last quarter of the
+ * progress reported.
+ */
+#define MMC_RAW_CHUNK_SIZE        (1024 * 1024)
+#define MMC_RAW_ALIGN             4096
+#define MMC_RAW_WRITE_PROGRESS    0.75
+void mmc_set_raw_chunk_size (size_t chunk_size);
+/* Called with the fraction done, 0.0 - 1.0, as raw reads and writes go;
+ * recovery hands it ui_set_progress.
+ */
+void mmc_set_progress_callback (void (*progress)(float fraction));
+
 int format_ext2_device(const char *device);
 int format_ext3_device(const char *device);
 
@@ -11,6 +11,16 @@ LOCAL_MODULE := libmtdutils
 
 include $(BUILD_STATIC_LIBRARY)
 
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := \
+	mtd_bench.c \
+	mtdsim.c \
+	mtdutils.c
+LOCAL_MODULE := mtd_bench
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_MODULE_TAGS := tests
+LOCAL_STATIC_LIBRARIES := libmincrypt libcutils libstdc++ libc
+include $(BUILD_EXECUTABLE)
 
 endif	# TARGET_ARCH == arm
 endif	# !TARGET_SIMULATOR
@@ -0,0 +1,226 @@
+/*
+ * Times mtdutils reads, writes and erases against a simulated NAND
+ * partition (see mtdsim.h), printing the throughput of each along with
+ * how many calls it made into the device.  Bad blocks, ECC errors and
+ * device latency can be set from the command line, so changes to the
+ * I/O paths can be measured without a phone.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "mtdutils.h"
+#include "mtdsim.h"
+
+#define CHUNK_SIZE  (64 * 1024)
+
+typedef struct {
+    const char *name;
+    int flags;
+} write_mode;
+
+static const write_mode write_modes[] = {
+    { "write",          0 },
+    { "write-deferred", MTD_WRITE_VERIFY_DEFERRED },
+    { "write-async",    MTD_WRITE_ASYNC | MTD_WRITE_VERIFY_DEFERRED },
+    { "rewrite-same",   MTD_WRITE_ASYNC | MTD_WRITE_VERIFY_DEFERRED |
+                        MTD_WRITE_SKIP_UNCHANGED },
+};
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The same bytes for the same offset every time, so reads can be checked
+static void fill(char *buf, size_t len, size_t offset) {
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        unsigned int x = (offset + i) / 4 * 2654435761u;
+        buf[i] = x >> (8 * ((offset + i) % 4));
+    }
+}
+
+// Every nth block, skipping the first so there's somewhere to start
+static int *spread_blocks(int count, int blocks, int phase) {
+    int *list = malloc((count + 1) * sizeof(int));
+    int i;
+    for (i = 0; i < count; ++i) {
+        list[i] = 1 + (i * (blocks - 1) / count + phase) % (blocks - 1);
+    }
+    list[count] = -1;
+    return list;
+}
+
+static void report(const char *name, double secs, size_t bytes) {
+    MtdSimCounts c;
+    mtdsim_get_counts(&c);
+    printf("%-16s %9.2f %7d %7d %7d %7d %7d %7d\n", name,
+           secs > 0 ? bytes / secs / (1024 * 1024) : 0.0,
+           c.opens, c.reads, c.writes, c.seeks, c.ioctls, c.erased_blocks);
+}
+
+static int run_erase(const MtdPartition *p, size_t size) {
+    mtdsim_reset_counts();
+    double start = now_sec();
+    MtdWriteContext *ctx = mtd_write_partition(p);
+    if (ctx == NULL) return -1;
+    int ret = mtd_erase_blocks(ctx, -1) < 0 ? -1 : 0;
+    ret |= mtd_write_close(ctx);
+    report("erase", now_sec() - start, size);
+    return ret;
+}
+
+static int run_write(const MtdPartition *p, const write_mode *mode, size_t len) {
+    char *buf = malloc(CHUNK_SIZE);
+    if (buf == NULL) return -1;
+
+    mtdsim_reset_counts();
+    double start = now_sec();
+    MtdWriteContext *ctx = mtd_write_partition_flags(p, mode->flags);
+    if (ctx == NULL) {
+        free(buf);
+        return -1;
+    }
+    int ret = 0;
+    size_t done;
+    for (done = 0; done < len && ret == 0; done += CHUNK_SIZE) {
+        size_t n = len - done < CHUNK_SIZE ? len - done : CHUNK_SIZE;
+        fill(buf, n, done);
+        if (mtd_write_data(ctx, buf, n) != (ssize_t) n) ret = -1;
+    }
+    if (ret == 0 && mtd_erase_blocks(ctx, -1) < 0) ret = -1;
+    ret |= mtd_write_close(ctx);
+    report(mode->name, now_sec() - start, len);
+    free(buf);
+    return ret;
+}
+
+static int run_read(const MtdPartition *p, size_t len) {
+    char *buf = malloc(CHUNK_SIZE);
+    char *expect = malloc(CHUNK_SIZE);
+    if (buf == NULL || expect == NULL) {
+        free(buf);
+        free(expect);
+        return -1;
+    }
+
+    mtdsim_reset_counts();
+    double start = now_sec();
+    MtdReadContext *ctx = mtd_read_partition(p);
+    int ret = ctx == NULL ? -1 : 0;
+    size_t done;
+    for (done = 0; done < len && ret == 0; done += CHUNK_SIZE) {
+        size_t n = len - done < CHUNK_SIZE ? len - done : CHUNK_SIZE;
+        if (mtd_read_data(ctx, buf, n) != (ssize_t) n) ret = -1;
+        fill(expect, n, done);
+        if (ret == 0 && memcmp(buf, expect, n) != 0) {
+            printf("read back wrong data near offset %lu\n", (unsigned long) done);
+            ret = -1;
+        }
+    }
+    if (ctx != NULL) mtd_read_close(ctx);
+    report("read", now_sec() - start, len);
+    free(buf);
+    free(expect);
+    return ret;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s [options] <work dir>\n"
+            "  -s MB     partition size (32)\n"
+            "  -e KB     erase block size (128)\n"
+            "  -p bytes  page size (2048)\n"
+            "  -b n      bad blocks (0)\n"
+            "  -c n      blocks with correctable ECC errors (0)\n"
+            "  -r usec   read latency per page (0)\n"
+            "  -w usec   program latency per page (0)\n"
+            "  -x usec   erase latency per block (0)\n",
+            argv0);
+}
+
+int main(int argc, char **argv) {
+    MtdSimPartition part;
+    MtdSimConfig config;
+    int size_mb = 32, erase_kb = 128, bad = 0, soft = 0;
+    int opt;
+
+    memset(&part, 0, sizeof(part));
+    memset(&config, 0, sizeof(config));
+    part.name = "bench";
+    part.write_size = 2048;
+
+    while ((opt = getopt(argc, argv, "s:e:p:b:c:r:w:x:")) != -1) {
+        switch (opt) {
+        case 's': size_mb = atoi(optarg); break;
+        case 'e': erase_kb = atoi(optarg); break;
+        case 'p': part.write_size = atoi(optarg); break;
+        case 'b': bad = atoi(optarg); break;
+        case 'c': soft = atoi(optarg); break;
+        case 'r': config.read_usec = atoi(optarg); break;
+        case 'w': config.write_usec = atoi(optarg); break;
+        case 'x': config.erase_usec = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1 || size_mb <= 0 || erase_kb <= 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    part.size = size_mb * 1024 * 1024;
+    part.erase_size = erase_kb * 1024;
+    int blocks = part.size / part.erase_size;
+    if (bad < 0 || soft < 0 || bad >= blocks - 1 || soft >= blocks - 1) {
+        fprintf(stderr, "too many bad blocks for %d erase blocks\n", blocks);
+        return 2;
+    }
+    part.bad_blocks = spread_blocks(bad, blocks, 0);
+    part.ecc_soft_blocks = spread_blocks(soft, blocks, 1);
+    config.dir = argv[optind];
+
+    if (mtdsim_start(&config, &part, 1) != 0) return 1;
+    if (mtd_scan_partitions() <= 0) {
+        fprintf(stderr, "no simulated partitions found\n");
+        mtdsim_stop();
+        return 1;
+    }
+    const MtdPartition *p = mtd_find_partition_by_name(part.name);
+    if (p == NULL) {
+        fprintf(stderr, "can't find partition \"%s\"\n", part.name);
+        mtdsim_stop();
+        return 1;
+    }
+
+    // Everything but the bad blocks gets written
+    size_t len = (size_t) (blocks - bad) * part.erase_size;
+    int failed = 0;
+    unsigned int i;
+
+    printf("%-16s %9s %7s %7s %7s %7s %7s %7s\n", "op", "MB/s",
+           "opens", "reads", "writes", "seeks", "ioctls", "erased");
+    if (run_erase(p, part.size) != 0) {
+        printf("erase failed\n");
+        failed = 1;
+    }
+    for (i = 0; i < sizeof(write_modes) / sizeof(write_modes[0]); ++i) {
+        if (run_write(p, &write_modes[i], len) != 0) {
+            printf("%s failed\n", write_modes[i].name);
+            failed = 1;
+        }
+    }
+    if (run_read(p, len) != 0) {
+        printf("read failed\n");
+        failed = 1;
+    }
+
+    mtdsim_stop();
+    return failed;
+}
@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <mtd/mtd-user.h>
+
+#include "mtdutils.h"
+#include "mtdsim.h"
+
+#define MAX_SIM_PARTITIONS  16
+#define MAX_SIM_FDS         256
+
+typedef struct {
+    const MtdSimPartition *info;
+    char path[PATH_MAX];
+    struct mtd_ecc_stats ecc;
+} SimDevice;
+
+static struct {
+    MtdSimConfig config;
+    SimDevice devices[MAX_SIM_PARTITIONS];
+    int count;
+    // which device each open fd belongs to
+    int fd_device[MAX_SIM_FDS];
+    MtdSimCounts counts;
+    // mtdutils may call in from its writer thread too
+    pthread_mutex_t lock;
+} sim = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#define COUNT(field, n) do { \
+        pthread_mutex_lock(&sim.lock); \
+        sim.counts.field += (n); \
+        pthread_mutex_unlock(&sim.lock); \
+    } while (0)
+
+static int in_list(const int *list, int block)
+{
+    for (; list != NULL && *list >= 0; ++list) {
+        if (*list == block) return 1;
+    }
+    return 0;
+}
+
+static SimDevice *device_for_fd(int fd)
+{
+    if (fd < 0 || fd >= MAX_SIM_FDS || sim.fd_device[fd] < 0) return NULL;
+    return &sim.devices[sim.fd_device[fd]];
+}
+
+static void sleep_usec(int usec, int times)
+{
+    if (usec > 0 && times > 0) usleep((useconds_t) usec * times);
+}
+
+static int pages(const MtdSimPartition *p, size_t len)
+{
+    return (len + p->write_size - 1) / p->write_size;
+}
+
+static int sim_read_proc(char *buf, size_t len)
+{
+    size_t used = snprintf(buf, len, "dev:    size   erasesize  name\n");
+    int i;
+    for (i = 0; i < sim.count && used < len; ++i) {
+        const MtdSimPartition *p = sim.devices[i].info;
+        used += snprintf(buf + used, len - used, "mtd%d: %08x %08x \"%s\"\n",
+                i, p->size, p->erase_size, p->name);
+    }
+    return used < len ? (int) used : (int) len;
+}
+
+static int sim_open(int device_index, int flags)
+{
+    if (device_index < 0 || device_index >= sim.count) {
+        errno = ENOENT;
+        return -1;
+    }
+    int fd = open(sim.devices[device_index].path, flags & O_ACCMODE);
+    if (fd >= MAX_SIM_FDS) {
+        close(fd);
+        errno = EMFILE;
+        return -1;
+    }
+    if (fd >= 0) {
+        sim.fd_device[fd] = device_index;
+        COUNT(opens, 1);
+    }
+    return fd;
+}
+
+static int sim_close(int fd)
+{
+    if (fd >= 0 && fd < MAX_SIM_FDS) sim.fd_device[fd] = -1;
+    return close(fd);
+}
+
+static ssize_t sim_pread(int fd, void *buf, size_t len, loff_t pos)
+{
+    SimDevice *d = device_for_fd(fd);
+    if (d == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    ssize_t n = pread(fd, buf, len, pos);
+    if (n <= 0) return n;
+
+    // Like the MTD char device, ECC failures still return the data, and
+    // only show up in the stats
+    const MtdSimPartition *p = d->info;
+    int first = pos / p->erase_size;
+    int last = (pos + n - 1) / p->erase_size;
+    int block;
+    pthread_mutex_lock(&sim.lock);
+    for (block = first; block <= last; ++block) {
+        if (in_list(p->ecc_soft_blocks, block)) {
+            d->ecc.corrected++;
+        }
+        if (in_list(p->ecc_hard_blocks, block)) {
+            d->ecc.failed++;
+            loff_t at = (loff_t) block * p->erase_size;
+            if (at < pos) at = pos;
+            ((char *) buf)[at - pos] ^= 0x01;
+        }
+    }
+    sim.counts.reads++;
+    sim.counts.bytes_read += n;
+    pthread_mutex_unlock(&sim.lock);
+
+    sleep_usec(sim.config.read_usec, pages(p, n));
+    return n;
+}
+
+static ssize_t sim_read(int fd, void *buf, size_t len)
+{
+    loff_t pos = lseek64(fd, 0, SEEK_CUR);
+    if (pos < 0) return -1;
+    ssize_t n = sim_pread(fd, buf, len, pos);
+    if (n > 0) lseek64(fd, pos + n, SEEK_SET);
+    return n;
+}
+
+static ssize_t sim_write(int fd, const void *buf, size_t len)
+{
+    SimDevice *d = device_for_fd(fd);
+    if (d == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+    const MtdSimPartition *p = d->info;
+
+    loff_t pos = lseek64(fd, 0, SEEK_CUR);
+    if (pos < 0 || pos + (loff_t) len > p->size) {
+        errno = ENOSPC;
+        return -1;
+    }
+    if (pos % p->write_size != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Programming can only clear bits, so writing over data that wasn't
+    // erased first leaves garbage, as it would on the real thing
+    char *merged = malloc(len);
+    if (merged == NULL) return -1;
+    ssize_t n = pread(fd, merged, len, pos);
+    if (n != (ssize_t) len) {
+        free(merged);
+        errno = EIO;
+        return -1;
+    }
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        merged[i] &= ((const char *) buf)[i];
+    }
+    n = pwrite(fd, merged, len, pos);
+    free(merged);
+    if (n > 0) lseek64(fd, pos + n, SEEK_SET);
+
+    pthread_mutex_lock(&sim.lock);
+    sim.counts.writes++;
+    if (n > 0) sim.counts.bytes_written += n;
+    pthread_mutex_unlock(&sim.lock);
+
+    sleep_usec(sim.config.write_usec, pages(p, len));
+    return n;
+}
+
+static loff_t sim_lseek(int fd, loff_t pos, int whence)
+{
+    COUNT(seeks, 1);
+    return lseek64(fd, pos, whence);
+}
+
+static int sim_erase(int fd, SimDevice *d, const struct erase_info_user *erase)
+{
+    const MtdSimPartition *p = d->info;
+    if (erase->start % p->erase_size != 0 || erase->length % p->erase_size != 0 ||
+        erase->start + erase->length > p->size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char *ff = malloc(p->erase_size);
+    if (ff == NULL) return -1;
+    memset(ff, 0xff, p->erase_size);
+
+    // The driver stops at the first bad block in the range
+    int ret = 0;
+    unsigned int off;
+    for (off = 0; off < erase->length; off += p->erase_size) {
+        int block = (erase->start + off) / p->erase_size;
+        if (in_list(p->bad_blocks, block)) {
+            errno = EIO;
+            ret = -1;
+            break;
+        }
+        if (pwrite(fd, ff, p->erase_size, erase->start + off) != (ssize_t) p->erase_size) {
+            ret = -1;
+            break;
+        }
+        COUNT(erased_blocks, 1);
+        sleep_usec(sim.config.erase_usec, 1);
+    }
+    free(ff);
+    return ret;
+}
+
+static int sim_ioctl(int fd, unsigned long request, void *arg)
+{
+    SimDevice *d = device_for_fd(fd);
+    if (d == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+    const MtdSimPartition *p = d->info;
+    COUNT(ioctls, 1);
+
+    switch (request) {
+    case MEMGETINFO: {
+        struct mtd_info_user *info = (struct mtd_info_user *) arg;
+        memset(info, 0, sizeof(*info));
+        info->type = MTD_NANDFLASH;
+        info->flags = MTD_CAP_NANDFLASH;
+        info->size = p->size;
+        info->erasesize = p->erase_size;
+        info->writesize = p->write_size;
+        info->oobsize = p->write_size / 32;
+        return 0;
+    }
+    case MEMGETBADBLOCK: {
+        loff_t pos = *(loff_t *) arg;
+        if (pos < 0 || pos >= p->size) {
+            errno = EINVAL;
+            return -1;
+        }
+        return in_list(p->bad_blocks, pos / p->erase_size);
+    }
+    case ECCGETSTATS:
+        pthread_mutex_lock(&sim.lock);
+        memcpy(arg, &d->ecc, sizeof(d->ecc));
+        pthread_mutex_unlock(&sim.lock);
+        return 0;
+    case MEMERASE:
+        return sim_erase(fd, d, (const struct erase_info_user *) arg);
+    }
+
+    errno = ENOTTY;
+    return -1;
+}
+
+static const MtdBackend sim_backend = {
+    sim_read_proc,
+    sim_open,
+    sim_close,
+    sim_read,
+    sim_write,
+    sim_pread,
+    sim_lseek,
+    sim_ioctl,
+};
+
+// Fill a backing file with 0xff, the way an erased part comes
+static int create_erased(const char *path, const MtdSimPartition *p)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return -1;
+
+    char *ff = malloc(p->erase_size);
+    if (ff == NULL) {
+        close(fd);
+        return -1;
+    }
+    memset(ff, 0xff, p->erase_size);
+
+    int ret = 0;
+    unsigned int off;
+    for (off = 0; off < p->size && ret == 0; off += p->erase_size) {
+        if (write(fd, ff, p->erase_size) != (ssize_t) p->erase_size) ret = -1;
+    }
+    free(ff);
+    if (close(fd)) ret = -1;
+    return ret;
+}
+
+int mtdsim_start(const MtdSimConfig *config,
+        const MtdSimPartition *partitions, int count)
+{
+    if (count <= 0 || count > MAX_SIM_PARTITIONS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&sim.counts, 0, sizeof(sim.counts));
+    sim.config = *config;
+    sim.count = 0;
+    int i;
+    for (i = 0; i < MAX_SIM_FDS; ++i) {
+        sim.fd_device[i] = -1;
+    }
+
+    for (i = 0; i < count; ++i) {
+        const MtdSimPartition *p = &partitions[i];
+        if (p->erase_size == 0 || p->write_size == 0 ||
+            p->size % p->erase_size != 0 || p->erase_size % p->write_size != 0) {
+            fprintf(stderr, "mtdsim: bad geometry for %s\n", p->name);
+            errno = EINVAL;
+            mtdsim_stop();
+            return -1;
+        }
+
+        SimDevice *d = &sim.devices[i];
+        memset(d, 0, sizeof(*d));
+        d->info = p;
+        snprintf(d->path, sizeof(d->path), "%s/mtdsim-%d-%d.img",
+                 config->dir, getpid(), i);
+        sim.count = i + 1;
+        if (create_erased(d->path, p)) {
+            fprintf(stderr, "mtdsim: can't create %s (%s)\n",
+                    d->path, strerror(errno));
+            mtdsim_stop();
+            return -1;
+        }
+    }
+
+    mtd_set_backend(&sim_backend);
+    return 0;
+}
+
+void mtdsim_stop(void)
+{
+    mtd_set_backend(NULL);
+
+    int i;
+    for (i = 0; i < sim.count; ++i) {
+        unlink(sim.devices[i].path);
+    }
+    sim.count = 0;
+}
+
+void mtdsim_get_counts(MtdSimCounts *counts)
+{
+    pthread_mutex_lock(&sim.lock);
+    *counts = sim.counts;
+    pthread_mutex_unlock(&sim.lock);
+}
+
+void mtdsim_reset_counts(void)
+{
+    pthread_mutex_lock(&sim.lock);
+    memset(&sim.counts, 0, sizeof(sim.counts));
+    pthread_mutex_unlock(&sim.lock);
+}
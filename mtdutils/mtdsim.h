@@ -0,0 +1,59 @@
+/*
+ * A simulated MTD backend for mtdutils, so it can be run and measured on
+ * a machine without NAND.  Each partition is backed by a file and behaves
+ * like NAND: erased blocks read as 0xff, programming can only clear bits,
+ * and bad blocks and ECC errors can be injected.
+ */
+
+#ifndef MTDSIM_H_
+#define MTDSIM_H_
+
+#include "mtdutils.h"
+
+typedef struct {
+    const char *name;
+    unsigned int size;
+    unsigned int erase_size;
+    unsigned int write_size;
+
+    /* erase block numbers, each list ended by -1; NULL for none */
+    const int *bad_blocks;       /* marked bad, and won't erase */
+    const int *ecc_soft_blocks;  /* reads need ECC correction */
+    const int *ecc_hard_blocks;  /* reads fail ECC, and come back corrupted */
+} MtdSimPartition;
+
+typedef struct {
+    /* where the backing files go */
+    const char *dir;
+
+    /* latency of each operation, in microseconds */
+    int read_usec;   /* per page read */
+    int write_usec;  /* per page programmed */
+    int erase_usec;  /* per block erased */
+} MtdSimConfig;
+
+/* calls made into the backend, by kind */
+typedef struct {
+    int opens;
+    int reads;
+    int writes;
+    int seeks;
+    int ioctls;
+    int erased_blocks;
+    long long bytes_read;
+    long long bytes_written;
+} MtdSimCounts;
+
+/* creates the backing files, all erased, and switches mtdutils over to
+ * the simulated partitions.  returns 0 on success.
+ */
+int mtdsim_start(const MtdSimConfig *config,
+        const MtdSimPartition *partitions, int count);
+
+/* switches mtdutils back to the real devices and removes the files */
+void mtdsim_stop(void);
+
+void mtdsim_get_counts(MtdSimCounts *counts);
+void mtdsim_reset_counts(void);
+
+#endif  // MTDSIM_H_
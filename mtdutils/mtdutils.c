@@ -20,9 +20,12 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/mount.h>  // for _IOW, _IOR, mount()
 #include <sys/stat.h>
 #include <mtd/mtd-user.h>
+#include "mincrypt/sha.h"
 #undef NDEBUG
 #include <assert.h>
 
@@ -31,41 +34,160 @@
 struct MtdReadContext {
     const MtdPartition *partition;
     char *buffer;
+    size_t buffer_blocks;
+    size_t buffered;
     size_t consumed;
     int fd;
+
+    // offset of the next block to read
+    loff_t pos;
 };
 
+typedef struct {
+    off_t pos;
+    uint8_t sha1[SHA_DIGEST_SIZE];
+} WrittenBlock;
+
 struct MtdWriteContext {
     const MtdPartition *partition;
     char *buffer;
     size_t stored;
     int fd;
-
-    off_t* bad_block_offsets;
-    int bad_block_alloc;
-    int bad_block_count;
+    int flags;
+
+    // read-back buffer for verifying a block
+    char *verify;
+
+    // blocks given up on while writing, one bit each; the factory bad
+    // blocks are in the partition's shared map
+    unsigned char *skipped;
+
+    // with MTD_WRITE_VERIFY_DEFERRED, what was written where, checked
+    // when the context is closed
+    WrittenBlock *written;
+    int written_alloc;
+    int written_count;
+
+    // with MTD_WRITE_ASYNC, buffer is a ring of erase blocks; the writer
+    // thread takes full ones from ring_head while the next one fills
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int ring_head;
+    int ring_count;
+    int stopping;
+    int write_error;
+
+    // with MTD_WRITE_SKIP_UNCHANGED, how many blocks were left alone
+    int blocks_unchanged;
+    int blocks_written;
 };
 
+// Erase blocks that can be queued up ahead of the writer thread
+#define MTD_WRITE_RING_BLOCKS   4
+
+typedef struct {
+    unsigned int size;
+    unsigned int erase_size;
+    // one bit per erase block, set if the block is bad; NULL until probed
+    unsigned char *bits;
+} MtdBadBlockMap;
+
 typedef struct {
     MtdPartition *partitions;
+    MtdBadBlockMap *bad_block_maps;
     int partitions_allocd;
     int partition_count;
+    // what /proc/mtd said at the last successful scan
+    char *proc_text;
 } MtdState;
 
 static MtdState g_mtd_state = {
     NULL,   // partitions
+    NULL,   // bad_block_maps
     0,      // partitions_allocd
-    -1      // partition_count
+    -1,     // partition_count
+    NULL    // proc_text
 };
 
+static void load_bad_block_map(const MtdPartition *partition);
+
 #define MTD_PROC_FILENAME   "/proc/mtd"
 
+static int default_read_proc(char *buf, size_t len)
+{
+    int fd = open(MTD_PROC_FILENAME, O_RDONLY);
+    if (fd < 0) return -1;
+    int nbytes = read(fd, buf, len);
+    close(fd);
+    return nbytes;
+}
+
+static int default_open(int device_index, int flags)
+{
+    char mtddevname[32];
+    sprintf(mtddevname, "/dev/mtd/mtd%d", device_index);
+    return open(mtddevname, flags);
+}
+
+static ssize_t default_pread(int fd, void *buf, size_t len, loff_t pos)
+{
+    return pread64(fd, buf, len, pos);
+}
+
+static loff_t default_lseek(int fd, loff_t pos, int whence)
+{
+    return lseek64(fd, pos, whence);
+}
+
+static int default_ioctl(int fd, unsigned long request, void *arg)
+{
+    return ioctl(fd, request, arg);
+}
+
+static const MtdBackend default_backend = {
+    default_read_proc,
+    default_open,
+    close,
+    read,
+    write,
+    default_pread,
+    default_lseek,
+    default_ioctl,
+};
+
+// Everything done to an MTD device goes through here
+static const MtdBackend *backend = &default_backend;
+
+void mtd_set_backend(const MtdBackend *b)
+{
+    backend = b ? b : &default_backend;
+
+    // The partitions and bad block maps came from the old devices
+    free(g_mtd_state.proc_text);
+    g_mtd_state.proc_text = NULL;
+    g_mtd_state.partition_count = -1;
+    int i;
+    for (i = 0; g_mtd_state.bad_block_maps && i < g_mtd_state.partitions_allocd; i++) {
+        free(g_mtd_state.bad_block_maps[i].bits);
+        g_mtd_state.bad_block_maps[i].bits = NULL;
+    }
+}
+
+int
+mtd_scan_partitions_cached()
+{
+    // Reading /proc/mtd is one small read with no flash I/O behind it, and
+    // mtd_scan_partitions() only parses it again if the text changed, so
+    // that comparison is the cache; skipping it would miss repartitioning
+    return mtd_scan_partitions();
+}
+
 int
 mtd_scan_partitions()
 {
     char buf[2048];
     const char *bufp;
-    int fd;
     int i;
     ssize_t nbytes;
 
@@ -76,10 +198,34 @@ mtd_scan_partitions()
             errno = ENOMEM;
             return -1;
         }
+        MtdBadBlockMap *maps = calloc(nump, sizeof(*maps));
+        if (maps == NULL) {
+            free(partitions);
+            errno = ENOMEM;
+            return -1;
+        }
         g_mtd_state.partitions = partitions;
+        g_mtd_state.bad_block_maps = maps;
         g_mtd_state.partitions_allocd = nump;
         memset(partitions, 0, nump * sizeof(*partitions));
     }
+
+    /* Open and read the file contents.
+     */
+    nbytes = backend->read_proc(buf, sizeof(buf) - 1);
+    if (nbytes < 0) {
+        goto bail;
+    }
+    buf[nbytes] = '\0';
+
+    // Nothing to do if the partitions haven't changed, which they almost
+    // never do; this keeps the names of the partitions handed out stable
+    if (g_mtd_state.partition_count >= 0 && g_mtd_state.proc_text != NULL &&
+        strcmp(g_mtd_state.proc_text, buf) == 0) {
+        return g_mtd_state.partition_count;
+    }
+    free(g_mtd_state.proc_text);
+    g_mtd_state.proc_text = NULL;
     g_mtd_state.partition_count = 0;
 
     /* Initialize all of the entries to make things easier later.
@@ -95,19 +241,6 @@ mtd_scan_partitions()
         p->device_index = -1;
     }
 
-    /* Open and read the file contents.
-     */
-    fd = open(MTD_PROC_FILENAME, O_RDONLY);
-    if (fd < 0) {
-        goto bail;
-    }
-    nbytes = read(fd, buf, sizeof(buf) - 1);
-    close(fd);
-    if (nbytes < 0) {
-        goto bail;
-    }
-    buf[nbytes] = '\0';
-
     /* Parse the contents of the file, which looks like:
      *
      *     # cat /proc/mtd
@@ -143,6 +276,18 @@ mtd_scan_partitions()
                 goto bail;
             }
             g_mtd_state.partition_count++;
+
+            // The bad block map survives rescans; it's only probed again
+            // if the partition changed underneath it
+            MtdBadBlockMap *map = &g_mtd_state.bad_block_maps[mtdnum];
+            if (map->bits != NULL &&
+                (map->size != p->size || map->erase_size != p->erase_size)) {
+                free(map->bits);
+                map->bits = NULL;
+            }
+            if (map->bits == NULL) {
+                load_bad_block_map(p);
+            }
         }
 
         /* Eat the line.
@@ -157,6 +302,7 @@ mtd_scan_partitions()
         }
     }
 
+    g_mtd_state.proc_text = strdup(buf);
     return g_mtd_state.partition_count;
 
 bail:
@@ -165,6 +311,80 @@ bail:
     return -1;
 }
 
+static int is_bad_block(int fd, loff_t pos)
+{
+    int ret = backend->ioctl(fd, MEMGETBADBLOCK, &pos);
+    if (ret == -1 && errno == EOPNOTSUPP) return 0;  // NOR flash has none
+    if (ret != 0) {
+        fprintf(stderr,
+                "mtd: MEMGETBADBLOCK returned %d at 0x%08llx (errno=%d)\n",
+                ret, pos, errno);
+    }
+    return ret != 0;
+}
+
+static MtdBadBlockMap *bad_block_map(const MtdPartition *partition)
+{
+    return &g_mtd_state.bad_block_maps[partition - g_mtd_state.partitions];
+}
+
+// Probe every block of the partition once.  If the device can't be
+// opened the map stays unloaded and every block is taken to be good;
+// whatever wanted the map won't get far with the device anyway.
+static void load_bad_block_map(const MtdPartition *partition)
+{
+    MtdBadBlockMap *map = bad_block_map(partition);
+    int count = partition->size / partition->erase_size;
+
+    int fd = backend->open(partition->device_index, O_RDONLY);
+    if (fd < 0) return;
+
+    unsigned char *bits = calloc((count + 7) / 8, 1);
+    if (bits == NULL) {
+        backend->close(fd);
+        return;
+    }
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (is_bad_block(fd, (loff_t) i * partition->erase_size)) {
+            bits[i / 8] |= 1 << (i % 8);
+        }
+    }
+    backend->close(fd);
+
+    free(map->bits);
+    map->bits = bits;
+    map->size = partition->size;
+    map->erase_size = partition->erase_size;
+}
+
+int mtd_block_is_bad(const MtdPartition *partition, off_t pos)
+{
+    MtdBadBlockMap *map = bad_block_map(partition);
+    if (map->bits == NULL) load_bad_block_map(partition);
+    if (map->bits == NULL || pos < 0 || pos >= (off_t) map->size) return 0;
+
+    int block = pos / map->erase_size;
+    return (map->bits[block / 8] >> (block % 8)) & 1;
+}
+
+int mtd_refresh_bad_blocks(const MtdPartition *partition)
+{
+    MtdBadBlockMap *map = bad_block_map(partition);
+    free(map->bits);
+    map->bits = NULL;
+    load_bad_block_map(partition);
+    if (map->bits == NULL) return -1;
+
+    int count = 0;
+    int i;
+    for (i = 0; i < (int) (map->size / map->erase_size); ++i) {
+        count += (map->bits[i / 8] >> (i % 8)) & 1;
+    }
+    return count;
+}
+
 const MtdPartition *
 mtd_find_partition_by_name(const char *name)
 {
@@ -231,14 +451,12 @@ int
 mtd_partition_info(const MtdPartition *partition,
         size_t *total_size, size_t *erase_size, size_t *write_size)
 {
-    char mtddevname[32];
-    sprintf(mtddevname, "/dev/mtd/mtd%d", partition->device_index);
-    int fd = open(mtddevname, O_RDONLY);
+    int fd = backend->open(partition->device_index, O_RDONLY);
     if (fd < 0) return -1;
 
     struct mtd_info_user mtd_info;
-    int ret = ioctl(fd, MEMGETINFO, &mtd_info);
-    close(fd);
+    int ret = backend->ioctl(fd, MEMGETINFO, &mtd_info);
+    backend->close(fd);
     if (ret < 0) return -1;
 
     if (total_size != NULL) *total_size = mtd_info.size;
@@ -247,56 +465,77 @@ mtd_partition_info(const MtdPartition *partition,
     return 0;
 }
 
+// Runs of good blocks are read with a single read of up to this much
+#define MTD_READ_RUN_SIZE   (1024 * 1024)
+
 MtdReadContext *mtd_read_partition(const MtdPartition *partition)
 {
     MtdReadContext *ctx = (MtdReadContext*) malloc(sizeof(MtdReadContext));
     if (ctx == NULL) return NULL;
 
-    ctx->buffer = malloc(partition->erase_size);
+    ctx->buffer_blocks = MTD_READ_RUN_SIZE / partition->erase_size;
+    if (ctx->buffer_blocks == 0) ctx->buffer_blocks = 1;
+    ctx->buffer = malloc(ctx->buffer_blocks * partition->erase_size);
     if (ctx->buffer == NULL) {
         free(ctx);
         return NULL;
     }
 
-    char mtddevname[32];
-    sprintf(mtddevname, "/dev/mtd/mtd%d", partition->device_index);
-    ctx->fd = open(mtddevname, O_RDONLY);
+    ctx->fd = backend->open(partition->device_index, O_RDONLY);
     if (ctx->fd < 0) {
-        free(ctx);
         free(ctx->buffer);
+        free(ctx);
         return NULL;
     }
 
     ctx->partition = partition;
-    ctx->consumed = partition->erase_size;
+    ctx->pos = 0;
+    ctx->buffered = 0;
+    ctx->consumed = 0;
     return ctx;
 }
 
 // Seeks to a location in the partition.  Don't mix with reads of
 // anything other than whole blocks; unpredictable things will result.
-void mtd_read_skip_to(const MtdReadContext* ctx, size_t offset) {
-    lseek64(ctx->fd, offset, SEEK_SET);
+void mtd_read_skip_to(MtdReadContext* ctx, size_t offset) {
+    ctx->pos = offset;
+    ctx->buffered = 0;
+    ctx->consumed = 0;
 }
 
-static int read_block(const MtdPartition *partition, int fd, char *data)
+static int ecc_stats(int fd, struct mtd_ecc_stats *stats)
 {
-    struct mtd_ecc_stats before, after;
-    if (ioctl(fd, ECCGETSTATS, &before)) {
+    if (backend->ioctl(fd, ECCGETSTATS, stats)) {
         fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
         return -1;
     }
+    return 0;
+}
 
-    loff_t pos = lseek64(fd, 0, SEEK_CUR);
+// Knowing the bad blocks up front is what lets good ones be read in runs
+static int is_bad_pos(const MtdReadContext *ctx, loff_t pos)
+{
+    return mtd_block_is_bad(ctx->partition, pos);
+}
 
+// Read the next good block, checking it on its own; used when a run
+// turns up errors so that only the failing blocks get skipped
+static int read_block(MtdReadContext *ctx, char *data)
+{
+    const MtdPartition *partition = ctx->partition;
+    struct mtd_ecc_stats before, after;
+    if (ecc_stats(ctx->fd, &before)) return -1;
+
+    loff_t pos = ctx->pos;
     ssize_t size = partition->erase_size;
-    int mgbb;
 
     while (pos + size <= (int) partition->size) {
-        if (lseek64(fd, pos, SEEK_SET) != pos || read(fd, data, size) != size) {
+        if (is_bad_pos(ctx, pos)) {
+            fprintf(stderr, "mtd: not reading bad block at 0x%08llx\n", pos);
+        } else if (backend->pread(ctx->fd, data, size, pos) != size) {
             fprintf(stderr, "mtd: read error at 0x%08llx (%s)\n",
                     pos, strerror(errno));
-        } else if (ioctl(fd, ECCGETSTATS, &after)) {
-            fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
+        } else if (ecc_stats(ctx->fd, &after)) {
             return -1;
         } else if (after.failed != before.failed) {
             fprintf(stderr, "mtd: ECC errors (%d soft, %d hard) at 0x%08llx\n",
@@ -304,27 +543,72 @@ static int read_block(const MtdPartition *partition, int fd, char *data)
                     after.failed - before.failed, pos);
             // copy the comparison baseline for the next read.
             memcpy(&before, &after, sizeof(struct mtd_ecc_stats));
-        } else if ((mgbb = ioctl(fd, MEMGETBADBLOCK, &pos))) {
-            fprintf(stderr,
-                    "mtd: MEMGETBADBLOCK returned %d at 0x%08llx (errno=%d)\n",
-                    mgbb, pos, errno);
         } else {
+            ctx->pos = pos + size;
             return 0;  // Success!
         }
 
         pos += partition->erase_size;
     }
 
+    ctx->pos = pos;
     errno = ENOSPC;
     return -1;
 }
 
+// Read up to max_blocks good blocks.  Contiguous good blocks are read
+// together and the ECC stats only checked once for the whole run.
+// Returns the number of blocks read, or -1.
+static int read_blocks(MtdReadContext *ctx, char *data, int max_blocks)
+{
+    const MtdPartition *partition = ctx->partition;
+    const size_t size = partition->erase_size;
+
+    while (ctx->pos + size <= partition->size && is_bad_pos(ctx, ctx->pos)) {
+        fprintf(stderr, "mtd: not reading bad block at 0x%08llx\n", ctx->pos);
+        ctx->pos += size;
+    }
+    if (ctx->pos + size > partition->size) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    int count = 1;
+    while (count < max_blocks &&
+           ctx->pos + (count + 1) * size <= partition->size &&
+           !is_bad_pos(ctx, ctx->pos + count * size)) {
+        ++count;
+    }
+
+    struct mtd_ecc_stats before, after;
+    if (ecc_stats(ctx->fd, &before)) return -1;
+
+    ssize_t len = count * size;
+    if (backend->pread(ctx->fd, data, len, ctx->pos) == len) {
+        if (ecc_stats(ctx->fd, &after)) return -1;
+        if (after.failed == before.failed) {
+            ctx->pos += len;
+            return count;
+        }
+    }
+
+    // Something in the run failed; go back over it a block at a time.
+    // Skipping a failed block can run us off the end of the partition,
+    // so hand back whatever was read before that.
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (read_block(ctx, data + i * size)) return i > 0 ? i : -1;
+    }
+    return count;
+}
+
 ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
 {
+    const size_t erase_size = ctx->partition->erase_size;
     ssize_t read = 0;
     while (read < (int) len) {
-        if (ctx->consumed < ctx->partition->erase_size) {
-            size_t avail = ctx->partition->erase_size - ctx->consumed;
+        if (ctx->consumed < ctx->buffered) {
+            size_t avail = ctx->buffered - ctx->consumed;
             size_t copy = len - read < avail ? len - read : avail;
             memcpy(data + read, ctx->buffer + ctx->consumed, copy);
             ctx->consumed += copy;
@@ -332,19 +616,23 @@ ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
         }
 
         // Read complete blocks directly into the user's buffer
-        while (ctx->consumed == ctx->partition->erase_size &&
-               len - read >= ctx->partition->erase_size) {
-            if (read_block(ctx->partition, ctx->fd, data + read)) return -1;
-            read += ctx->partition->erase_size;
+        while (ctx->consumed == ctx->buffered && len - read >= erase_size) {
+            size_t blocks = (len - read) / erase_size;
+            if (blocks > ctx->buffer_blocks) blocks = ctx->buffer_blocks;
+            int n = read_blocks(ctx, data + read, blocks);
+            if (n < 0) return -1;
+            read += n * erase_size;
         }
 
         if (read >= (int)len) {
             return read;
         }
 
-        // Read the next block into the buffer
-        if (ctx->consumed == ctx->partition->erase_size && read < (int) len) {
-            if (read_block(ctx->partition, ctx->fd, ctx->buffer)) return -1;
+        // Read the next run of blocks into the buffer
+        if (ctx->consumed == ctx->buffered && read < (int) len) {
+            int n = read_blocks(ctx, ctx->buffer, ctx->buffer_blocks);
+            if (n < 0) return -1;
+            ctx->buffered = n * erase_size;
             ctx->consumed = 0;
         }
     }
@@ -354,30 +642,52 @@ ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
 
 void mtd_read_close(MtdReadContext *ctx)
 {
-    close(ctx->fd);
+    backend->close(ctx->fd);
     free(ctx->buffer);
     free(ctx);
 }
 
+static void *writer_thread(void *cookie);
+
 MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
+{
+    return mtd_write_partition_flags(partition, 0);
+}
+
+MtdWriteContext *mtd_write_partition_flags(const MtdPartition *partition, int flags)
 {
     MtdWriteContext *ctx = (MtdWriteContext*) malloc(sizeof(MtdWriteContext));
     if (ctx == NULL) return NULL;
 
-    ctx->bad_block_offsets = NULL;
-    ctx->bad_block_alloc = 0;
-    ctx->bad_block_count = 0;
+    ctx->skipped = NULL;
+    ctx->written = NULL;
+    ctx->written_alloc = 0;
+    ctx->written_count = 0;
+    ctx->blocks_unchanged = 0;
+    ctx->blocks_written = 0;
+    ctx->flags = flags;
 
-    ctx->buffer = malloc(partition->erase_size);
+    int blocks = (flags & MTD_WRITE_ASYNC) ? MTD_WRITE_RING_BLOCKS : 1;
+    ctx->buffer = malloc(blocks * partition->erase_size);
     if (ctx->buffer == NULL) {
         free(ctx);
         return NULL;
     }
 
-    char mtddevname[32];
-    sprintf(mtddevname, "/dev/mtd/mtd%d", partition->device_index);
-    ctx->fd = open(mtddevname, O_RDWR);
+    // The deferred pass reads whole runs, and allocates its own buffer
+    ctx->verify = NULL;
+    if (!(flags & MTD_WRITE_VERIFY_DEFERRED) || (flags & MTD_WRITE_SKIP_UNCHANGED)) {
+        ctx->verify = malloc(partition->erase_size);
+        if (ctx->verify == NULL) {
+            free(ctx->buffer);
+            free(ctx);
+            return NULL;
+        }
+    }
+
+    ctx->fd = backend->open(partition->device_index, O_RDWR);
     if (ctx->fd < 0) {
+        free(ctx->verify);
         free(ctx->buffer);
         free(ctx);
         return NULL;
@@ -385,16 +695,88 @@ MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
 
     ctx->partition = partition;
     ctx->stored = 0;
+
+    if (flags & MTD_WRITE_ASYNC) {
+        ctx->ring_head = 0;
+        ctx->ring_count = 0;
+        ctx->stopping = 0;
+        ctx->write_error = 0;
+        pthread_mutex_init(&ctx->lock, NULL);
+        pthread_cond_init(&ctx->cond, NULL);
+        if (pthread_create(&ctx->writer, NULL, writer_thread, ctx)) {
+            pthread_cond_destroy(&ctx->cond);
+            pthread_mutex_destroy(&ctx->lock);
+            backend->close(ctx->fd);
+            free(ctx->verify);
+            free(ctx->buffer);
+            free(ctx);
+            return NULL;
+        }
+    }
     return ctx;
 }
 
-static void add_bad_block_offset(MtdWriteContext *ctx, off_t pos) {
-    if (ctx->bad_block_count + 1 > ctx->bad_block_alloc) {
-        ctx->bad_block_alloc = (ctx->bad_block_alloc*2) + 1;
-        ctx->bad_block_offsets = realloc(ctx->bad_block_offsets,
-                                         ctx->bad_block_alloc * sizeof(off_t));
+static void add_skipped_block(MtdWriteContext *ctx, off_t pos) {
+    if (ctx->skipped == NULL) {
+        int count = ctx->partition->size / ctx->partition->erase_size;
+        ctx->skipped = calloc((count + 7) / 8, 1);
+        if (ctx->skipped == NULL) return;
+    }
+    int block = pos / ctx->partition->erase_size;
+    ctx->skipped[block / 8] |= 1 << (block % 8);
+}
+
+static int is_skipped_block(const MtdWriteContext *ctx, off_t pos) {
+    if (ctx->skipped == NULL) return 0;
+    int block = pos / ctx->partition->erase_size;
+    return (ctx->skipped[block / 8] >> (block % 8)) & 1;
+}
+
+static int add_written_block(MtdWriteContext *ctx, off_t pos, const char *data)
+{
+    if (ctx->written_count + 1 > ctx->written_alloc) {
+        int alloc = (ctx->written_alloc*2) + 64;
+        WrittenBlock *written = realloc(ctx->written, alloc * sizeof(WrittenBlock));
+        if (written == NULL) return -1;
+        ctx->written = written;
+        ctx->written_alloc = alloc;
     }
-    ctx->bad_block_offsets[ctx->bad_block_count++] = pos;
+    WrittenBlock *b = &ctx->written[ctx->written_count++];
+    b->pos = pos;
+    SHA(data, ctx->partition->erase_size, b->sha1);
+    return 0;
+}
+
+static int is_erased(const char *data, size_t size)
+{
+    const unsigned long *p = (const unsigned long *) data;
+    size_t i;
+    for (i = 0; i < size / sizeof(*p); ++i) {
+        if (p[i] != ~0UL) return 0;
+    }
+    for (i = size - size % sizeof(*p); i < size; ++i) {
+        if ((unsigned char) data[i] != 0xff) return 0;
+    }
+    return 1;
+}
+
+// Check whether the block at pos already holds data.  A block that needed
+// ECC correction to read back is rewritten anyway, to refresh it.
+static int block_unchanged(MtdWriteContext *ctx, off_t pos, const char *data)
+{
+    ssize_t size = ctx->partition->erase_size;
+    struct mtd_ecc_stats before, after;
+    int have_stats = (backend->ioctl(ctx->fd, ECCGETSTATS, &before) == 0);
+
+    if (backend->pread(ctx->fd, ctx->verify, size, pos) != size) return 0;
+    if (have_stats) {
+        if (backend->ioctl(ctx->fd, ECCGETSTATS, &after) != 0 ||
+            after.corrected != before.corrected ||
+            after.failed != before.failed) {
+            return 0;
+        }
+    }
+    return memcmp(ctx->verify, data, size) == 0;
 }
 
 static int write_block(MtdWriteContext *ctx, const char *data)
@@ -402,41 +784,59 @@ static int write_block(MtdWriteContext *ctx, const char *data)
     const MtdPartition *partition = ctx->partition;
     int fd = ctx->fd;
 
-    off_t pos = lseek(fd, 0, SEEK_CUR);
+    off_t pos = backend->lseek(fd, 0, SEEK_CUR);
     if (pos == (off_t) -1) return 1;
 
     ssize_t size = partition->erase_size;
+    int erased = is_erased(data, size);
     while (pos + size <= (int) partition->size) {
-        loff_t bpos = pos;
-        int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
-        if (ret != 0 && !(ret == -1 && errno == EOPNOTSUPP)) {
-            add_bad_block_offset(ctx, pos);
-            fprintf(stderr,
-                    "mtd: not writing bad block at 0x%08lx (ret %d errno %d)\n",
-                    pos, ret, errno);
+        if (mtd_block_is_bad(partition, pos)) {
+            fprintf(stderr, "mtd: not writing bad block at 0x%08lx\n", pos);
             pos += partition->erase_size;
             continue;  // Don't try to erase known factory-bad blocks.
         }
 
+        if ((ctx->flags & MTD_WRITE_SKIP_UNCHANGED) && block_unchanged(ctx, pos, data)) {
+            if (backend->lseek(fd, pos + size, SEEK_SET) != pos + size) return -1;
+            ctx->blocks_unchanged++;
+            return 0;
+        }
+        ctx->blocks_written++;
+
         struct erase_info_user erase_info;
         erase_info.start = pos;
         erase_info.length = size;
         int retry;
         for (retry = 0; retry < 2; ++retry) {
-            if (ioctl(fd, MEMERASE, &erase_info) < 0) {
+            if (backend->ioctl(fd, MEMERASE, &erase_info) < 0) {
                 fprintf(stderr, "mtd: erase failure at 0x%08lx (%s)\n",
                         pos, strerror(errno));
                 continue;
             }
-            if (lseek(fd, pos, SEEK_SET) != pos ||
-                write(fd, data, size) != size) {
+            // An erased block already reads back as all 0xff, so there is
+            // nothing to program; the verify below still checks the erase.
+            if (!erased &&
+                (backend->lseek(fd, pos, SEEK_SET) != pos ||
+                backend->write(fd, data, size) != size)) {
                 fprintf(stderr, "mtd: write error at 0x%08lx (%s)\n",
                         pos, strerror(errno));
+                // Nothing reads it back now, so retry straight away
+                if (ctx->flags & MTD_WRITE_VERIFY_DEFERRED) continue;
+            }
+
+            if (ctx->flags & MTD_WRITE_VERIFY_DEFERRED) {
+                // Checked with everything else once the partition is done
+                if (backend->lseek(fd, pos + size, SEEK_SET) != pos + size ||
+                    add_written_block(ctx, pos, data)) {
+                    fprintf(stderr, "mtd: can't record block at 0x%08lx\n", pos);
+                    return -1;
+                }
+                return 0;
             }
 
-            char verify[size];
-            if (lseek(fd, pos, SEEK_SET) != pos ||
-                read(fd, verify, size) != size) {
+            char *verify = ctx->verify;
+            if (backend->lseek(fd, pos, SEEK_SET) != pos ||
+                backend->read(fd, verify, size) != size) {
                 fprintf(stderr, "mtd: re-read error at 0x%08lx (%s)\n",
                         pos, strerror(errno));
                 continue;
@@ -455,9 +855,9 @@ static int write_block(MtdWriteContext *ctx, const char *data)
         }
 
         // Try to erase it once more as we give up on this block
-        add_bad_block_offset(ctx, pos);
+        add_skipped_block(ctx, pos);
         fprintf(stderr, "mtd: skipping write block at 0x%08lx\n", pos);
-        ioctl(fd, MEMERASE, &erase_info);
+        backend->ioctl(fd, MEMERASE, &erase_info);
         pos += partition->erase_size;
     }
 
@@ -466,8 +866,106 @@ static int write_block(MtdWriteContext *ctx, const char *data)
     return -1;
 }
 
+static void *writer_thread(void *cookie)
+{
+    MtdWriteContext *ctx = (MtdWriteContext*) cookie;
+    const size_t size = ctx->partition->erase_size;
+
+    pthread_mutex_lock(&ctx->lock);
+    for (;;) {
+        while (ctx->ring_count == 0 && !ctx->stopping) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        if (ctx->ring_count == 0) break;  // stopping, and nothing left
+
+        char *block = ctx->buffer + ctx->ring_head * size;
+        int failed = ctx->write_error;
+        pthread_mutex_unlock(&ctx->lock);
+
+        // After a failure the rest of the queue is just thrown away
+        if (!failed && write_block(ctx, block)) {
+            failed = errno ? errno : EIO;
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        if (failed && !ctx->write_error) ctx->write_error = failed;
+        ctx->ring_head = (ctx->ring_head + 1) % MTD_WRITE_RING_BLOCKS;
+        ctx->ring_count--;
+        pthread_cond_broadcast(&ctx->cond);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+// Get the ring slot being filled, waiting for the writer to free one up
+// if they're all queued.  Returns NULL once the writer has failed.
+static char *async_slot(MtdWriteContext *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->ring_count == MTD_WRITE_RING_BLOCKS && !ctx->write_error) {
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    int slot = (ctx->ring_head + ctx->ring_count) % MTD_WRITE_RING_BLOCKS;
+    int err = ctx->write_error;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (err) {
+        errno = err;
+        return NULL;
+    }
+    return ctx->buffer + slot * ctx->partition->erase_size;
+}
+
+static void async_queue(MtdWriteContext *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    ctx->ring_count++;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+    ctx->stored = 0;
+}
+
+// Wait for the writer to finish everything queued, so the caller can
+// use the fd and the bad block list.
+static int async_drain(MtdWriteContext *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->ring_count > 0) {
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    int err = ctx->write_error;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static ssize_t write_data_async(MtdWriteContext *ctx, const char *data, size_t len)
+{
+    const size_t size = ctx->partition->erase_size;
+    size_t wrote = 0;
+    while (wrote < len) {
+        char *slot = async_slot(ctx);
+        if (slot == NULL) return -1;
+
+        size_t avail = size - ctx->stored;
+        size_t copy = len - wrote < avail ? len - wrote : avail;
+        memcpy(slot + ctx->stored, data + wrote, copy);
+        ctx->stored += copy;
+        wrote += copy;
+
+        if (ctx->stored == size) async_queue(ctx);
+    }
+    return wrote;
+}
+
 ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
 {
+    if (ctx->flags & MTD_WRITE_ASYNC) return write_data_async(ctx, data, len);
+
     size_t wrote = 0;
     while (wrote < len) {
         // Coalesce partial writes into complete blocks
@@ -498,14 +996,22 @@ ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
 off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
 {
     // Zero-pad and write any pending data to get us to a block boundary
-    if (ctx->stored > 0) {
+    if (ctx->flags & MTD_WRITE_ASYNC) {
+        if (ctx->stored > 0) {
+            char *slot = async_slot(ctx);
+            if (slot == NULL) return -1;
+            memset(slot + ctx->stored, 0, ctx->partition->erase_size - ctx->stored);
+            async_queue(ctx);
+        }
+        if (async_drain(ctx)) return -1;
+    } else if (ctx->stored > 0) {
         size_t zero = ctx->partition->erase_size - ctx->stored;
         memset(ctx->buffer + ctx->stored, 0, zero);
         if (write_block(ctx, ctx->buffer)) return -1;
         ctx->stored = 0;
     }
 
-    off_t pos = lseek(ctx->fd, 0, SEEK_CUR);
+    off_t pos = backend->lseek(ctx->fd, 0, SEEK_CUR);
     if ((off_t) pos == (off_t) -1) return pos;
 
     const int total = (ctx->partition->size - pos) / ctx->partition->erase_size;
@@ -515,36 +1021,138 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
         return -1;
     }
 
-    // Erase the specified number of blocks
-    while (blocks-- > 0) {
-        loff_t bpos = pos;
-        if (ioctl(ctx->fd, MEMGETBADBLOCK, &bpos) > 0) {
+    const size_t size = ctx->partition->erase_size;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int erased = 0;
+    int ioctls = 0;
+
+    // Erase the specified number of blocks, a run of good ones at a time
+    while (blocks > 0) {
+        if (mtd_block_is_bad(ctx->partition, pos)) {
             fprintf(stderr, "mtd: not erasing bad block at 0x%08lx\n", pos);
-            pos += ctx->partition->erase_size;
+            pos += size;
+            blocks--;
             continue;  // Don't try to erase known factory-bad blocks.
         }
 
+        int run = 1;
+        while (run < blocks && !mtd_block_is_bad(ctx->partition, pos + run * size)) {
+            ++run;
+        }
+
         struct erase_info_user erase_info;
         erase_info.start = pos;
-        erase_info.length = ctx->partition->erase_size;
-        if (ioctl(ctx->fd, MEMERASE, &erase_info) < 0) {
-            fprintf(stderr, "mtd: erase failure at 0x%08lx\n", pos);
+        erase_info.length = run * size;
+        ++ioctls;
+        if (backend->ioctl(ctx->fd, MEMERASE, &erase_info) < 0) {
+            // Go back over the run a block at a time, so one block that
+            // won't erase doesn't leave the rest of the run unerased
+            int i;
+            for (i = 0; i < run; ++i) {
+                erase_info.start = pos + i * size;
+                erase_info.length = size;
+                ++ioctls;
+                if (backend->ioctl(ctx->fd, MEMERASE, &erase_info) < 0) {
+                    fprintf(stderr, "mtd: erase failure at 0x%08lx\n", pos + i * size);
+                }
+            }
         }
-        pos += ctx->partition->erase_size;
+        erased += run;
+        pos += run * size;
+        blocks -= run;
+    }
+
+    if (erased > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        long ms = (end.tv_sec - start.tv_sec) * 1000 +
+                  (end.tv_nsec - start.tv_nsec) / 1000000;
+        fprintf(stderr, "mtd: erased %d blocks with %d ioctls in %ld ms\n",
+                erased, ioctls, ms);
     }
 
     return pos;
 }
 
+// Read back everything written in MTD_WRITE_VERIFY_DEFERRED mode, in runs
+// of consecutive blocks, and check it against the digests taken while
+// writing.  Returns 0 if it all matches, otherwise -1 with errno EIO.
+static int verify_written_blocks(MtdWriteContext *ctx)
+{
+    const size_t size = ctx->partition->erase_size;
+    int run_blocks = MTD_READ_RUN_SIZE / size;
+    if (run_blocks == 0) run_blocks = 1;
+
+    char *buf = malloc(run_blocks * size);
+    if (buf == NULL) return -1;
+
+    int failed = 0;
+    int i = 0;
+    while (i < ctx->written_count) {
+        int count = 1;
+        while (count < run_blocks && i + count < ctx->written_count &&
+               ctx->written[i + count].pos == ctx->written[i].pos + (off_t) (count * size)) {
+            ++count;
+        }
+
+        ssize_t len = count * size;
+        if (backend->pread(ctx->fd, buf, len, ctx->written[i].pos) != len) {
+            fprintf(stderr, "mtd: re-read error at 0x%08lx (%s)\n",
+                    ctx->written[i].pos, strerror(errno));
+            failed = 1;
+            break;
+        }
+
+        int j;
+        for (j = 0; j < count; ++j) {
+            uint8_t sha1[SHA_DIGEST_SIZE];
+            SHA(buf + j * size, size, sha1);
+            if (memcmp(sha1, ctx->written[i + j].sha1, SHA_DIGEST_SIZE) != 0) {
+                fprintf(stderr, "mtd: verification error at 0x%08lx\n",
+                        ctx->written[i + j].pos);
+                failed = 1;
+            }
+        }
+        i += count;
+    }
+
+    free(buf);
+    if (failed) {
+        errno = EIO;
+        return -1;
+    }
+    fprintf(stderr, "mtd: verified %d blocks\n", ctx->written_count);
+    return 0;
+}
+
 int mtd_write_close(MtdWriteContext *ctx)
 {
     int r = 0;
     // Make sure any pending data gets written
     if (mtd_erase_blocks(ctx, 0) == (off_t) -1) r = -1;
-    if (close(ctx->fd)) r = -1;
-    free(ctx->bad_block_offsets);
+    if (r == 0 && (ctx->flags & MTD_WRITE_VERIFY_DEFERRED) &&
+        verify_written_blocks(ctx)) r = -1;
+    if (ctx->flags & MTD_WRITE_SKIP_UNCHANGED) {
+        fprintf(stderr, "mtd: %d blocks unchanged, %d rewritten\n",
+                ctx->blocks_unchanged, ctx->blocks_written);
+    }
+    int err = errno;
+    if (ctx->flags & MTD_WRITE_ASYNC) {
+        pthread_mutex_lock(&ctx->lock);
+        ctx->stopping = 1;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+        pthread_join(ctx->writer, NULL);
+        pthread_cond_destroy(&ctx->cond);
+        pthread_mutex_destroy(&ctx->lock);
+    }
+    if (backend->close(ctx->fd)) r = -1;
+    free(ctx->written);
+    free(ctx->skipped);
+    free(ctx->verify);
     free(ctx->buffer);
     free(ctx);
+    errno = err;
     return r;
 }
 
@@ -552,13 +1160,12 @@ int mtd_write_close(MtdWriteContext *ctx)
  * might be pos itself).
  */
 off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos) {
-    int i;
-    for (i = 0; i < ctx->bad_block_count; ++i) {
-        if (ctx->bad_block_offsets[i] == pos) {
-            pos += ctx->partition->erase_size;
-        } else if (ctx->bad_block_offsets[i] > pos) {
-            return pos;
-        }
+    // The skipped blocks belong to the writer thread until it's idle
+    if (ctx->flags & MTD_WRITE_ASYNC) async_drain(ctx);
+
+    while (pos < (off_t) ctx->partition->size &&
+           (mtd_block_is_bad(ctx->partition, pos) || is_skipped_block(ctx, pos))) {
+        pos += ctx->partition->erase_size;
     }
     return pos;
 }
@@ -567,116 +1174,111 @@ off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos) {
 #define SPARE_SIZE    (BLOCK_SIZE >> 5)
 #define HEADER_SIZE 2048
 
-int cmd_mtd_restore_raw_partition(const char *partition_name, const char *filename)
+// Read as much of len as the file has, for streams that return short reads
+static int read_fully(int fd, char *buf, int len)
 {
-    const MtdPartition *ptn;
-    MtdWriteContext *write;
-    void *data;
-    unsigned sz;
-
-    if (mtd_scan_partitions() <= 0)
-    {
-        printf("error scanning partitions");
-        return -1;
-    }
-    const MtdPartition *partition = mtd_find_partition_by_name(partition_name);
-    if (partition == NULL)
-    {
-        printf("can't find %s partition", partition_name);
-        return -1;
-    }
-
-    // If the first part of the file matches the partition, skip writing
-
-    int fd = open(filename, O_RDONLY);
-    if (fd < 0)
-    {
-        printf("error opening %s", filename);
-        return -1;
-    }
-
-    char header[HEADER_SIZE];
-    int headerlen = read(fd, header, sizeof(header));
-    if (headerlen <= 0)
-    {
-        printf("error reading %s header", filename);
-        return -1;
-    }
-
-    MtdReadContext *in = mtd_read_partition(partition);
-    if (in == NULL) {
-        printf("error opening %s: %s\n", partition, strerror(errno));
-        // just assume it needs re-writing
-    } else {
-        char check[HEADER_SIZE];
-        int checklen = mtd_read_data(in, check, sizeof(check));
-        if (checklen <= 0) {
-            printf("error reading %s: %s\n", partition_name, strerror(errno));
-            // just assume it needs re-writing
-        } else if (checklen == headerlen && !memcmp(header, check, headerlen)) {
-            printf("header is the same, not flashing %s\n", partition_name);
-            return 0;
-        }
-        mtd_read_close(in);
+    int got = 0;
+    while (got < len) {
+        int n = read(fd, buf + got, len - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        got += n;
     }
+    return got;
+}
 
+// Write the file to the partition, leaving the first block for last so
+// that a partial flash never looks like a good one.  The first block has
+// already been read into first; fd is positioned just past it.  Returns
+// -2 if the data was written but didn't verify.
+static int flash_raw_partition(const MtdPartition *partition, int fd,
+        const char *first, int firstlen, int headerlen, int flags)
+{
     // Skip the header (we'll come back to it), write everything else
-    printf("flashing %s from %s\n", partition_name, filename);
-
-    MtdWriteContext *out = mtd_write_partition(partition);
+    MtdWriteContext *out = mtd_write_partition_flags(partition, flags);
     if (out == NULL)
     {
-       printf("error writing %s", partition_name);
+       printf("error writing %s", partition->name);
        return -1;
     }
 
     char buf[HEADER_SIZE];
     memset(buf, 0, headerlen);
-    int wrote = mtd_write_data(out, buf, headerlen);
-    if (wrote != headerlen)
+    if (mtd_write_data(out, buf, headerlen) != headerlen ||
+        mtd_write_data(out, first + headerlen, firstlen - headerlen) != firstlen - headerlen)
     {
-        printf("error writing %s", partition_name);
+        printf("error writing %s", partition->name);
+        mtd_write_close(out);
         return -1;
     }
 
     int len;
     while ((len = read(fd, buf, sizeof(buf))) > 0) {
-        wrote = mtd_write_data(out, buf, len);
-        if (wrote != len)
+        if (mtd_write_data(out, buf, len) != len)
         {
-            printf("error writing %s", partition_name);
+            printf("error writing %s", partition->name);
+            mtd_write_close(out);
             return -1;
         }
     }
     if (len < 0)
     {
-       printf("error reading %s", filename);
+       printf("error reading image for %s", partition->name);
+       mtd_write_close(out);
        return -1;
     }
 
     if (mtd_write_close(out))
     {
-        printf("error closing %s", partition_name);
-        return -1;
+        int verify_failed = (errno == EIO);
+        printf("error closing %s", partition->name);
+        return verify_failed ? -2 : -1;
     }
 
-    // Now come back and write the header last
+    // Now come back and write the header last, along with the rest of the
+    // first block since we have to write a complete block
 
-    out = mtd_write_partition(partition);
+    out = mtd_write_partition_flags(partition, flags);
     if (out == NULL)
     {
-        printf("error re-opening %s", partition_name);
+        printf("error re-opening %s", partition->name);
         return -1;
     }
 
-    wrote = mtd_write_data(out, header, headerlen);
-    if (wrote != headerlen)
+    if (mtd_write_data(out, first, firstlen) != firstlen)
     {
-        printf("error re-writing %s", partition_name);
+        printf("error re-writing %s", partition->name);
+        mtd_write_close(out);
+        return -1;
+    }
+
+    if (mtd_write_close(out))
+    {
+        int verify_failed = (errno == EIO);
+        printf("error closing %s", partition->name);
+        return verify_failed ? -2 : -1;
+    }
+    return 0;
+}
+
+int cmd_mtd_restore_raw_partition(const char *partition_name, const char *filename)
+{
+    if (mtd_scan_partitions_cached() <= 0)
+    {
+        printf("error scanning partitions");
+        return -1;
+    }
+    const MtdPartition *partition = mtd_find_partition_by_name(partition_name);
+    if (partition == NULL)
+    {
+        printf("can't find %s partition", partition_name);
         return -1;
     }
 
-    // Need to write a complete block, so write the rest of the first block
     size_t block_size;
     if (mtd_partition_info(partition, NULL, &block_size, NULL))
     {
@@ -684,37 +1286,55 @@ int cmd_mtd_restore_raw_partition(const char *partition_name, const char *filena
         return -1;
     }
 
-    if (lseek(fd, headerlen, SEEK_SET) != headerlen)
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
     {
-        printf("error rewinding %s", filename);
+        printf("error opening %s", filename);
         return -1;
     }
 
-    int left = block_size - headerlen;
-    while (left < 0) left += block_size;
-    while (left > 0) {
-        len = read(fd, buf, left > (int)sizeof(buf) ? (int)sizeof(buf) : left);
-        if (len <= 0){
-            printf("error reading %s", filename);
-            return -1;
-        }
-        if (mtd_write_data(out, buf, len) != len)
-        {
-            printf("error writing %s", partition_name);
-            return -1;
-        }
+    // The first block is kept in memory and written last, so the file is
+    // only read front to back and can be a pipe.
+    int ret = -1;
+    char *first = malloc(block_size);
+    if (first == NULL)
+        goto done;
 
-        left -= len;
+    int firstlen = read_fully(fd, first, block_size);
+    if (firstlen <= 0)
+    {
+        printf("error reading %s header", filename);
+        goto done;
     }
+    int headerlen = firstlen < HEADER_SIZE ? firstlen : HEADER_SIZE;
 
-    if (mtd_write_close(out))
+    printf("flashing %s from %s\n", partition_name, filename);
+
+    // Blocks are written by a separate thread while the next ones are
+    // read in, and only if they differ from what's already there.
+    // Read-back verification is left for one pass at the end.  If that
+    // finds a block that went bad, flash the file again checking each
+    // block so the bad one gets skipped.  That needs to read the file
+    // twice, so a pipe is checked block by block from the start.
+    int flags = MTD_WRITE_ASYNC | MTD_WRITE_SKIP_UNCHANGED;
+    int seekable = lseek(fd, 0, SEEK_CUR) != -1;
+    if (seekable)
+        flags |= MTD_WRITE_VERIFY_DEFERRED;
+    ret = flash_raw_partition(partition, fd, first, firstlen, headerlen, flags);
+    if (ret == -2 && seekable && lseek(fd, firstlen, SEEK_SET) == firstlen)
     {
-        printf("error closing %s", partition_name);
-        return -1;
+        printf("verification of %s failed, flashing again\n", partition_name);
+        ret = flash_raw_partition(partition, fd, first, firstlen, headerlen,
+                                  MTD_WRITE_ASYNC | MTD_WRITE_SKIP_UNCHANGED);
     }
-    return 0;
-}
+    if (ret != 0)
+        ret = -1;
 
+done:
+    free(first);
+    close(fd);
+    return ret;
+}
 
 int cmd_mtd_backup_raw_partition(const char *partition_name, const char *filename)
 {
@@ -728,7 +1348,7 @@ int cmd_mtd_backup_raw_partition(const char *partition_name, const char *filenam
     int wrote;
     int len;
 
-    if (mtd_scan_partitions() <= 0)
+    if (mtd_scan_partitions_cached() <= 0)
     {
         printf("error scanning partitions");
         return -1;
@@ -796,7 +1416,7 @@ int cmd_mtd_erase_raw_partition(const char *partition_name)
     size_t total_size;
     size_t erase_size;
 
-    if (mtd_scan_partitions() <= 0)
+    if (mtd_scan_partitions_cached() <= 0)
     {
         printf("error scanning partitions");
         return -1;
@@ -836,7 +1456,7 @@ int cmd_mtd_erase_partition(const char *partition, const char *filesystem)
 
 int cmd_mtd_mount_partition(const char *partition, const char *mount_point, const char *filesystem, int read_only)
 {
-    mtd_scan_partitions();
+    mtd_scan_partitions_cached();
     const MtdPartition *p;
     p = mtd_find_partition_by_name(partition);
     if (p == NULL) {
@@ -847,7 +1467,7 @@ int cmd_mtd_mount_partition(const char *partition, const char *mount_point, cons
 
 int cmd_mtd_get_partition_device(const char *partition, char *device)
 {
-    mtd_scan_partitions();
+    mtd_scan_partitions_cached();
     MtdPartition *p = mtd_find_partition_by_name(partition);
     if (p == NULL)
         return -1;
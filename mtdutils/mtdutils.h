@@ -21,7 +21,13 @@
 
 typedef struct MtdPartition MtdPartition;
 
+/* reads /proc/mtd and returns the number of partitions.  the table is
+ * only rebuilt if /proc/mtd changed since the last scan, so partitions
+ * already looked up stay valid, and calling it often is cheap.
+ * mtd_scan_partitions_cached() does the same.
+ */
 int mtd_scan_partitions(void);
+int mtd_scan_partitions_cached(void);
 
 const MtdPartition *mtd_find_partition_by_name(const char *name);
 
@@ -36,6 +42,13 @@ int mtd_mount_partition(const MtdPartition *partition, const char *mount_point,
 int mtd_partition_info(const MtdPartition *partition,
         size_t *total_size, size_t *erase_size, size_t *write_size);
 
+/* the factory bad blocks of a partition are probed once, when the
+ * partitions are scanned, and shared by every read and write context.
+ * mtd_refresh_bad_blocks() probes again and returns the bad block count.
+ */
+int mtd_block_is_bad(const MtdPartition *partition, off_t pos);
+int mtd_refresh_bad_blocks(const MtdPartition *partition);
+
 /* read or write raw data from a partition, starting at the beginning.
  * skips bad blocks as best we can.
  */
@@ -45,14 +58,57 @@ typedef struct MtdWriteContext MtdWriteContext;
 MtdReadContext *mtd_read_partition(const MtdPartition *);
 ssize_t mtd_read_data(MtdReadContext *, char *data, size_t data_len);
 void mtd_read_close(MtdReadContext *);
-void mtd_read_skip_to(const MtdReadContext *, size_t offset);
+void mtd_read_skip_to(MtdReadContext *, size_t offset);
 
 MtdWriteContext *mtd_write_partition(const MtdPartition *);
+
+/* Don't read each block back as it is written; instead the whole
+ * partition is read back in one pass by mtd_write_close(), which fails
+ * with errno EIO if anything doesn't match.  Blocks that go bad while
+ * writing aren't skipped in this mode, so callers that can should redo
+ * the write without it when that happens.
+ */
+#define MTD_WRITE_VERIFY_DEFERRED   0x1
+
+/* Erase and write blocks on a separate thread, so mtd_write_data() only
+ * waits when a few blocks are already queued up.  A failure shows up
+ * as an error from a later mtd_write_data(), mtd_erase_blocks() or
+ * mtd_write_close(), and everything after it is discarded.
+ */
+#define MTD_WRITE_ASYNC             0x2
+
+/* Read each block before erasing it, and leave it alone if it already
+ * holds the data being written.  mtd_write_close() reports how many
+ * blocks were skipped and how many were rewritten.
+ */
+#define MTD_WRITE_SKIP_UNCHANGED    0x4
+
+MtdWriteContext *mtd_write_partition_flags(const MtdPartition *, int flags);
 ssize_t mtd_write_data(MtdWriteContext *, const char *data, size_t data_len);
 off_t mtd_erase_blocks(MtdWriteContext *, int blocks);  /* 0 ok, -1 for all */
 off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos);
 int mtd_write_close(MtdWriteContext *);
 
+/* everything mtdutils does to an MTD device goes through a backend.
+ * the default one uses /proc/mtd and /dev/mtd/mtd*; a simulated one
+ * (see mtdsim.h) lets mtdutils run and be measured off-device.
+ */
+typedef struct {
+    int (*read_proc)(char *buf, size_t len);  /* contents of /proc/mtd */
+    int (*open)(int device_index, int flags);
+    int (*close)(int fd);
+    ssize_t (*read)(int fd, void *buf, size_t len);
+    ssize_t (*write)(int fd, const void *buf, size_t len);
+    ssize_t (*pread)(int fd, void *buf, size_t len, loff_t pos);
+    loff_t (*lseek)(int fd, loff_t pos, int whence);
+    int (*ioctl)(int fd, unsigned long request, void *arg);
+} MtdBackend;
+
+/* NULL goes back to the real devices.  rescan the partitions after
+ * switching.
+ */
+void mtd_set_backend(const MtdBackend *backend);
+
 struct MtdPartition {
     int device_index;
     unsigned int size;
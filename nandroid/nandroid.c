@@ -4,16 +4,23 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <limits.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "roots.h"
 #include "recovery_lib.h"
 #include "recovery_config.h"
+#include "minzip/DirUtil.h"
 
 #include "nandroid/nandroid.h"
+#include "nandroid/nandroid_catalog.h"
+#include "nandroid/nandroid_md5.h"
 #include "nandroid/nandroid_scan.h"
+#include "nandroid/nandroid_sched.h"
+#include "nandroid/nandroid_tee.h"
 
 // include nandroid types
+#include "nandroid/nandroid_dedup.h"
 #include "nandroid/nandroid_raw.h"
 #include "nandroid/nandroid_tar.h"
 #include "nandroid/nandroid_yaffs.h"
@@ -36,40 +43,68 @@ int nandroid_backup_path(char* path, char* backup_dir) {
     int ret;
     int type = get_nandroid_type_for_new(path);
 
-    ui_print("Backing up %s ... ", path);
+    // backends write through a tee, which hashes the data on its way to the
+    // backup file so we never have to read it back.  Raw images are the
+    // exception: their sparse header is filled in last, so they are hashed
+    // afterwards (they're small once the empty space is gone)
+    unsigned char digest[NANDROID_MD5_DIGEST_SIZE];
+    nandroid_tee* tee = (type != NANDROID_TYPE_RAW) ? nandroid_tee_create(backup_file) : NULL;
+    char* target = (tee != NULL) ? nandroid_tee_path(tee) : backup_file;
+
+    // volumes on different devices are backed up at the same time, so only
+    // ever print whole lines
+    ui_print("Backing up %s ...\n", path);
     switch(type) {
     case NANDROID_TYPE_RAW:
-        ret = nandroid_backup_path_raw(path, backup_file);
+        ret = nandroid_backup_path_raw(path, target);
         break;
     case NANDROID_TYPE_TAR:
-        ret = nandroid_backup_path_tar(path, backup_file);
+        ret = nandroid_backup_path_tar(path, target);
         break;
     case NANDROID_TYPE_TAR_GZ:
-        ret = nandroid_backup_path_tar_gz(path, backup_file);
+        ret = nandroid_backup_path_tar_gz(path, target);
         break;
     case NANDROID_TYPE_TAR_BZ2:
-        ret = nandroid_backup_path_tar_bz2(path, backup_file);
+        ret = nandroid_backup_path_tar_bz2(path, target);
         break;
     case NANDROID_TYPE_TAR_LZMA:
-        ret = nandroid_backup_path_tar_lzma(path, backup_file);
+        ret = nandroid_backup_path_tar_lzma(path, target);
         break;
     case NANDROID_TYPE_YAFFS:
-        ret = nandroid_backup_path_yaffs(path, backup_file);
+        ret = nandroid_backup_path_yaffs(path, target);
+        break;
+    case NANDROID_TYPE_DEDUP:
+        ret = nandroid_backup_path_dedup(path, target);
+        break;
     default:
         ret = -1;
         break;
     }
+
+    if(tee != NULL) {
+        if(0 != nandroid_tee_finish(tee, digest) && ret == 0)
+            ret = -1;
+    } else if(ret == 0) {
+        ret = nandroid_md5_file(backup_file, digest);
+    }
+    if(ret == 0)
+        nandroid_md5_list_add(backup_file, digest);
+
     if(ret == 0) {
-        ui_print("done\n");
+        ui_print("Backup of %s done\n", path);
     } else {
-        ui_print("error (%d)\n", ret);
+        ui_print("Backup of %s failed (%d)\n", path, ret);
     }
 
     free(backup_file);
     return ret;
 }
 
-int nandroid_restore_path(char* path, char* backup_dir) {
+// returned by nandroid_restore_path when the data restored doesn't match its
+// recorded MD5, which means the rest of the backup can't be trusted either
+#define NANDROID_ERROR_MD5_MISMATCH -2
+
+int nandroid_restore_path(char* path, char* backup_dir, char* md5_file) {
     Volume* v = volume_for_path(path);
 
     if(v == NULL) {
@@ -93,43 +128,109 @@ int nandroid_restore_path(char* path, char* backup_dir) {
     struct stat file_info;
     if (0 != (ret = statfs(backup_file, &file_info))) {
         ui_print("Skipping restore of %s ... (%s not found)\n", path, backup_file);
+        free(backup_file);
         return ret;
     }
 
+    unsigned char expected[NANDROID_MD5_DIGEST_SIZE];
+    unsigned char digest[NANDROID_MD5_DIGEST_SIZE];
+    nandroid_tee* tee = NULL;
+
+    if(md5_file != NULL) {
+        if(0 != nandroid_md5_lookup(md5_file, backup_file, expected)) {
+            ui_print("No MD5 sum for %s, restoring it unverified\n", path);
+        } else {
+            // the hash is checked as the backend reads the file through a
+            // tee, except for raw images which get flashed with seeks, and
+            // dedup manifests which are read twice (see below), so those are
+            // checked before the volume is touched
+            if(type != NANDROID_TYPE_RAW && type != NANDROID_TYPE_DEDUP)
+                tee = nandroid_tee_create_reader(backup_file);
+
+            if(tee == NULL) {
+                ui_print("Checking MD5 of %s ... ", path);
+                if(0 != (ret = nandroid_md5_file(backup_file, digest))) {
+                    ui_print("error (%d)\n", ret);
+                    free(backup_file);
+                    return ret;
+                }
+                if(0 != memcmp(digest, expected, NANDROID_MD5_DIGEST_SIZE)) {
+                    ui_print("mismatch\n");
+                    free(backup_file);
+                    return NANDROID_ERROR_MD5_MISMATCH;
+                }
+                ui_print("done\n");
+            }
+        }
+    }
+
+    // the md5 of a deduplicated backup only covers its manifest, so check
+    // the chunks it points at as well, while the volume is still intact
+    if(type == NANDROID_TYPE_DEDUP) {
+        ui_print("Checking chunks for %s ... ", path);
+        if(0 != nandroid_dedup_verify(backup_file)) {
+            ui_print("error\n");
+            free(backup_file);
+            return NANDROID_ERROR_MD5_MISMATCH;
+        }
+        ui_print("done\n");
+    }
+
     ui_print("Erasing %s before restore ... ", path);
     if (0 != (ret = format_volume(v->mount_point))) {
         ui_print("error (%d)\n", ret);
+        if(tee != NULL)
+            nandroid_tee_abort(tee);
         free(backup_file);
         return ret;
     } else {
         ui_print("done\n");
     }
 
-    int was_p_mounted;
+    char* source = (tee != NULL) ? nandroid_tee_path(tee) : backup_file;
 
     ui_print("Restoring %s ... ", path);
     switch(type) {
     case NANDROID_TYPE_RAW:
-        ret = nandroid_restore_path_raw(path, backup_file);
+        ret = nandroid_restore_path_raw(path, source);
         break;
     case NANDROID_TYPE_TAR:
-        ret = nandroid_restore_path_tar(path, backup_file);
+        ret = nandroid_restore_path_tar(path, source);
         break;
     case NANDROID_TYPE_TAR_GZ:
-        ret = nandroid_restore_path_tar_gz(path, backup_file);
+        ret = nandroid_restore_path_tar_gz(path, source);
         break;
     case NANDROID_TYPE_TAR_BZ2:
-        ret = nandroid_restore_path_tar_bz2(path, backup_file);
+        ret = nandroid_restore_path_tar_bz2(path, source);
         break;
     case NANDROID_TYPE_TAR_LZMA:
-        ret = nandroid_restore_path_tar_lzma(path, backup_file);
+        ret = nandroid_restore_path_tar_lzma(path, source);
         break;
     case NANDROID_TYPE_YAFFS:
-        ret = nandroid_restore_path_yaffs(path, backup_file);
+        ret = nandroid_restore_path_yaffs(path, source);
+        break;
+    case NANDROID_TYPE_DEDUP:
+        ret = nandroid_restore_path_dedup(path, source);
+        break;
     default:
         ret = -1;
         break;
     }
+
+    if(tee != NULL) {
+        if(ret != 0) {
+            nandroid_tee_abort(tee);
+        } else if(0 != (ret = nandroid_tee_finish(tee, digest))) {
+            // couldn't read the whole backup file
+        } else if(0 != memcmp(digest, expected, NANDROID_MD5_DIGEST_SIZE)) {
+            // whatever we restored came from a corrupt backup, so don't leave
+            // it lying around on the volume
+            ui_print("MD5 mismatch, erasing %s again ... ", path);
+            format_volume(v->mount_point);
+            ret = NANDROID_ERROR_MD5_MISMATCH;
+        }
+    }
+
     if(ret == 0) {
         ui_print("done\n");
     } else {
@@ -141,42 +242,18 @@ int nandroid_restore_path(char* path, char* backup_dir) {
 }
 
 int nandroid_md5_create(char* backup_dir) {
-    const char* create_md5_format = "cd %s && md5sum %s > %s";
-    const char* append_md5_format = "cd %s && md5sum %s >> %s";
+    int ret;
 
-    int ret = 0;
-    int count = 0;
+    ui_print("Writing MD5 sums ... ");
 
-    ui_print("Creating MD5 sums ... ");
-
-    // open the directory
-    DIR* dir = opendir(backup_dir);
-    if (dir != NULL) {
-        struct dirent* de;
-    	while ((de = readdir(dir)) != NULL) {
-            if(de->d_name[0] != '.' && // don't do '.' files
-                    de->d_type == DT_REG && // make sure it's a regular file
-                    strcmp(de->d_name, NANDROID_MD5SUM_FILE) != 0) { // dont md5 the md5 file if overwriting
-                if(count++ == 0) {
-                    int cmdlen = strlen(create_md5_format) + strlen(backup_dir) + strlen(de->d_name) + strlen(NANDROID_MD5SUM_FILE);
-                    char* cmd = (char*)calloc(cmdlen, sizeof(char));
-                    snprintf(cmd, cmdlen, create_md5_format, backup_dir, de->d_name, NANDROID_MD5SUM_FILE);
-                    ret |= __system(cmd);
-                    free(cmd);
-                } else {
-                    int cmdlen = strlen(append_md5_format) + strlen(backup_dir) + strlen(de->d_name) + strlen(NANDROID_MD5SUM_FILE);
-                    char* cmd = (char*)calloc(cmdlen, sizeof(char));
-                    snprintf(cmd, cmdlen, append_md5_format, backup_dir, de->d_name, NANDROID_MD5SUM_FILE);
-                    ret |= __system(cmd);
-                    free(cmd);
-                }
-            }
-        }
+    // the sums were collected while the backup files were written
+    int len = strlen(backup_dir) + strlen(NANDROID_MD5SUM_FILE) + 2;
+    char* md5_file = (char*)calloc(len, sizeof(char));
+    snprintf(md5_file, len, "%s/%s", backup_dir, NANDROID_MD5SUM_FILE);
 
-        closedir(dir);
-    } else {
-        ret = -1;
-    }
+    ret = nandroid_md5_list_write(md5_file);
+    nandroid_md5_list_clear();
+    free(md5_file);
 
     if (0 != ret)
         ui_print("error (%d)\n", ret);
@@ -186,25 +263,6 @@ int nandroid_md5_create(char* backup_dir) {
     return ret;
 }
 
-int nandroid_md5_check(char* backup_dir) {
-    const char* check_md5_format = "cd %s && md5sum -c %s";
-
-    int cmdlen = strlen(check_md5_format) + strlen(backup_dir) + strlen(NANDROID_MD5SUM_FILE);
-    char* cmd = (char*)calloc(cmdlen, sizeof(char));
-    snprintf(cmd, cmdlen, check_md5_format, backup_dir, NANDROID_MD5SUM_FILE);
-
-    int ret;
-
-    ui_print("Checking MD5 sums ... ");
-    if (0 != (ret = __system(cmd)))
-        ui_print("error (%d)\n", ret);
-    else
-        ui_print("done\n");
-
-    free(cmd);
-    return ret;
-}
-
 int nandroid_ensure_dir(char* backup_dir) {
     ensure_path_mounted(backup_dir);
 
@@ -226,6 +284,44 @@ int nandroid_ensure_dir(char* backup_dir) {
     return ret;
 }
 
+/**
+ * Remove the dedup chunks no backup needs any more.  Backups are looked for
+ * in the usual places and next to backup_dir, wherever that is.
+ */
+static void nandroid_collect_chunks(char* backup_dir) {
+    int num;
+    char** dirs = nandroid_scan_dirs(&num);
+    char** roots = (char**)calloc(num + 1, sizeof(char*));
+    char* parent = strdup(backup_dir);
+    if(roots == NULL || parent == NULL) {
+        free(roots);
+        free(parent);
+        return;
+    }
+
+    int i;
+    for(i = 0; i < num; ++i)
+        roots[i] = dirs[i];
+    roots[num] = dirname(parent);
+
+    nandroid_dedup_gc(roots, num + 1);
+
+    free(roots);
+    free(parent);
+}
+
+static int nandroid_backup_job(char* path, void* cookie) {
+    // we print ui updates on error in here, the scheduler just collects the result
+    return nandroid_backup_path(path, (char*)cookie);
+}
+
+static int nandroid_is_saveable(int i) {
+    return i >= 0 && i < device_partition_num && // make sure our iterator is valid
+            device_partitions[i].id == i && // sanity-check the id
+            (device_partitions[i].flags & PARTITION_FLAG_SAVEABLE) > 0 &&
+            has_volume(device_partitions[i].path);
+}
+
 void nandroid_backup(char* backup_dir, int* partitions) {
     int ret;
 
@@ -234,63 +330,107 @@ void nandroid_backup(char* backup_dir, int* partitions) {
         return;
     }
 
+    nandroid_md5_list_clear();
+
+    char** paths = (char**)calloc(device_partition_num, sizeof(char*));
+    if(paths == NULL)
+        return;
+
+    int count = 0;
     if(partitions == NULL) {
         // if null, we will be backing up all of them
         int i;
         for(i = 0; i < device_partition_num; ++i) {
-            if((device_partitions[i].flags & PARTITION_FLAG_SAVEABLE) > 0 &&
-                    has_volume(device_partitions[i].path)) {
-                // we print ui updates on error here, so we don't check errors here
-                nandroid_backup_path(device_partitions[i].path, backup_dir);
-            }
+            if(nandroid_is_saveable(i))
+                paths[count++] = device_partitions[i].path;
         }
     } else {
-        while(partitions) {
-            int i = *partitions;
-            if(i >= 0 && i < device_partition_num && // make sure our iterator is valid
-                    device_partitions[i].id == i && // sanity-check the id
-                    (device_partitions[i].flags & PARTITION_FLAG_SAVEABLE) > 0 &&
-                    has_volume(device_partitions[i].path)) {
-                // we print ui updates on error here, so we don't check errors here
-                nandroid_backup_path(device_partitions[i].path, backup_dir);
-            }
-            partitions++;
+        for(; *partitions != INT_MAX && count < device_partition_num; ++partitions) {
+            if(nandroid_is_saveable(*partitions))
+                paths[count++] = device_partitions[*partitions].path;
         }
     }
 
+    // jobs only overlap when they share no device, reading or writing;
+    // every volume is written to backup_dir, so that card sets the pace
+    nandroid_run_by_device(paths, count, backup_dir, nandroid_backup_job, backup_dir);
+    free(paths);
+
     nandroid_md5_create(backup_dir);
+
+    // the backup is done, so record it while we know exactly what's in it
+    nandroid_catalog_update(backup_dir);
+
+    // chunks that only backups deleted since the last run needed can go now
+    nandroid_collect_chunks(backup_dir);
+}
+
+static int nandroid_is_restoreable(int i) {
+    return i >= 0 && i < device_partition_num && // make sure our iterator is valid
+            device_partitions[i].id == i && // sanity-check the id
+            (device_partitions[i].flags & PARTITION_FLAG_RESTOREABLE) > 0 &&
+            has_volume(device_partitions[i].path);
+}
+
+/**
+ * Delete a backup, along with any dedup chunks only it was using
+ *
+ * \param backup_dir The backup to delete
+ *
+ * \return 0 on success
+ */
+int nandroid_delete(char* backup_dir) {
+    int ret;
+    if(0 != (ret = ensure_path_mounted(backup_dir)))
+        return ret;
+
+    ui_print("Deleting %s ... ", backup_dir);
+    if(0 != (ret = dirUnlinkHierarchy(backup_dir))) {
+        ui_print("error (%d)\n", ret);
+        return ret;
+    }
+    ui_print("done\n");
+
+    nandroid_collect_chunks(backup_dir);
+    return 0;
 }
 
 void nandroid_restore(char* backup_dir, int* partitions) {
+    // sums are checked as each volume is restored rather than in a pass of
+    // their own, so every backup file only gets read once
+    char* md5_file = NULL;
     recovery_config* rconfig = get_config();
     if(rconfig && rconfig->nandroid_do_md5_verification) {
-        if(0 != nandroid_md5_check(backup_dir)) {
+        int len = strlen(backup_dir) + strlen(NANDROID_MD5SUM_FILE) + 2;
+        md5_file = (char*)calloc(len, sizeof(char));
+        if(md5_file == NULL)
+            return;
+        snprintf(md5_file, len, "%s/%s", backup_dir, NANDROID_MD5SUM_FILE);
+
+        if(0 != access(md5_file, R_OK)) {
+            ui_print("No MD5 sums found in %s, not restoring\n", backup_dir);
+            free(md5_file);
             return;
         }
     }
 
-    if(partitions == NULL) {
-        // if null, we will be restoring up all of them
-        int i;
-        for(i = 0; i < device_partition_num; ++i) {
-            if((device_partitions[i].flags & PARTITION_FLAG_RESTOREABLE) > 0 &&
-                    has_volume(device_partitions[i].path)) {
-                // we print ui updates on error here, so we don't check errors here
-                nandroid_restore_path(device_partitions[i].path, backup_dir);
-            }
-        }
-    } else {
-        while(partitions) {
-            int i = *partitions;
-            if(i >= 0 && i < device_partition_num && // make sure our iterator is valid
-                    device_partitions[i].id == i && // sanity-check the id
-                    (device_partitions[i].flags & PARTITION_FLAG_RESTOREABLE) > 0 &&
-                    has_volume(device_partitions[i].path)) {
-                // we print ui updates on error here, so we don't check errors here
-                nandroid_restore_path(device_partitions[i].path, backup_dir);
-            }
-            partitions++;
+    int i;
+    int count = (partitions == NULL) ? device_partition_num : INT_MAX;
+    for(i = 0; i < count; ++i) {
+        // if null, we will be restoring all of them
+        int p = (partitions == NULL) ? i : partitions[i];
+        if(p == INT_MAX)
+            break;
+        if(!nandroid_is_restoreable(p))
+            continue;
+
+        // we print ui updates on error in here, the only failure we act on
+        // is a bad checksum, which means the backup is corrupt
+        if(NANDROID_ERROR_MD5_MISMATCH == nandroid_restore_path(device_partitions[p].path, backup_dir, md5_file)) {
+            ui_print("Backup is corrupt, aborting restore\n");
+            break;
         }
     }
-}
 
+    free(md5_file);
+}
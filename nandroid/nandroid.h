@@ -1,6 +1,8 @@
 #ifndef RECOVERY_NANDROID_H_
 #define RECOVERY_NANDROID_H_
 
+#include <time.h>
+
 // nandroid types
 #define NANDROID_TYPE_NULL    -1 // null if shouldn't be nandroided
 #define NANDROID_TYPE_RAW      0 // raw MTD image
@@ -9,7 +11,8 @@
 #define NANDROID_TYPE_TAR_BZ2  3 // tar.bz2 file 
 #define NANDROID_TYPE_TAR_LZMA 4 // tar.lzma file (not supported yet)
 #define NANDROID_TYPE_YAFFS    5 // yaffs image (fastboot/cwm)
-#define NANDROID_TYPE_LAST     NANDROID_TYPE_YAFFS // used to determine validity of types
+#define NANDROID_TYPE_DEDUP    6 // manifest of chunks in the shared blob store
+#define NANDROID_TYPE_LAST     NANDROID_TYPE_DEDUP // used to determine validity of types
 
 typedef struct {
     // directory of the nandroid
@@ -17,9 +20,16 @@ typedef struct {
     // list of partitions by id
     // end of the list is indicated by INT_MAX
     int* partitions;
+    // backup type and file size (in bytes) of each partition, in the same
+    // order as partitions (may be NULL)
+    int* types;
+    long long* sizes;
+    // modification time of dir when it was scanned
+    time_t time;
 } nandroid;
 
 void nandroid_backup(char* backup_dir, int* partitions);
 void nandroid_restore(char* backup_dir, int* partitions);
+int nandroid_delete(char* backup_dir);
 
 #endif//RECOVERY_NANDROID_H_
@@ -0,0 +1,126 @@
+/*
+ * Times the native nandroid backup engines against each other on the same
+ * tree: each one backs the source directory up into the work directory and
+ * restores it again, and the throughput of both halves is printed.
+ *
+ * Run through nandroid_bench.sh, which sets up a loop-mounted test image.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "nandroid/nandroid_compress.h"
+#include "nandroid/nandroid_tar_reader.h"
+#include "nandroid/nandroid_tar_writer.h"
+#include "nandroid/nandroid_yaffs_image.h"
+
+void ui_print(const char* fmt, ...) {
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, 256, fmt, ap);
+    va_end(ap);
+
+    fputs(buf, stderr);
+}
+
+typedef struct {
+    const char* name;
+    const char* ext;
+    int compress_type;
+    int yaffs;
+} engine;
+
+static const engine engines[] = {
+    { "tar",     "tar",     NANDROID_COMPRESS_NONE,  0 },
+    { "tar.gz",  "tar.gz",  NANDROID_COMPRESS_GZIP,  0 },
+    { "tar.bz2", "tar.bz2", NANDROID_COMPRESS_BZIP2, 0 },
+    { "yaffs2",  "img",     NANDROID_COMPRESS_NONE,  1 },
+};
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int backup(const engine* e, const char* src, const char* file) {
+    int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+
+    int threads = e->yaffs ? 1 : nandroid_default_thread_count();
+    nandroid_compressor* c = nandroid_compressor_create(fd, e->compress_type, threads);
+    if (c == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    int ret = e->yaffs ? nandroid_yaffs_image_create(src, nandroid_compressor_sink, c)
+                       : nandroid_tar_create(src, nandroid_compressor_sink, c);
+    ret |= nandroid_compressor_close(c);
+    // include the flush in the time, the restore has to read it back anyway
+    ret |= fsync(fd);
+    ret |= close(fd);
+    return ret;
+}
+
+static int restore(const engine* e, const char* dst, const char* file) {
+    if (mkdir(dst, 0755) != 0)
+        return -1;
+    int ret = e->yaffs ? nandroid_yaffs_image_extract(dst, file)
+                       : nandroid_tar_extract_file(dst, file, e->compress_type);
+    sync();
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <source dir> <work dir>\n", argv[0]);
+        return 2;
+    }
+
+    const char* src = argv[1];
+    const char* work = argv[2];
+    char file[PATH_MAX];
+    char dst[PATH_MAX];
+    int failed = 0;
+    unsigned int i;
+
+    printf("%-8s %12s %10s %10s\n", "engine", "size (KB)", "backup", "restore");
+    for (i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i) {
+        const engine* e = &engines[i];
+        snprintf(file, sizeof(file), "%s/bench.%s", work, e->ext);
+        snprintf(dst, sizeof(dst), "%s/restore-%s", work, e->name);
+
+        double start = now_sec();
+        if (backup(e, src, file) != 0) {
+            printf("%-8s backup failed\n", e->name);
+            failed = 1;
+            continue;
+        }
+        double backup_time = now_sec() - start;
+
+        start = now_sec();
+        if (restore(e, dst, file) != 0) {
+            printf("%-8s restore failed\n", e->name);
+            failed = 1;
+            continue;
+        }
+        double restore_time = now_sec() - start;
+
+        struct stat st;
+        stat(file, &st);
+        printf("%-8s %12lld %9.2fs %9.2fs\n", e->name,
+               (long long)st.st_size / 1024, backup_time, restore_time);
+    }
+
+    return failed;
+}
@@ -0,0 +1,63 @@
+#!/bin/bash
+#
+# Benchmarks the nandroid backup engines (tar, tar.gz, tar.bz2 and yaffs2)
+# against each other.  Run in a client where you have done envsetup,
+# choosecombo, etc. and built the nandroid_bench test module.
+#
+# A copy of /system is put on a loop-mounted ext2 image so every engine
+# reads the same tree from the same kind of device, and the backups are
+# written to WORK_DIR.  Needs root on the device.
+
+WORK_DIR=/data/local/tmp/nandroid_bench
+
+# size of the loop-mounted test image, in MB
+IMAGE_SIZE=256
+
+ADB="adb -d "
+
+# ------------------------
+
+echo "waiting to connect to device"
+$ADB wait-for-device
+
+# run a command on the device; exit with the exit status of the device
+# command.
+run_command() {
+  $ADB shell "$@" \; echo \$? | awk '{if (b) {print a}; a=$0; b=1} END {exit a}'
+}
+
+fail() {
+  echo
+  echo FAIL: $1
+  echo
+  cleanup
+  exit 1
+}
+
+cleanup() {
+  run_command umount $WORK_DIR/mnt
+  run_command rm -r $WORK_DIR
+}
+
+run_command mkdir -p $WORK_DIR/mnt || fail "mkdir"
+$ADB push $ANDROID_PRODUCT_OUT/system/bin/nandroid_bench \
+          $WORK_DIR/nandroid_bench || fail "push"
+
+run_command dd if=/dev/zero of=$WORK_DIR/test.img bs=1048576 count=$IMAGE_SIZE || fail "dd"
+run_command mke2fs -F $WORK_DIR/test.img || fail "mke2fs"
+run_command mount -o loop $WORK_DIR/test.img $WORK_DIR/mnt || fail "mount"
+run_command cp -a /system/. $WORK_DIR/mnt/ || fail "populate"
+
+# drop the page cache so the first engine doesn't pay for everyone
+run_command sync
+run_command "echo 3 > /proc/sys/vm/drop_caches"
+
+run_command $WORK_DIR/nandroid_bench $WORK_DIR/mnt $WORK_DIR || fail "nandroid_bench"
+
+# --------------- cleanup ----------------------
+
+cleanup
+
+echo
+echo PASS
+echo
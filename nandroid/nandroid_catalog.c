@@ -0,0 +1,432 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "roots.h"
+
+#include "nandroid/nandroid.h"
+#include "nandroid/nandroid_catalog.h"
+#include "nandroid/nandroid_scan.h"
+
+// kept outside the nandroid directories so writing it doesn't touch their mtimes
+#define NANDROID_CATALOG_DIR     "/sdcard/clockworkmod"
+#define NANDROID_CATALOG_FILE    NANDROID_CATALOG_DIR "/.nandroid_catalog"
+#define NANDROID_CATALOG_MAGIC   "nandroid-catalog"
+#define NANDROID_CATALOG_VERSION 1
+
+// FAT only keeps mtimes to 2 seconds, so a directory that changed this close
+// to being scanned could change again without its mtime moving
+#define NANDROID_CATALOG_MTIME_SLOP 2
+
+typedef struct {
+    char* path;
+    time_t time;
+    // set once the mtime is old enough to be trusted
+    int settled;
+} catalog_root;
+
+typedef struct {
+    nandroid* n;
+    int settled;
+} catalog_entry;
+
+typedef struct {
+    int root_num;
+    int root_alloc;
+    catalog_root* roots;
+    // every directory under the roots, nandroid or not, so that one that
+    // becomes a nandroid is still noticed without rereading its root
+    int count;
+    int alloc;
+    catalog_entry* entries;
+} catalog;
+
+static catalog* catalog_create() {
+    return (catalog*)calloc(1, sizeof(catalog));
+}
+
+static void catalog_destroy(catalog* c) {
+    int i;
+    for(i = 0; i < c->root_num; ++i)
+        free(c->roots[i].path);
+    for(i = 0; i < c->count; ++i) {
+        if(c->entries[i].n)
+            destroy_nandroid(c->entries[i].n);
+    }
+    free(c->roots);
+    free(c->entries);
+    free(c);
+}
+
+static int catalog_add_root(catalog* c, const char* path, time_t time, int settled) {
+    if(c->root_num == c->root_alloc) {
+        int alloc = c->root_alloc ? c->root_alloc * 2 : 4;
+        catalog_root* roots = (catalog_root*)realloc(c->roots, alloc * sizeof(catalog_root));
+        if(roots == NULL)
+            return -1;
+        c->roots = roots;
+        c->root_alloc = alloc;
+    }
+    catalog_root* r = &c->roots[c->root_num++];
+    r->path = strdup(path);
+    r->time = time;
+    r->settled = settled;
+    return 0;
+}
+
+static int catalog_add(catalog* c, nandroid* n, int settled) {
+    if(c->count == c->alloc) {
+        int alloc = c->alloc ? c->alloc * 2 : 32;
+        catalog_entry* entries = (catalog_entry*)realloc(c->entries, alloc * sizeof(catalog_entry));
+        if(entries == NULL) {
+            destroy_nandroid(n);
+            return -1;
+        }
+        c->entries = entries;
+        c->alloc = alloc;
+    }
+    c->entries[c->count].n = n;
+    c->entries[c->count].settled = settled;
+    c->count++;
+    return 0;
+}
+
+static catalog_root* catalog_find_root(catalog* c, const char* path) {
+    int i;
+    for(i = 0; i < c->root_num; ++i) {
+        if(strcmp(c->roots[i].path, path) == 0)
+            return &c->roots[i];
+    }
+    return NULL;
+}
+
+static int catalog_find(catalog* c, const char* dir) {
+    int i;
+    for(i = 0; i < c->count; ++i) {
+        if(c->entries[i].n && strcmp(c->entries[i].n->dir, dir) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * Check whether dir is an immediate subdirectory of root.
+ */
+static int is_child(const char* root, const char* dir) {
+    size_t len = strlen(root);
+    return strncmp(dir, root, len) == 0 && dir[len] == '/' &&
+            dir[len + 1] != '\0' && strchr(dir + len + 1, '/') == NULL;
+}
+
+/**
+ * Check that a cached partition still means the same thing on this device.
+ */
+static int is_valid_part(int id, int type) {
+    return id >= 0 && id < device_partition_num &&
+            device_partitions[id].id == id &&
+            type >= 0 && type <= NANDROID_TYPE_LAST;
+}
+
+/**
+ * Read the catalog from the sdcard.  Anything unexpected in it throws the
+ * whole thing away, the worst that costs is one full scan.
+ *
+ * \return The catalog, which is empty if there wasn't a usable one
+ */
+static catalog* catalog_load() {
+    catalog* c = catalog_create();
+    if(c == NULL)
+        return NULL;
+
+    FILE* f = fopen(NANDROID_CATALOG_FILE, "r");
+    if(f == NULL)
+        return c;
+
+    int buflen = PATH_MAX + 128;
+    char* line = (char*)malloc(buflen);
+    nandroid* n = NULL;
+    int settled = 0;
+    int parts = 0;
+    int j = 0;
+    int bad = 0;
+    int version;
+
+    if(line == NULL || fgets(line, buflen, f) == NULL ||
+            1 != sscanf(line, NANDROID_CATALOG_MAGIC " %d", &version) ||
+            version != NANDROID_CATALOG_VERSION) {
+        bad = 1;
+    }
+
+    while(!bad && fgets(line, buflen, f) != NULL) {
+        char* nl = strchr(line, '\n');
+        if(nl == NULL) { // truncated, or longer than any path we'd write
+            bad = 1;
+            break;
+        }
+        *nl = '\0';
+
+        long time;
+        long long size;
+        int id, type, count;
+        int pos = -1;
+
+        if(parts > 0) {
+            // partitions of the backup before this line
+            if(3 != sscanf(line, "part %d %d %lld", &id, &type, &size) || !is_valid_part(id, type)) {
+                bad = 1;
+                break;
+            }
+            n->partitions[j] = id;
+            n->types[j] = type;
+            n->sizes[j++] = size;
+            if(--parts == 0) {
+                n->partitions[j] = INT_MAX;
+                catalog_add(c, n, settled);
+                n = NULL;
+            }
+        } else if(2 == sscanf(line, "root %ld %d %n", &time, &settled, &pos) && pos > 0) {
+            catalog_add_root(c, line + pos, (time_t)time, settled);
+        } else if(3 == sscanf(line, "backup %ld %d %d %n", &time, &settled, &count, &pos) &&
+                pos > 0 && count >= 0 && count <= device_partition_num) {
+            n = (nandroid*)calloc(1, sizeof(nandroid));
+            n->dir = strdup(line + pos);
+            n->partitions = (int*)calloc(count + 1, sizeof(int));
+            n->types = (int*)calloc(count + 1, sizeof(int));
+            n->sizes = (long long*)calloc(count + 1, sizeof(long long));
+            n->time = (time_t)time;
+            n->partitions[0] = INT_MAX;
+            j = 0;
+            parts = count;
+            if(parts == 0) {
+                catalog_add(c, n, settled);
+                n = NULL;
+            }
+        } else {
+            bad = 1;
+        }
+    }
+
+    if(n != NULL)
+        destroy_nandroid(n);
+    free(line);
+    fclose(f);
+
+    if(bad || parts > 0) {
+        LOGW("Ignoring unreadable nandroid catalog\n");
+        catalog_destroy(c);
+        c = catalog_create();
+    }
+    return c;
+}
+
+/**
+ * Write the catalog to the sdcard.  It goes to a temporary file first, so a
+ * reader sees either the old catalog or the new one.
+ *
+ * \return 0 on success
+ */
+static int catalog_save(catalog* c) {
+    const char* tmp = NANDROID_CATALOG_FILE ".tmp";
+
+    // the directory usually exists already
+    mkdir(NANDROID_CATALOG_DIR, 0777);
+
+    FILE* f = fopen(tmp, "w");
+    if(f == NULL) {
+        LOGW("Unable to write nandroid catalog (%s)\n", strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, NANDROID_CATALOG_MAGIC " %d\n", NANDROID_CATALOG_VERSION);
+
+    // paths are the rest of the line, so the rare one with a newline in it
+    // is left out and simply scanned each time
+    int i;
+    for(i = 0; i < c->root_num; ++i) {
+        catalog_root* r = &c->roots[i];
+        if(strchr(r->path, '\n') == NULL)
+            fprintf(f, "root %ld %d %s\n", (long)r->time, r->settled, r->path);
+    }
+    for(i = 0; i < c->count; ++i) {
+        nandroid* n = c->entries[i].n;
+        if(n == NULL || strchr(n->dir, '\n') != NULL)
+            continue;
+
+        int count = 0;
+        while(n->partitions[count] != INT_MAX) count++;
+
+        fprintf(f, "backup %ld %d %d %s\n", (long)n->time, c->entries[i].settled, count, n->dir);
+        int j;
+        for(j = 0; j < count; ++j)
+            fprintf(f, "part %d %d %lld\n", n->partitions[j], n->types[j], n->sizes[j]);
+    }
+
+    int ret = ferror(f);
+    if(0 != fclose(f))
+        ret = -1;
+    if(ret == 0 && 0 != rename(tmp, NANDROID_CATALOG_FILE))
+        ret = -1;
+    if(ret != 0) {
+        LOGW("Unable to write nandroid catalog (%s)\n", strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Add a directory to a new catalog, reusing what the old catalog has on it if
+ * its mtime hasn't moved since.
+ *
+ * \param c The catalog being built
+ * \param old The catalog from the last scan; reused entries are taken from it
+ * \param path The directory
+ * \param now When this scan started
+ *
+ * \return 0 if the old catalog was right about the directory, 1 if not
+ */
+static int catalog_add_dir(catalog* c, catalog* old, char* path, time_t now) {
+    struct stat info;
+    if(0 != stat(path, &info) || !S_ISDIR(info.st_mode))
+        return 1;
+
+    int i = catalog_find(old, path);
+    if(i >= 0 && old->entries[i].settled && old->entries[i].n->time == info.st_mtime) {
+        catalog_add(c, old->entries[i].n, 1);
+        old->entries[i].n = NULL;
+        return 0;
+    }
+
+    nandroid* n = nandroid_scan_dir(path);
+    // the mtime from before the scan, if it moved during the scan then the
+    // next scan has to look again
+    n->time = info.st_mtime;
+    catalog_add(c, n, info.st_mtime + NANDROID_CATALOG_MTIME_SLOP < now);
+    return 1;
+}
+
+/**
+ * List the nandroids in the given directories, scanning only the backups that
+ * changed since the catalog was last written, then bring the catalog up to
+ * date.
+ *
+ * \param roots The directories holding nandroid backups
+ * \param root_num The number of roots
+ *
+ * \return A null-terminated list of nandroids that were found.  This should later
+ *         be destroyed with a call to destroy_nandroid_list()
+ */
+nandroid** nandroid_catalog_scan(char** roots, int root_num) {
+    catalog* old = catalog_load();
+    catalog* c = catalog_create();
+    if(old == NULL || c == NULL) {
+        if(old) catalog_destroy(old);
+        if(c) catalog_destroy(c);
+        return (nandroid**)calloc(1, sizeof(nandroid*));
+    }
+
+    time_t now = time(NULL);
+    int changed = 0;
+
+    int i;
+    for(i = 0; i < root_num; ++i) {
+        catalog_root* r = catalog_find_root(old, roots[i]);
+
+        struct stat info;
+        if(0 != stat(roots[i], &info) || !S_ISDIR(info.st_mode)) {
+            changed |= (r != NULL);
+            continue;
+        }
+        catalog_add_root(c, roots[i], info.st_mtime, info.st_mtime + NANDROID_CATALOG_MTIME_SLOP < now);
+
+        if(r != NULL && r->settled && r->time == info.st_mtime) {
+            // nothing was added to or removed from the root, so the
+            // directories we already know about are all there is
+            int j;
+            for(j = 0; j < old->count; ++j) {
+                nandroid* n = old->entries[j].n;
+                if(n && is_child(roots[i], n->dir))
+                    changed |= catalog_add_dir(c, old, n->dir, now);
+            }
+            continue;
+        }
+
+        changed = 1;
+        DIR* dir = opendir(roots[i]);
+        if(dir == NULL)
+            continue;
+
+        char* buf = (char*)calloc(PATH_MAX, sizeof(char));
+        struct dirent* de;
+        while((de = readdir(dir)) != NULL) {
+            // assume directories reference nandroids
+            if(de->d_name[0] != '.' && de->d_type == DT_DIR) {
+                snprintf(buf, PATH_MAX, "%s/%s", roots[i], de->d_name);
+                catalog_add_dir(c, old, buf, now);
+            }
+        }
+        free(buf);
+        closedir(dir);
+    }
+
+    if(changed)
+        catalog_save(c);
+
+    // hand the nandroids over to the caller, leaving out plain directories
+    nandroid** nandroids = (nandroid**)calloc(c->count + 1, sizeof(nandroid*));
+    int j = 0;
+    for(i = 0; i < c->count; ++i) {
+        if(c->entries[i].n->partitions[0] != INT_MAX) {
+            nandroids[j++] = c->entries[i].n;
+            c->entries[i].n = NULL;
+        }
+    }
+    nandroids[j] = NULL;
+
+    catalog_destroy(old);
+    catalog_destroy(c);
+    return nandroids;
+}
+
+/**
+ * Record a freshly written backup in the catalog, so the next scan doesn't
+ * have to probe it.
+ *
+ * \param backup_dir The directory of the finished backup
+ *
+ * \return 0 on success
+ */
+int nandroid_catalog_update(char* backup_dir) {
+    struct stat info;
+    if(0 != stat(backup_dir, &info) || !S_ISDIR(info.st_mode))
+        return -1;
+
+    catalog* c = catalog_load();
+    if(c == NULL)
+        return -1;
+
+    nandroid* n = nandroid_scan_dir(backup_dir);
+    n->time = info.st_mtime;
+
+    // the backup is finished, nothing else writes to its directory, so the
+    // mtime can be trusted right away rather than after the usual slop
+    int i = catalog_find(c, backup_dir);
+    if(i >= 0) {
+        destroy_nandroid(c->entries[i].n);
+        c->entries[i].n = n;
+        c->entries[i].settled = 1;
+    } else {
+        catalog_add(c, n, 1);
+    }
+
+    int ret = catalog_save(c);
+    catalog_destroy(c);
+    return ret;
+}
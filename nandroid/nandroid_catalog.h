@@ -0,0 +1,17 @@
+/**
+ * \file nandroid_catalog.h
+ *
+ * This file defines the nandroid catalog, a record of every backup directory
+ * kept on the sdcard so that listing backups doesn't mean probing every file
+ * of every backup.  Entries are revalidated against the directory mtime.
+ */
+
+#ifndef RECOVERY_NANDROID_CATALOG_H_
+#define RECOVERY_NANDROID_CATALOG_H_
+
+#include "nandroid/nandroid.h"
+
+nandroid** nandroid_catalog_scan(char** roots, int root_num);
+int nandroid_catalog_update(char* backup_dir);
+
+#endif//RECOVERY_NANDROID_CATALOG_H_
@@ -0,0 +1,552 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "zlib.h"
+#include "bzlib.h"
+
+#include "common.h"
+
+#include "nandroid/nandroid_compress.h"
+
+// gzip blocks are small, and each one is primed with the tail of the block
+// before it so the compression ratio stays close to a single-threaded gzip
+#define GZIP_BLOCK_SIZE  (128 * 1024)
+#define GZIP_DICT_SIZE   (32 * 1024)
+// bzip2 compresses in 900k blocks anyway, so use the same size
+#define BZIP2_BLOCK_SIZE (900 * 1000)
+#define BZIP2_LEVEL      9
+// buffer size used when we aren't compressing at all
+#define PASSTHROUGH_BUFFER_SIZE (128 * 1024)
+
+// job states
+#define JOB_FREE  0 // owned by the producer
+#define JOB_READY 1 // filled, waiting on a worker
+#define JOB_BUSY  2 // being compressed
+#define JOB_DONE  3 // compressed, waiting on the writer
+
+typedef struct {
+    int state;
+    int last;
+    int err;
+
+    char* in;
+    size_t in_len;
+
+    char* dict;
+    size_t dict_len;
+
+    char* out;
+    size_t out_len;
+    size_t out_alloc;
+
+    unsigned long crc;
+} compress_job;
+
+struct nandroid_compressor {
+    int fd;
+    int type;
+    size_t block_size;
+
+    int thread_count;
+    pthread_t* workers;
+    pthread_t writer;
+
+    // jobs form a ring, job n lives in jobs[n % job_count]
+    int job_count;
+    compress_job* jobs;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    long fill_seq;     // job the producer is currently filling
+    long compress_seq; // next job a worker should pick up
+    long write_seq;    // next job the writer should output
+    int finished;      // the last job has been handed off
+    int err;
+
+    // tail of the previous gzip block, handed to the next job as a dictionary
+    char* dict;
+    size_t dict_len;
+
+    // gzip trailer info, only touched by the writer thread
+    unsigned long crc;
+    unsigned long total_in;
+
+    // buffer for NANDROID_COMPRESS_NONE
+    char* buf;
+    size_t buf_len;
+};
+
+static int write_all(int fd, const char* data, size_t len) {
+    while(len > 0) {
+        ssize_t n = write(fd, data, len);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int nandroid_default_thread_count() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : (int)n;
+}
+
+/**
+ * Make sure a job's output buffer has at least "needed" bytes free.
+ */
+static int job_reserve_output(compress_job* job, size_t needed) {
+    if(job->out_alloc - job->out_len >= needed)
+        return 0;
+
+    size_t alloc = job->out_alloc * 2;
+    if(alloc < job->out_len + needed)
+        alloc = job->out_len + needed;
+
+    char* out = (char*)realloc(job->out, alloc);
+    if(out == NULL)
+        return -1;
+
+    job->out = out;
+    job->out_alloc = alloc;
+    return 0;
+}
+
+/**
+ * Compress a block into raw deflate data.  Every block but the last ends with
+ * a sync flush so the blocks can simply be concatenated into one stream.
+ */
+static int compress_job_gzip(z_stream* strm, compress_job* job) {
+    int flush = job->last ? Z_FINISH : Z_SYNC_FLUSH;
+    int ret;
+
+    job->crc = crc32(crc32(0L, Z_NULL, 0), (const Bytef*)job->in, job->in_len);
+    job->out_len = 0;
+
+    if(deflateReset(strm) != Z_OK)
+        return -1;
+    if(job->dict_len > 0 &&
+            deflateSetDictionary(strm, (const Bytef*)job->dict, job->dict_len) != Z_OK)
+        return -1;
+
+    strm->next_in = (Bytef*)job->in;
+    strm->avail_in = job->in_len;
+
+    do {
+        if(0 != job_reserve_output(job, 4096))
+            return -1;
+
+        strm->next_out = (Bytef*)(job->out + job->out_len);
+        strm->avail_out = job->out_alloc - job->out_len;
+
+        ret = deflate(strm, flush);
+        if(ret == Z_STREAM_ERROR)
+            return -1;
+
+        job->out_len = job->out_alloc - strm->avail_out;
+    } while(job->last ? ret != Z_STREAM_END : (strm->avail_in > 0 || strm->avail_out == 0));
+
+    return 0;
+}
+
+/**
+ * Compress a block into a complete bzip2 stream.  Concatenated bzip2 streams
+ * are decompressed back to back by bunzip2 and tar -j.
+ */
+static int compress_job_bzip2(compress_job* job) {
+    job->out_len = 0;
+
+    // an empty trailing block doesn't need a stream of its own
+    if(job->in_len == 0)
+        return 0;
+
+    if(0 != job_reserve_output(job, job->in_len + job->in_len / 100 + 600))
+        return -1;
+
+    unsigned int out_len = job->out_alloc;
+    if(BZ_OK != BZ2_bzBuffToBuffCompress(job->out, &out_len, job->in, job->in_len,
+                BZIP2_LEVEL, 0, 0))
+        return -1;
+
+    job->out_len = out_len;
+    return 0;
+}
+
+static void* compress_worker_thread(void* cookie) {
+    nandroid_compressor* c = (nandroid_compressor*)cookie;
+
+    z_stream strm;
+    int strm_ok = 0;
+    if(c->type == NANDROID_COMPRESS_GZIP) {
+        memset(&strm, 0, sizeof(strm));
+        // negative window bits give us raw deflate with no zlib header
+        strm_ok = (Z_OK == deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                -MAX_WBITS, 8, Z_DEFAULT_STRATEGY));
+    }
+
+    pthread_mutex_lock(&c->lock);
+    for(;;) {
+        while(c->compress_seq >= c->fill_seq && !c->finished)
+            pthread_cond_wait(&c->cond, &c->lock);
+        if(c->compress_seq >= c->fill_seq)
+            break;
+
+        compress_job* job = &c->jobs[c->compress_seq % c->job_count];
+        c->compress_seq++;
+        job->state = JOB_BUSY;
+        pthread_mutex_unlock(&c->lock);
+
+        if(c->type == NANDROID_COMPRESS_GZIP) {
+            job->err = strm_ok ? compress_job_gzip(&strm, job) : -1;
+        } else {
+            job->err = compress_job_bzip2(job);
+        }
+
+        pthread_mutex_lock(&c->lock);
+        job->state = JOB_DONE;
+        pthread_cond_broadcast(&c->cond);
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    if(strm_ok)
+        deflateEnd(&strm);
+
+    return NULL;
+}
+
+static void put_le32(unsigned char* p, unsigned long v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static void compressor_set_error(nandroid_compressor* c) {
+    pthread_mutex_lock(&c->lock);
+    c->err = -1;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+}
+
+static void* compress_writer_thread(void* cookie) {
+    nandroid_compressor* c = (nandroid_compressor*)cookie;
+
+    if(c->type == NANDROID_COMPRESS_GZIP) {
+        // magic, deflate, no flags, mtime, no extra flags, unix
+        unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+        put_le32(header + 4, (unsigned long)time(NULL));
+        if(0 != write_all(c->fd, (const char*)header, sizeof(header)))
+            compressor_set_error(c);
+    }
+
+    pthread_mutex_lock(&c->lock);
+    for(;;) {
+        compress_job* job = &c->jobs[c->write_seq % c->job_count];
+        while(!(c->write_seq < c->fill_seq && job->state == JOB_DONE))
+            pthread_cond_wait(&c->cond, &c->lock);
+        int failed = c->err;
+        pthread_mutex_unlock(&c->lock);
+
+        if(!failed) {
+            if(job->err != 0 || 0 != write_all(c->fd, job->out, job->out_len)) {
+                compressor_set_error(c);
+            } else if(c->type == NANDROID_COMPRESS_GZIP) {
+                c->crc = crc32_combine(c->crc, job->crc, job->in_len);
+                c->total_in += job->in_len;
+            }
+        }
+        int last = job->last;
+
+        pthread_mutex_lock(&c->lock);
+        job->state = JOB_FREE;
+        c->write_seq++;
+        pthread_cond_broadcast(&c->cond);
+
+        if(last)
+            break;
+    }
+    int failed = c->err;
+    pthread_mutex_unlock(&c->lock);
+
+    if(!failed && c->type == NANDROID_COMPRESS_GZIP) {
+        unsigned char trailer[8];
+        put_le32(trailer, c->crc);
+        put_le32(trailer + 4, c->total_in);
+        if(0 != write_all(c->fd, (const char*)trailer, sizeof(trailer)))
+            compressor_set_error(c);
+    }
+
+    return NULL;
+}
+
+/**
+ * Wait for the producer's next job slot to be written out, then prepare it
+ * for filling.  Must be called with the lock held.
+ */
+static compress_job* compressor_acquire_job(nandroid_compressor* c) {
+    compress_job* job = &c->jobs[c->fill_seq % c->job_count];
+    while(job->state != JOB_FREE)
+        pthread_cond_wait(&c->cond, &c->lock);
+
+    job->last = 0;
+    job->err = 0;
+    job->in_len = 0;
+    job->dict_len = 0;
+    if(c->type == NANDROID_COMPRESS_GZIP && c->dict_len > 0) {
+        memcpy(job->dict, c->dict, c->dict_len);
+        job->dict_len = c->dict_len;
+    }
+    return job;
+}
+
+/**
+ * Hand the job currently being filled to the workers.  Must be called with
+ * the lock held.
+ */
+static void compressor_submit_job(nandroid_compressor* c, int last) {
+    compress_job* job = &c->jobs[c->fill_seq % c->job_count];
+
+    if(c->type == NANDROID_COMPRESS_GZIP) {
+        size_t keep = job->in_len < GZIP_DICT_SIZE ? job->in_len : GZIP_DICT_SIZE;
+        memcpy(c->dict, job->in + job->in_len - keep, keep);
+        c->dict_len = keep;
+    }
+
+    job->last = last;
+    job->state = JOB_READY;
+    c->fill_seq++;
+    if(last)
+        c->finished = 1;
+    pthread_cond_broadcast(&c->cond);
+}
+
+static void compressor_free(nandroid_compressor* c) {
+    int i;
+    if(c->jobs) {
+        for(i = 0; i < c->job_count; ++i) {
+            free(c->jobs[i].in);
+            free(c->jobs[i].dict);
+            free(c->jobs[i].out);
+        }
+        free(c->jobs);
+    }
+    free(c->workers);
+    free(c->dict);
+    free(c->buf);
+    free(c);
+}
+
+/**
+ * Create a compressor that writes its output to a file descriptor.
+ *
+ * \param fd The file descriptor to write the compressed stream to
+ * \param type One of the NANDROID_COMPRESS_* types
+ * \param threads Number of compression threads, or 0 to use one per core
+ *
+ * \return A compressor that must be finished with nandroid_compressor_close(),
+ *         or NULL on error.
+ */
+nandroid_compressor* nandroid_compressor_create(int fd, int type, int threads) {
+    nandroid_compressor* c = (nandroid_compressor*)calloc(1, sizeof(nandroid_compressor));
+    if(c == NULL)
+        return NULL;
+
+    c->fd = fd;
+    c->type = type;
+
+    if(type == NANDROID_COMPRESS_NONE) {
+        c->buf = (char*)malloc(PASSTHROUGH_BUFFER_SIZE);
+        if(c->buf == NULL) {
+            compressor_free(c);
+            return NULL;
+        }
+        return c;
+    }
+
+    if(type != NANDROID_COMPRESS_GZIP && type != NANDROID_COMPRESS_BZIP2) {
+        compressor_free(c);
+        return NULL;
+    }
+
+    if(threads <= 0)
+        threads = nandroid_default_thread_count();
+
+    // bzip2 blocks are big, so only keep enough around to keep everyone busy
+    size_t out_alloc;
+    if(type == NANDROID_COMPRESS_GZIP) {
+        c->block_size = GZIP_BLOCK_SIZE;
+        c->job_count = threads * 2 + 2;
+        out_alloc = GZIP_BLOCK_SIZE + GZIP_BLOCK_SIZE / 16 + 1024;
+    } else {
+        c->block_size = BZIP2_BLOCK_SIZE;
+        c->job_count = threads + 2;
+        out_alloc = BZIP2_BLOCK_SIZE + BZIP2_BLOCK_SIZE / 100 + 600;
+    }
+
+    c->jobs = (compress_job*)calloc(c->job_count, sizeof(compress_job));
+    c->workers = (pthread_t*)calloc(threads, sizeof(pthread_t));
+    if(c->jobs == NULL || c->workers == NULL) {
+        compressor_free(c);
+        return NULL;
+    }
+
+    int i;
+    for(i = 0; i < c->job_count; ++i) {
+        compress_job* job = &c->jobs[i];
+        job->state = JOB_FREE;
+        job->in = (char*)malloc(c->block_size);
+        job->out = (char*)malloc(out_alloc);
+        job->out_alloc = out_alloc;
+        if(type == NANDROID_COMPRESS_GZIP)
+            job->dict = (char*)malloc(GZIP_DICT_SIZE);
+        if(job->in == NULL || job->out == NULL ||
+                (type == NANDROID_COMPRESS_GZIP && job->dict == NULL)) {
+            compressor_free(c);
+            return NULL;
+        }
+    }
+    if(type == NANDROID_COMPRESS_GZIP) {
+        c->dict = (char*)malloc(GZIP_DICT_SIZE);
+        if(c->dict == NULL) {
+            compressor_free(c);
+            return NULL;
+        }
+    }
+
+    c->crc = crc32(0L, Z_NULL, 0);
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->cond, NULL);
+
+    // the first job is ours to fill right away
+    compressor_acquire_job(c);
+
+    for(i = 0; i < threads; ++i) {
+        if(0 != pthread_create(&c->workers[i], NULL, compress_worker_thread, c)) {
+            LOGW("Unable to start compression thread %d, continuing with %d\n", i, i);
+            break;
+        }
+    }
+    c->thread_count = i;
+
+    if(c->thread_count == 0 ||
+            0 != pthread_create(&c->writer, NULL, compress_writer_thread, c)) {
+        LOGE("Unable to start compression threads (%s)\n", strerror(errno));
+
+        // let any workers we did start run dry and exit
+        pthread_mutex_lock(&c->lock);
+        c->finished = 1;
+        pthread_cond_broadcast(&c->cond);
+        pthread_mutex_unlock(&c->lock);
+        for(i = 0; i < c->thread_count; ++i) {
+            pthread_join(c->workers[i], NULL);
+        }
+
+        pthread_mutex_destroy(&c->lock);
+        pthread_cond_destroy(&c->cond);
+        compressor_free(c);
+        return NULL;
+    }
+
+    return c;
+}
+
+/**
+ * Queue data for compression.
+ *
+ * \return 0 on success, or -1 if an earlier write to the output failed
+ */
+int nandroid_compressor_write(nandroid_compressor* c, const char* data, size_t len) {
+    if(c->type == NANDROID_COMPRESS_NONE) {
+        if(c->err)
+            return -1;
+        while(len > 0) {
+            size_t copy = PASSTHROUGH_BUFFER_SIZE - c->buf_len;
+            if(copy > len)
+                copy = len;
+            memcpy(c->buf + c->buf_len, data, copy);
+            c->buf_len += copy;
+            data += copy;
+            len -= copy;
+
+            if(c->buf_len == PASSTHROUGH_BUFFER_SIZE) {
+                if(0 != write_all(c->fd, c->buf, c->buf_len)) {
+                    c->err = -1;
+                    return -1;
+                }
+                c->buf_len = 0;
+            }
+        }
+        return 0;
+    }
+
+    while(len > 0) {
+        // the job being filled is owned by us, so no need to lock to copy
+        compress_job* job = &c->jobs[c->fill_seq % c->job_count];
+        size_t copy = c->block_size - job->in_len;
+        if(copy > len)
+            copy = len;
+        memcpy(job->in + job->in_len, data, copy);
+        job->in_len += copy;
+        data += copy;
+        len -= copy;
+
+        if(job->in_len == c->block_size) {
+            pthread_mutex_lock(&c->lock);
+            if(c->err) {
+                pthread_mutex_unlock(&c->lock);
+                return -1;
+            }
+            compressor_submit_job(c, 0);
+            compressor_acquire_job(c);
+            pthread_mutex_unlock(&c->lock);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Flush any remaining data, finish the stream, and free the compressor.
+ *
+ * \return 0 if the whole stream was written successfully, nonzero otherwise
+ */
+int nandroid_compressor_close(nandroid_compressor* c) {
+    int ret;
+
+    if(c->type == NANDROID_COMPRESS_NONE) {
+        ret = c->err;
+        if(ret == 0 && c->buf_len > 0)
+            ret = write_all(c->fd, c->buf, c->buf_len);
+        compressor_free(c);
+        return ret;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    compressor_submit_job(c, 1);
+    pthread_mutex_unlock(&c->lock);
+
+    int i;
+    for(i = 0; i < c->thread_count; ++i) {
+        pthread_join(c->workers[i], NULL);
+    }
+    pthread_join(c->writer, NULL);
+
+    ret = c->err;
+
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->cond);
+    compressor_free(c);
+    return ret;
+}
+
+int nandroid_compressor_sink(void* cookie, const char* data, size_t len) {
+    return nandroid_compressor_write((nandroid_compressor*)cookie, data, len);
+}
@@ -0,0 +1,32 @@
+/**
+ * \file nandroid_compress.h
+ *
+ * This file defines a block-parallel compressor used to write nandroid
+ * archives.  Data is split into independent blocks which are compressed on a
+ * pool of worker threads and written back out in order, so the output is a
+ * single standard gzip (or bzip2) stream.
+ */
+
+#ifndef RECOVERY_NANDROID_COMPRESS_H_
+#define RECOVERY_NANDROID_COMPRESS_H_
+
+#include <stddef.h>
+
+// compression types
+#define NANDROID_COMPRESS_NONE  0 // pass data straight through
+#define NANDROID_COMPRESS_GZIP  1 // gzip (pigz-style, one member)
+#define NANDROID_COMPRESS_BZIP2 2 // bzip2 (pbzip2-style, one stream per block)
+
+typedef struct nandroid_compressor nandroid_compressor;
+
+nandroid_compressor* nandroid_compressor_create(int fd, int type, int threads);
+int nandroid_compressor_write(nandroid_compressor* c, const char* data, size_t len);
+int nandroid_compressor_close(nandroid_compressor* c);
+
+// adapter so a compressor can be handed to anything taking a nandroid_sink_fn
+int nandroid_compressor_sink(void* cookie, const char* data, size_t len);
+
+// number of worker threads to use when the caller doesn't care
+int nandroid_default_thread_count();
+
+#endif//RECOVERY_NANDROID_COMPRESS_H_
@@ -0,0 +1,703 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "zlib.h"
+#include "mincrypt/sha.h"
+
+#include "common.h"
+#include "roots.h"
+#include "minzip/DirUtil.h"
+
+#include "nandroid/nandroid_compress.h"
+#include "nandroid/nandroid_dedup.h"
+#include "nandroid/nandroid_tar_reader.h"
+#include "nandroid/nandroid_tar_writer.h"
+
+#define DEDUP_MAGIC       "nandroid-dedup 1"
+#define DEDUP_LINE_SIZE   128
+#define SHA_HEX_SIZE      (SHA_DIGEST_SIZE * 2 + 1)
+
+// chunk boundaries are picked from the content (a gear rolling hash), so an
+// insertion early in the stream only changes the chunks around it.  16 bits
+// of mask past the 16k minimum gives chunks of roughly 64k on average.
+#define CHUNK_MIN_SIZE    (16 * 1024)
+#define CHUNK_MAX_SIZE    (256 * 1024)
+#define CHUNK_MASK        0xffff0000U
+
+// blobs are written once and read on every restore, but backups happen on
+// the device, so favour speed
+#define BLOB_LEVEL        Z_BEST_SPEED
+
+typedef struct {
+    FILE* manifest;
+
+    // data not yet cut into a chunk
+    char* buf;
+    size_t len;
+    size_t scanned;
+    uint32_t hash;
+
+    unsigned char* zbuf;
+    unsigned long zbuf_size;
+
+    unsigned long chunks;
+    unsigned long long total;
+    unsigned long new_chunks;
+    unsigned long long new_bytes;
+    int err;
+} dedup_writer;
+
+typedef struct {
+    FILE* manifest;
+    const char* name;
+
+    char* buf;
+    size_t len;
+    size_t pos;
+
+    unsigned char* zbuf;
+    size_t zbuf_alloc;
+
+    unsigned long chunks;
+    unsigned long long total;
+    int done;
+    int err;
+} dedup_reader;
+
+static uint32_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Fill the gear table.  This uses a fixed seed: changing the table moves
+ * every chunk boundary, which would stop new backups sharing chunks with
+ * old ones.
+ */
+static void gear_init() {
+    uint32_t x = 0x2545f491;
+    int i;
+    for(i = 0; i < 256; ++i) {
+        // xorshift32
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        gear[i] = x;
+    }
+}
+
+static void sha_to_hex(const uint8_t* digest, char* hex) {
+    static const char digits[] = "0123456789abcdef";
+    int i;
+    for(i = 0; i < SHA_DIGEST_SIZE; ++i) {
+        hex[i * 2]     = digits[digest[i] >> 4];
+        hex[i * 2 + 1] = digits[digest[i] & 0xf];
+    }
+    hex[SHA_HEX_SIZE - 1] = '\0';
+}
+
+static void blob_path(char* path, size_t len, const char* hex) {
+    snprintf(path, len, "%s/%.2s/%s", NANDROID_DEDUP_BLOB_DIR, hex, hex);
+}
+
+static int write_all(int fd, const void* data, size_t len) {
+    const char* p = (const char*)data;
+    while(len > 0) {
+        ssize_t n = write(fd, p, len);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Add a chunk to the store (unless it's already there) and to the manifest.
+ */
+static int dedup_store_chunk(dedup_writer* w, const char* data, size_t len) {
+    uint8_t digest[SHA_DIGEST_SIZE];
+    char hex[SHA_HEX_SIZE];
+    char path[PATH_MAX];
+
+    SHA(data, len, digest);
+    sha_to_hex(digest, hex);
+    blob_path(path, sizeof(path), hex);
+
+    if(0 != access(path, F_OK)) {
+        unsigned long zlen = w->zbuf_size;
+        if(Z_OK != compress2(w->zbuf, &zlen, (const Bytef*)data, len, BLOB_LEVEL)) {
+            LOGE("Unable to compress chunk %s\n", hex);
+            return -1;
+        }
+
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s/%.2s", NANDROID_DEDUP_BLOB_DIR, hex);
+        mkdir(dir, 0755);
+
+        // write under a temporary name so a half-written blob is never
+        // mistaken for a good one, even if we're interrupted
+        static int counter = 0;
+        char tmp[PATH_MAX];
+        snprintf(tmp, sizeof(tmp), "%s.%d.%d.tmp", path, getpid(), __sync_fetch_and_add(&counter, 1));
+
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0) {
+            LOGE("Unable to create %s (%s)\n", tmp, strerror(errno));
+            return -1;
+        }
+        int ret = write_all(fd, w->zbuf, zlen);
+        if(0 != close(fd))
+            ret = -1;
+        if(ret == 0 && 0 != rename(tmp, path))
+            ret = -1;
+        if(ret != 0) {
+            LOGE("Unable to write %s (%s)\n", path, strerror(errno));
+            unlink(tmp);
+            return -1;
+        }
+
+        w->new_chunks++;
+        w->new_bytes += zlen;
+    }
+
+    w->chunks++;
+    w->total += len;
+    if(fprintf(w->manifest, "%s %lu\n", hex, (unsigned long)len) < 0)
+        return -1;
+    return 0;
+}
+
+/**
+ * Cut the first "len" bytes of the buffer off as a chunk.
+ */
+static int dedup_emit(dedup_writer* w, size_t len) {
+    int ret = dedup_store_chunk(w, w->buf, len);
+
+    memmove(w->buf, w->buf + len, w->len - len);
+    w->len -= len;
+    w->scanned = 0;
+    w->hash = 0;
+    return ret;
+}
+
+/**
+ * nandroid_sink_fn that splits the tar stream into chunks.
+ */
+static int dedup_sink(void* cookie, const char* data, size_t len) {
+    dedup_writer* w = (dedup_writer*)cookie;
+
+    while(len > 0 && w->err == 0) {
+        size_t copy = CHUNK_MAX_SIZE - w->len;
+        if(copy > len)
+            copy = len;
+        memcpy(w->buf + w->len, data, copy);
+        w->len += copy;
+        data += copy;
+        len -= copy;
+
+        // look for a boundary in the new data
+        while(w->err == 0 && w->scanned < w->len) {
+            size_t i;
+            size_t cut = 0;
+            for(i = w->scanned; i < w->len; ++i) {
+                if(i < CHUNK_MIN_SIZE)
+                    continue;
+                w->hash = (w->hash << 1) + gear[(unsigned char)w->buf[i]];
+                if((w->hash & CHUNK_MASK) == 0) {
+                    cut = i + 1;
+                    break;
+                }
+            }
+
+            if(cut == 0 && w->len == CHUNK_MAX_SIZE)
+                cut = CHUNK_MAX_SIZE;
+
+            if(cut == 0) {
+                w->scanned = w->len;
+                break;
+            }
+
+            if(0 != dedup_emit(w, cut))
+                w->err = -1;
+        }
+    }
+
+    return w->err;
+}
+
+/**
+ * Back up a path in the deduplicated format.
+ *
+ * \param path The path to back up
+ * \param backup_path The manifest to write
+ *
+ * \return 0 on success
+ */
+int nandroid_backup_path_dedup(char* path, char* backup_path) {
+    int was_mounted = is_path_mounted(path);
+    int ret = 0;
+
+    if(0 != (ret = ensure_path_mounted(path))) {
+        return ret;
+    }
+
+    pthread_once(&gear_once, gear_init);
+
+    dedup_writer w;
+    memset(&w, 0, sizeof(w));
+    w.buf = (char*)malloc(CHUNK_MAX_SIZE);
+    w.zbuf_size = compressBound(CHUNK_MAX_SIZE);
+    w.zbuf = (unsigned char*)malloc(w.zbuf_size);
+
+    ensure_path_mounted(NANDROID_DEDUP_BLOB_DIR);
+    dirCreateHierarchy(NANDROID_DEDUP_BLOB_DIR, 0755, NULL, false);
+
+    w.manifest = fopen(backup_path, "w");
+    if(w.manifest == NULL) {
+        LOGE("Unable to open %s for writing (%s)\n", backup_path, strerror(errno));
+        ret = -1;
+    } else if(w.buf == NULL || w.zbuf == NULL) {
+        ret = -1;
+    } else {
+        fprintf(w.manifest, "%s\n", DEDUP_MAGIC);
+
+        ret = nandroid_tar_create(path, dedup_sink, &w);
+        if(ret == 0 && w.len > 0)
+            ret = dedup_emit(&w, w.len);
+
+        // the end marker lets restore tell a complete manifest from a cut off one
+        if(ret == 0)
+            fprintf(w.manifest, "end %lu %llu\n", w.chunks, w.total);
+        if(ferror(w.manifest))
+            ret = -1;
+    }
+
+    if(w.manifest != NULL && 0 != fclose(w.manifest))
+        ret = -1;
+
+    if(ret == 0) {
+        LOGI("%s: %lu chunks (%llu KB), %lu new (%llu KB stored)\n", path,
+                w.chunks, w.total / 1024, w.new_chunks, w.new_bytes / 1024);
+    }
+
+    free(w.buf);
+    free(w.zbuf);
+
+    if(!was_mounted)
+        ensure_path_unmounted(path);
+
+    return ret;
+}
+
+static int dedup_reader_open(dedup_reader* r, const char* manifest) {
+    char line[DEDUP_LINE_SIZE];
+
+    memset(r, 0, sizeof(dedup_reader));
+    r->name = manifest;
+    r->buf = (char*)malloc(CHUNK_MAX_SIZE);
+    if(r->buf == NULL)
+        return -1;
+
+    r->manifest = fopen(manifest, "r");
+    if(r->manifest == NULL) {
+        LOGE("Unable to open %s (%s)\n", manifest, strerror(errno));
+        free(r->buf);
+        return -1;
+    }
+
+    if(fgets(line, sizeof(line), r->manifest) == NULL || strncmp(line, DEDUP_MAGIC, strlen(DEDUP_MAGIC)) != 0) {
+        LOGE("%s is not a deduplicated backup\n", manifest);
+        fclose(r->manifest);
+        free(r->buf);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void dedup_reader_close(dedup_reader* r) {
+    fclose(r->manifest);
+    free(r->buf);
+    free(r->zbuf);
+}
+
+/**
+ * Load the next chunk listed in the manifest into the reader's buffer.
+ *
+ * \return 1 if a chunk was loaded, 0 at the end of the manifest, -1 on error
+ */
+static int dedup_reader_next(dedup_reader* r) {
+    char line[DEDUP_LINE_SIZE];
+    char hex[SHA_HEX_SIZE];
+    char path[PATH_MAX];
+    unsigned long len;
+
+    if(r->done)
+        return 0;
+
+    if(fgets(line, sizeof(line), r->manifest) == NULL) {
+        LOGE("%s is truncated\n", r->name);
+        return -1;
+    }
+
+    if(strncmp(line, "end ", 4) == 0) {
+        unsigned long chunks;
+        unsigned long long total;
+        if(2 != sscanf(line + 4, "%lu %llu", &chunks, &total) || chunks != r->chunks || total != r->total) {
+            LOGE("%s is corrupt\n", r->name);
+            return -1;
+        }
+        r->done = 1;
+        return 0;
+    }
+
+    if(2 != sscanf(line, "%40s %lu", hex, &len) || strlen(hex) != SHA_HEX_SIZE - 1 || len > CHUNK_MAX_SIZE) {
+        LOGE("%s is corrupt\n", r->name);
+        return -1;
+    }
+
+    blob_path(path, sizeof(path), hex);
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        LOGE("Missing chunk %s (%s)\n", hex, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if(0 != fstat(fd, &st)) {
+        close(fd);
+        return -1;
+    }
+
+    if((size_t)st.st_size > r->zbuf_alloc) {
+        unsigned char* zbuf = (unsigned char*)realloc(r->zbuf, st.st_size);
+        if(zbuf == NULL) {
+            close(fd);
+            return -1;
+        }
+        r->zbuf = zbuf;
+        r->zbuf_alloc = st.st_size;
+    }
+
+    size_t got = 0;
+    while(got < (size_t)st.st_size) {
+        ssize_t n = read(fd, r->zbuf + got, st.st_size - got);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        got += n;
+    }
+    close(fd);
+
+    uLongf out_len = len;
+    uint8_t digest[SHA_DIGEST_SIZE];
+    char actual[SHA_HEX_SIZE];
+    if(got != (size_t)st.st_size ||
+            Z_OK != uncompress((Bytef*)r->buf, &out_len, r->zbuf, got) || out_len != len) {
+        LOGE("Chunk %s is damaged\n", hex);
+        return -1;
+    }
+
+    SHA(r->buf, len, digest);
+    sha_to_hex(digest, actual);
+    if(strcmp(hex, actual) != 0) {
+        LOGE("Chunk %s is damaged\n", hex);
+        return -1;
+    }
+
+    r->len = len;
+    r->pos = 0;
+    r->chunks++;
+    r->total += len;
+    return 1;
+}
+
+/**
+ * nandroid_source_fn that rebuilds the tar stream from the chunk store.
+ */
+static ssize_t dedup_source(void* cookie, char* buf, size_t len) {
+    dedup_reader* r = (dedup_reader*)cookie;
+    size_t copied = 0;
+
+    while(copied < len) {
+        if(r->pos == r->len) {
+            int ret = dedup_reader_next(r);
+            if(ret < 0) {
+                r->err = -1;
+                errno = EIO;
+                return -1;
+            }
+            if(ret == 0)
+                break;
+        }
+
+        size_t n = r->len - r->pos;
+        if(n > len - copied)
+            n = len - copied;
+        memcpy(buf + copied, r->buf + r->pos, n);
+        r->pos += n;
+        copied += n;
+    }
+
+    return copied;
+}
+
+/**
+ * Restore a path from a deduplicated backup.
+ *
+ * \param path The path to restore
+ * \param backup_path The manifest to restore from
+ *
+ * \return 0 on success
+ */
+int nandroid_restore_path_dedup(char* path, char* backup_path) {
+    int was_mounted = is_path_mounted(path);
+    int ret = 0;
+
+    if(0 != (ret = ensure_path_mounted(path))) {
+        return ret;
+    }
+
+    dedup_reader r;
+    if(0 != dedup_reader_open(&r, backup_path)) {
+        ret = -1;
+    } else {
+        ret = nandroid_tar_extract(path, NANDROID_COMPRESS_NONE, dedup_source, &r);
+        if(r.err != 0)
+            ret = -1;
+        dedup_reader_close(&r);
+    }
+
+    if(!was_mounted)
+        ensure_path_unmounted(path);
+
+    return ret;
+}
+
+/**
+ * Check that every chunk a manifest refers to is present and intact.
+ *
+ * \param manifest The manifest to check
+ *
+ * \return 0 if the backup can be restored
+ */
+int nandroid_dedup_verify(const char* manifest) {
+    dedup_reader r;
+    if(0 != dedup_reader_open(&r, manifest))
+        return -1;
+
+    int ret;
+    while((ret = dedup_reader_next(&r)) > 0)
+        ;
+
+    dedup_reader_close(&r);
+    return ret;
+}
+
+// the chunks some manifest still refers to
+typedef struct {
+    uint8_t (*digests)[SHA_DIGEST_SIZE];
+    size_t count;
+    size_t alloc;
+} blob_set;
+
+static int hex_to_digest(const char* hex, uint8_t* digest) {
+    int i;
+    for(i = 0; i < SHA_DIGEST_SIZE * 2; ++i) {
+        char c = hex[i];
+        int v;
+        if(c >= '0' && c <= '9')
+            v = c - '0';
+        else if(c >= 'a' && c <= 'f')
+            v = c - 'a' + 10;
+        else
+            return -1;
+        if(i & 1)
+            digest[i / 2] |= v;
+        else
+            digest[i / 2] = v << 4;
+    }
+    return hex[i] == '\0' ? 0 : -1;
+}
+
+static int compare_digests(const void* a, const void* b) {
+    return memcmp(a, b, SHA_DIGEST_SIZE);
+}
+
+static int blob_set_add(blob_set* s, const uint8_t* digest) {
+    if(s->count == s->alloc) {
+        size_t alloc = s->alloc ? s->alloc * 2 : 4096;
+        void* digests = realloc(s->digests, alloc * SHA_DIGEST_SIZE);
+        if(digests == NULL)
+            return -1;
+        s->digests = digests;
+        s->alloc = alloc;
+    }
+    memcpy(s->digests[s->count++], digest, SHA_DIGEST_SIZE);
+    return 0;
+}
+
+/**
+ * Mark every chunk a manifest lists.  A cut off manifest still marks what
+ * it has, but one we can't make sense of stops the collection, since the
+ * chunks it needs can't be told apart from garbage.
+ */
+static int dedup_mark_manifest(blob_set* live, const char* manifest) {
+    char line[DEDUP_LINE_SIZE];
+    char hex[SHA_HEX_SIZE];
+    uint8_t digest[SHA_DIGEST_SIZE];
+    unsigned long len;
+    int ret = 0;
+
+    FILE* f = fopen(manifest, "r");
+    if(f == NULL) {
+        LOGE("Unable to open %s (%s)\n", manifest, strerror(errno));
+        return -1;
+    }
+
+    if(fgets(line, sizeof(line), f) == NULL || strncmp(line, DEDUP_MAGIC, strlen(DEDUP_MAGIC)) != 0) {
+        LOGE("%s is not a deduplicated backup\n", manifest);
+        fclose(f);
+        return -1;
+    }
+
+    while(ret == 0 && fgets(line, sizeof(line), f) != NULL) {
+        if(strncmp(line, "end ", 4) == 0)
+            break;
+        if(2 != sscanf(line, "%40s %lu", hex, &len) || 0 != hex_to_digest(hex, digest)) {
+            LOGE("%s is corrupt\n", manifest);
+            ret = -1;
+        } else {
+            ret = blob_set_add(live, digest);
+        }
+    }
+    if(ferror(f))
+        ret = -1;
+
+    fclose(f);
+    return ret;
+}
+
+/**
+ * Mark the chunks of every backup directly under root.
+ */
+static int dedup_mark_root(blob_set* live, const char* root) {
+    DIR* dir = opendir(root);
+    if(dir == NULL)
+        return 0;
+
+    int ret = 0;
+    struct dirent* de;
+    while(ret == 0 && (de = readdir(dir)) != NULL) {
+        if(de->d_name[0] == '.')
+            continue;
+
+        char backup_dir[PATH_MAX];
+        snprintf(backup_dir, sizeof(backup_dir), "%s/%s", root, de->d_name);
+        DIR* backup = opendir(backup_dir);
+        if(backup == NULL)
+            continue;
+
+        struct dirent* file;
+        while(ret == 0 && (file = readdir(backup)) != NULL) {
+            char* ext = strrchr(file->d_name, '.');
+            if(ext == NULL || strcmp(ext, ".dedup") != 0)
+                continue;
+
+            char manifest[PATH_MAX];
+            snprintf(manifest, sizeof(manifest), "%s/%s", backup_dir, file->d_name);
+            ret = dedup_mark_manifest(live, manifest);
+        }
+        closedir(backup);
+    }
+
+    closedir(dir);
+    return ret;
+}
+
+/**
+ * Delete the chunks no backup refers to any more, along with blobs left half
+ * written by an interrupted backup.  Nothing may be backing up while this
+ * runs.
+ *
+ * \param roots The directories holding backups, one per subdirectory
+ * \param root_num Number of roots
+ *
+ * \return 0 on success
+ */
+int nandroid_dedup_gc(char** roots, int root_num) {
+    DIR* store = opendir(NANDROID_DEDUP_BLOB_DIR);
+    if(store == NULL)
+        return 0;
+
+    blob_set live;
+    memset(&live, 0, sizeof(live));
+
+    int ret = 0;
+    int i;
+    for(i = 0; ret == 0 && i < root_num; ++i)
+        ret = dedup_mark_root(&live, roots[i]);
+    if(ret != 0) {
+        LOGE("Not removing unused chunks\n");
+        free(live.digests);
+        closedir(store);
+        return ret;
+    }
+
+    qsort(live.digests, live.count, SHA_DIGEST_SIZE, compare_digests);
+
+    unsigned long removed = 0;
+    unsigned long long removed_bytes = 0;
+    struct dirent* de;
+    while((de = readdir(store)) != NULL) {
+        if(de->d_name[0] == '.')
+            continue;
+
+        char dir_path[PATH_MAX];
+        snprintf(dir_path, sizeof(dir_path), "%s/%s", NANDROID_DEDUP_BLOB_DIR, de->d_name);
+        DIR* dir = opendir(dir_path);
+        if(dir == NULL)
+            continue;
+
+        struct dirent* blob;
+        while((blob = readdir(dir)) != NULL) {
+            uint8_t digest[SHA_DIGEST_SIZE];
+            char* ext = strrchr(blob->d_name, '.');
+            int stale = ext != NULL && strcmp(ext, ".tmp") == 0;
+
+            if(!stale && (0 != hex_to_digest(blob->d_name, digest) ||
+                    bsearch(digest, live.digests, live.count, SHA_DIGEST_SIZE, compare_digests) != NULL))
+                continue;
+
+            char path[PATH_MAX];
+            struct stat st;
+            snprintf(path, sizeof(path), "%s/%s", dir_path, blob->d_name);
+            if(0 == stat(path, &st) && 0 == unlink(path)) {
+                removed++;
+                removed_bytes += st.st_size;
+            }
+        }
+        closedir(dir);
+
+        // only goes if it's empty now
+        rmdir(dir_path);
+    }
+    closedir(store);
+    free(live.digests);
+
+    LOGI("Removed %lu unused chunks (%llu KB)\n", removed, removed_bytes / 1024);
+    return 0;
+}
@@ -0,0 +1,25 @@
+/**
+ * \file nandroid_dedup.h
+ *
+ * This file defines the deduplicated nandroid format.  A volume is archived
+ * as a tar stream that is split into content-defined chunks, each chunk is
+ * stored once in a blob store shared by every backup, and the backup itself
+ * is just a manifest listing the chunks in order.
+ */
+
+#ifndef RECOVERY_NANDROID_DEDUP_H_
+#define RECOVERY_NANDROID_DEDUP_H_
+
+// where chunks are kept, shared by all backups
+#define NANDROID_DEDUP_BLOB_DIR "/sdcard/clockworkmod/blobs"
+
+int nandroid_backup_path_dedup(char* path, char* backup_path);
+int nandroid_restore_path_dedup(char* path, char* backup_path);
+
+// reads every chunk a manifest refers to and checks its hash
+int nandroid_dedup_verify(const char* manifest);
+
+// deletes the chunks no backup under roots refers to
+int nandroid_dedup_gc(char** roots, int root_num);
+
+#endif//RECOVERY_NANDROID_DEDUP_H_
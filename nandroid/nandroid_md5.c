@@ -0,0 +1,364 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "common.h"
+
+#include "nandroid/nandroid_md5.h"
+
+// size of the reads used to hash existing files
+#define MD5_FILE_BUFFER_SIZE (256 * 1024)
+
+// MD5 as described in RFC 1321
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+#define ROTATE_LEFT(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define STEP(f, a, b, c, d, x, t, s) \
+    (a) += f((b), (c), (d)) + (x) + (t); \
+    (a) = ROTATE_LEFT((a), (s)) + (b);
+
+static void md5_transform(uint32_t state[4], const unsigned char block[64]) {
+    uint32_t a = state[0];
+    uint32_t b = state[1];
+    uint32_t c = state[2];
+    uint32_t d = state[3];
+    uint32_t x[16];
+    int i;
+
+    for(i = 0; i < 16; ++i) {
+        x[i] = (uint32_t)block[i * 4] |
+                ((uint32_t)block[i * 4 + 1] << 8) |
+                ((uint32_t)block[i * 4 + 2] << 16) |
+                ((uint32_t)block[i * 4 + 3] << 24);
+    }
+
+    STEP(F, a, b, c, d, x[ 0], 0xd76aa478,  7)
+    STEP(F, d, a, b, c, x[ 1], 0xe8c7b756, 12)
+    STEP(F, c, d, a, b, x[ 2], 0x242070db, 17)
+    STEP(F, b, c, d, a, x[ 3], 0xc1bdceee, 22)
+    STEP(F, a, b, c, d, x[ 4], 0xf57c0faf,  7)
+    STEP(F, d, a, b, c, x[ 5], 0x4787c62a, 12)
+    STEP(F, c, d, a, b, x[ 6], 0xa8304613, 17)
+    STEP(F, b, c, d, a, x[ 7], 0xfd469501, 22)
+    STEP(F, a, b, c, d, x[ 8], 0x698098d8,  7)
+    STEP(F, d, a, b, c, x[ 9], 0x8b44f7af, 12)
+    STEP(F, c, d, a, b, x[10], 0xffff5bb1, 17)
+    STEP(F, b, c, d, a, x[11], 0x895cd7be, 22)
+    STEP(F, a, b, c, d, x[12], 0x6b901122,  7)
+    STEP(F, d, a, b, c, x[13], 0xfd987193, 12)
+    STEP(F, c, d, a, b, x[14], 0xa679438e, 17)
+    STEP(F, b, c, d, a, x[15], 0x49b40821, 22)
+
+    STEP(G, a, b, c, d, x[ 1], 0xf61e2562,  5)
+    STEP(G, d, a, b, c, x[ 6], 0xc040b340,  9)
+    STEP(G, c, d, a, b, x[11], 0x265e5a51, 14)
+    STEP(G, b, c, d, a, x[ 0], 0xe9b6c7aa, 20)
+    STEP(G, a, b, c, d, x[ 5], 0xd62f105d,  5)
+    STEP(G, d, a, b, c, x[10], 0x02441453,  9)
+    STEP(G, c, d, a, b, x[15], 0xd8a1e681, 14)
+    STEP(G, b, c, d, a, x[ 4], 0xe7d3fbc8, 20)
+    STEP(G, a, b, c, d, x[ 9], 0x21e1cde6,  5)
+    STEP(G, d, a, b, c, x[14], 0xc33707d6,  9)
+    STEP(G, c, d, a, b, x[ 3], 0xf4d50d87, 14)
+    STEP(G, b, c, d, a, x[ 8], 0x455a14ed, 20)
+    STEP(G, a, b, c, d, x[13], 0xa9e3e905,  5)
+    STEP(G, d, a, b, c, x[ 2], 0xfcefa3f8,  9)
+    STEP(G, c, d, a, b, x[ 7], 0x676f02d9, 14)
+    STEP(G, b, c, d, a, x[12], 0x8d2a4c8a, 20)
+
+    STEP(H, a, b, c, d, x[ 5], 0xfffa3942,  4)
+    STEP(H, d, a, b, c, x[ 8], 0x8771f681, 11)
+    STEP(H, c, d, a, b, x[11], 0x6d9d6122, 16)
+    STEP(H, b, c, d, a, x[14], 0xfde5380c, 23)
+    STEP(H, a, b, c, d, x[ 1], 0xa4beea44,  4)
+    STEP(H, d, a, b, c, x[ 4], 0x4bdecfa9, 11)
+    STEP(H, c, d, a, b, x[ 7], 0xf6bb4b60, 16)
+    STEP(H, b, c, d, a, x[10], 0xbebfbc70, 23)
+    STEP(H, a, b, c, d, x[13], 0x289b7ec6,  4)
+    STEP(H, d, a, b, c, x[ 0], 0xeaa127fa, 11)
+    STEP(H, c, d, a, b, x[ 3], 0xd4ef3085, 16)
+    STEP(H, b, c, d, a, x[ 6], 0x04881d05, 23)
+    STEP(H, a, b, c, d, x[ 9], 0xd9d4d039,  4)
+    STEP(H, d, a, b, c, x[12], 0xe6db99e5, 11)
+    STEP(H, c, d, a, b, x[15], 0x1fa27cf8, 16)
+    STEP(H, b, c, d, a, x[ 2], 0xc4ac5665, 23)
+
+    STEP(I, a, b, c, d, x[ 0], 0xf4292244,  6)
+    STEP(I, d, a, b, c, x[ 7], 0x432aff97, 10)
+    STEP(I, c, d, a, b, x[14], 0xab9423a7, 15)
+    STEP(I, b, c, d, a, x[ 5], 0xfc93a039, 21)
+    STEP(I, a, b, c, d, x[12], 0x655b59c3,  6)
+    STEP(I, d, a, b, c, x[ 3], 0x8f0ccc92, 10)
+    STEP(I, c, d, a, b, x[10], 0xffeff47d, 15)
+    STEP(I, b, c, d, a, x[ 1], 0x85845dd1, 21)
+    STEP(I, a, b, c, d, x[ 8], 0x6fa87e4f,  6)
+    STEP(I, d, a, b, c, x[15], 0xfe2ce6e0, 10)
+    STEP(I, c, d, a, b, x[ 6], 0xa3014314, 15)
+    STEP(I, b, c, d, a, x[13], 0x4e0811a1, 21)
+    STEP(I, a, b, c, d, x[ 4], 0xf7537e82,  6)
+    STEP(I, d, a, b, c, x[11], 0xbd3af235, 10)
+    STEP(I, c, d, a, b, x[ 2], 0x2ad7d2bb, 15)
+    STEP(I, b, c, d, a, x[ 9], 0xeb86d391, 21)
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+void nandroid_md5_init(nandroid_md5_ctx* ctx) {
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->count = 0;
+}
+
+void nandroid_md5_update(nandroid_md5_ctx* ctx, const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+    size_t used = ctx->count & 63;
+
+    ctx->count += len;
+
+    if(used > 0) {
+        size_t fill = 64 - used;
+        if(len < fill) {
+            memcpy(ctx->buffer + used, p, len);
+            return;
+        }
+        memcpy(ctx->buffer + used, p, fill);
+        md5_transform(ctx->state, ctx->buffer);
+        p += fill;
+        len -= fill;
+    }
+
+    while(len >= 64) {
+        md5_transform(ctx->state, p);
+        p += 64;
+        len -= 64;
+    }
+
+    memcpy(ctx->buffer, p, len);
+}
+
+void nandroid_md5_final(nandroid_md5_ctx* ctx, unsigned char digest[NANDROID_MD5_DIGEST_SIZE]) {
+    static const unsigned char padding[64] = { 0x80 };
+    unsigned char bits[8];
+    uint64_t count = ctx->count << 3;
+    int i;
+
+    for(i = 0; i < 8; ++i)
+        bits[i] = (unsigned char)(count >> (i * 8));
+
+    size_t used = ctx->count & 63;
+    nandroid_md5_update(ctx, padding, used < 56 ? 56 - used : 120 - used);
+    nandroid_md5_update(ctx, bits, 8);
+
+    for(i = 0; i < 4; ++i) {
+        digest[i * 4]     = (unsigned char)(ctx->state[i]);
+        digest[i * 4 + 1] = (unsigned char)(ctx->state[i] >> 8);
+        digest[i * 4 + 2] = (unsigned char)(ctx->state[i] >> 16);
+        digest[i * 4 + 3] = (unsigned char)(ctx->state[i] >> 24);
+    }
+}
+
+void nandroid_md5_to_hex(const unsigned char digest[NANDROID_MD5_DIGEST_SIZE], char hex[NANDROID_MD5_HEX_SIZE]) {
+    static const char digits[] = "0123456789abcdef";
+    int i;
+    for(i = 0; i < NANDROID_MD5_DIGEST_SIZE; ++i) {
+        hex[i * 2]     = digits[digest[i] >> 4];
+        hex[i * 2 + 1] = digits[digest[i] & 0xf];
+    }
+    hex[NANDROID_MD5_HEX_SIZE - 1] = '\0';
+}
+
+/**
+ * Compute the MD5 of an existing file.
+ *
+ * \param path The file to hash
+ * \param digest Receives the digest
+ *
+ * \return 0 on success
+ */
+int nandroid_md5_file(const char* path, unsigned char digest[NANDROID_MD5_DIGEST_SIZE]) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        LOGE("Unable to open %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    char* buf = (char*)malloc(MD5_FILE_BUFFER_SIZE);
+    if(buf == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    nandroid_md5_ctx ctx;
+    nandroid_md5_init(&ctx);
+
+    int ret = 0;
+    while(1) {
+        ssize_t n = read(fd, buf, MD5_FILE_BUFFER_SIZE);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0) {
+            LOGE("Error reading %s (%s)\n", path, strerror(errno));
+            ret = -1;
+            break;
+        }
+        if(n == 0)
+            break;
+        nandroid_md5_update(&ctx, buf, n);
+    }
+
+    nandroid_md5_final(&ctx, digest);
+    free(buf);
+    close(fd);
+    return ret;
+}
+
+static int hex_value(char c) {
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * Look up the digest recorded for a backup file.
+ *
+ * \param md5_file The list to search, as written by md5sum or nandroid_md5_list_write
+ * \param file Path of the backup file, only the base name is compared
+ * \param digest Receives the digest
+ *
+ * \return 0 if found, 1 if the file isn't listed, -1 if the list can't be read
+ */
+int nandroid_md5_lookup(const char* md5_file, const char* file, unsigned char digest[NANDROID_MD5_DIGEST_SIZE]) {
+    FILE* f = fopen(md5_file, "r");
+    if(f == NULL)
+        return -1;
+
+    char* tmp = strdup(file);
+    if(tmp == NULL) {
+        fclose(f);
+        return -1;
+    }
+    const char* name = basename(tmp);
+
+    int ret = 1;
+    char line[PATH_MAX + NANDROID_MD5_HEX_SIZE + 4];
+    while(ret == 1 && fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if(strlen(line) < NANDROID_MD5_HEX_SIZE + 1 || line[NANDROID_MD5_HEX_SIZE - 1] != ' ')
+            continue;
+
+        // md5sum marks binary files with '*' in place of the second space
+        const char* entry = line + NANDROID_MD5_HEX_SIZE;
+        if(*entry == ' ' || *entry == '*')
+            entry++;
+        if(strcmp(entry, name) != 0)
+            continue;
+
+        int i;
+        for(i = 0; i < NANDROID_MD5_DIGEST_SIZE; ++i) {
+            int hi = hex_value(line[i * 2]);
+            int lo = hex_value(line[i * 2 + 1]);
+            if(hi < 0 || lo < 0)
+                break;
+            digest[i] = (hi << 4) | lo;
+        }
+        if(i == NANDROID_MD5_DIGEST_SIZE)
+            ret = 0;
+    }
+
+    free(tmp);
+    fclose(f);
+    return ret;
+}
+
+typedef struct md5_list_entry {
+    char* name;
+    char hex[NANDROID_MD5_HEX_SIZE];
+    struct md5_list_entry* next;
+} md5_list_entry;
+
+static md5_list_entry* md5_list = NULL;
+static pthread_mutex_t md5_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Remember the digest of a backup file for nandroid_md5_list_write.
+ *
+ * \param file Path of the backup file, only the base name is recorded
+ * \param digest The file's digest
+ */
+void nandroid_md5_list_add(const char* file, const unsigned char digest[NANDROID_MD5_DIGEST_SIZE]) {
+    md5_list_entry* entry = (md5_list_entry*)malloc(sizeof(md5_list_entry));
+    if(entry == NULL)
+        return;
+
+    // basename may modify its argument
+    char* tmp = strdup(file);
+    entry->name = tmp ? strdup(basename(tmp)) : NULL;
+    free(tmp);
+    if(entry->name == NULL) {
+        free(entry);
+        return;
+    }
+    nandroid_md5_to_hex(digest, entry->hex);
+
+    pthread_mutex_lock(&md5_list_lock);
+    entry->next = md5_list;
+    md5_list = entry;
+    pthread_mutex_unlock(&md5_list_lock);
+}
+
+/**
+ * Write the collected digests in the format "md5sum -c" expects.
+ *
+ * \param md5_file The file to write
+ *
+ * \return 0 on success
+ */
+int nandroid_md5_list_write(const char* md5_file) {
+    FILE* f = fopen(md5_file, "w");
+    if(f == NULL) {
+        LOGE("Unable to open %s (%s)\n", md5_file, strerror(errno));
+        return -1;
+    }
+
+    pthread_mutex_lock(&md5_list_lock);
+    md5_list_entry* entry;
+    for(entry = md5_list; entry != NULL; entry = entry->next)
+        fprintf(f, "%s  %s\n", entry->hex, entry->name);
+    pthread_mutex_unlock(&md5_list_lock);
+
+    int ret = ferror(f) ? -1 : 0;
+    if(0 != fclose(f))
+        ret = -1;
+    return ret;
+}
+
+void nandroid_md5_list_clear() {
+    pthread_mutex_lock(&md5_list_lock);
+    while(md5_list != NULL) {
+        md5_list_entry* entry = md5_list;
+        md5_list = entry->next;
+        free(entry->name);
+        free(entry);
+    }
+    pthread_mutex_unlock(&md5_list_lock);
+}
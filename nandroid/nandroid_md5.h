@@ -0,0 +1,40 @@
+/**
+ * \file nandroid_md5.h
+ *
+ * This file defines the MD5 implementation used for nandroid checksums, and
+ * the list of digests that gets written out to nandroid.md5.
+ */
+
+#ifndef RECOVERY_NANDROID_MD5_H_
+#define RECOVERY_NANDROID_MD5_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NANDROID_MD5_DIGEST_SIZE 16
+// hex string plus terminator
+#define NANDROID_MD5_HEX_SIZE    (NANDROID_MD5_DIGEST_SIZE * 2 + 1)
+
+typedef struct {
+    uint32_t state[4];
+    uint64_t count;
+    unsigned char buffer[64];
+} nandroid_md5_ctx;
+
+void nandroid_md5_init(nandroid_md5_ctx* ctx);
+void nandroid_md5_update(nandroid_md5_ctx* ctx, const void* data, size_t len);
+void nandroid_md5_final(nandroid_md5_ctx* ctx, unsigned char digest[NANDROID_MD5_DIGEST_SIZE]);
+void nandroid_md5_to_hex(const unsigned char digest[NANDROID_MD5_DIGEST_SIZE], char hex[NANDROID_MD5_HEX_SIZE]);
+
+// hash an existing file
+int nandroid_md5_file(const char* path, unsigned char digest[NANDROID_MD5_DIGEST_SIZE]);
+
+// find the expected digest of a backup file in an md5sum-style list
+int nandroid_md5_lookup(const char* md5_file, const char* file, unsigned char digest[NANDROID_MD5_DIGEST_SIZE]);
+
+// digests collected during a backup, safe to call from multiple threads
+void nandroid_md5_list_add(const char* file, const unsigned char digest[NANDROID_MD5_DIGEST_SIZE]);
+int nandroid_md5_list_write(const char* md5_file);
+void nandroid_md5_list_clear();
+
+#endif//RECOVERY_NANDROID_MD5_H_
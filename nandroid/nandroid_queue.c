@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "nandroid/nandroid_queue.h"
+
+struct nandroid_queue {
+    void** items;
+    int capacity;
+    int head;
+    int count;
+
+    int closed;
+    int aborted;
+
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+/**
+ * Create a queue.
+ *
+ * \param capacity Maximum number of items held before pushes block
+ *
+ * \return The queue, or NULL if out of memory
+ */
+nandroid_queue* nandroid_queue_create(int capacity) {
+    nandroid_queue* q = (nandroid_queue*)calloc(1, sizeof(nandroid_queue));
+    if(q == NULL)
+        return NULL;
+
+    if(capacity < 1)
+        capacity = 1;
+
+    q->items = (void**)calloc(capacity, sizeof(void*));
+    if(q->items == NULL) {
+        free(q);
+        return NULL;
+    }
+    q->capacity = capacity;
+
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+
+    return q;
+}
+
+/**
+ * Destroy a queue.  Nothing may be blocked on it.
+ *
+ * \param q The queue
+ * \param free_item Called on every item still queued, may be NULL
+ */
+void nandroid_queue_destroy(nandroid_queue* q, void (*free_item)(void*)) {
+    if(q == NULL)
+        return;
+
+    if(free_item != NULL) {
+        while(q->count > 0) {
+            free_item(q->items[q->head]);
+            q->head = (q->head + 1) % q->capacity;
+            q->count--;
+        }
+    }
+
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->lock);
+    free(q->items);
+    free(q);
+}
+
+int nandroid_queue_push(nandroid_queue* q, void* item) {
+    pthread_mutex_lock(&q->lock);
+    while(q->count == q->capacity && !q->aborted)
+        pthread_cond_wait(&q->not_full, &q->lock);
+
+    if(q->aborted || q->closed) {
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+
+    q->items[(q->head + q->count) % q->capacity] = item;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+void* nandroid_queue_pop(nandroid_queue* q) {
+    void* item = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    while(q->count == 0 && !q->closed && !q->aborted)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+
+    if(q->count > 0 && !q->aborted) {
+        item = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return item;
+}
+
+void nandroid_queue_close(nandroid_queue* q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void nandroid_queue_abort(nandroid_queue* q) {
+    pthread_mutex_lock(&q->lock);
+    q->aborted = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_cond_broadcast(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+}
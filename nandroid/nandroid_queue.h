@@ -0,0 +1,26 @@
+/**
+ * \file nandroid_queue.h
+ *
+ * This file defines a small bounded blocking queue used to hand work between
+ * the stages of the nandroid restore pipeline.
+ */
+
+#ifndef RECOVERY_NANDROID_QUEUE_H_
+#define RECOVERY_NANDROID_QUEUE_H_
+
+typedef struct nandroid_queue nandroid_queue;
+
+nandroid_queue* nandroid_queue_create(int capacity);
+void nandroid_queue_destroy(nandroid_queue* q, void (*free_item)(void*));
+
+// blocks while the queue is full; returns -1 if the queue was aborted
+int nandroid_queue_push(nandroid_queue* q, void* item);
+// blocks while the queue is empty; returns NULL once closed and drained, or aborted
+void* nandroid_queue_pop(nandroid_queue* q);
+
+// no more items will be pushed, consumers drain what is left
+void nandroid_queue_close(nandroid_queue* q);
+// stop handing out items, wake up both ends and fail any further pushes
+void nandroid_queue_abort(nandroid_queue* q);
+
+#endif//RECOVERY_NANDROID_QUEUE_H_
@@ -1,10 +1,191 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
 #include "common.h"
 #include "roots.h"
 
 #include "flashutils/flashutils.h"
 
 #include "nandroid/nandroid.h"
+#include "nandroid/nandroid_sparse.h"
+
+#define RAW_FIFO_DIR "/tmp"
+
+// the flashutils backends only know how to dump to and flash from a path,
+// so the sparse conversion happens on the far side of a fifo
+typedef struct {
+    char fifo[PATH_MAX];
+    // our end of the fifo, and the file on the other side
+    int fifo_fd;
+    int file_fd;
+    // the opposite end of the fifo, held so opens never block
+    int hold_fd;
+    pthread_t thread;
+    int sink_gone;
+    int ret;
+} raw_pipe;
+
+static int raw_pipe_open(raw_pipe* p, int read_side) {
+    static int counter = 0;
+
+    snprintf(p->fifo, sizeof(p->fifo), "%s/nandroid-%d-raw-%d.fifo", RAW_FIFO_DIR,
+            getpid(), __sync_fetch_and_add(&counter, 1));
+    unlink(p->fifo);
+    if(0 != mkfifo(p->fifo, 0600)) {
+        LOGE("Unable to create %s (%s)\n", p->fifo, strerror(errno));
+        return -1;
+    }
+
+    // whichever end we use, open the reader non-blocking first so that
+    // neither open waits for the backend
+    if(read_side) {
+        p->fifo_fd = open(p->fifo, O_RDONLY | O_NONBLOCK);
+        p->hold_fd = (p->fifo_fd >= 0) ? open(p->fifo, O_WRONLY) : -1;
+        if(p->fifo_fd >= 0)
+            fcntl(p->fifo_fd, F_SETFL, fcntl(p->fifo_fd, F_GETFL) & ~O_NONBLOCK);
+    } else {
+        p->hold_fd = open(p->fifo, O_RDONLY | O_NONBLOCK);
+        p->fifo_fd = (p->hold_fd >= 0) ? open(p->fifo, O_WRONLY) : -1;
+    }
+
+    if(p->fifo_fd < 0 || p->hold_fd < 0) {
+        LOGE("Unable to open %s (%s)\n", p->fifo, strerror(errno));
+        if(p->fifo_fd >= 0)
+            close(p->fifo_fd);
+        if(p->hold_fd >= 0)
+            close(p->hold_fd);
+        unlink(p->fifo);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Close our hold on the fifo, so the thread sees EOF (backup) or EPIPE
+ * (restore) once the backend is done with it, then wait for the thread.
+ */
+static int raw_pipe_finish(raw_pipe* p) {
+    close(p->hold_fd);
+    pthread_join(p->thread, NULL);
+    close(p->fifo_fd);
+    unlink(p->fifo);
+    return p->ret;
+}
+
+static void* encode_thread(void* cookie) {
+    raw_pipe* p = (raw_pipe*)cookie;
+    p->ret = nandroid_sparse_encode(p->fifo_fd, p->file_fd);
+
+    // keep draining on failure so the backend doesn't block on a full pipe
+    if(p->ret != 0) {
+        char buf[4096];
+        while(read(p->fifo_fd, buf, sizeof(buf)) > 0)
+            ;
+    }
+    return NULL;
+}
+
+static int fifo_write(void* cookie, const char* data, size_t len) {
+    raw_pipe* p = (raw_pipe*)cookie;
+    while(len > 0) {
+        ssize_t n = write(p->fifo_fd, data, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && errno == EPIPE)
+            p->sink_gone = 1;
+        if(n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void* decode_thread(void* cookie) {
+    raw_pipe* p = (raw_pipe*)cookie;
+
+    // the backend may stop reading early, we find out through EPIPE
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    p->ret = nandroid_sparse_decode(p->file_fd, fifo_write, p);
+    if(p->sink_gone)
+        p->ret = 0;
+
+    // closing our end is what gives the backend its EOF
+    close(p->fifo_fd);
+    p->fifo_fd = -1;
+    return NULL;
+}
+
+static int file_write(void* cookie, const char* data, size_t len) {
+    int fd = *(int*)cookie;
+    while(len > 0) {
+        ssize_t n = write(fd, data, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * The BML backend opens the image once for each bml device it flashes and
+ * stops at the first short read, so it can't be fed from a fifo.  Expand
+ * the image into a plain file first; boot and recovery are only a few MB.
+ */
+static int restore_raw_via_file(Volume* v, char* backup_path) {
+    char image[PATH_MAX];
+    snprintf(image, sizeof(image), "%s/nandroid-%d-raw.img", RAW_FIFO_DIR, getpid());
 
+    int in_fd = open(backup_path, O_RDONLY);
+    if(in_fd < 0) {
+        LOGE("Unable to open %s (%s)\n", backup_path, strerror(errno));
+        return -1;
+    }
+
+    int out_fd = open(image, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if(out_fd < 0) {
+        LOGE("Unable to open %s for writing (%s)\n", image, strerror(errno));
+        close(in_fd);
+        return -1;
+    }
+
+    int ret = nandroid_sparse_decode(in_fd, file_write, &out_fd);
+    close(in_fd);
+    if(0 != close(out_fd))
+        ret = -1;
+
+    if(ret == 0)
+        ret = restore_raw_partition(v->device, image);
+    unlink(image);
+    return ret;
+}
+
+/**
+ * Back up a raw partition as a sparse image.  The partition is dumped into
+ * a fifo and converted as it streams past, so runs of erased or zeroed
+ * blocks never hit the sdcard.
+ *
+ * \param path The root path of the partition
+ * \param backup_path The image to create, which must be seekable
+ *
+ * \return 0 on success
+ */
 int nandroid_backup_path_raw(char* path, char* backup_path) {
     int ret;
     if(0 != (ret = ensure_path_unmounted(path))) {
@@ -16,9 +197,45 @@ int nandroid_backup_path_raw(char* path, char* backup_path) {
         return -1;
     }
 
-    return backup_raw_partition(v->device, backup_path);
+    raw_pipe p;
+    memset(&p, 0, sizeof(p));
+    p.file_fd = open(backup_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(p.file_fd < 0) {
+        LOGE("Unable to open %s for writing (%s)\n", backup_path, strerror(errno));
+        return -1;
+    }
+
+    if(0 != raw_pipe_open(&p, 1)) {
+        close(p.file_fd);
+        return -1;
+    }
+
+    if(0 != pthread_create(&p.thread, NULL, encode_thread, &p)) {
+        close(p.hold_fd);
+        close(p.fifo_fd);
+        unlink(p.fifo);
+        close(p.file_fd);
+        return -1;
+    }
+
+    ret = backup_raw_partition(v->device, p.fifo);
+    if(0 != raw_pipe_finish(&p))
+        ret = -1;
+    if(0 != close(p.file_fd))
+        ret = -1;
+
+    return ret;
 }
 
+/**
+ * Restore a raw partition from a sparse image, or from a plain dump made
+ * before RAW backups were sparse.
+ *
+ * \param path The root path of the partition
+ * \param backup_path The image to restore, read front to back
+ *
+ * \return 0 on success
+ */
 int nandroid_restore_path_raw(char* path, char* backup_path) {
     int ret;
     if(0 != (ret = ensure_path_unmounted(path))) {
@@ -30,5 +247,37 @@ int nandroid_restore_path_raw(char* path, char* backup_path) {
         return -1;
     }
 
-    return restore_raw_partition(v->device, backup_path);
+    if(!nandroid_sparse_is_sparse(backup_path))
+        return restore_raw_partition(v->device, backup_path);
+
+    if(device_flash_type() == BML)
+        return restore_raw_via_file(v, backup_path);
+
+    raw_pipe p;
+    memset(&p, 0, sizeof(p));
+    p.file_fd = open(backup_path, O_RDONLY);
+    if(p.file_fd < 0) {
+        LOGE("Unable to open %s (%s)\n", backup_path, strerror(errno));
+        return -1;
+    }
+
+    if(0 != raw_pipe_open(&p, 0)) {
+        close(p.file_fd);
+        return -1;
+    }
+
+    if(0 != pthread_create(&p.thread, NULL, decode_thread, &p)) {
+        close(p.hold_fd);
+        close(p.fifo_fd);
+        unlink(p.fifo);
+        close(p.file_fd);
+        return -1;
+    }
+
+    ret = restore_raw_partition(v->device, p.fifo);
+    if(0 != raw_pipe_finish(&p))
+        ret = -1;
+    close(p.file_fd);
+
+    return ret;
 }
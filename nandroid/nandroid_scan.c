@@ -10,6 +10,8 @@
 #include "recovery_lib.h"
 
 #include "nandroid/nandroid.h"
+#include "nandroid/nandroid_catalog.h"
+#include "nandroid/nandroid_scan.h"
 
 // extensions for the various nandroid types
 #define NANDROID_TYPE_RAW_EXT      ".img"
@@ -18,6 +20,7 @@
 #define NANDROID_TYPE_TAR_BZ2_EXT  ".tar.bz2"
 #define NANDROID_TYPE_TAR_LZMA_EXT ".tar.lzma"
 #define NANDROID_TYPE_YAFFS_EXT    ".img"
+#define NANDROID_TYPE_DEDUP_EXT    ".dedup"
 
 #define NANDROID_MD5_EXT ".md5"
 
@@ -105,6 +108,8 @@ int get_nandroid_type_for_existing(char* backup_dir, char* path) {
             ret = NANDROID_TYPE_TAR_LZMA;
         } else if(snprintf(buf, PATH_MAX, file_format, backup_dir, p, NANDROID_TYPE_YAFFS_EXT) && 0 == statfs(buf, &file_info)) {
             ret = NANDROID_TYPE_YAFFS;
+        } else if(snprintf(buf, PATH_MAX, file_format, backup_dir, p, NANDROID_TYPE_DEDUP_EXT) && 0 == statfs(buf, &file_info)) {
+            ret = NANDROID_TYPE_DEDUP;
         }
     }
 
@@ -113,28 +118,19 @@ int get_nandroid_type_for_existing(char* backup_dir, char* path) {
 }
 
 /**
- * Returns the appropriate file name for the given backup directory and path.
- * This function will first check for an existing backup, and if it exists, return
- * the appropriate file name based on the detected type. If the backup is not found
- * it will return the appropriate filename for a new backup.
+ * Returns the file name a backup of the given type uses for path.
  *
  * \param backup_dir The nandroid backup directory you are referencing
- * \param path The root path (e.g. /boot) that you intend to backup/restore
+ * \param path The root path (e.g. /boot) of the backup
+ * \param type The NANDROID_TYPE of the backup
  *
- * \returns The appropriate backup filename.
+ * \returns The backup filename, or NULL if path or type is invalid.
  */
-char* get_nandroid_file_for_path(char* backup_dir, char* path) {
+static char* get_nandroid_file_for_type(char* backup_dir, char* path, int type) {
     Volume* v = volume_for_path(path);
     if(v == NULL)
         return NULL;
 
-    // first see if we're getting an existing path
-    int type = get_nandroid_type_for_existing(backup_dir, path);
-
-    if(type == NANDROID_TYPE_NULL) {
-        type = get_nandroid_type_for_new(path);
-    }
-
     char* ext;
     char* p = path + 1;
 
@@ -158,6 +154,9 @@ char* get_nandroid_file_for_path(char* backup_dir, char* path) {
     case NANDROID_TYPE_YAFFS:
         ext = NANDROID_TYPE_YAFFS_EXT;
         break;
+    case NANDROID_TYPE_DEDUP:
+        ext = NANDROID_TYPE_DEDUP_EXT;
+        break;
     default:
         return NULL;
     }
@@ -170,38 +169,71 @@ char* get_nandroid_file_for_path(char* backup_dir, char* path) {
 }
 
 /**
- * Scan a given directory and determine if it is a nandroid backup or not.  If it
- * is, then return a nandroid structure with the appropriate information.
+ * Returns the appropriate file name for the given backup directory and path.
+ * This function will first check for an existing backup, and if it exists, return
+ * the appropriate file name based on the detected type. If the backup is not found
+ * it will return the appropriate filename for a new backup.
+ *
+ * \param backup_dir The nandroid backup directory you are referencing
+ * \param path The root path (e.g. /boot) that you intend to backup/restore
+ *
+ * \returns The appropriate backup filename.
+ */
+char* get_nandroid_file_for_path(char* backup_dir, char* path) {
+    // first see if we're getting an existing path
+    int type = get_nandroid_type_for_existing(backup_dir, path);
+
+    if(type == NANDROID_TYPE_NULL) {
+        type = get_nandroid_type_for_new(path);
+    }
+
+    return get_nandroid_file_for_type(backup_dir, path, type);
+}
+
+/**
+ * Scan a given directory and determine if it is a nandroid backup or not.
  *
  * \param dir_path The directory path to scan for nandroids
  *
- * \return A valid nandroid structure if the directory is a nandroid, or NULL if it
- *         is not.
+ * \return A nandroid structure describing the directory.  If it is not a
+ *         nandroid its partition list is empty.
  */
 nandroid* nandroid_scan_dir(char* dir_path) {
-    // make an int array that we KNOW will be big enough
+    // make arrays that we KNOW will be big enough
     int* partitions = (int*)calloc(device_partition_num + 1, sizeof(int));
+    int* types = (int*)calloc(device_partition_num + 1, sizeof(int));
+    long long* sizes = (long long*)calloc(device_partition_num + 1, sizeof(long long));
 
     int i;
     int j = 0;
     for(i = 0; i < device_partition_num; ++i) {
-        if((device_partitions[i].flags & PARTITION_FLAG_RESTOREABLE) > 0 && // only bother scanning restorable partitions
-                has_volume(device_partitions[i].path) && // make sure the path exists on this device
-                get_nandroid_type_for_existing(dir_path, device_partitions[i].path) != NANDROID_TYPE_NULL) { // make sure the backup file exists
-            partitions[j++] = device_partitions[i].id;
+        if((device_partitions[i].flags & PARTITION_FLAG_RESTOREABLE) == 0 || // only bother scanning restorable partitions
+                !has_volume(device_partitions[i].path)) { // make sure the path exists on this device
+            continue;
         }
-    }
-    partitions[j] = INT_MAX; // INT_MAX is our indication of the end of the list
 
-    if(j == 0) { // didn't find anything
-        free(partitions);
-        return NULL;
+        int type = get_nandroid_type_for_existing(dir_path, device_partitions[i].path);
+        if(type == NANDROID_TYPE_NULL) // make sure the backup file exists
+            continue;
+
+        // note the size while we're here, so the catalog can show it
+        struct stat file_info;
+        char* file = get_nandroid_file_for_type(dir_path, device_partitions[i].path, type);
+        sizes[j] = (file && 0 == stat(file, &file_info)) ? (long long)file_info.st_size : 0;
+        free(file);
+
+        types[j] = type;
+        partitions[j++] = device_partitions[i].id;
     }
+    partitions[j] = INT_MAX; // INT_MAX is our indication of the end of the list
 
-    // found something, time to create our nandroid structure
+    struct stat dir_info;
     nandroid* n = (nandroid*)malloc(sizeof(nandroid));
     n->dir = strdup(dir_path);
     n->partitions = partitions;
+    n->types = types;
+    n->sizes = sizes;
+    n->time = (0 == stat(dir_path, &dir_info)) ? dir_info.st_mtime : 0;
 
     // return it
     return n;
@@ -209,7 +241,8 @@ nandroid* nandroid_scan_dir(char* dir_path) {
 
 /**
  * Scan the defined nandroid directories, returning a list of all nandroids that
- * were found.
+ * were found.  Backups that haven't changed since the last scan come from the
+ * catalog rather than being scanned again.
  *
  * \return A null-terminated list of nandroids that were found.  This should later
  *         be destroyed with a call to destroy_nandroid_list()
@@ -223,58 +256,32 @@ nandroid** nandroid_scan() {
         ensure_path_mounted(nandroid_dirs[i]);
     }
 
-    // count our nandroids.  here we assume that every subdirectory within our
-    // nandroid directories are nandroids, to ensure that our list will be big
-    // enough.
-    int count = 0;
-    for(i = 0; i < nandroid_dir_num; ++i) {
-        // open the directory
-        DIR* dir = opendir(nandroid_dirs[i]);
-        if (dir != NULL) {
-            struct dirent* de;
-        	while ((de = readdir(dir)) != NULL) {
-                // assume directories reference nandroids
-                if(de->d_name[0] != '.' && de->d_type == DT_DIR) {
-                    ++count;
-                }
-            }
-
-            closedir(dir);
-        }
-    }
+    return nandroid_catalog_scan(nandroid_dirs, nandroid_dir_num);
+}
 
-    // now we create our array
-    nandroid** nandroids = (nandroid**)calloc(count + 1, sizeof(nandroid*));
-    int j = 0;
-    for(i = 0; i < nandroid_dir_num; ++i) {
-        // open the directory
-        DIR* dir = opendir(nandroid_dirs[i]);
-        if (dir != NULL) {
-            struct dirent* de;
-
-        	while ((de = readdir(dir)) != NULL) {
-                // assume directories reference nandroids
-                if(de->d_name[0] != '.' && de->d_type == DT_DIR) {
-                    // create our directory string and scan for a nandroid
-                    int buflen = strlen(nandroid_dirs[i]) + strlen(de->d_name) + 2;
-                    char* buf = (char*)calloc(buflen, sizeof(char));
-                    snprintf(buf, buflen, "%s/%s", nandroid_dirs[i], de->d_name);
-                    nandroid* n = nandroid_scan_dir(buf);
-                    free(buf);
-
-                    // if it's not null (valid nandroid), then add it to the list
-                    if(n != NULL) {
-                        nandroids[j++] = n;
-                    }
-                }
-            }
-
-            closedir(dir);
-        }
-    }
-    // end the list and return it
-    nandroids[j] = NULL;
-    return nandroids;
+/**
+ * The directories nandroid_scan() looks for backups in
+ *
+ * \param num Receives the number of directories
+ *
+ * \return The directories, which must not be freed
+ */
+char** nandroid_scan_dirs(int* num) {
+    *num = nandroid_dir_num;
+    return nandroid_dirs;
+}
+
+/**
+ * Destroy a single nandroid (free from memory)
+ *
+ * \param n A nandroid from nandroid_scan_dir()
+ */
+void destroy_nandroid(nandroid* n) {
+    free(n->dir);
+    free(n->partitions);
+    free(n->types);
+    free(n->sizes);
+    free(n);
 }
 
 /**
@@ -286,12 +293,7 @@ void destroy_nandroid_list(nandroid** list) {
     nandroid** p = list;
 
     while(*p) {
-        nandroid* n = *p;
-
-        free(n->dir);
-        free(n->partitions);
-        free(n);
-
+        destroy_nandroid(*p);
         p++;
     }
 
@@ -15,7 +15,10 @@ int get_nandroid_type_for_existing(char* backup_dir, char* path);
 char* get_nandroid_file_for_path(char* backup_dir, char* path);
 
 // scans for available nandroids
+nandroid* nandroid_scan_dir(char* dir_path);
 nandroid** nandroid_scan();
+char** nandroid_scan_dirs(int* num);
+void destroy_nandroid(nandroid* n);
 void destroy_nandroid_list(nandroid** list);
 
 #endif//RECOVERY_NANDROID_SCAN_H_
@@ -0,0 +1,223 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "roots.h"
+
+#include "nandroid/nandroid_sched.h"
+
+#define GROUP_NAME_SIZE 32
+
+typedef struct {
+    char name[GROUP_NAME_SIZE];
+    char** paths;
+    int count;
+    int ret;
+
+    nandroid_job_fn fn;
+    void* cookie;
+    pthread_t thread;
+    int started;
+} device_group;
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Works out which physical device a volume lives on, e.g. "mtd" for yaffs2
+ * and raw MTD volumes, "mmcblk0" for /dev/block/mmcblk0p25.
+ *
+ * \param path The root path (e.g. /system)
+ * \param group Receives the name of the device
+ * \param len Size of the group buffer
+ *
+ * \return 0 on success, -1 if the volume is unknown
+ */
+int nandroid_device_group(const char* path, char* group, int len) {
+    Volume* v = volume_for_path(path);
+    if(v == NULL)
+        return -1;
+
+    if(v->device == NULL) {
+        snprintf(group, len, "%s", v->fs_type);
+        return 0;
+    }
+
+    if(strncmp(v->device, "/dev/", 5) != 0) {
+        // raw partitions can be named by partition rather than by device node,
+        // those all live on the internal flash
+        if(strcmp(v->fs_type, "emmc") == 0)
+            snprintf(group, len, "mmcblk0");
+        else if(strcmp(v->fs_type, "bml") == 0)
+            snprintf(group, len, "bml");
+        else
+            snprintf(group, len, "mtd");
+        return 0;
+    }
+
+    const char* name = strrchr(v->device, '/') + 1;
+    snprintf(group, len, "%s", name);
+
+    // strip the partition number: mmcblk0p25 -> mmcblk0, sda1 -> sda, bml7 -> bml
+    int n = strlen(group);
+    while(n > 0 && isdigit((unsigned char)group[n - 1]))
+        n--;
+    if(n > 1 && group[n - 1] == 'p' && isdigit((unsigned char)group[n - 2]))
+        n--;
+    group[n] = '\0';
+
+    // mtdblock devices are MTD, and stl is the FTL sitting on top of the
+    // same OneNAND that bml exposes
+    if(strcmp(group, "mtdblock") == 0)
+        snprintf(group, len, "mtd");
+    else if(strcmp(group, "stl") == 0)
+        snprintf(group, len, "bml");
+
+    return 0;
+}
+
+static void* group_thread(void* cookie) {
+    device_group* g = (device_group*)cookie;
+    long long start = now_ms();
+    int i;
+
+    for(i = 0; i < g->count; ++i) {
+        if(0 != g->fn(g->paths[i], g->cookie))
+            g->ret = -1;
+    }
+
+    LOGI("%s: %d volume(s) in %lld ms\n", g->name, g->count, now_ms() - start);
+    return NULL;
+}
+
+static int find_root(int* parent, int i) {
+    while(parent[i] != i)
+        i = parent[i] = parent[parent[i]];
+    return i;
+}
+
+// the lowest index stays the root, so groups keep the order paths came in
+static void join_groups(int* parent, int a, int b) {
+    a = find_root(parent, a);
+    b = find_root(parent, b);
+    if(a < b)
+        parent[b] = a;
+    else
+        parent[a] = b;
+}
+
+/**
+ * Run a job for each path.  Jobs that touch a common device, whether they
+ * read it or write it, run one after another in the order given; the rest
+ * run concurrently.  Every job writes to dest, so when dest is a known
+ * device (the sdcard, which may also hold /sd-ext) they all end up on one
+ * thread: parallel writers on one card only slow each other down.
+ *
+ * \param paths The root paths to run the job for
+ * \param count Number of paths
+ * \param dest Where the jobs write to, NULL if they don't share a destination
+ * \param fn The job
+ * \param cookie Passed through to the job
+ *
+ * \return 0 if every job succeeded
+ */
+int nandroid_run_by_device(char** paths, int count, const char* dest,
+                           nandroid_job_fn fn, void* cookie) {
+    if(count <= 0)
+        return 0;
+
+    device_group* groups = (device_group*)calloc(count, sizeof(device_group));
+    char** slots = (char**)calloc(count, sizeof(char*));
+    char (*names)[GROUP_NAME_SIZE] = calloc(count, GROUP_NAME_SIZE);
+    int* parent = (int*)calloc(count, sizeof(int));
+    int* group_of = (int*)calloc(count, sizeof(int));
+    if(groups == NULL || slots == NULL || names == NULL || parent == NULL || group_of == NULL) {
+        free(groups);
+        free(slots);
+        free(names);
+        free(parent);
+        free(group_of);
+        return -1;
+    }
+
+    char dest_name[GROUP_NAME_SIZE];
+    if(dest == NULL || 0 != nandroid_device_group(dest, dest_name, sizeof(dest_name)))
+        dest_name[0] = '\0';
+
+    // jobs are joined up when they read the same device, and all of them
+    // are once they write to a known dest, since they'd all be writing to
+    // it at once otherwise
+    int i, j;
+    for(i = 0; i < count; ++i) {
+        if(0 != nandroid_device_group(paths[i], names[i], GROUP_NAME_SIZE))
+            snprintf(names[i], GROUP_NAME_SIZE, "%s", paths[i]);
+        parent[i] = i;
+
+        for(j = 0; j < i; ++j) {
+            if(strcmp(names[i], names[j]) == 0 || dest_name[0] != '\0') {
+                join_groups(parent, i, j);
+                break;
+            }
+        }
+    }
+
+    // number the groups in the order their first path appears, keeping the
+    // order of the paths within a group
+    int group_count = 0;
+    for(i = 0; i < count; ++i) {
+        int root = find_root(parent, i);
+        if(root == i) {
+            device_group* g = &groups[group_count];
+            if(dest_name[0] != '\0' && strcmp(dest_name, names[i]) != 0)
+                snprintf(g->name, sizeof(g->name), "%s+%s", names[i], dest_name);
+            else
+                snprintf(g->name, sizeof(g->name), "%s", names[i]);
+            g->fn = fn;
+            g->cookie = cookie;
+            group_of[i] = group_count++;
+        } else {
+            group_of[i] = group_of[root];
+        }
+        groups[group_of[i]].count++;
+    }
+
+    // hand each group its slice of the slot array
+    int offset = 0;
+    for(j = 0; j < group_count; ++j) {
+        groups[j].paths = slots + offset;
+        offset += groups[j].count;
+        groups[j].count = 0;
+    }
+    for(i = 0; i < count; ++i) {
+        device_group* g = &groups[group_of[i]];
+        g->paths[g->count++] = paths[i];
+    }
+
+    // the first group runs on this thread, the rest get their own
+    for(j = 1; j < group_count; ++j)
+        groups[j].started = (0 == pthread_create(&groups[j].thread, NULL, group_thread, &groups[j]));
+    group_thread(&groups[0]);
+
+    int ret = groups[0].ret;
+    for(j = 1; j < group_count; ++j) {
+        if(groups[j].started)
+            pthread_join(groups[j].thread, NULL);
+        else
+            group_thread(&groups[j]);
+        ret |= groups[j].ret;
+    }
+
+    free(slots);
+    free(groups);
+    free(names);
+    free(parent);
+    free(group_of);
+    return ret;
+}
@@ -0,0 +1,20 @@
+/**
+ * \file nandroid_sched.h
+ *
+ * This file defines a scheduler that runs nandroid jobs for several volumes
+ * at once, one thread per set of physical devices the jobs read and write,
+ * so jobs on different devices overlap while each device still sees
+ * sequential I/O.
+ */
+
+#ifndef RECOVERY_NANDROID_SCHED_H_
+#define RECOVERY_NANDROID_SCHED_H_
+
+// does the work for one volume, returns 0 on success
+typedef int (*nandroid_job_fn)(char* path, void* cookie);
+
+int nandroid_device_group(const char* path, char* group, int len);
+int nandroid_run_by_device(char** paths, int count, const char* dest,
+                           nandroid_job_fn fn, void* cookie);
+
+#endif//RECOVERY_NANDROID_SCHED_H_
@@ -0,0 +1,320 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <linux/types.h>
+
+#include "common.h"
+#include "sparse_format.h"
+
+#include "nandroid/nandroid_sparse.h"
+
+// raw partitions are only guaranteed to be a whole number of sectors, so
+// that's the block size; runs are what save space, not big blocks
+#define SPARSE_BLOCK_SIZE   512
+// the raw dump is read, and the image expanded, this much at a time
+#define SPARSE_BUFFER_SIZE  (1024 * 1024)
+
+#define SPARSE_MAJOR_VERSION 1
+
+static int write_all(int fd, const void* data, size_t len) {
+    const char* p = (const char*)data;
+    while(len > 0) {
+        ssize_t n = write(fd, p, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static ssize_t read_full(int fd, void* buf, size_t len) {
+    char* p = (char*)buf;
+    size_t got = 0;
+    while(got < len) {
+        ssize_t n = read(fd, p + got, len - got);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            return -1;
+        if(n == 0)
+            break;
+        got += n;
+    }
+    return got;
+}
+
+typedef struct {
+    int out_fd;
+    uint32_t total_blocks;
+    uint32_t total_chunks;
+
+    // the FILL run being built, carried across reads
+    int fill_active;
+    uint32_t fill_value;
+    uint32_t fill_blocks;
+} sparse_encoder;
+
+static int sparse_write_chunk(sparse_encoder* e, uint16_t type, uint32_t blocks,
+        const void* data, size_t len) {
+    chunk_header_t ch;
+    ch.chunk_type = type;
+    ch.reserved1 = 0;
+    ch.chunk_sz = blocks;
+    ch.total_sz = sizeof(ch) + len;
+
+    if(0 != write_all(e->out_fd, &ch, sizeof(ch)) || 0 != write_all(e->out_fd, data, len))
+        return -1;
+
+    e->total_blocks += blocks;
+    e->total_chunks++;
+    return 0;
+}
+
+static int sparse_flush_fill(sparse_encoder* e) {
+    if(!e->fill_active)
+        return 0;
+    e->fill_active = 0;
+    return sparse_write_chunk(e, CHUNK_TYPE_FILL, e->fill_blocks, &e->fill_value, sizeof(e->fill_value));
+}
+
+/**
+ * Check whether a block is one 32-bit word repeated.
+ */
+static int block_is_uniform(const char* block, uint32_t* value) {
+    const uint32_t* words = (const uint32_t*)block;
+    uint32_t first = words[0];
+    int i;
+    for(i = 1; i < SPARSE_BLOCK_SIZE / 4; ++i)
+        if(words[i] != first)
+            return 0;
+    *value = first;
+    return 1;
+}
+
+/**
+ * Convert a raw partition dump into a sparse image.  The dump is read as a
+ * stream, so it can come straight from a pipe; the image has to be seekable
+ * since the header is filled in once the totals are known.
+ *
+ * \param in_fd The raw dump
+ * \param out_fd Where to write the sparse image
+ *
+ * \return 0 on success
+ */
+int nandroid_sparse_encode(int in_fd, int out_fd) {
+    sparse_encoder e;
+    memset(&e, 0, sizeof(e));
+    e.out_fd = out_fd;
+
+    // room for the header, which gets written at the end
+    sparse_header_t header;
+    memset(&header, 0, sizeof(header));
+    if(0 != write_all(out_fd, &header, sizeof(header)))
+        return -1;
+
+    char* buf = (char*)malloc(SPARSE_BUFFER_SIZE);
+    if(buf == NULL)
+        return -1;
+
+    int ret = 0;
+    while(ret == 0) {
+        ssize_t n = read_full(in_fd, buf, SPARSE_BUFFER_SIZE);
+        if(n < 0) {
+            LOGE("Error reading raw image (%s)\n", strerror(errno));
+            ret = -1;
+            break;
+        }
+        if(n % SPARSE_BLOCK_SIZE != 0) {
+            LOGE("Raw image is not a whole number of %d byte blocks\n", SPARSE_BLOCK_SIZE);
+            ret = -1;
+            break;
+        }
+
+        int blocks = n / SPARSE_BLOCK_SIZE;
+        int raw_start = -1;
+        int i;
+        for(i = 0; i < blocks && ret == 0; ++i) {
+            uint32_t value;
+            if(!block_is_uniform(buf + (size_t)i * SPARSE_BLOCK_SIZE, &value)) {
+                if(raw_start < 0) {
+                    ret = sparse_flush_fill(&e);
+                    raw_start = i;
+                }
+                continue;
+            }
+
+            // raw runs are written straight out of the read buffer
+            if(raw_start >= 0) {
+                ret = sparse_write_chunk(&e, CHUNK_TYPE_RAW, i - raw_start,
+                        buf + (size_t)raw_start * SPARSE_BLOCK_SIZE,
+                        (size_t)(i - raw_start) * SPARSE_BLOCK_SIZE);
+                raw_start = -1;
+            }
+
+            if(e.fill_active && e.fill_value == value) {
+                e.fill_blocks++;
+            } else if(ret == 0 && 0 == (ret = sparse_flush_fill(&e))) {
+                e.fill_active = 1;
+                e.fill_value = value;
+                e.fill_blocks = 1;
+            }
+        }
+
+        if(ret == 0 && raw_start >= 0) {
+            ret = sparse_write_chunk(&e, CHUNK_TYPE_RAW, blocks - raw_start,
+                    buf + (size_t)raw_start * SPARSE_BLOCK_SIZE,
+                    (size_t)(blocks - raw_start) * SPARSE_BLOCK_SIZE);
+        }
+
+        if(n < SPARSE_BUFFER_SIZE)
+            break;
+    }
+
+    if(ret == 0)
+        ret = sparse_flush_fill(&e);
+    free(buf);
+
+    if(ret != 0)
+        return ret;
+
+    header.magic = SPARSE_HEADER_MAGIC;
+    header.major_version = SPARSE_MAJOR_VERSION;
+    header.minor_version = 0;
+    header.file_hdr_sz = sizeof(sparse_header_t);
+    header.chunk_hdr_sz = sizeof(chunk_header_t);
+    header.blk_sz = SPARSE_BLOCK_SIZE;
+    header.total_blks = e.total_blocks;
+    header.total_chunks = e.total_chunks;
+    // the backup's MD5 covers the data, so the optional crc is left out
+    header.image_checksum = 0;
+
+    if(pwrite(out_fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+        LOGE("Error writing sparse header (%s)\n", strerror(errno));
+        return -1;
+    }
+
+    LOGI("Sparse image: %u blocks in %u chunks\n", e.total_blocks, e.total_chunks);
+    return 0;
+}
+
+/**
+ * Expand a sparse image, handing the raw data to write_fn in order.
+ *
+ * \param in_fd The sparse image, read front to back
+ * \param write_fn Receives the raw data
+ * \param cookie Passed through to write_fn
+ *
+ * \return 0 on success
+ */
+int nandroid_sparse_decode(int in_fd, nandroid_sparse_write_fn write_fn, void* cookie) {
+    sparse_header_t header;
+    if(read_full(in_fd, &header, sizeof(header)) != (ssize_t)sizeof(header) ||
+            header.magic != SPARSE_HEADER_MAGIC) {
+        LOGE("Not a sparse image\n");
+        return -1;
+    }
+    if(header.major_version != SPARSE_MAJOR_VERSION ||
+            header.file_hdr_sz < sizeof(sparse_header_t) ||
+            header.chunk_hdr_sz < sizeof(chunk_header_t) ||
+            header.blk_sz == 0 || header.blk_sz % 4 != 0) {
+        LOGE("Unsupported sparse image version %d.%d\n", header.major_version, header.minor_version);
+        return -1;
+    }
+
+    char* buf = (char*)malloc(SPARSE_BUFFER_SIZE);
+    if(buf == NULL)
+        return -1;
+
+    int ret = 0;
+    char skip[64];
+    // newer minor versions may have longer headers
+    size_t extra = header.file_hdr_sz - sizeof(sparse_header_t);
+    while(ret == 0 && extra > 0) {
+        size_t n = extra > sizeof(skip) ? sizeof(skip) : extra;
+        if(read_full(in_fd, skip, n) != (ssize_t)n)
+            ret = -1;
+        extra -= n;
+    }
+
+    uint32_t chunk;
+    for(chunk = 0; chunk < header.total_chunks && ret == 0; ++chunk) {
+        chunk_header_t ch;
+        if(read_full(in_fd, &ch, sizeof(ch)) != (ssize_t)sizeof(ch)) {
+            LOGE("Sparse image is truncated\n");
+            ret = -1;
+            break;
+        }
+        extra = header.chunk_hdr_sz - sizeof(chunk_header_t);
+        while(ret == 0 && extra > 0) {
+            size_t n = extra > sizeof(skip) ? sizeof(skip) : extra;
+            if(read_full(in_fd, skip, n) != (ssize_t)n)
+                ret = -1;
+            extra -= n;
+        }
+
+        unsigned long long len = (unsigned long long)ch.chunk_sz * header.blk_sz;
+        if(ch.chunk_type == CHUNK_TYPE_RAW) {
+            while(ret == 0 && len > 0) {
+                size_t n = len > SPARSE_BUFFER_SIZE ? SPARSE_BUFFER_SIZE : (size_t)len;
+                if(read_full(in_fd, buf, n) != (ssize_t)n) {
+                    LOGE("Sparse image is truncated\n");
+                    ret = -1;
+                } else {
+                    ret = write_fn(cookie, buf, n);
+                }
+                len -= n;
+            }
+        } else if(ch.chunk_type == CHUNK_TYPE_FILL || ch.chunk_type == CHUNK_TYPE_DONT_CARE) {
+            // don't care regions are written as zeros, the restore target
+            // can't tell us what was there before
+            uint32_t value = 0;
+            if(ch.chunk_type == CHUNK_TYPE_FILL &&
+                    read_full(in_fd, &value, sizeof(value)) != (ssize_t)sizeof(value)) {
+                LOGE("Sparse image is truncated\n");
+                ret = -1;
+                break;
+            }
+
+            size_t fill_len = len > SPARSE_BUFFER_SIZE ? SPARSE_BUFFER_SIZE : (size_t)len;
+            uint32_t* words = (uint32_t*)buf;
+            size_t i;
+            for(i = 0; i < fill_len / 4; ++i)
+                words[i] = value;
+
+            while(ret == 0 && len > 0) {
+                size_t n = len > SPARSE_BUFFER_SIZE ? SPARSE_BUFFER_SIZE : (size_t)len;
+                ret = write_fn(cookie, buf, n);
+                len -= n;
+            }
+        } else {
+            LOGE("Unknown sparse chunk type 0x%04x\n", ch.chunk_type);
+            ret = -1;
+        }
+    }
+
+    free(buf);
+    return ret;
+}
+
+/**
+ * Check whether a RAW backup is a sparse image, older backups are plain
+ * partition dumps.
+ */
+int nandroid_sparse_is_sparse(const char* file) {
+    int fd = open(file, O_RDONLY);
+    if(fd < 0)
+        return 0;
+
+    uint32_t magic = 0;
+    int ret = (read_full(fd, &magic, sizeof(magic)) == (ssize_t)sizeof(magic) &&
+            magic == SPARSE_HEADER_MAGIC);
+    close(fd);
+    return ret;
+}
@@ -0,0 +1,21 @@
+/**
+ * \file nandroid_sparse.h
+ *
+ * This file defines the sparse raw image format used for RAW backups.  It is
+ * the Android sparse image format from ext4_utils, with runs of identical
+ * words (erased 0xff NAND pages, zeroed eMMC blocks) stored as FILL chunks.
+ */
+
+#ifndef RECOVERY_NANDROID_SPARSE_H_
+#define RECOVERY_NANDROID_SPARSE_H_
+
+#include <stddef.h>
+
+// receives expanded image data; returns 0 on success, nonzero to stop
+typedef int (*nandroid_sparse_write_fn)(void* cookie, const char* data, size_t len);
+
+int nandroid_sparse_encode(int in_fd, int out_fd);
+int nandroid_sparse_decode(int in_fd, nandroid_sparse_write_fn write_fn, void* cookie);
+int nandroid_sparse_is_sparse(const char* file);
+
+#endif//RECOVERY_NANDROID_SPARSE_H_
@@ -1,14 +1,31 @@
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #include "common.h"
 #include "roots.h"
 
 #include "nandroid/nandroid.h"
+#include "nandroid/nandroid_compress.h"
+#include "nandroid/nandroid_tar_reader.h"
+#include "nandroid/nandroid_tar_writer.h"
 
 extern int __system(const char* cmd);
 
-int nandroid_backup_path_tar_ext(char* path, char* backup_path, const char* tar_cmd_format) {
+/**
+ * Back up a path to a tar archive without shelling out.  The directory is
+ * walked by the native tar writer and the stream is fed to a block-parallel
+ * compressor, so gzip and bzip2 backups use every core instead of one.
+ *
+ * \param path The path to back up
+ * \param backup_path The archive to create
+ * \param compress_type One of the NANDROID_COMPRESS_* constants
+ *
+ * \return 0 on success
+ */
+int nandroid_backup_path_tar_native(char* path, char* backup_path, int compress_type) {
     int was_mounted = is_path_mounted(path);
     int ret = 0;
 
@@ -16,13 +33,29 @@ int nandroid_backup_path_tar_ext(char* path, char* backup_path, const char* tar_
         return ret;
     }
 
-    int cmd_len = strlen(tar_cmd_format) + strlen(path) + strlen(backup_path);
-    char* cmd = (char*)calloc(cmd_len, sizeof(char));
-
-    snprintf(cmd, cmd_len, tar_cmd_format, backup_path, path);
-    ret = __system(cmd);
-
-    free(cmd);
+    int fd = open(backup_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        LOGE("Unable to open %s for writing (%s)\n", backup_path, strerror(errno));
+        ret = -1;
+    } else {
+        nandroid_compressor* c = nandroid_compressor_create(fd, compress_type, nandroid_default_thread_count());
+        if(c == NULL) {
+            LOGE("Unable to start compressor for %s\n", backup_path);
+            ret = -1;
+        } else {
+            ret = nandroid_tar_create(path, nandroid_compressor_sink, c);
+
+            // always close so the worker threads are torn down
+            if(0 != nandroid_compressor_close(c))
+                ret = -1;
+        }
+
+        if(0 != close(fd))
+            ret = -1;
+
+        if(ret != 0)
+            LOGE("Error writing %s\n", backup_path);
+    }
 
     if(!was_mounted)
         ensure_path_unmounted(path);
@@ -30,7 +63,16 @@ int nandroid_backup_path_tar_ext(char* path, char* backup_path, const char* tar_
     return ret;
 }
 
-int nandroid_restore_path_tar_ext(char* path, char* backup_path, const char* tar_cmd_format) {
+/**
+ * Restore a path from a tar archive with the native restore pipeline.
+ *
+ * \param path The path to restore
+ * \param backup_path The archive to restore from
+ * \param compress_type One of the NANDROID_COMPRESS_* constants
+ *
+ * \return 0 on success
+ */
+int nandroid_restore_path_tar_native(char* path, char* backup_path, int compress_type) {
     int was_mounted = is_path_mounted(path);
     int ret = 0;
 
@@ -38,13 +80,7 @@ int nandroid_restore_path_tar_ext(char* path, char* backup_path, const char* tar
         return ret;
     }
 
-    int cmd_len = strlen(tar_cmd_format) + strlen(path) + strlen(backup_path);
-    char* cmd = (char*)calloc(cmd_len, sizeof(char));
-
-    snprintf(cmd, cmd_len, tar_cmd_format, backup_path, path);
-    ret = __system(cmd);
-
-    free(cmd);
+    ret = nandroid_tar_extract_file(path, backup_path, compress_type);
 
     if(!was_mounted)
         ensure_path_unmounted(path);
@@ -52,14 +88,14 @@ int nandroid_restore_path_tar_ext(char* path, char* backup_path, const char* tar
     return ret;
 }
 
-int nandroid_backup_path_tar(char* path, char* backup_path)  { return nandroid_backup_path_tar_ext(path, backup_path, "tar -cf %s . -C %s");  }
-int nandroid_restore_path_tar(char* path, char* backup_path) { return nandroid_restore_path_tar_ext(path, backup_path, "tar -xf %s . -C %s"); }
+int nandroid_backup_path_tar(char* path, char* backup_path)  { return nandroid_backup_path_tar_native(path, backup_path, NANDROID_COMPRESS_NONE);  }
+int nandroid_restore_path_tar(char* path, char* backup_path) { return nandroid_restore_path_tar_native(path, backup_path, NANDROID_COMPRESS_NONE); }
 
-int nandroid_backup_path_tar_gz(char* path, char* backup_path)  { return nandroid_backup_path_tar_ext(path, backup_path, "tar -zcf %s . -C %s");  }
-int nandroid_restore_path_tar_gz(char* path, char* backup_path) { return nandroid_restore_path_tar_ext(path, backup_path, "tar -zxf %s . -C %s"); }
+int nandroid_backup_path_tar_gz(char* path, char* backup_path)  { return nandroid_backup_path_tar_native(path, backup_path, NANDROID_COMPRESS_GZIP);  }
+int nandroid_restore_path_tar_gz(char* path, char* backup_path) { return nandroid_restore_path_tar_native(path, backup_path, NANDROID_COMPRESS_GZIP); }
 
-int nandroid_backup_path_tar_bz2(char* path, char* backup_path)  { return nandroid_backup_path_tar_ext(path, backup_path, "tar -jcf %s . -C %s");  }
-int nandroid_restore_path_tar_bz2(char* path, char* backup_path) { return nandroid_restore_path_tar_ext(path, backup_path, "tar -jxf %s . -C %s"); }
+int nandroid_backup_path_tar_bz2(char* path, char* backup_path)  { return nandroid_backup_path_tar_native(path, backup_path, NANDROID_COMPRESS_BZIP2);  }
+int nandroid_restore_path_tar_bz2(char* path, char* backup_path) { return nandroid_restore_path_tar_native(path, backup_path, NANDROID_COMPRESS_BZIP2); }
 
 int nandroid_backup_path_tar_lzma(char* path, char* backup_path) {
     const char* tar_cmd_format = "tar -c . -C %s | lzma -cz - > %s";
@@ -0,0 +1,989 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+
+#include "zlib.h"
+#include "bzlib.h"
+
+#include "common.h"
+
+#include "nandroid/nandroid_compress.h"
+#include "nandroid/nandroid_queue.h"
+#include "nandroid/nandroid_tar_reader.h"
+
+#define TAR_BLOCK_SIZE     512
+// large sequential reads keep the sdcard busy
+#define READ_CHUNK_SIZE    (1024 * 1024)
+#define INFLATE_CHUNK_SIZE (256 * 1024)
+#define STAGE_QUEUE_DEPTH  4
+// files up to this size are buffered and handed to the writer pool, anything
+// bigger is streamed straight to disk by the parsing thread
+#define POOLED_FILE_MAX    (1024 * 1024)
+#define POOL_QUEUE_DEPTH   16
+
+// a buffer passed between pipeline stages, data follows the struct
+typedef struct {
+    size_t len;
+    char* data;
+} stream_chunk;
+
+// throughput accounting for one stage
+typedef struct {
+    unsigned long long bytes;
+    long long busy_us;
+} stage_stats;
+
+// a small regular file waiting on the writer pool
+typedef struct {
+    char* path;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+    size_t len;
+    char* data;
+} file_job;
+
+// directory metadata, applied once everything inside has been written
+typedef struct dir_entry {
+    char* path;
+    mode_t mode;
+    time_t mtime;
+    struct dir_entry* next;
+} dir_entry;
+
+typedef struct {
+    const char* root;
+    int compress_type;
+    nandroid_source_fn source;
+    void* cookie;
+
+    nandroid_queue* raw_q;  // reader -> decompressor
+    nandroid_queue* data_q; // decompressor -> parser
+    nandroid_queue* file_q; // parser -> writer pool
+
+    pthread_t reader;
+    pthread_t decompressor;
+    pthread_t* writers;
+    int writer_count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    int pending_files; // files queued or being written by the pool
+    int err;
+
+    stage_stats read_stats;
+    stage_stats decompress_stats;
+    stage_stats parse_stats;
+    stage_stats write_stats;
+
+    // parser's view of the decompressed stream
+    stream_chunk* chunk;
+    size_t chunk_pos;
+    long long wait_us;
+
+    dir_entry* dirs;
+} restore_pipeline;
+
+static long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static stream_chunk* chunk_alloc(size_t size) {
+    stream_chunk* chunk = (stream_chunk*)malloc(sizeof(stream_chunk) + size);
+    if(chunk == NULL)
+        return NULL;
+    chunk->len = 0;
+    chunk->data = (char*)(chunk + 1);
+    return chunk;
+}
+
+static void file_job_free(void* item) {
+    file_job* job = (file_job*)item;
+    free(job->path);
+    free(job->data);
+    free(job);
+}
+
+static void pipeline_set_error(restore_pipeline* p) {
+    pthread_mutex_lock(&p->lock);
+    p->err = -1;
+    pthread_mutex_unlock(&p->lock);
+
+    nandroid_queue_abort(p->raw_q);
+    nandroid_queue_abort(p->data_q);
+    nandroid_queue_abort(p->file_q);
+}
+
+static int pipeline_failed(restore_pipeline* p) {
+    pthread_mutex_lock(&p->lock);
+    int err = p->err;
+    pthread_mutex_unlock(&p->lock);
+    return err;
+}
+
+static int write_all(int fd, const char* data, size_t len) {
+    while(len > 0) {
+        ssize_t n = write(fd, data, len);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Stage 1: pull the archive from the source in large sequential reads.
+ */
+static void* reader_thread(void* cookie) {
+    restore_pipeline* p = (restore_pipeline*)cookie;
+
+    while(1) {
+        stream_chunk* chunk = chunk_alloc(READ_CHUNK_SIZE);
+        if(chunk == NULL) {
+            pipeline_set_error(p);
+            break;
+        }
+
+        long long start = now_us();
+        while(chunk->len < READ_CHUNK_SIZE) {
+            ssize_t n = p->source(p->cookie, chunk->data + chunk->len, READ_CHUNK_SIZE - chunk->len);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0) {
+                if(n < 0) {
+                    LOGE("Error reading archive (%s)\n", strerror(errno));
+                    pipeline_set_error(p);
+                }
+                break;
+            }
+            chunk->len += n;
+        }
+        p->read_stats.busy_us += now_us() - start;
+        p->read_stats.bytes += chunk->len;
+
+        if(chunk->len == 0 || pipeline_failed(p)) {
+            free(chunk);
+            break;
+        }
+
+        int last = chunk->len < READ_CHUNK_SIZE;
+        if(0 != nandroid_queue_push(p->raw_q, chunk)) {
+            free(chunk);
+            break;
+        }
+        if(last)
+            break;
+    }
+
+    nandroid_queue_close(p->raw_q);
+    return NULL;
+}
+
+/**
+ * Stage 2: decompress.  Concatenated gzip members and bzip2 streams (as
+ * written by the parallel compressors) are handled by restarting the
+ * decoder at the end of each one.
+ */
+static void* decompress_thread(void* cookie) {
+    restore_pipeline* p = (restore_pipeline*)cookie;
+
+    z_stream zs;
+    bz_stream bs;
+    int stream_open = 0;
+    int streams = 0;
+    int err = 0;
+    int trailing = 0;
+
+    stream_chunk* out = NULL;
+    stream_chunk* in;
+    while(!err && (in = (stream_chunk*)nandroid_queue_pop(p->raw_q)) != NULL) {
+        if(p->compress_type == NANDROID_COMPRESS_NONE || trailing) {
+            if(trailing) {
+                free(in);
+                continue;
+            }
+            p->decompress_stats.bytes += in->len;
+            if(0 != nandroid_queue_push(p->data_q, in)) {
+                free(in);
+                break;
+            }
+            continue;
+        }
+
+        long long start = now_us();
+        char* next_in = in->data;
+        size_t avail_in = in->len;
+
+        while(avail_in > 0 && !err) {
+            if(out == NULL && (out = chunk_alloc(INFLATE_CHUNK_SIZE)) == NULL) {
+                err = -1;
+                break;
+            }
+
+            if(!stream_open) {
+                int r;
+                if(p->compress_type == NANDROID_COMPRESS_GZIP) {
+                    memset(&zs, 0, sizeof(zs));
+                    r = (inflateInit2(&zs, 15 + 16) == Z_OK) ? 0 : -1;
+                } else {
+                    memset(&bs, 0, sizeof(bs));
+                    r = (BZ2_bzDecompressInit(&bs, 0, 0) == BZ_OK) ? 0 : -1;
+                }
+                if(r != 0) {
+                    err = -1;
+                    break;
+                }
+                stream_open = 1;
+            }
+
+            size_t avail_out = INFLATE_CHUNK_SIZE - out->len;
+            int stream_end = 0;
+            int stream_err = 0;
+            int produced = 0;
+
+            if(p->compress_type == NANDROID_COMPRESS_GZIP) {
+                zs.next_in = (Bytef*)next_in;
+                zs.avail_in = avail_in;
+                zs.next_out = (Bytef*)(out->data + out->len);
+                zs.avail_out = avail_out;
+                int r = inflate(&zs, Z_NO_FLUSH);
+                stream_end = (r == Z_STREAM_END);
+                stream_err = (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR);
+                produced = zs.total_out > 0;
+                next_in = (char*)zs.next_in;
+                avail_in = zs.avail_in;
+                out->len = INFLATE_CHUNK_SIZE - zs.avail_out;
+            } else {
+                bs.next_in = next_in;
+                bs.avail_in = avail_in;
+                bs.next_out = out->data + out->len;
+                bs.avail_out = avail_out;
+                int r = BZ2_bzDecompress(&bs);
+                stream_end = (r == BZ_STREAM_END);
+                stream_err = (r != BZ_OK && r != BZ_STREAM_END);
+                produced = bs.total_out_lo32 > 0 || bs.total_out_hi32 > 0;
+                next_in = bs.next_in;
+                avail_in = bs.avail_in;
+                out->len = INFLATE_CHUNK_SIZE - bs.avail_out;
+            }
+
+            if(stream_end || stream_err) {
+                if(p->compress_type == NANDROID_COMPRESS_GZIP)
+                    inflateEnd(&zs);
+                else
+                    BZ2_bzDecompressEnd(&bs);
+                stream_open = 0;
+            }
+
+            if(stream_end) {
+                streams++;
+            } else if(stream_err) {
+                if(streams > 0 && !produced) {
+                    // same as gzip: junk after a complete stream is ignored
+                    LOGW("Ignoring trailing garbage in archive\n");
+                    trailing = 1;
+                    avail_in = 0;
+                } else {
+                    LOGE("Archive is corrupt\n");
+                    err = -1;
+                }
+            }
+
+            if(out->len == INFLATE_CHUNK_SIZE) {
+                p->decompress_stats.bytes += out->len;
+                if(0 != nandroid_queue_push(p->data_q, out)) {
+                    free(out);
+                    out = NULL;
+                    err = -1;
+                    break;
+                }
+                out = NULL;
+            }
+        }
+
+        p->decompress_stats.busy_us += now_us() - start;
+        free(in);
+    }
+
+    if(stream_open) {
+        if(p->compress_type == NANDROID_COMPRESS_GZIP)
+            inflateEnd(&zs);
+        else
+            BZ2_bzDecompressEnd(&bs);
+        if(!err && !pipeline_failed(p)) {
+            LOGE("Archive is truncated\n");
+            err = -1;
+        }
+    }
+
+    if(out != NULL) {
+        if(!err && out->len > 0) {
+            p->decompress_stats.bytes += out->len;
+            if(0 == nandroid_queue_push(p->data_q, out))
+                out = NULL;
+        }
+        free(out);
+    }
+
+    if(err)
+        pipeline_set_error(p);
+    nandroid_queue_close(p->data_q);
+    return NULL;
+}
+
+/**
+ * Set ownership, mode and mtime on a freshly written file.  The mode is set
+ * after the owner since chown clears the setuid/setgid bits.
+ */
+static void apply_file_metadata(int fd, const char* path, mode_t mode, uid_t uid, gid_t gid, time_t mtime) {
+    if(0 != fchown(fd, uid, gid))
+        LOGW("Unable to chown %s (%s)\n", path, strerror(errno));
+    if(0 != fchmod(fd, mode & 07777))
+        LOGW("Unable to chmod %s (%s)\n", path, strerror(errno));
+
+    struct timeval tv[2];
+    tv[0].tv_sec = tv[1].tv_sec = mtime;
+    tv[0].tv_usec = tv[1].tv_usec = 0;
+    utimes(path, tv);
+}
+
+/**
+ * Stage 4: create small files handed off by the parser.
+ */
+static void* writer_thread(void* cookie) {
+    restore_pipeline* p = (restore_pipeline*)cookie;
+
+    file_job* job;
+    while((job = (file_job*)nandroid_queue_pop(p->file_q)) != NULL) {
+        long long start = now_us();
+        int ret = 0;
+
+        unlink(job->path);
+        int fd = open(job->path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if(fd < 0) {
+            LOGE("Unable to create %s (%s)\n", job->path, strerror(errno));
+            ret = -1;
+        } else {
+            if(0 != write_all(fd, job->data, job->len)) {
+                LOGE("Error writing %s (%s)\n", job->path, strerror(errno));
+                ret = -1;
+            }
+            apply_file_metadata(fd, job->path, job->mode, job->uid, job->gid, job->mtime);
+            if(0 != close(fd))
+                ret = -1;
+        }
+
+        pthread_mutex_lock(&p->lock);
+        p->write_stats.bytes += job->len;
+        p->write_stats.busy_us += now_us() - start;
+        p->pending_files--;
+        if(ret != 0)
+            p->err = -1;
+        pthread_cond_broadcast(&p->idle);
+        pthread_mutex_unlock(&p->lock);
+
+        file_job_free(job);
+
+        if(ret != 0)
+            pipeline_set_error(p);
+    }
+
+    return NULL;
+}
+
+/**
+ * Wait for the writer pool to finish everything queued so far.
+ */
+static void pipeline_drain_writers(restore_pipeline* p) {
+    long long start = now_us();
+    pthread_mutex_lock(&p->lock);
+    while(p->pending_files > 0 && p->err == 0)
+        pthread_cond_wait(&p->idle, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+    p->wait_us += now_us() - start;
+}
+
+/**
+ * Get a pointer to the next run of decompressed bytes without copying.
+ *
+ * \return Pointer to at least one byte, or NULL at the end of the stream
+ */
+static const char* stream_peek(restore_pipeline* p, size_t max, size_t* got) {
+    while(p->chunk == NULL || p->chunk_pos == p->chunk->len) {
+        free(p->chunk);
+        p->chunk_pos = 0;
+
+        long long start = now_us();
+        p->chunk = (stream_chunk*)nandroid_queue_pop(p->data_q);
+        p->wait_us += now_us() - start;
+
+        if(p->chunk == NULL)
+            return NULL;
+    }
+
+    size_t avail = p->chunk->len - p->chunk_pos;
+    *got = avail < max ? avail : max;
+    return p->chunk->data + p->chunk_pos;
+}
+
+static void stream_consume(restore_pipeline* p, size_t len) {
+    p->chunk_pos += len;
+    p->parse_stats.bytes += len;
+}
+
+static int stream_read(restore_pipeline* p, char* buf, size_t len) {
+    while(len > 0) {
+        size_t got;
+        const char* data = stream_peek(p, len, &got);
+        if(data == NULL)
+            return -1;
+        memcpy(buf, data, got);
+        stream_consume(p, got);
+        buf += got;
+        len -= got;
+    }
+    return 0;
+}
+
+/**
+ * Pass "len" bytes of the stream to a file descriptor (or drop them if fd
+ * is negative), without an intermediate copy.
+ */
+static int stream_copy(restore_pipeline* p, int fd, unsigned long long len) {
+    int ret = 0;
+    while(len > 0) {
+        size_t got;
+        const char* data = stream_peek(p, len > READ_CHUNK_SIZE ? READ_CHUNK_SIZE : len, &got);
+        if(data == NULL)
+            return -1;
+        if(fd >= 0 && ret == 0 && 0 != write_all(fd, data, got))
+            ret = -1;
+        stream_consume(p, got);
+        len -= got;
+    }
+    return ret;
+}
+
+static int stream_skip_padding(restore_pipeline* p, unsigned long long size) {
+    return stream_copy(p, -1, (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE);
+}
+
+/**
+ * Parse a numeric header field, octal or GNU base-256.
+ */
+static unsigned long long tar_get_number(const char* field, size_t len) {
+    unsigned long long value = 0;
+    size_t i = 0;
+
+    if((unsigned char)field[0] & 0x80) {
+        value = (unsigned char)field[0] & 0x7f;
+        for(i = 1; i < len; ++i)
+            value = (value << 8) | (unsigned char)field[i];
+        return value;
+    }
+
+    while(i < len && (field[i] == ' ' || field[i] == '\0'))
+        i++;
+    while(i < len && field[i] >= '0' && field[i] <= '7')
+        value = (value << 3) | (field[i++] - '0');
+    return value;
+}
+
+static int tar_header_valid(const unsigned char* block) {
+    unsigned long long expected = tar_get_number((const char*)block + 148, 8);
+    unsigned long sum = 0;
+    int i;
+    for(i = 0; i < TAR_BLOCK_SIZE; ++i)
+        sum += (i >= 148 && i < 156) ? ' ' : block[i];
+    return sum == expected;
+}
+
+static int tar_block_is_zero(const unsigned char* block) {
+    int i;
+    for(i = 0; i < TAR_BLOCK_SIZE; ++i)
+        if(block[i] != 0)
+            return 0;
+    return 1;
+}
+
+/**
+ * Read the data of a GNU long name / pax header entry into a new string.
+ */
+static char* tar_read_string(restore_pipeline* p, unsigned long long size) {
+    if(size > 64 * 1024)
+        return NULL;
+
+    char* str = (char*)malloc(size + 1);
+    if(str == NULL)
+        return NULL;
+
+    if(0 != stream_read(p, str, size) || 0 != stream_skip_padding(p, size)) {
+        free(str);
+        return NULL;
+    }
+    str[size] = '\0';
+    return str;
+}
+
+/**
+ * Pull path and linkpath out of a pax extended header.
+ */
+static void tar_parse_pax(char* data, char** name, char** link) {
+    char* rec = data;
+    while(*rec != '\0') {
+        char* space = strchr(rec, ' ');
+        long len = strtol(rec, NULL, 10);
+        if(space == NULL || len <= 0 || (size_t)len > strlen(rec))
+            return;
+
+        char* kv = space + 1;
+        char* end = rec + len - 1; // points at the newline
+        char* eq = strchr(kv, '=');
+        if(eq != NULL && eq < end) {
+            *end = '\0';
+            if(strncmp(kv, "path=", 5) == 0) {
+                free(*name);
+                *name = strdup(eq + 1);
+            } else if(strncmp(kv, "linkpath=", 9) == 0) {
+                free(*link);
+                *link = strdup(eq + 1);
+            }
+        }
+        rec += len;
+    }
+}
+
+/**
+ * Turn an archive name into a path under the root, refusing anything that
+ * would escape it.
+ */
+static char* tar_make_path(restore_pipeline* p, const char* name) {
+    while(name[0] == '.' && name[1] == '/')
+        name += 2;
+    while(name[0] == '/')
+        name++;
+
+    if(strcmp(name, "..") == 0 || strncmp(name, "../", 3) == 0 || strstr(name, "/../") != NULL) {
+        LOGW("Skipping unsafe path %s\n", name);
+        return NULL;
+    }
+
+    size_t len = strlen(p->root) + strlen(name) + 2;
+    char* path = (char*)malloc(len);
+    if(path == NULL)
+        return NULL;
+
+    if(name[0] == '\0' || strcmp(name, ".") == 0)
+        snprintf(path, len, "%s", p->root);
+    else
+        snprintf(path, len, "%s/%s", p->root, name);
+
+    // drop trailing slashes from directory names
+    size_t plen = strlen(path);
+    while(plen > 1 && path[plen - 1] == '/')
+        path[--plen] = '\0';
+    return path;
+}
+
+/**
+ * Create any missing parent directories of a path.
+ */
+static void ensure_parent_dirs(const char* path) {
+    char* tmp = strdup(path);
+    if(tmp == NULL)
+        return;
+
+    char* slash = tmp;
+    while((slash = strchr(slash + 1, '/')) != NULL) {
+        *slash = '\0';
+        mkdir(tmp, 0755);
+        *slash = '/';
+    }
+    free(tmp);
+}
+
+static void record_dir(restore_pipeline* p, const char* path, mode_t mode, time_t mtime) {
+    dir_entry* d = (dir_entry*)malloc(sizeof(dir_entry));
+    if(d == NULL)
+        return;
+    d->path = strdup(path);
+    d->mode = mode;
+    d->mtime = mtime;
+    d->next = p->dirs;
+    p->dirs = d;
+}
+
+/**
+ * Apply directory modes and mtimes.  The list is newest first, so children
+ * are handled before their parents and writing into them doesn't bump the
+ * parent mtime afterwards.
+ */
+static void apply_dir_metadata(restore_pipeline* p) {
+    while(p->dirs != NULL) {
+        dir_entry* d = p->dirs;
+        p->dirs = d->next;
+
+        if(d->path != NULL) {
+            chmod(d->path, d->mode & 07777);
+
+            struct timeval tv[2];
+            tv[0].tv_sec = tv[1].tv_sec = d->mtime;
+            tv[0].tv_usec = tv[1].tv_usec = 0;
+            utimes(d->path, tv);
+        }
+
+        free(d->path);
+        free(d);
+    }
+}
+
+/**
+ * Write a regular file entry, either through the writer pool or inline.
+ */
+static int extract_regular(restore_pipeline* p, char* path, mode_t mode, uid_t uid, gid_t gid,
+        time_t mtime, unsigned long long size) {
+    if(size <= POOLED_FILE_MAX) {
+        file_job* job = (file_job*)calloc(1, sizeof(file_job));
+        if(job == NULL)
+            return -1;
+
+        job->path = path;
+        job->mode = mode;
+        job->uid = uid;
+        job->gid = gid;
+        job->mtime = mtime;
+        job->len = size;
+        job->data = (char*)malloc(size > 0 ? size : 1);
+
+        if(job->data == NULL || 0 != stream_read(p, job->data, size) || 0 != stream_skip_padding(p, size)) {
+            file_job_free(job);
+            return -1;
+        }
+
+        pthread_mutex_lock(&p->lock);
+        p->pending_files++;
+        pthread_mutex_unlock(&p->lock);
+
+        long long start = now_us();
+        if(0 != nandroid_queue_push(p->file_q, job)) {
+            pthread_mutex_lock(&p->lock);
+            p->pending_files--;
+            pthread_mutex_unlock(&p->lock);
+            file_job_free(job);
+            return -1;
+        }
+        p->wait_us += now_us() - start;
+        return 0;
+    }
+
+    int ret = 0;
+    unlink(path);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if(fd < 0) {
+        LOGE("Unable to create %s (%s)\n", path, strerror(errno));
+        ret = -1;
+    }
+
+    if(0 != stream_copy(p, fd, size) || 0 != stream_skip_padding(p, size)) {
+        LOGE("Error writing %s\n", path);
+        ret = -1;
+    }
+
+    if(fd >= 0) {
+        apply_file_metadata(fd, path, mode, uid, gid, mtime);
+        if(0 != close(fd))
+            ret = -1;
+    }
+
+    free(path);
+    return ret;
+}
+
+/**
+ * Stage 3: parse the tar stream and create everything except small regular
+ * files, which go to the writer pool.
+ */
+static int extract_entries(restore_pipeline* p) {
+    unsigned char block[TAR_BLOCK_SIZE];
+    char* long_name = NULL;
+    char* long_link = NULL;
+    int ret = 0;
+
+    while(ret == 0) {
+        if(0 != stream_read(p, (char*)block, TAR_BLOCK_SIZE)) {
+            LOGE("Archive ended unexpectedly\n");
+            ret = -1;
+            break;
+        }
+
+        if(tar_block_is_zero(block))
+            break;
+
+        if(!tar_header_valid(block)) {
+            LOGE("Bad tar header checksum\n");
+            ret = -1;
+            break;
+        }
+
+        char type = block[156];
+        unsigned long long size = tar_get_number((char*)block + 124, 12);
+
+        // entries that describe the next entry
+        if(type == 'L' || type == 'K' || type == 'x' || type == 'g') {
+            char* str = tar_read_string(p, size);
+            if(str == NULL) {
+                ret = -1;
+                break;
+            }
+            if(type == 'L') {
+                free(long_name);
+                long_name = str;
+            } else if(type == 'K') {
+                free(long_link);
+                long_link = str;
+            } else {
+                if(type == 'x')
+                    tar_parse_pax(str, &long_name, &long_link);
+                free(str);
+            }
+            continue;
+        }
+
+        char name[256 + 2];
+        char link_name[101];
+        if(long_name == NULL) {
+            // ustar splits long names into prefix and name
+            if(memcmp(block + 257, "ustar\0", 6) == 0 && block[345] != '\0')
+                snprintf(name, sizeof(name), "%.155s/%.100s", (char*)block + 345, (char*)block);
+            else
+                snprintf(name, sizeof(name), "%.100s", (char*)block);
+        }
+        snprintf(link_name, sizeof(link_name), "%.100s", (char*)block + 157);
+
+        mode_t mode = tar_get_number((char*)block + 100, 8);
+        uid_t uid = tar_get_number((char*)block + 108, 8);
+        gid_t gid = tar_get_number((char*)block + 116, 8);
+        time_t mtime = tar_get_number((char*)block + 136, 12);
+        dev_t dev = makedev(tar_get_number((char*)block + 329, 8), tar_get_number((char*)block + 337, 8));
+
+        char* path = tar_make_path(p, long_name != NULL ? long_name : name);
+        const char* target = long_link != NULL ? long_link : link_name;
+
+        if(path == NULL) {
+            if(type == '0' || type == '\0' || type == '7')
+                ret = stream_copy(p, -1, size) || stream_skip_padding(p, size);
+        } else if(type == '0' || type == '\0' || type == '7') {
+            ensure_parent_dirs(path);
+            ret = extract_regular(p, path, mode, uid, gid, mtime, size);
+            path = NULL;
+        } else if(type == '5') {
+            ensure_parent_dirs(path);
+            if(0 != mkdir(path, 0700) && errno != EEXIST) {
+                LOGE("Unable to create directory %s (%s)\n", path, strerror(errno));
+                ret = -1;
+            } else {
+                chown(path, uid, gid);
+                record_dir(p, path, mode, mtime);
+            }
+        } else if(type == '2') {
+            ensure_parent_dirs(path);
+            unlink(path);
+            if(0 != symlink(target, path)) {
+                LOGE("Unable to create symlink %s (%s)\n", path, strerror(errno));
+                ret = -1;
+            } else {
+                lchown(path, uid, gid);
+            }
+        } else if(type == '1') {
+            // the target may still be sitting in the writer pool
+            char* target_path = tar_make_path(p, target);
+            pipeline_drain_writers(p);
+            ensure_parent_dirs(path);
+            unlink(path);
+            if(target_path == NULL || 0 != link(target_path, path)) {
+                LOGE("Unable to create hard link %s (%s)\n", path, strerror(errno));
+                ret = -1;
+            }
+            free(target_path);
+        } else if(type == '3' || type == '4' || type == '6') {
+            mode_t fmt = type == '3' ? S_IFCHR : (type == '4' ? S_IFBLK : S_IFIFO);
+            ensure_parent_dirs(path);
+            unlink(path);
+            if(0 != mknod(path, fmt | (mode & 07777), type == '6' ? 0 : dev)) {
+                LOGE("Unable to create node %s (%s)\n", path, strerror(errno));
+                ret = -1;
+            } else {
+                chown(path, uid, gid);
+                chmod(path, mode & 07777);
+            }
+        } else {
+            LOGW("Skipping %s, unknown entry type '%c'\n", path, type);
+            ret = stream_copy(p, -1, size) || stream_skip_padding(p, size);
+        }
+
+        free(path);
+        free(long_name);
+        free(long_link);
+        long_name = NULL;
+        long_link = NULL;
+    }
+
+    free(long_name);
+    free(long_link);
+    return ret;
+}
+
+static void log_stage(const char* stage, stage_stats* s) {
+    long long ms = s->busy_us / 1000;
+    unsigned long long rate = s->busy_us > 0 ? (s->bytes * 1000000ULL / s->busy_us) / 1024 : 0;
+    LOGI("restore %-10s %8llu KB in %6lld ms busy (%llu KB/s)\n", stage, s->bytes / 1024, ms, rate);
+}
+
+/**
+ * Extract a tar archive into a directory.  Reading, decompression and
+ * unpacking each run on their own thread, and small files are written by a
+ * pool of worker threads, so a slow sdcard, a slow decompressor and a slow
+ * filesystem overlap instead of adding up.
+ *
+ * \param root The directory to extract into
+ * \param compress_type One of the NANDROID_COMPRESS_* constants
+ * \param source Function that supplies the archive data
+ * \param cookie Passed through to the source
+ *
+ * \return 0 on success
+ */
+int nandroid_tar_extract(const char* root, int compress_type, nandroid_source_fn source, void* cookie) {
+    restore_pipeline p;
+    memset(&p, 0, sizeof(p));
+    p.root = root;
+    p.compress_type = compress_type;
+    p.source = source;
+    p.cookie = cookie;
+
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.idle, NULL);
+
+    p.writer_count = nandroid_default_thread_count();
+    if(p.writer_count < 2)
+        p.writer_count = 2;
+
+    p.raw_q = nandroid_queue_create(STAGE_QUEUE_DEPTH);
+    p.data_q = nandroid_queue_create(STAGE_QUEUE_DEPTH);
+    p.file_q = nandroid_queue_create(POOL_QUEUE_DEPTH);
+    p.writers = (pthread_t*)calloc(p.writer_count, sizeof(pthread_t));
+
+    int ret = -1;
+    int started_writers = 0;
+    int started_reader = 0;
+    int started_decompressor = 0;
+    long long start;
+    long long wall_us = 0;
+
+    if(p.raw_q == NULL || p.data_q == NULL || p.file_q == NULL || p.writers == NULL)
+        goto done;
+
+    for(started_writers = 0; started_writers < p.writer_count; ++started_writers)
+        if(0 != pthread_create(&p.writers[started_writers], NULL, writer_thread, &p))
+            break;
+    if(started_writers == 0)
+        goto done;
+
+    if(0 != pthread_create(&p.reader, NULL, reader_thread, &p))
+        goto done;
+    started_reader = 1;
+
+    if(0 != pthread_create(&p.decompressor, NULL, decompress_thread, &p))
+        goto done;
+    started_decompressor = 1;
+
+    start = now_us();
+    ret = extract_entries(&p);
+    pipeline_drain_writers(&p);
+    wall_us = now_us() - start;
+    p.parse_stats.busy_us = wall_us - p.wait_us;
+
+    if(ret == 0)
+        ret = pipeline_failed(&p);
+
+    apply_dir_metadata(&p);
+
+done:
+    // stop everything that's still running, the archive may have trailing
+    // data after the end marker that nobody is going to read
+    if(p.raw_q != NULL)
+        nandroid_queue_abort(p.raw_q);
+    if(p.data_q != NULL)
+        nandroid_queue_abort(p.data_q);
+    if(p.file_q != NULL)
+        nandroid_queue_close(p.file_q);
+
+    if(started_decompressor)
+        pthread_join(p.decompressor, NULL);
+    if(started_reader)
+        pthread_join(p.reader, NULL);
+
+    int i;
+    for(i = 0; i < started_writers; ++i)
+        pthread_join(p.writers[i], NULL);
+
+    if(wall_us > 0) {
+        LOGI("restore pipeline finished in %lld ms with %d writers\n", wall_us / 1000, started_writers);
+        log_stage("read", &p.read_stats);
+        log_stage("decompress", &p.decompress_stats);
+        log_stage("unpack", &p.parse_stats);
+        log_stage("write", &p.write_stats);
+    }
+
+    free(p.chunk);
+    nandroid_queue_destroy(p.raw_q, free);
+    nandroid_queue_destroy(p.data_q, free);
+    nandroid_queue_destroy(p.file_q, file_job_free);
+    free(p.writers);
+    pthread_cond_destroy(&p.idle);
+    pthread_mutex_destroy(&p.lock);
+
+    return ret;
+}
+
+static ssize_t fd_source(void* cookie, char* buf, size_t len) {
+    return read(*(int*)cookie, buf, len);
+}
+
+/**
+ * Extract a tar archive file into a directory.
+ *
+ * \param root The directory to extract into
+ * \param archive Path of the archive
+ * \param compress_type One of the NANDROID_COMPRESS_* constants
+ *
+ * \return 0 on success
+ */
+int nandroid_tar_extract_file(const char* root, const char* archive, int compress_type) {
+    int fd = open(archive, O_RDONLY);
+    if(fd < 0) {
+        LOGE("Unable to open %s (%s)\n", archive, strerror(errno));
+        return -1;
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    int ret = nandroid_tar_extract(root, compress_type, fd_source, &fd);
+    close(fd);
+    return ret;
+}
@@ -0,0 +1,21 @@
+/**
+ * \file nandroid_tar_reader.h
+ *
+ * This file defines the native tar restore pipeline.  The archive is read,
+ * decompressed and unpacked on separate threads, with regular files written
+ * out by a pool of worker threads.
+ */
+
+#ifndef RECOVERY_NANDROID_TAR_READER_H_
+#define RECOVERY_NANDROID_TAR_READER_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// supplies archive data; returns bytes read, 0 at the end, or -1 on error
+typedef ssize_t (*nandroid_source_fn)(void* cookie, char* buf, size_t len);
+
+int nandroid_tar_extract(const char* root, int compress_type, nandroid_source_fn source, void* cookie);
+int nandroid_tar_extract_file(const char* root, const char* archive, int compress_type);
+
+#endif//RECOVERY_NANDROID_TAR_READER_H_
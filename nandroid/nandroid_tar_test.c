@@ -0,0 +1,263 @@
+/*
+ * Round trip test for the native tar engines: builds a small tree with hard
+ * links in it, backs it up with each of tar, tar.gz and tar.bz2, restores it
+ * and checks that the links came back as links, with the same link count
+ * and contents as the original.
+ *
+ * Small files are restored by a pool of writer threads, so a hard link
+ * usually arrives while its target is still queued; a directory full of
+ * small linked pairs keeps the pool busy when that happens.  One target is
+ * too big for the pool and is written directly instead.
+ *
+ * Usage: nandroid_tar_test <work dir>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "nandroid/nandroid_compress.h"
+#include "nandroid/nandroid_tar_reader.h"
+#include "nandroid/nandroid_tar_writer.h"
+
+void ui_print(const char* fmt, ...) {
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, 256, fmt, ap);
+    va_end(ap);
+
+    fputs(buf, stderr);
+}
+
+typedef struct {
+    const char* name;
+    const char* ext;
+    int compress_type;
+} engine;
+
+static const engine engines[] = {
+    { "tar",     "tar",     NANDROID_COMPRESS_NONE },
+    { "tar.gz",  "tar.gz",  NANDROID_COMPRESS_GZIP },
+    { "tar.bz2", "tar.bz2", NANDROID_COMPRESS_BZIP2 },
+};
+
+// A file and the names linked to it, relative to the tree
+typedef struct {
+    const char* name;
+    size_t size;
+    const char* links[3];
+} link_set;
+
+#define LONG_DIR "a-directory-with-a-name-long-enough-that-paths-in-it-need-gnu-longlink-entries/"
+
+static const link_set link_sets[] = {
+    { "d1/hard", 774480, { "d1/r2", NULL } },
+    { "d2/small", 100, { "d2/also", "d3/again", NULL } },
+    { LONG_DIR "first", 5000, { LONG_DIR "and-a-second-name-that-is-also-long-enough", NULL } },
+    { "d1/big", 3 * 1024 * 1024 + 17, { "d3/big", NULL } },
+};
+#define NUM_LINK_SETS (sizeof(link_sets) / sizeof(link_sets[0]))
+
+static const char* dirs[] = { "d1", "d2", "d3", "pool", LONG_DIR };
+
+// pool/fN is linked to pool/lN
+#define POOL_PAIRS 64
+
+static int join(char* out, const char* root, const char* rel) {
+    int n = snprintf(out, PATH_MAX, "%s/%s", root, rel);
+    return n < 0 || n >= PATH_MAX ? -1 : 0;
+}
+
+// The same bytes for the same file and offset every time
+static char fill_byte(const link_set* l, size_t offset) {
+    return (char)((offset * 31 + l->size) >> 3);
+}
+
+static int write_file(const char* path, const link_set* l) {
+    FILE* f = fopen(path, "wb");
+    if (f == NULL)
+        return -1;
+    size_t n;
+    for (n = 0; n < l->size; ++n)
+        fputc(fill_byte(l, n), f);
+    return fclose(f);
+}
+
+static int make_tree(const char* root) {
+    char path[PATH_MAX], link_path[PATH_MAX];
+    unsigned int i, j;
+
+    if (mkdir(root, 0755) != 0)
+        return -1;
+    for (i = 0; i < sizeof(dirs) / sizeof(dirs[0]); ++i) {
+        if (join(path, root, dirs[i]) != 0 || mkdir(path, 0755) != 0)
+            return -1;
+    }
+
+    for (i = 0; i < NUM_LINK_SETS; ++i) {
+        const link_set* l = &link_sets[i];
+        if (join(path, root, l->name) != 0 || write_file(path, l) != 0)
+            return -1;
+
+        for (j = 0; l->links[j] != NULL; ++j) {
+            if (join(link_path, root, l->links[j]) != 0 || link(path, link_path) != 0)
+                return -1;
+        }
+    }
+
+    for (i = 0; i < POOL_PAIRS; ++i) {
+        link_set l = { NULL, 1000 + i, { NULL } };
+        char name[32];
+        snprintf(name, sizeof(name), "pool/f%u", i);
+        if (join(path, root, name) != 0 || write_file(path, &l) != 0)
+            return -1;
+        snprintf(name, sizeof(name), "pool/l%u", i);
+        if (join(link_path, root, name) != 0 || link(path, link_path) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int check_contents(const link_set* l, const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL)
+        return -1;
+    size_t n;
+    int c, ret = 0;
+    for (n = 0; (c = fgetc(f)) != EOF; ++n) {
+        if (n >= l->size || (char)c != fill_byte(l, n)) {
+            ret = -1;
+            break;
+        }
+    }
+    fclose(f);
+    return ret == 0 && n == l->size ? 0 : -1;
+}
+
+// Every name in each set should be the same inode, with every link counted
+static int check_tree(const char* engine_name, const char* root) {
+    char path[PATH_MAX];
+    unsigned int i, j;
+    int failed = 0;
+
+    for (i = 0; i < NUM_LINK_SETS; ++i) {
+        const link_set* l = &link_sets[i];
+        struct stat first;
+        nlink_t expect = 1;
+        for (j = 0; l->links[j] != NULL; ++j)
+            ++expect;
+
+        if (join(path, root, l->name) != 0 || stat(path, &first) != 0 ||
+            check_contents(l, path) != 0) {
+            printf("%-8s %s missing or wrong\n", engine_name, l->name);
+            failed = 1;
+            continue;
+        }
+        if (first.st_nlink != expect) {
+            printf("%-8s %s has %d links, expected %d\n", engine_name, l->name,
+                   (int)first.st_nlink, (int)expect);
+            failed = 1;
+        }
+
+        for (j = 0; l->links[j] != NULL; ++j) {
+            struct stat st;
+            if (join(path, root, l->links[j]) != 0 || stat(path, &st) != 0 ||
+                st.st_ino != first.st_ino ||
+                st.st_dev != first.st_dev) {
+                printf("%-8s %s is not a link to %s\n", engine_name,
+                       l->links[j], l->name);
+                failed = 1;
+            }
+        }
+    }
+
+    for (i = 0; i < POOL_PAIRS; ++i) {
+        link_set l = { NULL, 1000 + i, { NULL } };
+        struct stat f, st;
+        char name[32];
+        snprintf(name, sizeof(name), "pool/f%u", i);
+        if (join(path, root, name) != 0 || stat(path, &f) != 0 || f.st_nlink != 2 ||
+            check_contents(&l, path) != 0) {
+            printf("%-8s pool/f%u missing, wrong or not linked\n", engine_name, i);
+            failed = 1;
+            continue;
+        }
+        snprintf(name, sizeof(name), "pool/l%u", i);
+        if (join(path, root, name) != 0 || stat(path, &st) != 0 || st.st_ino != f.st_ino) {
+            printf("%-8s pool/l%u is not a link to pool/f%u\n", engine_name, i, i);
+            failed = 1;
+        }
+    }
+    return failed;
+}
+
+static int backup(const engine* e, const char* src, const char* file) {
+    int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+
+    nandroid_compressor* c = nandroid_compressor_create(fd, e->compress_type,
+                                                        nandroid_default_thread_count());
+    if (c == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    int ret = nandroid_tar_create(src, nandroid_compressor_sink, c);
+    ret |= nandroid_compressor_close(c);
+    ret |= close(fd);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <work dir>\n", argv[0]);
+        return 2;
+    }
+
+    const char* work = argv[1];
+    char src[PATH_MAX];
+    char file[PATH_MAX];
+    char dst[PATH_MAX];
+    int failed = 0;
+    unsigned int i;
+
+    if (join(src, work, "links") != 0 || make_tree(src) != 0) {
+        fprintf(stderr, "Unable to create test tree in %s\n", src);
+        return 1;
+    }
+    if (check_tree("source", src) != 0)
+        return 1;
+
+    for (i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i) {
+        const engine* e = &engines[i];
+        snprintf(file, sizeof(file), "%s/links.%s", work, e->ext);
+        snprintf(dst, sizeof(dst), "%s/restore-%s", work, e->name);
+
+        if (backup(e, src, file) != 0) {
+            printf("%-8s backup failed\n", e->name);
+            failed = 1;
+            continue;
+        }
+        if (mkdir(dst, 0755) != 0 ||
+            nandroid_tar_extract_file(dst, file, e->compress_type) != 0) {
+            printf("%-8s restore failed\n", e->name);
+            failed = 1;
+            continue;
+        }
+        if (check_tree(e->name, dst) != 0) {
+            failed = 1;
+            continue;
+        }
+        printf("%-8s ok\n", e->name);
+    }
+
+    printf("%s\n", failed ? "FAIL" : "PASS");
+    return failed;
+}
@@ -0,0 +1,405 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+
+#include "common.h"
+
+#include "nandroid/nandroid_tar_writer.h"
+
+#define TAR_BLOCK_SIZE   512
+#define TAR_NAME_SIZE    100
+#define TAR_LONGLINK     "././@LongLink"
+// size of the staging buffer handed to the sink
+#define TAR_BUFFER_SIZE  (64 * 1024)
+// buckets in the table of files with more than one link
+#define TAR_LINK_BUCKETS 256
+
+// ustar header, with the GNU magic so long names go in ././@LongLink entries
+typedef struct {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+} tar_header;
+
+// A file with more than one link, and the name it was first archived under
+typedef struct tar_hardlink {
+    dev_t dev;
+    ino_t ino;
+    char* name;
+    struct tar_hardlink* next;
+} tar_hardlink;
+
+typedef struct {
+    nandroid_sink_fn sink;
+    void* cookie;
+    char* buf;
+    size_t buf_len;
+    int err;
+    tar_hardlink* links[TAR_LINK_BUCKETS];
+} tar_writer;
+
+static int tar_flush(tar_writer* w) {
+    if(w->err == 0 && w->buf_len > 0 && 0 != w->sink(w->cookie, w->buf, w->buf_len))
+        w->err = -1;
+    w->buf_len = 0;
+    return w->err;
+}
+
+static int tar_out(tar_writer* w, const char* data, size_t len) {
+    while(len > 0 && w->err == 0) {
+        size_t copy = TAR_BUFFER_SIZE - w->buf_len;
+        if(copy > len)
+            copy = len;
+        memcpy(w->buf + w->buf_len, data, copy);
+        w->buf_len += copy;
+        data += copy;
+        len -= copy;
+
+        if(w->buf_len == TAR_BUFFER_SIZE)
+            tar_flush(w);
+    }
+    return w->err;
+}
+
+static int tar_out_zeros(tar_writer* w, size_t len) {
+    static const char zeros[TAR_BLOCK_SIZE];
+    while(len > 0 && w->err == 0) {
+        size_t n = len > sizeof(zeros) ? sizeof(zeros) : len;
+        tar_out(w, zeros, n);
+        len -= n;
+    }
+    return w->err;
+}
+
+/**
+ * Write a numeric header field as octal, falling back to GNU base-256 for
+ * values that won't fit (files over 8GB).
+ */
+static void tar_set_number(char* field, size_t len, unsigned long long value) {
+    unsigned long long max = 1ULL << (3 * (len - 1));
+    if(value < max) {
+        snprintf(field, len, "%0*llo", (int)(len - 1), value);
+        return;
+    }
+
+    size_t i;
+    for(i = len - 1; i > 0; --i) {
+        field[i] = value & 0xff;
+        value >>= 8;
+    }
+    field[0] = (char)0x80;
+}
+
+static int tar_write_header(tar_writer* w, tar_header* h) {
+    memcpy(h->magic, "ustar ", sizeof(h->magic));
+    memcpy(h->version, " ", sizeof(h->version));
+
+    // the checksum is computed with the checksum field set to spaces; at
+    // most 512 * 255, it always fits in six octal digits
+    memset(h->chksum, ' ', sizeof(h->chksum));
+    unsigned int sum = 0;
+    const unsigned char* p = (const unsigned char*)h;
+    size_t i;
+    for(i = 0; i < sizeof(tar_header); ++i)
+        sum += p[i];
+    for(i = 6; i-- > 0; sum >>= 3)
+        h->chksum[i] = '0' + (sum & 7);
+    h->chksum[6] = '\0';
+
+    return tar_out(w, (const char*)h, sizeof(tar_header));
+}
+
+/**
+ * Emit a GNU ././@LongLink entry for a name or link target that doesn't fit
+ * in the 100 bytes the header gives us.
+ */
+static int tar_write_longlink(tar_writer* w, char type, const char* name) {
+    size_t len = strlen(name) + 1;
+    tar_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.name, TAR_LONGLINK, sizeof(TAR_LONGLINK) - 1);
+    tar_set_number(h.mode, sizeof(h.mode), 0);
+    tar_set_number(h.uid, sizeof(h.uid), 0);
+    tar_set_number(h.gid, sizeof(h.gid), 0);
+    tar_set_number(h.size, sizeof(h.size), len);
+    tar_set_number(h.mtime, sizeof(h.mtime), 0);
+    h.typeflag = type;
+
+    if(0 != tar_write_header(w, &h) || 0 != tar_out(w, name, len))
+        return w->err;
+    return tar_out_zeros(w, (TAR_BLOCK_SIZE - len % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE);
+}
+
+/**
+ * Stream the contents of a regular file, padded out to a whole block.  If
+ * the file changes size while we read it, we stick to the size recorded in
+ * the header so the archive stays readable.
+ */
+static int tar_write_file_data(tar_writer* w, const char* path, unsigned long long size) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        LOGW("Unable to open %s for backup (%s)\n", path, strerror(errno));
+    }
+
+    unsigned long long left = size;
+    while(left > 0 && w->err == 0) {
+        if(w->buf_len == TAR_BUFFER_SIZE)
+            tar_flush(w);
+
+        // read straight into the staging buffer
+        size_t want = TAR_BUFFER_SIZE - w->buf_len;
+        if(want > left)
+            want = left;
+
+        ssize_t n = fd < 0 ? 0 : read(fd, w->buf + w->buf_len, want);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0) {
+            LOGW("%s shrank during backup, padding with zeros\n", path);
+            if(fd >= 0) {
+                close(fd);
+                fd = -1;
+            }
+            tar_out_zeros(w, left);
+            left = 0;
+            break;
+        }
+        w->buf_len += n;
+        left -= n;
+    }
+
+    if(fd >= 0)
+        close(fd);
+
+    return tar_out_zeros(w, (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE);
+}
+
+/**
+ * Look up a file with more than one link.  The first time we see it, it's
+ * remembered under its archive name and NULL is returned, so it gets
+ * archived in full; after that the first name is returned, for a hard link
+ * entry pointing back at it.
+ */
+static const char* tar_find_hardlink(tar_writer* w, const struct stat* st, const char* name) {
+    tar_hardlink** bucket = &w->links[(st->st_ino ^ st->st_dev) % TAR_LINK_BUCKETS];
+    tar_hardlink* l;
+    for(l = *bucket; l != NULL; l = l->next) {
+        if(l->ino == st->st_ino && l->dev == st->st_dev)
+            return l->name;
+    }
+
+    l = (tar_hardlink*)malloc(sizeof(tar_hardlink));
+    if(l == NULL || (l->name = strdup(name)) == NULL) {
+        // worst case, the next link is stored as a copy
+        free(l);
+        return NULL;
+    }
+    l->dev = st->st_dev;
+    l->ino = st->st_ino;
+    l->next = *bucket;
+    *bucket = l;
+    return NULL;
+}
+
+static void tar_free_hardlinks(tar_writer* w) {
+    int i;
+    for(i = 0; i < TAR_LINK_BUCKETS; ++i) {
+        while(w->links[i] != NULL) {
+            tar_hardlink* l = w->links[i];
+            w->links[i] = l->next;
+            free(l->name);
+            free(l);
+        }
+    }
+}
+
+/**
+ * Archive one filesystem object, and recurse into it if it's a directory.
+ *
+ * \param path Absolute path of the object, in a PATH_MAX buffer we may append to
+ * \param name Archive name (e.g. "./app/foo.apk"), in a PATH_MAX buffer we may append to
+ */
+static int tar_add_path(tar_writer* w, char* path, char* name) {
+    struct stat st;
+    if(0 != lstat(path, &st)) {
+        LOGW("Unable to stat %s for backup (%s)\n", path, strerror(errno));
+        return 0;
+    }
+
+    tar_header h;
+    memset(&h, 0, sizeof(h));
+
+    char link_target[PATH_MAX];
+    const char* link = NULL;
+    unsigned long long size = 0;
+    size_t name_len = strlen(name);
+
+    if(S_ISDIR(st.st_mode)) {
+        h.typeflag = '5';
+        if(name[name_len - 1] != '/') {
+            name[name_len++] = '/';
+            name[name_len] = '\0';
+        }
+    } else if(S_ISREG(st.st_mode)) {
+        if(st.st_nlink > 1 && (link = tar_find_hardlink(w, &st, name)) != NULL) {
+            h.typeflag = '1';
+        } else {
+            h.typeflag = '0';
+            size = st.st_size;
+        }
+    } else if(S_ISLNK(st.st_mode)) {
+        ssize_t n = readlink(path, link_target, sizeof(link_target) - 1);
+        if(n < 0) {
+            LOGW("Unable to read link %s (%s)\n", path, strerror(errno));
+            return 0;
+        }
+        link_target[n] = '\0';
+        link = link_target;
+        h.typeflag = '2';
+    } else if(S_ISCHR(st.st_mode)) {
+        h.typeflag = '3';
+    } else if(S_ISBLK(st.st_mode)) {
+        h.typeflag = '4';
+    } else if(S_ISFIFO(st.st_mode)) {
+        h.typeflag = '6';
+    } else {
+        // sockets don't survive an archive anyway, same as tar
+        return 0;
+    }
+
+    // the header fields were zeroed above, so anything that fits is
+    // already NUL padded
+    if(name_len > TAR_NAME_SIZE && 0 != tar_write_longlink(w, 'L', name))
+        return w->err;
+    memcpy(h.name, name, name_len < TAR_NAME_SIZE ? name_len : TAR_NAME_SIZE);
+
+    if(link != NULL) {
+        size_t link_len = strlen(link);
+        if(link_len > TAR_NAME_SIZE && 0 != tar_write_longlink(w, 'K', link))
+            return w->err;
+        memcpy(h.linkname, link, link_len < TAR_NAME_SIZE ? link_len : TAR_NAME_SIZE);
+    }
+
+    tar_set_number(h.mode, sizeof(h.mode), st.st_mode & 07777);
+    tar_set_number(h.uid, sizeof(h.uid), st.st_uid);
+    tar_set_number(h.gid, sizeof(h.gid), st.st_gid);
+    tar_set_number(h.size, sizeof(h.size), size);
+    tar_set_number(h.mtime, sizeof(h.mtime), st.st_mtime);
+    if(h.typeflag == '3' || h.typeflag == '4') {
+        tar_set_number(h.devmajor, sizeof(h.devmajor), major(st.st_rdev));
+        tar_set_number(h.devminor, sizeof(h.devminor), minor(st.st_rdev));
+    }
+
+    if(0 != tar_write_header(w, &h))
+        return w->err;
+
+    if(h.typeflag == '0')
+        return tar_write_file_data(w, path, size);
+
+    if(h.typeflag != '5')
+        return w->err;
+
+    DIR* dir = opendir(path);
+    if(dir == NULL) {
+        LOGW("Unable to open directory %s for backup (%s)\n", path, strerror(errno));
+        return w->err;
+    }
+
+    size_t path_len = strlen(path);
+    struct dirent* de;
+    while(w->err == 0 && (de = readdir(dir)) != NULL) {
+        if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+
+        size_t de_len = strlen(de->d_name);
+        if(path_len + de_len + 2 > PATH_MAX || name_len + de_len + 2 > PATH_MAX) {
+            LOGW("Skipping %s/%s, path is too long\n", path, de->d_name);
+            continue;
+        }
+
+        path[path_len] = '/';
+        memcpy(path + path_len + 1, de->d_name, de_len + 1);
+        memcpy(name + name_len, de->d_name, de_len + 1);
+
+        tar_add_path(w, path, name);
+
+        path[path_len] = '\0';
+        name[name_len] = '\0';
+    }
+    closedir(dir);
+
+    return w->err;
+}
+
+/**
+ * Create a tar archive of a directory.  Entries are named relative to the
+ * root ("./", "./app", ...) like "tar -c ." would produce, so the archive can
+ * be extracted with a plain "tar -x -C root".  A file with several links is
+ * stored once; its other names become hard link entries pointing at the first.
+ *
+ * \param root The directory to archive
+ * \param sink Function that receives the archive data
+ * \param cookie Passed through to the sink
+ *
+ * \return 0 on success, nonzero if the sink failed
+ */
+int nandroid_tar_create(const char* root, nandroid_sink_fn sink, void* cookie) {
+    tar_writer w;
+    memset(&w, 0, sizeof(w));
+    w.sink = sink;
+    w.cookie = cookie;
+    w.buf_len = 0;
+    w.err = 0;
+    w.buf = (char*)malloc(TAR_BUFFER_SIZE);
+
+    char* path = (char*)calloc(PATH_MAX, sizeof(char));
+    char* name = (char*)calloc(PATH_MAX, sizeof(char));
+
+    if(w.buf == NULL || path == NULL || name == NULL) {
+        free(w.buf);
+        free(path);
+        free(name);
+        return -1;
+    }
+
+    strncpy(path, root, PATH_MAX - 1);
+    // strip trailing slashes so child paths come out clean
+    size_t len = strlen(path);
+    while(len > 1 && path[len - 1] == '/')
+        path[--len] = '\0';
+    strcpy(name, ".");
+
+    tar_add_path(&w, path, name);
+
+    // two zero blocks mark the end of the archive
+    tar_out_zeros(&w, 2 * TAR_BLOCK_SIZE);
+    tar_flush(&w);
+
+    tar_free_hardlinks(&w);
+    free(w.buf);
+    free(path);
+    free(name);
+    return w.err;
+}
@@ -0,0 +1,18 @@
+/**
+ * \file nandroid_tar_writer.h
+ *
+ * This file defines a native tar writer that walks a directory and streams
+ * a tar archive of it to a sink function.
+ */
+
+#ifndef RECOVERY_NANDROID_TAR_WRITER_H_
+#define RECOVERY_NANDROID_TAR_WRITER_H_
+
+#include <stddef.h>
+
+// receives archive data; returns 0 on success, nonzero to abort the archive
+typedef int (*nandroid_sink_fn)(void* cookie, const char* data, size_t len);
+
+int nandroid_tar_create(const char* root, nandroid_sink_fn sink, void* cookie);
+
+#endif//RECOVERY_NANDROID_TAR_WRITER_H_
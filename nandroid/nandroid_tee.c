@@ -0,0 +1,269 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "common.h"
+
+#include "nandroid/nandroid_tee.h"
+
+#define TEE_FIFO_DIR     "/tmp"
+#define TEE_BUFFER_SIZE  (256 * 1024)
+// ask for a bigger pipe so the backend isn't woken up every 64k
+#define TEE_PIPE_SIZE    (1024 * 1024)
+
+struct nandroid_tee {
+    char fifo[PATH_MAX];
+    const char* file;
+
+    // when backing up data flows fifo -> file, when restoring file -> fifo
+    int in_fd;
+    int out_fd;
+    // our own handle on the other end of the fifo, kept open until the
+    // backend is done so neither side ever blocks in open()
+    int hold_fd;
+
+    pthread_t thread;
+    char* buf;
+    nandroid_md5_ctx md5;
+    volatile int stop;
+    int sink_gone;
+    int err;
+};
+
+static int write_all(int fd, const char* data, size_t len) {
+    while(len > 0) {
+        ssize_t n = write(fd, data, len);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void* tee_thread(void* cookie) {
+    nandroid_tee* tee = (nandroid_tee*)cookie;
+
+    // a restore backend may stop reading before the end of the file (tar
+    // padding, for one), writes then fail with EPIPE instead of killing us
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    while(!tee->stop) {
+        ssize_t n = read(tee->in_fd, tee->buf, TEE_BUFFER_SIZE);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0) {
+            LOGE("Error reading %s (%s)\n", tee->file, strerror(errno));
+            tee->err = -1;
+            break;
+        }
+        if(n == 0)
+            break;
+
+        // after a write error we keep draining the input, otherwise a backup
+        // backend would block forever on a full pipe, and a restore still
+        // needs the digest of the whole file
+        if(tee->err == 0) {
+            nandroid_md5_update(&tee->md5, tee->buf, n);
+            if(!tee->sink_gone && 0 != write_all(tee->out_fd, tee->buf, n)) {
+                if(errno == EPIPE) {
+                    tee->sink_gone = 1;
+                } else {
+                    LOGE("Error writing %s (%s)\n", tee->file, strerror(errno));
+                    tee->err = -1;
+                }
+            }
+        }
+    }
+
+    // closing the output here is what lets a restore backend see EOF
+    if(0 != close(tee->out_fd))
+        tee->err = -1;
+    tee->out_fd = -1;
+
+    return NULL;
+}
+
+static nandroid_tee* tee_alloc(const char* file) {
+    static int counter = 0;
+
+    nandroid_tee* tee = (nandroid_tee*)calloc(1, sizeof(nandroid_tee));
+    if(tee == NULL)
+        return NULL;
+
+    tee->file = file;
+    tee->in_fd = tee->hold_fd = tee->out_fd = -1;
+    nandroid_md5_init(&tee->md5);
+
+    tee->buf = (char*)malloc(TEE_BUFFER_SIZE);
+    if(tee->buf == NULL) {
+        free(tee);
+        return NULL;
+    }
+
+    snprintf(tee->fifo, sizeof(tee->fifo), "%s/nandroid-%d-%d.fifo", TEE_FIFO_DIR,
+            getpid(), __sync_fetch_and_add(&counter, 1));
+    unlink(tee->fifo);
+    if(0 != mkfifo(tee->fifo, 0600)) {
+        LOGW("Unable to create %s (%s)\n", tee->fifo, strerror(errno));
+        free(tee->buf);
+        free(tee);
+        return NULL;
+    }
+
+    return tee;
+}
+
+static void tee_free(nandroid_tee* tee) {
+    if(tee->out_fd >= 0)
+        close(tee->out_fd);
+    if(tee->hold_fd >= 0)
+        close(tee->hold_fd);
+    if(tee->in_fd >= 0)
+        close(tee->in_fd);
+    unlink(tee->fifo);
+    free(tee->buf);
+    free(tee);
+}
+
+/**
+ * Start a tee writing to a backup file.  The backend should write to the
+ * path returned by nandroid_tee_path, and nandroid_tee_finish must be called
+ * once it returns (whether it succeeded or not).
+ *
+ * \param file The backup file to create
+ *
+ * \return The tee, or NULL if it couldn't be set up
+ */
+nandroid_tee* nandroid_tee_create(const char* file) {
+    nandroid_tee* tee = tee_alloc(file);
+    if(tee == NULL)
+        return NULL;
+
+    // open our own read and write ends first: opening can't block that way,
+    // and the reader only sees EOF once both the backend and we are done,
+    // even if the backend never gets as far as opening the fifo
+    tee->in_fd = open(tee->fifo, O_RDONLY | O_NONBLOCK);
+    if(tee->in_fd >= 0)
+        tee->hold_fd = open(tee->fifo, O_WRONLY);
+    if(tee->in_fd < 0 || tee->hold_fd < 0) {
+        LOGW("Unable to open %s (%s)\n", tee->fifo, strerror(errno));
+        goto fail;
+    }
+    fcntl(tee->in_fd, F_SETFL, fcntl(tee->in_fd, F_GETFL) & ~O_NONBLOCK);
+#ifdef F_SETPIPE_SZ
+    fcntl(tee->in_fd, F_SETPIPE_SZ, TEE_PIPE_SIZE);
+#endif
+
+    tee->out_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(tee->out_fd < 0) {
+        LOGE("Unable to open %s for writing (%s)\n", file, strerror(errno));
+        goto fail;
+    }
+
+    if(0 != pthread_create(&tee->thread, NULL, tee_thread, tee))
+        goto fail;
+
+    return tee;
+
+fail:
+    tee_free(tee);
+    return NULL;
+}
+
+/**
+ * Start a tee reading from a backup file, the restore counterpart of
+ * nandroid_tee_create.  The backend reads the path returned by
+ * nandroid_tee_path, and the digest returned by nandroid_tee_finish covers
+ * the whole file even if the backend stopped reading early.
+ *
+ * \param file The backup file to read
+ *
+ * \return The tee, or NULL if it couldn't be set up
+ */
+nandroid_tee* nandroid_tee_create_reader(const char* file) {
+    nandroid_tee* tee = tee_alloc(file);
+    if(tee == NULL)
+        return NULL;
+
+    tee->in_fd = open(file, O_RDONLY);
+    if(tee->in_fd < 0) {
+        LOGE("Unable to open %s (%s)\n", file, strerror(errno));
+        goto fail;
+    }
+    posix_fadvise(tee->in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // same trick as above with the ends swapped: once we close our read end,
+    // writes fail with EPIPE if the backend has gone (or never came)
+    tee->hold_fd = open(tee->fifo, O_RDONLY | O_NONBLOCK);
+    if(tee->hold_fd >= 0)
+        tee->out_fd = open(tee->fifo, O_WRONLY);
+    if(tee->hold_fd < 0 || tee->out_fd < 0) {
+        LOGW("Unable to open %s (%s)\n", tee->fifo, strerror(errno));
+        goto fail;
+    }
+#ifdef F_SETPIPE_SZ
+    fcntl(tee->out_fd, F_SETPIPE_SZ, TEE_PIPE_SIZE);
+#endif
+
+    if(0 != pthread_create(&tee->thread, NULL, tee_thread, tee))
+        goto fail;
+
+    return tee;
+
+fail:
+    tee_free(tee);
+    return NULL;
+}
+
+char* nandroid_tee_path(nandroid_tee* tee) {
+    return tee->fifo;
+}
+
+/**
+ * Wait for the tee to write out everything the backend produced, and tear
+ * it down.
+ *
+ * \param tee The tee, freed by this call
+ * \param digest Receives the MD5 of the backup file
+ *
+ * \return 0 if everything made it to the backup file
+ */
+int nandroid_tee_finish(nandroid_tee* tee, unsigned char digest[NANDROID_MD5_DIGEST_SIZE]) {
+    close(tee->hold_fd);
+    tee->hold_fd = -1;
+    pthread_join(tee->thread, NULL);
+
+    int ret = tee->err;
+    nandroid_md5_final(&tee->md5, digest);
+    tee_free(tee);
+    return ret;
+}
+
+/**
+ * Tear down a tee without waiting for the rest of the data, for when the
+ * backend failed and the digest doesn't matter any more.
+ *
+ * \param tee The tee, freed by this call
+ */
+void nandroid_tee_abort(nandroid_tee* tee) {
+    tee->stop = 1;
+    close(tee->hold_fd);
+    tee->hold_fd = -1;
+    pthread_join(tee->thread, NULL);
+    tee_free(tee);
+}
@@ -0,0 +1,22 @@
+/**
+ * \file nandroid_tee.h
+ *
+ * This file defines a FIFO tee that sits between a backup/restore backend
+ * and the backup file, hashing the data as it streams past.  Backends just
+ * use the FIFO path as though it were the real file.
+ */
+
+#ifndef RECOVERY_NANDROID_TEE_H_
+#define RECOVERY_NANDROID_TEE_H_
+
+#include "nandroid/nandroid_md5.h"
+
+typedef struct nandroid_tee nandroid_tee;
+
+nandroid_tee* nandroid_tee_create(const char* file);
+nandroid_tee* nandroid_tee_create_reader(const char* file);
+char* nandroid_tee_path(nandroid_tee* tee);
+int nandroid_tee_finish(nandroid_tee* tee, unsigned char digest[NANDROID_MD5_DIGEST_SIZE]);
+void nandroid_tee_abort(nandroid_tee* tee);
+
+#endif//RECOVERY_NANDROID_TEE_H_
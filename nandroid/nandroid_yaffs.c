@@ -1,8 +1,15 @@
-#include "mkyaffs2image.h"
-#include "unyaffs.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 
+#include "common.h"
 #include "roots.h"
 
+#include "nandroid/nandroid_compress.h"
+#include "nandroid/nandroid_yaffs_image.h"
+
 int nandroid_backup_path_yaffs(char* path, char* backup_path) {
     int was_mounted = is_path_mounted(path);
     int ret = 0;
@@ -11,7 +18,27 @@ int nandroid_backup_path_yaffs(char* path, char* backup_path) {
         return ret;
     }
 
-    ret = mkyaffs2image(path, backup_path, 0, NULL);
+    int fd = open(backup_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        LOGE("Unable to open %s for writing (%s)\n", backup_path, strerror(errno));
+        ret = -1;
+    } else {
+        // the image is streamed out a batch of pages at a time
+        nandroid_compressor* c = nandroid_compressor_create(fd, NANDROID_COMPRESS_NONE, 1);
+        if(c == NULL) {
+            ret = -1;
+        } else {
+            ret = nandroid_yaffs_image_create(path, nandroid_compressor_sink, c);
+            if(0 != nandroid_compressor_close(c))
+                ret = -1;
+        }
+
+        if(0 != close(fd))
+            ret = -1;
+
+        if(ret != 0)
+            LOGE("Error writing %s\n", backup_path);
+    }
 
     if(!was_mounted)
         ensure_path_unmounted(path);
@@ -27,7 +54,7 @@ int nandroid_restore_path_yaffs(char* path, char* backup_path) {
         return ret;
     }
 
-    ret = unyaffs(backup_path, path, NULL);
+    ret = nandroid_yaffs_image_extract(path, backup_path);
 
     if(!was_mounted)
         ensure_path_unmounted(path);
@@ -0,0 +1,745 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "common.h"
+
+#include "nandroid/nandroid_yaffs_image.h"
+
+// geometry used by mkyaffs2image
+#define YAFFS_CHUNK_SIZE    2048
+#define YAFFS_SPARE_SIZE    64
+#define YAFFS_PAGE_SIZE     (YAFFS_CHUNK_SIZE + YAFFS_SPARE_SIZE)
+
+// pages staged per write, and per read when restoring
+#define YAFFS_BATCH_PAGES   32
+// file data is read in batches of this many chunks
+#define YAFFS_FILE_BUFFER_SIZE (YAFFS_BATCH_PAGES * YAFFS_CHUNK_SIZE)
+
+#define YAFFS_MAX_NAME_LENGTH  255
+#define YAFFS_MAX_ALIAS_LENGTH 159
+
+#define YAFFS_OBJECTID_ROOT          1
+// mkyaffs2image numbers objects from YAFFS_NOBJECT_BUCKETS + 1
+#define YAFFS_FIRST_OBJECT_ID        257
+#define YAFFS_LOWEST_SEQUENCE_NUMBER 0x00001000
+// byte count mkyaffs2image puts in the tags of an object header
+#define YAFFS_HEADER_BYTE_COUNT      0xffff
+
+// tags written by the filesystem itself (rather than mkyaffs2image) may
+// stash extra header info in the chunk and object ids
+#define YAFFS_EXTRA_HEADER_INFO_FLAG 0x80000000
+#define YAFFS_OBJECT_ID_MASK         0x0fffffff
+
+enum {
+    YAFFS_OBJECT_TYPE_UNKNOWN = 0,
+    YAFFS_OBJECT_TYPE_FILE,
+    YAFFS_OBJECT_TYPE_SYMLINK,
+    YAFFS_OBJECT_TYPE_DIRECTORY,
+    YAFFS_OBJECT_TYPE_HARDLINK,
+    YAFFS_OBJECT_TYPE_SPECIAL
+};
+
+// on-flash object header, laid out like yaffs_ObjectHeader in yaffs_guts.h
+typedef struct {
+    uint32_t type;
+    int32_t parent_id;
+    uint16_t unused_sum;
+    char name[YAFFS_MAX_NAME_LENGTH + 1];
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t atime;
+    uint32_t mtime;
+    uint32_t ctime;
+    int32_t file_size;
+    int32_t equivalent_id;
+    char alias[YAFFS_MAX_ALIAS_LENGTH + 1];
+    uint32_t rdev;
+    uint32_t room_to_grow[6];
+    uint32_t inband_shadows;
+    uint32_t inband_is_shrink;
+    uint32_t reserved[2];
+    int32_t shadows;
+    uint32_t is_shrink;
+} yaffs_object_header;
+
+// packed tags at the start of each spare area, like yaffs_PackedTags2
+typedef struct {
+    uint32_t sequence;
+    uint32_t object_id;
+    uint32_t chunk_id;
+    uint32_t byte_count;
+} yaffs_tags;
+
+typedef struct {
+    unsigned char col_parity;
+    uint32_t line_parity;
+    uint32_t line_parity_prime;
+} yaffs_tags_ecc;
+
+typedef struct {
+    yaffs_tags tags;
+    yaffs_tags_ecc ecc;
+} yaffs_packed_tags;
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    int id;
+} yaffs_inode;
+
+typedef struct {
+    nandroid_sink_fn sink;
+    void* cookie;
+    char* pages;
+    int page_count;
+    char* file_buf;
+    int next_id;
+    int err;
+
+    // objects with more than one link, so later links become hardlinks
+    yaffs_inode* inodes;
+    int inode_count;
+    int inode_alloc;
+} yaffs_writer;
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int parity(unsigned int v) {
+    v ^= v >> 4;
+    v ^= v >> 2;
+    v ^= v >> 1;
+    return v & 1;
+}
+
+/**
+ * Column parity of a byte, the same bits as yaffs_ecc.c's column_parity_table.
+ */
+static unsigned char column_parity(unsigned char b) {
+    return (parity(b & 0xf0) << 7) | (parity(b & 0x0f) << 6) |
+            (parity(b & 0xcc) << 5) | (parity(b & 0x33) << 4) |
+            (parity(b & 0xaa) << 3) | (parity(b & 0x55) << 2) |
+            parity(b);
+}
+
+/**
+ * Hamming code over the tags, as yaffs_ECCCalculateOther does it.
+ */
+static void yaffs_tags_calculate_ecc(const yaffs_tags* tags, yaffs_tags_ecc* ecc) {
+    const unsigned char* data = (const unsigned char*)tags;
+    unsigned char col_parity = 0;
+    uint32_t line_parity = 0;
+    uint32_t line_parity_prime = 0;
+    unsigned int i;
+
+    for(i = 0; i < sizeof(yaffs_tags); ++i) {
+        unsigned char b = column_parity(data[i]);
+        col_parity ^= b;
+        if(b & 0x01) {
+            // odd number of bits in the byte
+            line_parity ^= i;
+            line_parity_prime ^= ~i;
+        }
+    }
+
+    ecc->col_parity = (col_parity >> 2) & 0x3f;
+    ecc->line_parity = line_parity;
+    ecc->line_parity_prime = line_parity_prime;
+}
+
+static int yaffs_flush(yaffs_writer* w) {
+    if(w->err == 0 && w->page_count > 0 &&
+            0 != w->sink(w->cookie, w->pages, (size_t)w->page_count * YAFFS_PAGE_SIZE))
+        w->err = -1;
+    w->page_count = 0;
+    return w->err;
+}
+
+/**
+ * Add one chunk and its tags to the image.
+ *
+ * \param data Chunk data, padded out with 0xff if shorter than a chunk
+ * \param len Length of data
+ * \param byte_count Byte count to record in the tags
+ */
+static int yaffs_write_chunk(yaffs_writer* w, const char* data, size_t len,
+        int object_id, int chunk_id, int byte_count) {
+    if(w->err != 0)
+        return w->err;
+
+    char* page = w->pages + (size_t)w->page_count * YAFFS_PAGE_SIZE;
+    memcpy(page, data, len);
+    memset(page + len, 0xff, YAFFS_PAGE_SIZE - len);
+
+    yaffs_packed_tags pt;
+    memset(&pt, 0xff, sizeof(pt));
+    pt.tags.sequence = YAFFS_LOWEST_SEQUENCE_NUMBER;
+    pt.tags.object_id = object_id;
+    pt.tags.chunk_id = chunk_id;
+    pt.tags.byte_count = byte_count;
+    yaffs_tags_calculate_ecc(&pt.tags, &pt.ecc);
+    memcpy(page + YAFFS_CHUNK_SIZE, &pt, sizeof(pt));
+
+    if(++w->page_count == YAFFS_BATCH_PAGES)
+        yaffs_flush(w);
+    return w->err;
+}
+
+static int yaffs_write_header(yaffs_writer* w, int id, int type, int parent_id,
+        const char* name, struct stat* st, int equivalent_id, const char* alias) {
+    // the header is filled with 0xff, so the strings are copied with their
+    // terminators; anything too long would come back as a different name
+    size_t name_len = strlen(name);
+    size_t alias_len = (type == YAFFS_OBJECT_TYPE_SYMLINK) ? strlen(alias) : 0;
+    if(name_len > YAFFS_MAX_NAME_LENGTH || alias_len > YAFFS_MAX_ALIAS_LENGTH) {
+        LOGW("Skipping %s, name or link target is too long\n", name);
+        return -1;
+    }
+
+    char chunk[YAFFS_CHUNK_SIZE];
+    memset(chunk, 0xff, sizeof(chunk));
+
+    yaffs_object_header* oh = (yaffs_object_header*)chunk;
+    oh->type = type;
+    oh->parent_id = parent_id;
+    memcpy(oh->name, name, name_len);
+    oh->name[name_len] = '\0';
+
+    if(type != YAFFS_OBJECT_TYPE_HARDLINK) {
+        oh->mode = st->st_mode;
+        oh->uid = st->st_uid;
+        oh->gid = st->st_gid;
+        oh->atime = st->st_atime;
+        oh->mtime = st->st_mtime;
+        oh->ctime = st->st_ctime;
+        oh->rdev = st->st_rdev;
+    }
+
+    if(type == YAFFS_OBJECT_TYPE_FILE)
+        oh->file_size = st->st_size;
+    else if(type == YAFFS_OBJECT_TYPE_HARDLINK)
+        oh->equivalent_id = equivalent_id;
+    else if(type == YAFFS_OBJECT_TYPE_SYMLINK) {
+        memcpy(oh->alias, alias, alias_len);
+        oh->alias[alias_len] = '\0';
+    }
+
+    return yaffs_write_chunk(w, chunk, sizeof(chunk), id, 0, YAFFS_HEADER_BYTE_COUNT);
+}
+
+/**
+ * Stream a regular file as data chunks.  Like the tar writer, if the file
+ * changes size while we read it we stick to the size in its header.
+ */
+static int yaffs_write_file_data(yaffs_writer* w, const char* path, int id, off_t size) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        LOGW("Unable to open %s for backup (%s)\n", path, strerror(errno));
+
+    int chunk_id = 1;
+    off_t left = size;
+    while(left > 0 && w->err == 0) {
+        size_t want = left > YAFFS_FILE_BUFFER_SIZE ? YAFFS_FILE_BUFFER_SIZE : (size_t)left;
+        size_t got = 0;
+        while(fd >= 0 && got < want) {
+            ssize_t n = read(fd, w->file_buf + got, want - got);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0) {
+                LOGW("%s shrank during backup, padding with zeros\n", path);
+                close(fd);
+                fd = -1;
+                break;
+            }
+            got += n;
+        }
+        memset(w->file_buf + got, 0, want - got);
+
+        size_t offset;
+        for(offset = 0; offset < want && w->err == 0; offset += YAFFS_CHUNK_SIZE) {
+            size_t len = want - offset > YAFFS_CHUNK_SIZE ? YAFFS_CHUNK_SIZE : want - offset;
+            yaffs_write_chunk(w, w->file_buf + offset, len, id, chunk_id++, len);
+        }
+        left -= want;
+    }
+
+    if(fd >= 0)
+        close(fd);
+    return w->err;
+}
+
+static int yaffs_find_inode(yaffs_writer* w, struct stat* st) {
+    int i;
+    for(i = 0; i < w->inode_count; ++i)
+        if(w->inodes[i].dev == st->st_dev && w->inodes[i].ino == st->st_ino)
+            return w->inodes[i].id;
+    return 0;
+}
+
+static void yaffs_add_inode(yaffs_writer* w, struct stat* st, int id) {
+    if(w->inode_count == w->inode_alloc) {
+        int alloc = w->inode_alloc ? w->inode_alloc * 2 : 64;
+        yaffs_inode* inodes = (yaffs_inode*)realloc(w->inodes, alloc * sizeof(yaffs_inode));
+        if(inodes == NULL)
+            return; // later links just get stored as copies
+        w->inodes = inodes;
+        w->inode_alloc = alloc;
+    }
+    w->inodes[w->inode_count].dev = st->st_dev;
+    w->inodes[w->inode_count].ino = st->st_ino;
+    w->inodes[w->inode_count].id = id;
+    w->inode_count++;
+}
+
+/**
+ * Add everything in a directory to the image, recursing into subdirectories.
+ *
+ * \param path Absolute path of the directory, in a PATH_MAX buffer we may append to
+ * \param parent_id Object id of the directory
+ */
+static int yaffs_add_directory(yaffs_writer* w, char* path, int parent_id) {
+    DIR* dir = opendir(path);
+    if(dir == NULL) {
+        LOGW("Unable to open directory %s for backup (%s)\n", path, strerror(errno));
+        return w->err;
+    }
+
+    size_t path_len = strlen(path);
+    struct dirent* de;
+    while(w->err == 0 && (de = readdir(dir)) != NULL) {
+        if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+
+        size_t de_len = strlen(de->d_name);
+        if(de_len > YAFFS_MAX_NAME_LENGTH || path_len + de_len + 2 > PATH_MAX) {
+            LOGW("Skipping %s/%s, name is too long\n", path, de->d_name);
+            continue;
+        }
+        snprintf(path + path_len, PATH_MAX - path_len, "/%s", de->d_name);
+
+        struct stat st;
+        if(0 != lstat(path, &st)) {
+            LOGW("Unable to stat %s for backup (%s)\n", path, strerror(errno));
+            path[path_len] = '\0';
+            continue;
+        }
+
+        int id = w->next_id++;
+        int equivalent_id = S_ISDIR(st.st_mode) ? 0 : yaffs_find_inode(w, &st);
+
+        if(equivalent_id > 0) {
+            yaffs_write_header(w, id, YAFFS_OBJECT_TYPE_HARDLINK, parent_id, de->d_name, &st, equivalent_id, NULL);
+        } else {
+            if(!S_ISDIR(st.st_mode) && st.st_nlink > 1)
+                yaffs_add_inode(w, &st, id);
+
+            if(S_ISREG(st.st_mode)) {
+                if(st.st_size > INT32_MAX) {
+                    LOGW("Skipping %s, too large for a yaffs2 image\n", path);
+                } else if(0 == yaffs_write_header(w, id, YAFFS_OBJECT_TYPE_FILE, parent_id, de->d_name, &st, 0, NULL)) {
+                    yaffs_write_file_data(w, path, id, st.st_size);
+                }
+            } else if(S_ISLNK(st.st_mode)) {
+                char alias[YAFFS_MAX_ALIAS_LENGTH + 2];
+                ssize_t n = readlink(path, alias, sizeof(alias) - 1);
+                if(n < 0 || n > YAFFS_MAX_ALIAS_LENGTH) {
+                    LOGW("Skipping link %s, unreadable or too long\n", path);
+                } else {
+                    alias[n] = '\0';
+                    yaffs_write_header(w, id, YAFFS_OBJECT_TYPE_SYMLINK, parent_id, de->d_name, &st, 0, alias);
+                }
+            } else if(S_ISDIR(st.st_mode)) {
+                if(0 == yaffs_write_header(w, id, YAFFS_OBJECT_TYPE_DIRECTORY, parent_id, de->d_name, &st, 0, NULL))
+                    yaffs_add_directory(w, path, id);
+            } else if(S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode) || S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)) {
+                yaffs_write_header(w, id, YAFFS_OBJECT_TYPE_SPECIAL, parent_id, de->d_name, &st, 0, NULL);
+            }
+        }
+
+        path[path_len] = '\0';
+    }
+    closedir(dir);
+
+    return w->err;
+}
+
+/**
+ * Create a yaffs2 image of a directory, the way mkyaffs2image would.  Only
+ * a batch of pages and one file buffer are held in memory at a time.
+ *
+ * \param root The directory to image
+ * \param sink Function that receives the image data
+ * \param cookie Passed through to the sink
+ *
+ * \return 0 on success, nonzero if the sink failed
+ */
+int nandroid_yaffs_image_create(const char* root, nandroid_sink_fn sink, void* cookie) {
+    yaffs_writer w;
+    memset(&w, 0, sizeof(w));
+    w.sink = sink;
+    w.cookie = cookie;
+    w.next_id = YAFFS_FIRST_OBJECT_ID;
+    w.pages = (char*)malloc(YAFFS_BATCH_PAGES * YAFFS_PAGE_SIZE);
+    w.file_buf = (char*)malloc(YAFFS_FILE_BUFFER_SIZE);
+
+    char* path = (char*)calloc(PATH_MAX, sizeof(char));
+
+    if(w.pages == NULL || w.file_buf == NULL || path == NULL) {
+        free(w.pages);
+        free(w.file_buf);
+        free(path);
+        return -1;
+    }
+
+    strncpy(path, root, PATH_MAX - 1);
+    // strip trailing slashes so child paths come out clean
+    size_t len = strlen(path);
+    while(len > 1 && path[len - 1] == '/')
+        path[--len] = '\0';
+
+    long long start = now_ms();
+
+    // the root object is implied, only its children get headers
+    yaffs_add_directory(&w, path, YAFFS_OBJECTID_ROOT);
+    yaffs_flush(&w);
+
+    LOGI("yaffs2 image of %s: %d objects in %lld ms\n", root,
+            w.next_id - YAFFS_FIRST_OBJECT_ID, now_ms() - start);
+
+    free(w.pages);
+    free(w.file_buf);
+    free(w.inodes);
+    free(path);
+    return w.err;
+}
+
+// what we remember about each object while restoring
+typedef struct {
+    char* path;
+    int is_dir;
+    mode_t mode;
+    time_t mtime;
+} yaffs_object;
+
+typedef struct {
+    const char* root;
+    yaffs_object* objects;
+    int object_alloc;
+
+    // the file whose data chunks we're expecting
+    int file_fd;
+    int file_id;
+    yaffs_object_header file_header;
+
+    int object_count;
+    unsigned long long bytes;
+} yaffs_reader;
+
+static yaffs_object* yaffs_object_get(yaffs_reader* r, uint32_t id, int create) {
+    if(id >= (uint32_t)r->object_alloc) {
+        if(!create || id > YAFFS_OBJECT_ID_MASK)
+            return NULL;
+        int alloc = r->object_alloc ? r->object_alloc : 1024;
+        while((uint32_t)alloc <= id)
+            alloc *= 2;
+        yaffs_object* objects = (yaffs_object*)realloc(r->objects, alloc * sizeof(yaffs_object));
+        if(objects == NULL)
+            return NULL;
+        memset(objects + r->object_alloc, 0, (alloc - r->object_alloc) * sizeof(yaffs_object));
+        r->objects = objects;
+        r->object_alloc = alloc;
+    }
+    return &r->objects[id];
+}
+
+static void yaffs_set_times(const char* path, time_t mtime) {
+    struct timeval tv[2];
+    tv[0].tv_sec = tv[1].tv_sec = mtime;
+    tv[0].tv_usec = tv[1].tv_usec = 0;
+    utimes(path, tv);
+}
+
+/**
+ * Finish off the file being restored, once all of its chunks are written.
+ */
+static int yaffs_close_file(yaffs_reader* r) {
+    if(r->file_fd < 0)
+        return 0;
+
+    int ret = 0;
+    yaffs_object_header* oh = &r->file_header;
+    const char* path = r->objects[r->file_id].path;
+
+    if(0 != ftruncate(r->file_fd, oh->file_size))
+        LOGW("Unable to size %s (%s)\n", path, strerror(errno));
+    if(0 != fchown(r->file_fd, oh->uid, oh->gid))
+        LOGW("Unable to chown %s (%s)\n", path, strerror(errno));
+    if(0 != fchmod(r->file_fd, oh->mode & 07777))
+        LOGW("Unable to chmod %s (%s)\n", path, strerror(errno));
+    if(0 != close(r->file_fd)) {
+        LOGE("Error writing %s (%s)\n", path, strerror(errno));
+        ret = -1;
+    }
+    yaffs_set_times(path, oh->mtime);
+
+    r->file_fd = -1;
+    return ret;
+}
+
+/**
+ * Create the object described by a header chunk.
+ */
+static int yaffs_restore_object(yaffs_reader* r, uint32_t id, const yaffs_object_header* oh) {
+    char name[YAFFS_MAX_NAME_LENGTH + 1];
+    memcpy(name, oh->name, YAFFS_MAX_NAME_LENGTH);
+    name[YAFFS_MAX_NAME_LENGTH] = '\0';
+
+    // never let a name step outside the volume
+    if(name[0] == '\0' || strchr(name, '/') != NULL ||
+            strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        LOGW("Skipping object %u with bad name\n", id);
+        return 0;
+    }
+
+    yaffs_object* parent = yaffs_object_get(r, oh->parent_id, 0);
+    if(parent == NULL || parent->path == NULL) {
+        LOGW("Skipping %s, parent %d not found\n", name, oh->parent_id);
+        return 0;
+    }
+
+    yaffs_object* obj = yaffs_object_get(r, id, 1);
+    if(obj == NULL)
+        return -1;
+
+    free(obj->path);
+    int len = strlen(parent->path) + strlen(name) + 2;
+    obj->path = (char*)malloc(len);
+    if(obj->path == NULL)
+        return -1;
+    snprintf(obj->path, len, "%s/%s", parent->path, name);
+    obj->is_dir = 0;
+
+    const char* path = obj->path;
+    r->object_count++;
+
+    switch(oh->type) {
+    case YAFFS_OBJECT_TYPE_FILE:
+        r->file_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if(r->file_fd < 0) {
+            LOGE("Unable to create %s (%s)\n", path, strerror(errno));
+            return -1;
+        }
+        r->file_id = id;
+        r->file_header = *oh;
+        return 0;
+    case YAFFS_OBJECT_TYPE_SYMLINK: {
+        char alias[YAFFS_MAX_ALIAS_LENGTH + 1];
+        memcpy(alias, oh->alias, YAFFS_MAX_ALIAS_LENGTH);
+        alias[YAFFS_MAX_ALIAS_LENGTH] = '\0';
+        unlink(path);
+        if(0 != symlink(alias, path)) {
+            LOGE("Unable to create link %s (%s)\n", path, strerror(errno));
+            return -1;
+        }
+        lchown(path, oh->uid, oh->gid);
+        return 0;
+    }
+    case YAFFS_OBJECT_TYPE_DIRECTORY:
+        if(0 != mkdir(path, 0700) && errno != EEXIST) {
+            LOGE("Unable to create directory %s (%s)\n", path, strerror(errno));
+            return -1;
+        }
+        chown(path, oh->uid, oh->gid);
+        // mode and mtime go on once everything inside has been written
+        obj->is_dir = 1;
+        obj->mode = oh->mode;
+        obj->mtime = oh->mtime;
+        return 0;
+    case YAFFS_OBJECT_TYPE_HARDLINK: {
+        yaffs_object* target = yaffs_object_get(r, oh->equivalent_id, 0);
+        if(target == NULL || target->path == NULL) {
+            LOGW("Skipping link %s, target %d not found\n", path, oh->equivalent_id);
+            return 0;
+        }
+        // the target has to be complete before it gets another name
+        if(r->file_fd >= 0 && r->file_id == oh->equivalent_id && 0 != yaffs_close_file(r))
+            return -1;
+        unlink(path);
+        if(0 != link(target->path, path)) {
+            LOGE("Unable to link %s to %s (%s)\n", path, target->path, strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+    case YAFFS_OBJECT_TYPE_SPECIAL:
+        unlink(path);
+        if(0 != mknod(path, oh->mode, oh->rdev)) {
+            LOGE("Unable to create node %s (%s)\n", path, strerror(errno));
+            return -1;
+        }
+        chown(path, oh->uid, oh->gid);
+        chmod(path, oh->mode & 07777);
+        yaffs_set_times(path, oh->mtime);
+        return 0;
+    default:
+        LOGW("Skipping %s, unknown object type %u\n", path, oh->type);
+        return 0;
+    }
+}
+
+static int yaffs_restore_page(yaffs_reader* r, const char* page) {
+    yaffs_tags tags;
+    memcpy(&tags, page + YAFFS_CHUNK_SIZE, sizeof(tags));
+
+    // erased pages, as found at the end of a dumped partition
+    if(tags.sequence == 0xffffffff || tags.object_id == 0 || tags.object_id == 0xffffffff)
+        return 0;
+
+    uint32_t id = tags.object_id & YAFFS_OBJECT_ID_MASK;
+
+    if(tags.chunk_id == 0 || (tags.chunk_id & YAFFS_EXTRA_HEADER_INFO_FLAG)) {
+        if(0 != yaffs_close_file(r))
+            return -1;
+
+        yaffs_object_header oh;
+        memcpy(&oh, page, sizeof(oh));
+        return yaffs_restore_object(r, id, &oh);
+    }
+
+    // data for anything but the file we just opened is left alone
+    if(r->file_fd < 0 || id != (uint32_t)r->file_id)
+        return 0;
+
+    if(tags.byte_count > YAFFS_CHUNK_SIZE) {
+        LOGE("Bad chunk %u for %s\n", tags.chunk_id, r->objects[id].path);
+        return -1;
+    }
+
+    off_t offset = (off_t)(tags.chunk_id - 1) * YAFFS_CHUNK_SIZE;
+    size_t done = 0;
+    while(done < tags.byte_count) {
+        ssize_t n = pwrite(r->file_fd, page + done, tags.byte_count - done, offset + done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0) {
+            LOGE("Error writing %s (%s)\n", r->objects[id].path, strerror(errno));
+            return -1;
+        }
+        done += n;
+    }
+    r->bytes += tags.byte_count;
+    return 0;
+}
+
+/**
+ * Read up to len bytes, only returning short at the end of the file.  The
+ * image may be a FIFO, which hands back whatever happens to be buffered.
+ */
+static ssize_t read_full(int fd, char* buf, size_t len) {
+    size_t got = 0;
+    while(got < len) {
+        ssize_t n = read(fd, buf + got, len - got);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            return -1;
+        if(n == 0)
+            break;
+        got += n;
+    }
+    return got;
+}
+
+/**
+ * Restore a yaffs2 image made by mkyaffs2image (or us) into a directory,
+ * reading it a batch of pages at a time.
+ *
+ * \param root The directory to restore into
+ * \param image The image file
+ *
+ * \return 0 on success
+ */
+int nandroid_yaffs_image_extract(const char* root, const char* image) {
+    int fd = open(image, O_RDONLY);
+    if(fd < 0) {
+        LOGE("Unable to open %s (%s)\n", image, strerror(errno));
+        return -1;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    yaffs_reader r;
+    memset(&r, 0, sizeof(r));
+    r.root = root;
+    r.file_fd = -1;
+
+    char* pages = (char*)malloc(YAFFS_BATCH_PAGES * YAFFS_PAGE_SIZE);
+    yaffs_object* root_obj = yaffs_object_get(&r, YAFFS_OBJECTID_ROOT, 1);
+    if(pages == NULL || root_obj == NULL || (root_obj->path = strdup(root)) == NULL) {
+        free(pages);
+        free(r.objects);
+        close(fd);
+        return -1;
+    }
+
+    long long start = now_ms();
+    int ret = 0;
+    while(ret == 0) {
+        ssize_t n = read_full(fd, pages, YAFFS_BATCH_PAGES * YAFFS_PAGE_SIZE);
+        if(n < 0) {
+            LOGE("Error reading %s (%s)\n", image, strerror(errno));
+            ret = -1;
+            break;
+        }
+        if(n % YAFFS_PAGE_SIZE != 0) {
+            LOGW("%s ends with a partial page, ignoring it\n", image);
+        }
+
+        int count = n / YAFFS_PAGE_SIZE;
+        int i;
+        for(i = 0; i < count && ret == 0; ++i)
+            ret = yaffs_restore_page(&r, pages + (size_t)i * YAFFS_PAGE_SIZE);
+
+        if(n < YAFFS_BATCH_PAGES * YAFFS_PAGE_SIZE)
+            break;
+    }
+
+    if(0 != yaffs_close_file(&r))
+        ret = -1;
+
+    // children have higher ids than their parents, so going backwards sets
+    // each directory's mtime after everything inside it has been created
+    int i;
+    for(i = r.object_alloc - 1; i >= 0; --i) {
+        yaffs_object* obj = &r.objects[i];
+        if(obj->is_dir) {
+            chmod(obj->path, obj->mode & 07777);
+            yaffs_set_times(obj->path, obj->mtime);
+        }
+        free(obj->path);
+    }
+
+    LOGI("yaffs2 restore of %s: %d objects, %llu KB in %lld ms\n", root,
+            r.object_count, r.bytes / 1024, now_ms() - start);
+
+    free(r.objects);
+    free(pages);
+    close(fd);
+    return ret;
+}
@@ -0,0 +1,18 @@
+/**
+ * \file nandroid_yaffs_image.h
+ *
+ * This file defines a native YAFFS2 image writer and reader.  Images use the
+ * same layout as mkyaffs2image (2048 byte chunks, each followed by 64 bytes
+ * of packed tags) and are produced and consumed one chunk at a time, so an
+ * image never has to fit in memory.
+ */
+
+#ifndef RECOVERY_NANDROID_YAFFS_IMAGE_H_
+#define RECOVERY_NANDROID_YAFFS_IMAGE_H_
+
+#include "nandroid/nandroid_tar_writer.h"
+
+int nandroid_yaffs_image_create(const char* root, nandroid_sink_fn sink, void* cookie);
+int nandroid_yaffs_image_extract(const char* root, const char* image);
+
+#endif//RECOVERY_NANDROID_YAFFS_IMAGE_H_
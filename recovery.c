@@ -40,6 +40,8 @@
 #include "roots.h"
 #include "recovery_ui.h"
 #include "encryptedfs_provisioning.h"
+#include "flashutils/flashutils.h"
+#include "mmcutils/mmcutils.h"
 
 #include "recovery_lib.h"
 #include "recovery_config.h"
@@ -710,6 +712,8 @@ main(int argc, char **argv) {
     ui_set_background(BACKGROUND_ICON_INSTALLING);
     ui_print("Welocome to RCRecovery\n\n");
     load_volume_table();
+    scan_partitions();
+    mmc_set_progress_callback(ui_set_progress);
     process_volumes();
     ui_print("Loading recovery configuration ... ");
     load_config();
@@ -21,6 +21,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #include "mtdutils/mtdutils.h"
 #include "mounts.h"
@@ -31,6 +32,29 @@
 static int num_volumes = 0;
 static Volume* device_volumes = NULL;
 
+// mount state, the mtd partition table and the ext4 formatter are all
+// global, so volume operations from different threads take turns.  The
+// lock is recursive since format_volume unmounts through the public API.
+static pthread_mutex_t roots_mutex;
+static pthread_once_t roots_mutex_once = PTHREAD_ONCE_INIT;
+
+static void roots_mutex_init() {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&roots_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static void roots_lock() {
+    pthread_once(&roots_mutex_once, roots_mutex_init);
+    pthread_mutex_lock(&roots_mutex);
+}
+
+static void roots_unlock() {
+    pthread_mutex_unlock(&roots_mutex);
+}
+
 const PartitionInfo device_partitions[] = {
         {PARTITION_BOOT,       "/boot",       "Boot",                                  PARTITION_FLAG_WIPEABLE | PARTITION_FLAG_SAVEABLE | PARTITION_FLAG_RESTOREABLE},
         {PARTITION_SYSTEM,     "/system",     "System",     PARTITION_FLAG_MOUNTABLE | PARTITION_FLAG_WIPEABLE | PARTITION_FLAG_SAVEABLE | PARTITION_FLAG_RESTOREABLE},
@@ -119,7 +143,7 @@ Volume* volume_for_path(const char* path) {
     return NULL;
 }
 
-int ensure_path_mounted(const char* path) {
+static int ensure_path_mounted_locked(const char* path) {
     Volume* v = volume_for_path(path);
     if (v == NULL) {
         LOGE("unknown volume for path [%s]\n", path);
@@ -148,7 +172,7 @@ int ensure_path_mounted(const char* path) {
 
     if (strcmp(v->fs_type, "yaffs2") == 0) {
         // mount an MTD partition as a YAFFS2 filesystem.
-        mtd_scan_partitions();
+        mtd_scan_partitions_cached();
         const MtdPartition* partition;
         partition = mtd_find_partition_by_name(v->device);
         if (partition == NULL) {
@@ -181,7 +205,7 @@ int ensure_path_mounted(const char* path) {
     return -1;
 }
 
-int ensure_path_unmounted(const char* path) {
+static int ensure_path_unmounted_locked(const char* path) {
     Volume* v = volume_for_path(path);
     if (v == NULL) {
         LOGE("unknown volume for path [%s]\n", path);
@@ -209,7 +233,7 @@ int ensure_path_unmounted(const char* path) {
     return unmount_mounted_volume(mv);
 }
 
-int format_volume(const char* volume) {
+static int format_volume_locked(const char* volume) {
     Volume* v = volume_for_path(volume);
     if (v == NULL) {
         LOGE("unknown volume \"%s\"\n", volume);
@@ -231,7 +255,7 @@ int format_volume(const char* volume) {
     }
 
     if (strcmp(v->fs_type, "yaffs2") == 0 || strcmp(v->fs_type, "mtd") == 0) {
-        mtd_scan_partitions();
+        mtd_scan_partitions_cached();
         const MtdPartition* partition = mtd_find_partition_by_name(v->device);
         if (partition == NULL) {
             LOGE("format_volume: no MTD partition \"%s\"\n", v->device);
@@ -285,7 +309,7 @@ int format_volume(const char* volume) {
     return -1;
 }
 
-int is_path_mounted(const char* path) {
+static int is_path_mounted_locked(const char* path) {
     Volume* v = volume_for_path(path);
     if (v == NULL) {
         return 0;
@@ -310,3 +334,31 @@ int is_path_mounted(const char* path) {
     }
     return 0;
 }
+
+int ensure_path_mounted(const char* path) {
+    roots_lock();
+    int result = ensure_path_mounted_locked(path);
+    roots_unlock();
+    return result;
+}
+
+int ensure_path_unmounted(const char* path) {
+    roots_lock();
+    int result = ensure_path_unmounted_locked(path);
+    roots_unlock();
+    return result;
+}
+
+int format_volume(const char* volume) {
+    roots_lock();
+    int result = format_volume_locked(volume);
+    roots_unlock();
+    return result;
+}
+
+int is_path_mounted(const char* path) {
+    roots_lock();
+    int result = is_path_mounted_locked(path);
+    roots_unlock();
+    return result;
+}
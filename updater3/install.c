@@ -79,7 +79,7 @@ Value* MountFn(const char* name, State* state, int argc, Expr* argv[]) {
     mkdir(mount_point, 0755);
 
     if (strcmp(partition_type, "MTD") == 0) {
-        mtd_scan_partitions();
+        mtd_scan_partitions_cached();
         const MtdPartition* mtd;
         mtd = mtd_find_partition_by_name(location);
         if (mtd == NULL) {
@@ -205,7 +205,7 @@ Value* FormatFn(const char* name, State* state, int argc, Expr* argv[]) {
     }
 
     if (strcmp(partition_type, "MTD") == 0) {
-        mtd_scan_partitions();
+        mtd_scan_partitions_cached();
         const MtdPartition* mtd = mtd_find_partition_by_name(location);
         if (mtd == NULL) {
             fprintf(stderr, "%s: no mtd partition named \"%s\"",
@@ -358,7 +358,8 @@ Value* PackageExtractDirFn(const char* name, State* state,
     struct utimbuf timestamp = { 1217592000, 1217592000 };  // 8/1/2008 default
 
     bool success = mzExtractRecursive(za, zip_path, dest_path,
-                                      MZ_EXTRACT_FILES_ONLY, &timestamp,
+                                      MZ_EXTRACT_FILES_ONLY | MZ_EXTRACT_PARALLEL,
+                                      &timestamp,
                                       NULL, NULL);
     free(zip_path);
     free(dest_path);
@@ -22,6 +22,7 @@
 #include "updater.h"
 #include "install.h"
 #include "minzip/Zip.h"
+#include "flashutils/flashutils.h"
 
 // Generated by the makefile, this function defines the
 // RegisterDeviceExtensions() function, which calls all the
@@ -60,6 +61,10 @@ int main(int argc, char** argv) {
     FILE* cmd_pipe = fdopen(fd, "wb");
     setlinebuf(cmd_pipe);
 
+    // Find the partitions once; the script functions use what this finds.
+
+    scan_partitions();
+
     // Extract the script from the package.
 
     char* package_data = argv[3];